@@ -0,0 +1,178 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ADDRESSINDEX_H
+#define ADDRESSINDEX_H
+
+#include "script.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+#include <boost/variant/get.hpp>
+
+// Address types in the address and spent indexes
+enum
+{
+    ADDRESS_TYPE_NONE = 0,
+    ADDRESS_TYPE_PUBKEYHASH = 1,
+    ADDRESS_TYPE_SCRIPTHASH = 2,
+};
+
+/** Address index entry: an output paying to an address, or an input spending one.
+  *
+  * Keys sort by address, then block height and position in the block, so the
+  * history of an address is a single range scan in the block tree database.
+  * The value is the amount, negative for spends.
+  */
+struct CAddressIndexKey
+{
+    unsigned char nType;
+    uint160 hashBytes;
+    int nBlockHeight;
+    unsigned int nTxIndex;
+    uint256 txhash;
+    unsigned int nIndex;
+    bool fSpending;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE(BIGENDIAN32(nBlockHeight));
+        READWRITE(BIGENDIAN32(nTxIndex));
+        READWRITE(txhash);
+        READWRITE(BIGENDIAN32(nIndex));
+        READWRITE(fSpending);
+    )
+
+    CAddressIndexKey()
+    {
+        SetNull();
+    }
+
+    CAddressIndexKey(unsigned char nTypeIn, const uint160& hashBytesIn, int nBlockHeightIn, unsigned int nTxIndexIn,
+                     const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        nType(nTypeIn), hashBytes(hashBytesIn), nBlockHeight(nBlockHeightIn), nTxIndex(nTxIndexIn),
+        txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    void SetNull()
+    {
+        nType = ADDRESS_TYPE_NONE;
+        hashBytes = 0;
+        nBlockHeight = 0;
+        nTxIndex = 0;
+        txhash = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+};
+
+/** Address unspent index entry: an unspent output paying to an address */
+struct CAddressUnspentKey
+{
+    unsigned char nType;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(BIGENDIAN32(nIndex));
+    )
+
+    CAddressUnspentKey() : nType(ADDRESS_TYPE_NONE), hashBytes(0), txhash(0), nIndex(0) {}
+
+    CAddressUnspentKey(unsigned char nTypeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int nIndexIn) :
+        nType(nTypeIn), hashBytes(hashBytesIn), txhash(txhashIn), nIndex(nIndexIn) {}
+};
+
+/** The output an address unspent index entry stands for; a null value erases the entry */
+struct CAddressUnspentValue
+{
+    int64_t nSatoshis;
+    CScript script;
+    int nBlockHeight;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nSatoshis);
+        READWRITE(script);
+        READWRITE(nBlockHeight);
+    )
+
+    CAddressUnspentValue() : nSatoshis(-1), nBlockHeight(0) {}
+
+    CAddressUnspentValue(int64_t nSatoshisIn, const CScript& scriptIn, int nBlockHeightIn) :
+        nSatoshis(nSatoshisIn), script(scriptIn), nBlockHeight(nBlockHeightIn) {}
+
+    bool IsNull() const { return nSatoshis == -1; }
+};
+
+/** Spent index entry: a spent output */
+struct CSpentIndexKey
+{
+    uint256 txid;
+    unsigned int nOutputIndex;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nOutputIndex);
+    )
+
+    CSpentIndexKey() : txid(0), nOutputIndex(0) {}
+
+    CSpentIndexKey(const uint256& txidIn, unsigned int nOutputIndexIn) : txid(txidIn), nOutputIndex(nOutputIndexIn) {}
+};
+
+/** The input spending an output; a null value erases the entry */
+struct CSpentIndexValue
+{
+    uint256 txid;
+    unsigned int nInputIndex;
+    int nBlockHeight;
+    int64_t nSatoshis;
+    unsigned char nAddressType;
+    uint160 addressHash;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nInputIndex);
+        READWRITE(nBlockHeight);
+        READWRITE(nSatoshis);
+        READWRITE(nAddressType);
+        READWRITE(addressHash);
+    )
+
+    CSpentIndexValue() : txid(0), nInputIndex(0), nBlockHeight(0), nSatoshis(0), nAddressType(ADDRESS_TYPE_NONE), addressHash(0) {}
+
+    CSpentIndexValue(const uint256& txidIn, unsigned int nInputIndexIn, int nBlockHeightIn, int64_t nSatoshisIn,
+                     unsigned char nAddressTypeIn, const uint160& addressHashIn) :
+        txid(txidIn), nInputIndex(nInputIndexIn), nBlockHeight(nBlockHeightIn), nSatoshis(nSatoshisIn),
+        nAddressType(nAddressTypeIn), addressHash(addressHashIn) {}
+
+    bool IsNull() const { return txid == 0; }
+};
+
+/** Get the address index type and hash of the address a scriptPubKey pays to */
+inline bool GetAddressIndexHash(const CScript& scriptPubKey, unsigned char& nType, uint160& hashBytes)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest)) {
+        nType = ADDRESS_TYPE_PUBKEYHASH;
+        hashBytes = *pkeyID;
+        return true;
+    }
+    if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest)) {
+        nType = ADDRESS_TYPE_SCRIPTHASH;
+        hashBytes = *pscriptID;
+        return true;
+    }
+    return false;
+}
+
+#endif
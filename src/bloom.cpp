@@ -180,3 +180,57 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+void CBloomFilter::clear()
+{
+    vData.assign(vData.size(), 0);
+    isFull = false;
+    isEmpty = true;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak) :
+    nBloomSize(nElements * 2),
+    nInsertions(0),
+    b1(nElements * 2, nFPRate, nTweak, BLOOM_UPDATE_NONE),
+    b2(nElements * 2, nFPRate, nTweak, BLOOM_UPDATE_NONE)
+{
+}
+
+void CRollingBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    if (nInsertions == 0)
+        b1.clear();
+    else if (nInsertions == nBloomSize / 2)
+        b2.clear();
+    b1.insert(vKey);
+    b2.insert(vKey);
+    if (++nInsertions == nBloomSize)
+        nInsertions = 0;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    insert(data);
+}
+
+bool CRollingBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    // b2 was cleared longer ago while b1 is filling its first half
+    if (nInsertions < nBloomSize / 2)
+        return b2.contains(vKey);
+    return b1.contains(vKey);
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    vector<unsigned char> data(hash.begin(), hash.end());
+    return contains(data);
+}
+
+void CRollingBloomFilter::clear()
+{
+    nInsertions = 0;
+    b1.clear();
+    b2.clear();
+}
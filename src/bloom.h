@@ -87,6 +87,35 @@ public:
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
+
+    void clear();
+};
+
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * It remembers at least the last nElements inserted, and forgets older ones
+ * over time, at a fixed memory cost and without reorganizing anything on insert.
+ *
+ * Implemented with two bloom filters of 2 * nElements each, filled at the same
+ * time and cleared in turn, staggered, every nElements insertions, so one of
+ * them always holds the last nElements.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void clear();
+
+private:
+    unsigned int nBloomSize;
+    unsigned int nInsertions;
+    CBloomFilter b1, b2;
 };
 
 #endif /* BITCOIN_BLOOM_H */
@@ -0,0 +1,109 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <deque>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** FIFO queue with a fixed capacity, used to connect the stages of a
+  * producer/consumer pipeline.
+  *
+  * Push() blocks while the queue is full and Pop() blocks while it is empty,
+  * so a slow stage applies back-pressure to the stages in front of it. Once
+  * Close() is called no further elements are accepted and consumers drain
+  * whatever is left before Pop() starts returning false. Both blocking calls
+  * are boost interruption points.
+  */
+template<typename T> class CBoundedQueue {
+private:
+    // Mutex to protect the inner state
+    boost::mutex mutex;
+
+    // Producers block on this while the queue is full
+    boost::condition_variable condNotFull;
+
+    // Consumers block on this while the queue is empty
+    boost::condition_variable condNotEmpty;
+
+    std::deque<T> queue;
+
+    // The maximum number of queued elements
+    size_t nMaxSize;
+
+    // Set once no further elements will be pushed
+    bool fClosed;
+
+public:
+    CBoundedQueue(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn > 0 ? nMaxSizeIn : 1), fClosed(false) {}
+
+    // Add an element, waiting for room if necessary. Returns false if the queue was closed.
+    bool Push(const T& item) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fClosed && queue.size() >= nMaxSize)
+            condNotFull.wait(lock);
+        if (fClosed)
+            return false;
+        queue.push_back(item);
+        condNotEmpty.notify_one();
+        return true;
+    }
+
+    // Add an element only if there is room right now. Returns false if the
+    // queue is full or closed.
+    bool TryPush(const T& item) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fClosed || queue.size() >= nMaxSize)
+            return false;
+        queue.push_back(item);
+        condNotEmpty.notify_one();
+        return true;
+    }
+
+    // Remove the oldest element, waiting for one if necessary. Returns false
+    // once the queue is closed and empty.
+    bool Pop(T& item) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fClosed && queue.empty())
+            condNotEmpty.wait(lock);
+        if (queue.empty())
+            return false;
+        item = queue.front();
+        queue.pop_front();
+        condNotFull.notify_one();
+        return true;
+    }
+
+    // Stop accepting elements and wake up everyone waiting on the queue.
+    void Close() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fClosed = true;
+        condNotFull.notify_all();
+        condNotEmpty.notify_all();
+    }
+
+    // Close the queue and throw away anything not yet consumed.
+    void Abort() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fClosed = true;
+        queue.clear();
+        condNotFull.notify_all();
+        condNotEmpty.notify_all();
+    }
+
+    size_t Size() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    size_t MaxSize() const {
+        return nMaxSize;
+    }
+};
+
+#endif
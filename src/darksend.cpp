@@ -8,13 +8,16 @@
 #include "util.h"
 #include "masternodeman.h"
 #include "instantx.h"
+#include "scheduler.h"
 #include "ui_interface.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include <algorithm>
+#include <limits>
 #include <boost/assign/list_of.hpp>
 
 using namespace std;
@@ -27,7 +30,7 @@ CDarksendPool darkSendPool;
 // A helper object for signing messages from Masternodes
 CDarkSendSigner darkSendSigner;
 // The current Darksends in progress on the network
-std::vector<CDarksendQueue> vecDarksendQueue;
+CDarksendQueueStore darksendQueueStore;
 // Keep track of the used Masternodes
 std::vector<CTxIn> vecMasternodesUsed;
 // Keep track of the scanning errors I've seen
@@ -114,10 +117,13 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
 
         CService addr;
         if(!dsq.GetAddress(addr)) return;
-        if(!dsq.CheckSignature()) return;
-
         if(dsq.IsExpired()) return;
 
+        // drop repeated announcements before paying for the signature check
+        if(!dsq.ready && darksendQueueStore.HasQueue(dsq.vin)) return;
+
+        if(!dsq.CheckSignature()) return;
+
         CMasternode* pmn = mnodeman.Find(dsq.vin);
         if(pmn == NULL) return;
 
@@ -134,10 +140,6 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
                 PrepareDarksendDenominate();
             }
         } else {
-            BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue){
-                if(q.vin == dsq.vin) return;
-            }
-
             if(fDebug) LogPrintf("dsq last %d last2 %d count %d\n", pmn->nLastDsq, pmn->nLastDsq + mnodeman.size()/5, mnodeman.nDsqCount);
             //don't allow a few nodes to dominate the queuing process
             if(pmn->nLastDsq != 0 &&
@@ -150,7 +152,7 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
             pmn->allowFreeTx = true;
 
             if(fDebug) LogPrintf("dsq - new Darksend queue object - %s\n", addr.ToString().c_str());
-            vecDarksendQueue.push_back(dsq);
+            if(!darksendQueueStore.Add(dsq)) return;
             dsq.Relay();
             dsq.time = GetTime();
         }
@@ -379,95 +381,11 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
 
 int randomizeList (int i) { return std::rand()%i;}
 
-// Recursively determine the rounds of a given input (How deep is the Darksend chain for a given input)
-int GetInputDarksendRounds(CTxIn in, int rounds)
+// Determine the rounds of a given input (How deep is the Darksend chain for a given input)
+int GetInputDarksendRounds(CTxIn in)
 {
-    static std::map<uint256, CWalletTx> mDenomWtxes;
-
-    if(rounds >= 17) return rounds;
-
-    uint256 hash = in.prevout.hash;
-    unsigned int nout = in.prevout.n;
-
-    CWalletTx wtx;
-    if(pwalletMain->GetTransaction(hash, wtx))
-    {
-        std::map<uint256, CWalletTx>::const_iterator mdwi = mDenomWtxes.find(hash);
-        // not known yet, let's add it
-        if(mdwi == mDenomWtxes.end())
-        {
-            if(fDebug) LogPrintf("GetInputDarksendRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = wtx;
-        }
-        // found and it's not an initial value, just return it
-        else if(mDenomWtxes[hash].vout[nout].nRounds != -10)
-        {
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-
-        // bounds check
-        if(nout >= wtx.vout.size())
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -4;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        mDenomWtxes[hash].vout[nout].nRounds = -3;
-        if(pwalletMain->IsCollateralAmount(wtx.vout[nout].nValue))
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        //make sure the final output is non-denominate
-        mDenomWtxes[hash].vout[nout].nRounds = -2;
-        if(/*rounds == 0 && */!pwalletMain->IsDenominatedAmount(wtx.vout[nout].nValue)) //NOT DENOM
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        bool fAllDenoms = true;
-        BOOST_FOREACH(CTxOut out, wtx.vout)
-        {
-            fAllDenoms = fAllDenoms && pwalletMain->IsDenominatedAmount(out.nValue);
-        }
-        // this one is denominated but there is another non-denominated output found in the same tx
-        if(!fAllDenoms)
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        int nShortest = -10; // an initial value, should be no way to get this by calculations
-        bool fDenomFound = false;
-        // only denoms here so let's look up
-        BOOST_FOREACH(CTxIn in2, wtx.vin)
-        {
-            if(pwalletMain->IsMine(in2))
-            {
-                int n = GetInputDarksendRounds(in2, rounds+1);
-                // denom found, find the shortest chain or initially assign nShortest with the first found value
-                if(n >= 0 && (n < nShortest || nShortest == -10))
-                {
-                    nShortest = n;
-                    fDenomFound = true;
-                }
-            }
-        }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound
-                ? nShortest + 1 // good, we a +1 to the shortest one
-                : 0;            // too bad, we are the fist one in that chain
-        if(fDebug) LogPrintf("GetInputDarksendRounds UPDATED   %s %3d %d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
-    }
-
-    return rounds-1;
+    if(!pwalletMain) return -1;
+    return pwalletMain->GetInputDarksendRounds(in);
 }
 
 void CDarksendPool::Reset(){
@@ -837,22 +755,14 @@ void CDarksendPool::CheckTimeout(){
     }
 
     // check Darksend queue objects for timeouts
-    int c = 0;
-    vector<CDarksendQueue>::iterator it;
-    for(it=vecDarksendQueue.begin();it<vecDarksendQueue.end();it++){
-        if((*it).IsExpired()){
-            if(fDebug) LogPrintf("CDarksendPool::CheckTimeout() : Removing expired queue entry - %d\n", c);
-            vecDarksendQueue.erase(it);
-            break;
-        }
-        c++;
-    }
+    int nExpired = darksendQueueStore.RemoveExpired();
+    if(nExpired > 0 && fDebug) LogPrintf("CDarksendPool::CheckTimeout() : Removed %d expired queue entries\n", nExpired);
 
     int addLagTime = 0;
     if(!fMasterNode) addLagTime = 10000; //if we're the client, give the server a few extra seconds before resetting.
 
     if(state == POOL_STATUS_ACCEPTING_ENTRIES || state == POOL_STATUS_QUEUE){
-        c = 0;
+        int c = 0;
 
         // if it's a Masternode, the entries are stored in "entries", otherwise they're stored in myEntries
         std::vector<CDarkSendEntry> *vec = &myEntries;
@@ -1504,10 +1414,9 @@ bool CDarksendPool::DoAutomaticDenominating(bool fDryRun, bool ready)
         if(nUseQueue > 33){
 
             // Look through the queues and see if anything matches
-            BOOST_FOREACH(CDarksendQueue& dsq, vecDarksendQueue){
+            std::vector<CDarksendQueue> vecQueues = darksendQueueStore.GetQueues();
+            BOOST_FOREACH(const CDarksendQueue& dsq, vecQueues){
                 CService addr;
-                if(dsq.time == 0) continue;
-
                 if(!dsq.GetAddress(addr)) continue;
                 if(dsq.IsExpired()) continue;
 
@@ -1559,13 +1468,13 @@ bool CDarksendPool::DoAutomaticDenominating(bool fDryRun, bool ready)
                         pNode->PushMessage("dsa", sessionDenom, txCollateral);
                         LogPrintf("DoAutomaticDenominating --- connected (from queue), sending dsa for %d %d - %s\n", sessionDenom, GetDenominationsByAmount(sessionTotalValue), pNode->addr.ToString().c_str());
                         strAutoDenomResult = "";
-                        dsq.time = 0; //remove node
+                        darksendQueueStore.Remove(dsq); //remove node
                         return true;
                     }
                 } else {
                     LogPrintf("DoAutomaticDenominating --- error connecting \n");
                     strAutoDenomResult = _("Error connecting to Masternode.");
-                    dsq.time = 0; //remove node
+                    darksendQueueStore.Remove(dsq); //remove node
                     return DoAutomaticDenominating();
                 }
             }
@@ -1764,27 +1673,32 @@ bool CDarksendPool::CreateDenominated(int64_t nTotalValue)
     }
 
     // ****** Add denoms ************ /
-    BOOST_REVERSE_FOREACH(int64_t v, darkSendDenominations){
-        int nOutputs = 0;
-
-        // add each output up to 10 times until it can't be added again
-        while(nValueLeft - v >= DARKSEND_COLLATERAL && nOutputs <= 10) {
-            CScript scriptChange;
-            CPubKey vchPubKey;
-            //use a unique change address
-            assert(reservekey.GetReservedKey(vchPubKey)); // should never fail, as we just unlocked
-            scriptChange.SetDestination(vchPubKey.GetID());
-            reservekey.KeepKey();
-
-            vecSend.push_back(make_pair(scriptChange, v));
+    // every output takes a fresh key from the pool, write them all in one go
+    {
+        CWalletBatch batch(pwalletMain);
+        BOOST_REVERSE_FOREACH(int64_t v, darkSendDenominations){
+            int nOutputs = 0;
+
+            // add each output up to 10 times until it can't be added again
+            while(nValueLeft - v >= DARKSEND_COLLATERAL && nOutputs <= 10) {
+                CScript scriptChange;
+                CPubKey vchPubKey;
+                //use a unique change address
+                assert(reservekey.GetReservedKey(vchPubKey)); // should never fail, as we just unlocked
+                scriptChange.SetDestination(vchPubKey.GetID());
+                reservekey.KeepKey();
+
+                vecSend.push_back(make_pair(scriptChange, v));
+
+                //increment outputs and subtract denomination amount
+                nOutputs++;
+                nValueLeft -= v;
+                LogPrintf("CreateDenominated1 %d\n", nValueLeft);
+            }
 
-            //increment outputs and subtract denomination amount
-            nOutputs++;
-            nValueLeft -= v;
-            LogPrintf("CreateDenominated1 %d\n", nValueLeft);
+            if(nValueLeft == 0) break;
         }
-
-        if(nValueLeft == 0) break;
+        batch.Commit();
     }
     LogPrintf("CreateDenominated2 %d\n", nValueLeft);
 
@@ -2064,14 +1978,28 @@ bool CDarkSendSigner::SignMessage(std::string strMessage, std::string& errorMess
     return true;
 }
 
-bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+bool CDarkSendSigner::VerifyMessage(const CPubKey& pubkey, const vector<unsigned char>& vchSig, const std::string& strMessage, std::string& errorMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    uint256 hashMessage = ss.GetHash();
+
+    // the same broadcast reaches us from many peers, only recover the key once
+    CHashWriter ssEntry(SER_GETHASH, 0);
+    ssEntry << hashMessage << vchSig << pubkey.GetID();
+    uint256 hashEntry = ssEntry.GetHash();
+    {
+        LOCK(cs);
+        if (setVerified.count(hashEntry)) {
+            nCacheHits++;
+            return true;
+        }
+        nRecoveries++;
+    }
 
     CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+    if (!pubkey2.RecoverCompact(hashMessage, vchSig)) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
@@ -2079,7 +2007,20 @@ bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSi
     if (fDebug && pubkey2.GetID() != pubkey.GetID())
         LogPrintf("CDarkSendSigner::VerifyMessage -- keys don't match: %s %s", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    if (pubkey2.GetID() != pubkey.GetID())
+        return false;
+
+    LOCK(cs);
+    setVerified.insert(hashEntry);
+    return true;
+}
+
+void CDarkSendSigner::GetCacheStats(int& nSize, uint64_t& nHits, uint64_t& nRecovered) const
+{
+    LOCK(cs);
+    nSize = setVerified.size();
+    nHits = nCacheHits;
+    nRecovered = nRecoveries;
 }
 
 bool CDarksendQueue::Sign()
@@ -2142,6 +2083,84 @@ bool CDarksendQueue::CheckSignature()
     return false;
 }
 
+bool CDarksendQueueStore::HasQueue(const CTxIn& vin) const
+{
+    LOCK(cs);
+
+    std::map<QueueKey, CDarksendQueue>::const_iterator it = mapQueues.lower_bound(std::make_pair(vin.prevout, std::numeric_limits<int>::min()));
+    return it != mapQueues.end() && it->first.first == vin.prevout;
+}
+
+bool CDarksendQueueStore::Add(const CDarksendQueue& dsq)
+{
+    LOCK(cs);
+
+    if(HasQueue(dsq.vin)) return false;
+
+    QueueKey key = std::make_pair(dsq.vin.prevout, dsq.nDenom);
+    mapQueues.insert(std::make_pair(key, dsq));
+    mapQueuesByTime.insert(std::make_pair(dsq.time, key));
+    return true;
+}
+
+void CDarksendQueueStore::Erase(std::map<QueueKey, CDarksendQueue>::iterator it)
+{
+    std::pair<std::multimap<int64_t, QueueKey>::iterator, std::multimap<int64_t, QueueKey>::iterator> range = mapQueuesByTime.equal_range(it->second.time);
+    for(std::multimap<int64_t, QueueKey>::iterator mi = range.first; mi != range.second; ++mi) {
+        if(mi->second == it->first) {
+            mapQueuesByTime.erase(mi);
+            break;
+        }
+    }
+    mapQueues.erase(it);
+}
+
+void CDarksendQueueStore::Remove(const CDarksendQueue& dsq)
+{
+    LOCK(cs);
+
+    std::map<QueueKey, CDarksendQueue>::iterator it = mapQueues.find(std::make_pair(dsq.vin.prevout, dsq.nDenom));
+    if(it != mapQueues.end()) Erase(it);
+}
+
+int CDarksendQueueStore::RemoveExpired()
+{
+    LOCK(cs);
+
+    int nRemoved = 0;
+    while(!mapQueuesByTime.empty() && GetTime() - mapQueuesByTime.begin()->first > DARKSEND_QUEUE_TIMEOUT) {
+        mapQueues.erase(mapQueuesByTime.begin()->second);
+        mapQueuesByTime.erase(mapQueuesByTime.begin());
+        nRemoved++;
+    }
+    return nRemoved;
+}
+
+std::vector<CDarksendQueue> CDarksendQueueStore::GetQueues() const
+{
+    LOCK(cs);
+
+    std::vector<CDarksendQueue> vecQueues;
+    vecQueues.reserve(mapQueues.size());
+    std::multimap<int64_t, QueueKey>::const_iterator it;
+    for(it = mapQueuesByTime.begin(); it != mapQueuesByTime.end(); ++it)
+        vecQueues.push_back(mapQueues.find(it->second)->second);
+    return vecQueues;
+}
+
+int CDarksendQueueStore::size() const
+{
+    LOCK(cs);
+    return mapQueues.size();
+}
+
+void CDarksendQueueStore::Clear()
+{
+    LOCK(cs);
+    mapQueues.clear();
+    mapQueuesByTime.clear();
+}
+
 
 void CDarksendPool::RelayFinalTransaction(const int sessionID, const CTransaction& txNew)
 {
@@ -2188,81 +2207,85 @@ void CDarksendPool::RelayCompletedTransaction(const int sessionID, const bool er
         pnode->PushMessage("dsc", sessionID, error, errorMessage);
 }
 
-//TODO: Rename/move to core
-void ThreadCheckDarkSendPool()
-{
-    if(fLiteMode) return; //disable all Darksend/Masternode related functionality
+// serializes the maintenance tasks that work on the local pool and masternode state
+static CCriticalSection cs_darksendmaintenance;
 
-    // Make this thread recognisable as the wallet flushing thread
-    RenameThread("unpay-darksend");
+static void CheckDarksendTimeout()
+{
+    darkSendPool.CheckTimeout();
+    darkSendPool.CheckForCompleteQueue();
+}
 
-    unsigned int c = 0;
-    std::string errorMessage;
+//try to sync the Masternode list and payment list every 5 seconds from at least 3 nodes
+static void RequestMasternodeLists()
+{
+    if(RequestedMasterNodeList >= 3 || IsInitialBlockDownload()) return;
 
-    while (true)
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
     {
-        c++;
-
-        MilliSleep(1000);
-        //LogPrintf("ThreadCheckDarkSendPool::check timeout\n");
-
-        darkSendPool.CheckTimeout();
-        darkSendPool.CheckForCompleteQueue();
-
-        if(c % 60 == 0)
-        {
-            LOCK(cs_main);
-            /*
-                cs_main is required for doing CMasternode.Check because something
-                is modifying the coins view without a mempool lock. It causes
-                segfaults from this code without the cs_main lock.
-            */
-            mnodeman.CheckAndRemove();
-            mnodeman.ProcessMasternodeConnections();
-            masternodePayments.CleanPaymentList();
-            CleanTransactionLocksList();
-        }
+        if (pnode->nVersion >= MIN_POOL_PEER_PROTO_VERSION) {
 
-        if(c % MASTERNODE_PING_SECONDS == 0) activeMasternode.ManageStatus();
+            //keep track of who we've asked for the list
+            if(pnode->HasFulfilledRequest("mnsync")) continue;
+            pnode->FulfilledRequest("mnsync");
 
-        if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            LogPrintf("Successfully synced, asking for Masternode list and payment list\n");
 
-        //try to sync the Masternode list and payment list every 5 seconds from at least 3 nodes
-        if(c % 5 == 0 && RequestedMasterNodeList < 3){
-            bool fIsInitialDownload = IsInitialBlockDownload();
-            if(!fIsInitialDownload) {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                {
-                    if (pnode->nVersion >= MIN_POOL_PEER_PROTO_VERSION) {
+            //request full mn list only if Masternodes.dat was updated quite a long time ago
+            mnodeman.DsegUpdate(pnode);
 
-                        //keep track of who we've asked for the list
-                        if(pnode->HasFulfilledRequest("mnsync")) continue;
-                        pnode->FulfilledRequest("mnsync");
+            pnode->PushMessage("mnget"); //sync payees
+            pnode->PushMessage("getsporks"); //get current network sporks
+            RequestedMasterNodeList++;
+        }
+    }
+}
 
-                        LogPrintf("Successfully synced, asking for Masternode list and payment list\n");
+static void ClearUsedMasternodes()
+{
+    //if we've used 1/5 of the Masternode list, then clear the list.
+    if((int)vecMasternodesUsed.size() > (int)mnodeman.size() / 5)
+        vecMasternodesUsed.clear();
+}
 
-                        //request full mn list only if Masternodes.dat was updated quite a long time ago
-                        mnodeman.DsegUpdate(pnode);
+static void AutomaticDenominating()
+{
+    if(darkSendPool.GetState() == POOL_STATUS_IDLE)
+        darkSendPool.DoAutomaticDenominating();
+}
 
-                        pnode->PushMessage("mnget"); //sync payees
-                        pnode->PushMessage("getsporks"); //get current network sporks
-                        RequestedMasterNodeList++;
-                    }
-                }
-            }
-        }
+//TODO: Rename/move to core
+void ThreadCheckDarkSendPool()
+{
+    if(fLiteMode) return; //disable all Darksend/Masternode related functionality
 
-        if(c % 60 == 0){
-            //if we've used 1/5 of the Masternode list, then clear the list.
-            if((int)vecMasternodesUsed.size() > (int)mnodeman.size() / 5)
-                vecMasternodesUsed.clear();
-        }
+    // Make this thread recognisable as the darksend maintenance thread
+    RenameThread("unpay-darksend");
 
-        if(darkSendPool.GetState() == POOL_STATUS_IDLE && c % 6 == 0){
-            darkSendPool.DoAutomaticDenominating();
-        }
-    }
+    // Every task runs on its own period, the ones that need cs_main are
+    // spread over the minute instead of taking it together.
+    CScheduler& scheduler = maintenanceScheduler;
+    scheduler.ScheduleEvery("dstimeout", &CheckDarksendTimeout, 1, 1, &cs_darksendmaintenance, "cs_darksendmaintenance");
+    // mnsync only touches its own counter and state locked elsewhere, mnscan and mncache lock what they use
+    scheduler.ScheduleEvery("mnsync", &RequestMasternodeLists, 5, 5);
+    scheduler.ScheduleEvery("dsauto", &AutomaticDenominating, 6, 6, &cs_darksendmaintenance, "cs_darksendmaintenance");
+    /*
+        cs_main is required for doing CMasternode.Check because something
+        is modifying the coins view without a mempool lock. It causes
+        segfaults from this code without the cs_main lock.
+    */
+    scheduler.ScheduleEvery("mncheck", boost::bind(&CMasternodeMan::CheckAndRemove, &mnodeman), 60, 60, &cs_main, "cs_main");
+    scheduler.ScheduleEvery("mnconnections", boost::bind(&CMasternodeMan::ProcessMasternodeConnections, &mnodeman), 60, 15, &cs_darksendmaintenance, "cs_darksendmaintenance");
+    scheduler.ScheduleEvery("mnpayments", boost::bind(&CMasternodePayments::CleanPaymentList, &masternodePayments), 60, 30, &cs_main, "cs_main");
+    scheduler.ScheduleEvery("txlocks", &CleanTransactionLocksList, 60, 45, &cs_main, "cs_main");
+    scheduler.ScheduleEvery("mnscan", boost::bind(&CMasternodeScanning::CleanMasternodeScanningErrors, &mnscan), 60, 55);
+    scheduler.ScheduleEvery("mnused", &ClearUsedMasternodes, 60, 50, &cs_darksendmaintenance, "cs_darksendmaintenance");
+    scheduler.ScheduleEvery("mnstatus", boost::bind(&CActiveMasternode::ManageStatus, &activeMasternode), MASTERNODE_PING_SECONDS, MASTERNODE_PING_SECONDS, &cs_darksendmaintenance, "cs_darksendmaintenance");
+    scheduler.ScheduleEvery("mncache", &DumpMasternodes, MASTERNODES_DUMP_SECONDS, MASTERNODES_DUMP_SECONDS);
+
+    // a second worker keeps a slow dump or denomination round from holding up the rest
+    scheduler.Run(2);
 }
 
 
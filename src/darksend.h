@@ -7,6 +7,7 @@
 
 #include "core.h"
 #include "main.h"
+#include "mruset.h"
 #include "sync.h"
 #include "activemasternode.h"
 #include "masternodeman.h"
@@ -18,6 +19,7 @@ class CDarkSendSigner;
 class CMasterNodeVote;
 class CBitcoinAddress;
 class CDarksendQueue;
+class CDarksendQueueStore;
 class CDarksendBroadcastTx;
 class CActiveMasternode;
 
@@ -42,6 +44,9 @@ class CActiveMasternode;
 #define DARKSEND_QUEUE_TIMEOUT                 30
 #define DARKSEND_SIGNING_TIMEOUT               15
 
+// verified Masternode, queue, spork and payment signatures we remember
+#define DARKSEND_SIGCACHE_SIZE                 20000
+
 // used for anonymous relaying of inputs/outputs/sigs
 #define DARKSEND_RELAY_IN                 1
 #define DARKSEND_RELAY_OUT                2
@@ -49,13 +54,13 @@ class CActiveMasternode;
 
 extern CDarksendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
-extern std::vector<CDarksendQueue> vecDarksendQueue;
+extern CDarksendQueueStore darksendQueueStore;
 extern std::string strMasterNodePrivKey;
 extern map<uint256, CDarksendBroadcastTx> mapDarksendBroadcastTxes;
 extern CActiveMasternode activeMasternode;
 
 // get the Darksend chain depth for a given input
-int GetInputDarksendRounds(CTxIn in, int rounds=0);
+int GetInputDarksendRounds(CTxIn in);
 
 /** Holds an Darksend input
  */
@@ -183,7 +188,7 @@ public:
         READWRITE(vchSig);
     )
 
-    bool GetAddress(CService &addr)
+    bool GetAddress(CService &addr) const
     {
         CMasternode* pmn = mnodeman.Find(vin);
         if(pmn != NULL)
@@ -195,7 +200,7 @@ public:
     }
 
     /// Get the protocol version
-    bool GetProtocolVersion(int &protocolVersion)
+    bool GetProtocolVersion(int &protocolVersion) const
     {
         CMasternode* pmn = mnodeman.Find(vin);
         if(pmn != NULL)
@@ -218,7 +223,7 @@ public:
     bool Relay();
 
     /// Is this Darksend expired?
-    bool IsExpired()
+    bool IsExpired() const
     {
         return (GetTime() - time) > DARKSEND_QUEUE_TIMEOUT;// 120 seconds
     }
@@ -228,6 +233,39 @@ public:
 
 };
 
+/** The Darksend queues announced by the Masternodes.
+ *
+ *  Queues are indexed by Masternode input and denomination, with a second
+ *  index ordered by time so expired queues can be dropped from the front.
+ *  A Masternode only gets one open queue at a time.
+ */
+class CDarksendQueueStore
+{
+private:
+    typedef std::pair<COutPoint, int> QueueKey;
+
+    mutable CCriticalSection cs;
+    std::map<QueueKey, CDarksendQueue> mapQueues;
+    std::multimap<int64_t, QueueKey> mapQueuesByTime;
+
+    void Erase(std::map<QueueKey, CDarksendQueue>::iterator it);
+
+public:
+    /// Is there an open queue from this Masternode?
+    bool HasQueue(const CTxIn& vin) const;
+    /// Add a queue, returns false if the Masternode already has one open
+    bool Add(const CDarksendQueue& dsq);
+    /// Remove a queue once we've tried to join it
+    void Remove(const CDarksendQueue& dsq);
+    /// Remove the expired queues, returns how many were removed
+    int RemoveExpired();
+    /// The open queues, oldest first
+    std::vector<CDarksendQueue> GetQueues() const;
+
+    int size() const;
+    void Clear();
+};
+
 /** Helper class to store Darksend transaction (tx) information.
  */
 class CDarksendBroadcastTx
@@ -243,7 +281,17 @@ public:
  */
 class CDarkSendSigner
 {
+private:
+    mutable CCriticalSection cs;
+
+    // signatures that recovered to the expected key, by Hash(message hash, signature, key id)
+    mruset<uint256> setVerified;
+    uint64_t nCacheHits;
+    uint64_t nRecoveries;
+
 public:
+    CDarkSendSigner() : setVerified(DARKSEND_SIGCACHE_SIZE), nCacheHits(0), nRecoveries(0) {}
+
     /// Is the inputs associated with this public key? (and there is 1000 UNP - checking if valid masternode)
     bool IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey);
     /// Set the private/public key values, returns true if successful
@@ -251,7 +299,9 @@ public:
     /// Sign the message, returns true if successful
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
-    bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    bool VerifyMessage(const CPubKey& pubkey, const std::vector<unsigned char>& vchSig, const std::string& strMessage, std::string& errorMessage);
+    /// Get the number of cached signatures, the verifications answered from the cache and the pubkey recoveries done
+    void GetCacheStats(int& nSize, uint64_t& nHits, uint64_t& nRecovered) const;
 };
 
 /** Used to keep track of current status of Darksend pool
@@ -158,8 +158,10 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(chainActive.GetLocator());
 #endif
-        if (pblocktree)
+        if (pblocktree) {
+            pblocktree->FlushIndexBatch();
             pblocktree->Flush();
+        }
         if (pcoinsTip)
             pcoinsTip->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
@@ -242,6 +244,8 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: unpayd.pid)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
     strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
+    strUsage += "  -addressindex          " + _("Maintain an index of the outputs and spends of every address (default: 0)") + "\n";
+    strUsage += "  -spentindex            " + _("Maintain an index of the input spending every output (default: 0)") + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
@@ -283,6 +287,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -keepassid=<name>        " + _("KeePassHttp id for the established association") + "\n";
     strUsage += "  -keepassname=<name>      " + _("Name to construct url for KeePass entry that stores the wallet passphrase") + "\n";
     strUsage += "  -keypool=<n>             " + _("Set key pool size to <n> (default: 1000)") + "\n";
+    strUsage += "  -keypoollow=<n>          " + _("Refill the key pool in the background once fewer than <n> keys are left (default: half the key pool size)") + "\n";
     strUsage += "  -paytxfee=<amt>          " + _("Fee per kB to add to transactions you send") + "\n";
     strUsage += "  -rescan                  " + _("Rescan the block chain for missing wallet transactions") + " " + _("on startup") + "\n";
     strUsage += "  -salvagewallet           " + _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup") + "\n";
@@ -370,6 +375,10 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 9998 or testnet: 19998)") + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n";
     strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + _("Set the depth of the work queue to service RPC calls (default: 16)") + "\n";
+    strUsage += "  -rpcmethodlimit=<n>    " + _("Set the number of calls of one RPC method allowed to run at the same time (default: 0 = no limit)") + "\n";
+    strUsage += "  -rpcmaxconnections=<n> " + _("Set the number of RPC connections allowed at once (default: 64)") + "\n";
+    strUsage += "  -rpcidletimeout=<n>    " + _("Close RPC connections that send no request for <n> seconds (default: 30)") + "\n";
 
     strUsage += "\n" + _("RPC SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -390,6 +399,8 @@ struct CImportingNow
     ~CImportingNow() {
         assert(fImporting == true);
         fImporting = false;
+        // let the GUI pick up the end of importing and reindexing
+        uiInterface.NotifyBlocksChanged();
     }
 };
 
@@ -700,6 +711,8 @@ bool AppInit2(boost::thread_group& threadGroup)
         LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadMasternodeListCheck);
     }
 
     if (mapArgs.count("-masternodepaymentskey")) // masternode payments priv key
@@ -968,7 +981,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nTotalCache > (nMaxDbCache << 20))
         nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-addressindex", false) && !GetBoolArg("-spentindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
@@ -1021,6 +1034,16 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Check for changed -addressindex and -spentindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
+                    break;
+                }
+                if (fSpentIndex != GetBoolArg("-spentindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg("-checkblocks", 288))) {
@@ -1227,18 +1250,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     uiInterface.InitMessage(_("Loading masternode cache..."));
 
-    CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok)
-    {
-        LogPrintf("Error reading mncache.dat: ");
-        if(readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-    }
+    LoadMasternodes();
 
     fMasterNode = GetBoolArg("-masternode", false);
     if(fMasterNode) {
@@ -1342,6 +1354,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     darkSendPool.InitCollateralAddress();
 
     threadGroup.create_thread(boost::bind(&ThreadCheckDarkSendPool));
+    threadGroup.create_thread(boost::bind(&ThreadMasternodePOS));
 
     // ********************************************************* Step 11: load peers
 
@@ -1400,6 +1413,9 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Keep the key pool filled in the background
+        threadGroup.create_thread(boost::bind(&CWallet::ThreadKeyPoolFiller, pwalletMain));
     }
 #endif
 
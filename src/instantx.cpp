@@ -16,16 +16,187 @@
 #include "spork.h"
 #include <boost/lexical_cast.hpp>
 
+#include <deque>
+
 using namespace std;
 using namespace boost;
 
 std::map<uint256, CTransaction> mapTxLockReq;
 std::map<uint256, CTransaction> mapTxLockReqRejected;
 std::map<uint256, CConsensusVote> mapTxLockVote;
+mruset<uint256> setTxLockVoteRejected(INSTANTX_MAX_REJECTED_VOTES);
 std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+int64_t nUnknownVotesTotal = 0;
 int nCompleteTXLocks;
+uint64_t nTxLocksExpired = 0;
+uint64_t nTxLocksEvicted = 0;
+uint64_t nTxLockVotesRejected = 0;
+
+// when to look at a lock or lock request again, ordered by time
+std::set<std::pair<int64_t, uint256> > setTxLockExpiry;
+// the time of the entry the requests of a transaction have in setTxLockExpiry
+static std::map<uint256, int64_t> mapTxLockReqExpiry;
+// when the unknown votes of a masternode are past, ordered by time
+static std::set<std::pair<int64_t, uint256> > setUnknownVoteExpiry;
+// lock requests in the order they came in, entries of removed requests are skipped
+static std::deque<uint256> queTxLockReq;
+static std::deque<uint256> queTxLockReqRejected;
+
+static void SetUnknownVoteTime(const uint256& hash, int64_t nTime)
+{
+    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.find(hash);
+    if(it != mapUnknownVotes.end()) {
+        nUnknownVotesTotal += nTime - it->second;
+        setUnknownVoteExpiry.erase(make_pair(it->second, hash));
+        it->second = nTime;
+    } else {
+        nUnknownVotesTotal += nTime;
+        mapUnknownVotes.insert(make_pair(hash, nTime));
+    }
+    setUnknownVoteExpiry.insert(make_pair(nTime, hash));
+}
+
+// forget everything about a transaction lock and its request
+static void RemoveTransactionLock(const uint256& txHash, bool fExpired)
+{
+    std::map<uint256, int64_t>::iterator ei = mapTxLockReqExpiry.find(txHash);
+    if(ei != mapTxLockReqExpiry.end()) {
+        setTxLockExpiry.erase(make_pair(ei->second, txHash));
+        mapTxLockReqExpiry.erase(ei);
+    }
+
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if(it != mapTxLocks.end()) {
+        setTxLockExpiry.erase(make_pair((int64_t)it->second.nExpiration, txHash));
+        if(fExpired) {
+            // loop through masternodes that responded
+            for(int nRank = 0; nRank <= INSTANTX_SIGNATURES_TOTAL; nRank++)
+            {
+                CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, it->second.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+                if(!pmn) continue;
+
+                if(!it->second.HasVoted(pmn->vin)){
+                    //increment a scanning error
+                    CMasternodeScanningError mnse(pmn->vin, SCANNING_ERROR_IX_NO_RESPONSE, it->second.nBlockHeight);
+                    pmn->ApplyScanningError(mnse);
+                }
+            }
+        }
+
+        BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
+            mapTxLockVote.erase(v.GetHash());
+
+        mapTxLocks.erase(it);
+    }
+
+    std::map<uint256, CTransaction>* pmapRequests[] = {&mapTxLockReq, &mapTxLockReqRejected};
+    for(int i = 0; i < 2; i++) {
+        std::map<uint256, CTransaction>::iterator mi = pmapRequests[i]->find(txHash);
+        if(mi == pmapRequests[i]->end()) continue;
+
+        BOOST_FOREACH(const CTxIn& in, mi->second.vin) {
+            std::map<COutPoint, uint256>::iterator li = mapLockedInputs.find(in.prevout);
+            if(li != mapLockedInputs.end() && li->second == txHash)
+                mapLockedInputs.erase(li);
+        }
+        pmapRequests[i]->erase(mi);
+    }
+}
+
+static bool IsCompleteTransactionLock(const uint256& txHash)
+{
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    return it != mapTxLocks.end() && it->second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED;
+}
+
+// make room for a new lock, the locks closest to expiring go first but complete locks are kept
+static bool EvictTransactionLocks()
+{
+    std::set<std::pair<int64_t, uint256> >::iterator it = setTxLockExpiry.begin();
+    while(mapTxLocks.size() >= INSTANTX_MAX_LOCKS && it != setTxLockExpiry.end())
+    {
+        std::pair<int64_t, uint256> entry = *it++;
+        const uint256& txHash = entry.second;
+        if(!mapTxLocks.count(txHash) || IsCompleteTransactionLock(txHash)) continue;
+
+        LogPrint("instantx", "EvictTransactionLocks - Evicting transaction lock %s\n", txHash.ToString());
+        RemoveTransactionLock(txHash, false);
+        nTxLocksEvicted++;
+        // that took the entries of the lock out of setTxLockExpiry
+        it = setTxLockExpiry.upper_bound(entry);
+    }
+
+    return mapTxLocks.size() < INSTANTX_MAX_LOCKS;
+}
+
+// make room for a new request, the oldest requests go first unless their lock is complete
+static bool EvictTransactionLockRequests(bool fAccepted)
+{
+    std::map<uint256, CTransaction>& mapRequests = fAccepted ? mapTxLockReq : mapTxLockReqRejected;
+    std::deque<uint256>& queRequests = fAccepted ? queTxLockReq : queTxLockReqRejected;
+    unsigned int nMaxRequests = fAccepted ? INSTANTX_MAX_REQUESTS : INSTANTX_MAX_REJECTED_REQUESTS;
+
+    // forget the hashes of requests that are gone already
+    if(queRequests.size() > 2 * nMaxRequests) {
+        std::deque<uint256> queKeep;
+        BOOST_FOREACH(const uint256& txHash, queRequests)
+            if(mapRequests.count(txHash)) queKeep.push_back(txHash);
+        queRequests.swap(queKeep);
+    }
+
+    size_t nKept = 0;
+    while(mapRequests.size() >= nMaxRequests && nKept < queRequests.size())
+    {
+        uint256 txHash = queRequests.front();
+        queRequests.pop_front();
+        if(!mapRequests.count(txHash)) continue;
+
+        if(IsCompleteTransactionLock(txHash)) {
+            queRequests.push_back(txHash);
+            nKept++;
+            continue;
+        }
+
+        LogPrint("instantx", "EvictTransactionLockRequests - Evicting transaction lock request %s\n", txHash.ToString());
+        RemoveTransactionLock(txHash, false);
+        nTxLocksEvicted++;
+    }
+
+    return mapRequests.size() < nMaxRequests;
+}
+
+static bool InsertTransactionLock(const CTransactionLock& lock)
+{
+    if(!EvictTransactionLocks()) {
+        LogPrint("instantx", "InsertTransactionLock - Too many complete transaction locks, ignoring %s\n", lock.txHash.ToString());
+        return false;
+    }
+    mapTxLocks.insert(make_pair(lock.txHash, lock));
+    setTxLockExpiry.insert(make_pair((int64_t)lock.nExpiration, lock.txHash));
+    return true;
+}
+
+void AddTxLockRequest(const CTransaction& tx, bool fAccepted)
+{
+    uint256 hash = tx.GetHash();
+    std::map<uint256, CTransaction>& mapRequests = fAccepted ? mapTxLockReq : mapTxLockReqRejected;
+    if(mapRequests.count(hash)) return;
+
+    if(!EvictTransactionLockRequests(fAccepted)) {
+        LogPrint("instantx", "AddTxLockRequest - Too many transaction lock requests, ignoring %s\n", hash.ToString());
+        return;
+    }
+    mapRequests.insert(make_pair(hash, tx));
+    (fAccepted ? queTxLockReq : queTxLockReqRejected).push_back(hash);
+    // requests live as long as their lock, but there might never be one
+    if(!mapTxLockReqExpiry.count(hash)) {
+        int64_t nExpiry = GetTime()+(60*60);
+        mapTxLockReqExpiry.insert(make_pair(hash, nExpiry));
+        setTxLockExpiry.insert(make_pair(nExpiry, hash));
+    }
+}
 
 //txlock - Locks transaction
 //
@@ -72,15 +243,11 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
-            vector<CInv> vInv;
-            vInv.push_back(inv);
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-                pnode->PushMessage("inv", vInv);
+            RelayInventory(inv);
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            AddTxLockRequest(tx, true);
 
             LogPrintf("ProcessMessageInstantX::txlreq - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -90,7 +257,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            AddTxLockRequest(tx, false);
 
             // can we get the conflicting transaction as proof?
 
@@ -115,7 +282,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 
                         CValidationState state;
                         DisconnectBlockAndInputs(state, tx);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                        AddTxLockRequest(tx, true);
                     }
                 }
             }
@@ -131,13 +298,17 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapTxLockVote.count(ctx.GetHash())){
+        if(mapTxLockVote.count(ctx.GetHash()) || setTxLockVoteRejected.count(ctx.GetHash())){
             return;
         }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
+        // only votes that made it into a lock are kept, they go away with the lock
+        if(!ProcessConsensusVote(ctx)){
+            setTxLockVoteRejected.insert(ctx.GetHash());
+            nTxLockVotesRejected++;
+        } else {
+            mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
 
-        if(ProcessConsensusVote(ctx)){
             //Spam/Dos protection
             /*
                 Masternodes will sometimes propagate votes before the transaction is known to the client.
@@ -146,7 +317,12 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             */
             if(!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)){
                 if(!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)){
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
+                    if(mapUnknownVotes.size() >= INSTANTX_MAX_UNKNOWN_VOTES){
+                        LogPrint("instantx", "ProcessMessageInstantX::txlvote - too many masternodes with unknown votes, not relaying %s\n",
+                            ctx.txHash.ToString());
+                        return;
+                    }
+                    SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime()+(60*10));
                 }
 
                 if(mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
@@ -157,14 +333,10 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
                         );
                         return;
                 } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
+                    SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime()+(60*10));
                 }
             }
-            vector<CInv> vInv;
-            vInv.push_back(inv);
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-                pnode->PushMessage("inv", vInv);
+            RelayInventory(inv);
 
         }
 
@@ -246,7 +418,7 @@ int64_t CreateNewLock(CTransaction tx)
         newLock.nExpiration = GetTime()+(60*60); //locks expire after 60 minutes (6 confirmations)
         newLock.nTimeout = GetTime()+(60*5);
         newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
+        InsertTransactionLock(newLock);
     } else {
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
         if(fDebug) LogPrintf("CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
@@ -294,16 +466,14 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
+    // our vote counts towards our own lock and is removed together with it
+    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
+    if(i == mapTxLocks.end() || !(*i).second.AddSignature(ctx)) return;
     mapTxLockVote[ctx.GetHash()] = ctx;
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
 
-    vector<CInv> vInv;
-    vInv.push_back(inv);
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
-    }
+    RelayInventory(inv);
 
 }
 
@@ -345,7 +515,7 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
         newLock.nExpiration = GetTime()+(60*60);
         newLock.nTimeout = GetTime()+(60*5);
         newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
+        InsertTransactionLock(newLock);
     } else {
         if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
     }
@@ -353,7 +523,8 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
     //compile consessus vote
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
     if (i != mapTxLocks.end()){
-        (*i).second.AddSignature(ctx);
+        // a masternode only gets one vote per lock
+        if(!(*i).second.AddSignature(ctx)) return false;
 
 #ifdef ENABLE_WALLET
         if(pwalletMain){
@@ -368,7 +539,8 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
         if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
             if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
+            std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(ctx.txHash);
+            CTransaction tx = itReq != mapTxLockReq.end() ? itReq->second : CTransaction();
             if(!CheckForConflictingLocks(tx)){
 
 #ifdef ENABLE_WALLET
@@ -403,6 +575,17 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
     return false;
 }
 
+// let a lock expire on the next cleanup
+static void ExpireTransactionLock(const uint256& txHash)
+{
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if(it == mapTxLocks.end()) return;
+
+    setTxLockExpiry.erase(make_pair((int64_t)it->second.nExpiration, txHash));
+    it->second.nExpiration = GetTime();
+    setTxLockExpiry.insert(make_pair((int64_t)it->second.nExpiration, txHash));
+}
+
 bool CheckForConflictingLocks(CTransaction& tx)
 {
     /*
@@ -416,8 +599,8 @@ bool CheckForConflictingLocks(CTransaction& tx)
         if(mapLockedInputs.count(in.prevout)){
             if(mapLockedInputs[in.prevout] != tx.GetHash()){
                 LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if(mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if(mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
+                ExpireTransactionLock(tx.GetHash());
+                ExpireTransactionLock(mapLockedInputs[in.prevout]);
                 return true;
             }
         }
@@ -428,69 +611,40 @@ bool CheckForConflictingLocks(CTransaction& tx)
 
 int64_t GetAverageVoteTime()
 {
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
+    if(mapUnknownVotes.empty()) return 0;
 
-    while(it != mapUnknownVotes.end()) {
-        total+= it->second;
-        count++;
-        it++;
-    }
-
-    return total / count;
+    return nUnknownVotesTotal / (int64_t)mapUnknownVotes.size();
 }
 
 void CleanTransactionLocksList()
 {
     if(chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    // keep them for an hour, only what is due is looked at
+    int64_t nNow = GetTime();
+    while(!setTxLockExpiry.empty() && setTxLockExpiry.begin()->first < nNow) {
+        uint256 txHash = setTxLockExpiry.begin()->second;
+        setTxLockExpiry.erase(setTxLockExpiry.begin());
 
-    while(it != mapTxLocks.end()) {
-        if(GetTime() > it->second.nExpiration){ //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        if(it != mapTxLocks.end()) {
+            // the lock has its own entry for a later time
+            if(nNow <= it->second.nExpiration) continue;
 
-            // loop through masternodes that responded
-            for(int nRank = 0; nRank <= INSTANTX_SIGNATURES_TOTAL; nRank++)
-            {
-                CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, it->second.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
-                if(!pmn) continue;
-
-                bool fFound = false;
-                BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
-                {
-                    if(pmn->vin == v.vinMasternode){ //Masternode responded
-                        fFound = true;
-                    }
-                }
-
-                if(!fFound){
-                    //increment a scanning error
-                    CMasternodeScanningError mnse(pmn->vin, SCANNING_ERROR_IX_NO_RESPONSE, it->second.nBlockHeight);
-                    pmn->ApplyScanningError(mnse);
-                }
-            }
-
-            if(mapTxLockReq.count(it->second.txHash)){
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
-
-                BOOST_FOREACH(const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
-
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
-
-                BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
-
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            LogPrintf("Removing old transaction lock %s\n", txHash.ToString().c_str());
+            nTxLocksExpired++;
         }
+
+        RemoveTransactionLock(txHash, true);
     }
 
+    // masternodes whose unknown votes are all past don't need tracking anymore
+    while(!setUnknownVoteExpiry.empty() && setUnknownVoteExpiry.begin()->first < nNow) {
+        const std::pair<int64_t, uint256>& entry = *setUnknownVoteExpiry.begin();
+        nUnknownVotesTotal -= entry.first;
+        mapUnknownVotes.erase(entry.second);
+        setUnknownVoteExpiry.erase(setUnknownVoteExpiry.begin());
+    }
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -597,12 +751,21 @@ bool CTransactionLock::SignaturesValid()
     return true;
 }
 
-void CTransactionLock::AddSignature(CConsensusVote& cv)
+bool CTransactionLock::AddSignature(const CConsensusVote& cv)
 {
+    if(!setVoters.insert(cv.vinMasternode.prevout).second) return false;
+
     vecConsensusVotes.push_back(cv);
+    mapVotesByHeight[cv.nBlockHeight]++;
+    return true;
+}
+
+bool CTransactionLock::HasVoted(const CTxIn& vin) const
+{
+    return setVoters.count(vin.prevout);
 }
 
-int CTransactionLock::CountSignatures()
+int CTransactionLock::CountSignatures() const
 {
     /*
         Only count signatures where the BlockHeight matches the transaction's blockheight.
@@ -611,11 +774,6 @@ int CTransactionLock::CountSignatures()
 
     if(nBlockHeight == 0) return -1;
 
-    int n = 0;
-    BOOST_FOREACH(CConsensusVote v, vecConsensusVotes){
-        if(v.nBlockHeight == nBlockHeight){
-            n++;
-        }
-    }
-    return n;
+    std::map<int, int>::const_iterator it = mapVotesByHeight.find(nBlockHeight);
+    return it != mapVotesByHeight.end() ? it->second : 0;
 }
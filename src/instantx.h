@@ -14,6 +14,7 @@
 #include "script.h"
 #include "base58.h"
 #include "main.h"
+#include "mruset.h"
 
 using namespace std;
 using namespace boost;
@@ -24,16 +25,34 @@ class CTransactionLock;
 
 static const int MIN_INSTANTX_PROTO_VERSION = 70066;
 
+/*
+    Hard limits on the InstantX state kept in memory. When a limit is hit the
+    oldest entries of that kind are dropped first. Complete locks and their
+    requests are never dropped, new entries are ignored instead.
+*/
+static const unsigned int INSTANTX_MAX_LOCKS = 10000;
+static const unsigned int INSTANTX_MAX_REQUESTS = 10000;
+static const unsigned int INSTANTX_MAX_REJECTED_REQUESTS = 10000;
+static const unsigned int INSTANTX_MAX_REJECTED_VOTES = 20000;
+static const unsigned int INSTANTX_MAX_UNKNOWN_VOTES = 10000;
+
 extern map<uint256, CTransaction> mapTxLockReq;
 extern map<uint256, CTransaction> mapTxLockReqRejected;
 extern map<uint256, CConsensusVote> mapTxLockVote;
+extern mruset<uint256> setTxLockVoteRejected;
 extern map<uint256, CTransactionLock> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
 extern int nCompleteTXLocks;
+extern uint64_t nTxLocksExpired;
+extern uint64_t nTxLocksEvicted;
+extern uint64_t nTxLockVotesRejected;
 
 
 int64_t CreateNewLock(CTransaction tx);
 
+// remember a lock request, fAccepted tells if it made it into our mempool
+void AddTxLockRequest(const CTransaction& tx, bool fAccepted);
+
 bool IsIXTXValid(const CTransaction& txCollateral);
 
 // if two conflicting locks are approved by the network, they will cancel out
@@ -80,12 +99,16 @@ public:
     int nBlockHeight;
     uint256 txHash;
     std::vector<CConsensusVote> vecConsensusVotes;
+    // masternodes that voted, and the number of votes per block height
+    std::set<COutPoint> setVoters;
+    std::map<int, int> mapVotesByHeight;
     int nExpiration;
     int nTimeout;
 
     bool SignaturesValid();
-    int CountSignatures();
-    void AddSignature(CConsensusVote& cv);
+    int CountSignatures() const;
+    bool AddSignature(const CConsensusVote& cv);
+    bool HasVoted(const CTxIn& vin) const;
 
     uint256 GetHash()
     {
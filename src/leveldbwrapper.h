@@ -52,6 +52,10 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear() {
+        batch.Clear();
+    }
 };
 
 class CLevelDBWrapper
@@ -8,6 +8,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "boundedqueue.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -28,6 +29,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 
 using namespace std;
 using namespace boost;
@@ -53,6 +55,8 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
 bool fLargeWorkForkFound = false;
 bool fLargeWorkInvalidChainFound = false;
 
@@ -1025,6 +1029,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         pool.addUnchecked(hash, entry);
     }
 
+    if (&pool == &mempool)
+        PublishChainTipSnapshot();
+
     g_signals.SyncTransaction(hash, tx, NULL);
 
     return true;
@@ -2082,11 +2089,28 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    // index entries to unwind, unless we're only checking the block (VerifyDB)
+    bool fUpdateIndexes = !pfClean && (fAddressIndex || fSpentIndex);
+    std::vector<std::pair<CAddressIndexKey, int64_t> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
         uint256 hash = tx.GetHash();
 
+        if (fUpdateIndexes && fAddressIndex) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                unsigned char nType;
+                uint160 hashBytes;
+                if (!GetAddressIndexHash(tx.vout[k].scriptPubKey, nType, hashBytes))
+                    continue;
+                addressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->nHeight, i, hash, k, false), tx.vout[k].nValue));
+                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         // Check that all outputs are available and match the outputs in the block itself
         // exactly. Note that transactions with only provably unspendable outputs won't
         // have outputs available even in the block itself, so we handle that case
@@ -2136,10 +2160,31 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 coins.vout[out.n] = undo.txout;
                 if (!view.SetCoins(out.hash, coins))
                     return error("DisconnectBlock() : cannot restore coin inputs");
+
+                if (fUpdateIndexes) {
+                    unsigned char nType;
+                    uint160 hashBytes;
+                    if (fAddressIndex && GetAddressIndexHash(undo.txout.scriptPubKey, nType, hashBytes)) {
+                        addressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->nHeight, i, hash, j, true), -undo.txout.nValue));
+                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, out.hash, out.n),
+                                                                CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, coins.nHeight)));
+                    }
+                    if (fSpentIndex)
+                        spentIndex.push_back(make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
+                }
             }
         }
     }
 
+    if (fUpdateIndexes) {
+        pblocktree->EraseAddressIndex(addressIndex);
+        pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex);
+        pblocktree->UpdateSpentIndex(spentIndex);
+        if (!IsInitialBlockDownload() || pblocktree->GetIndexBatchSize() >= MAX_INDEX_BATCH_OPS)
+            if (!pblocktree->FlushIndexBatch())
+                return state.Abort(_("Failed to write address index"));
+    }
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -2251,9 +2296,13 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
+    std::vector<std::pair<CAddressIndexKey, int64_t> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
+        const uint256 hash = block.GetTxHash(i);
 
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -2284,14 +2333,49 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+
+            if (fAddressIndex || fSpentIndex)
+            {
+                for (unsigned int j = 0; j < tx.vin.size(); j++)
+                {
+                    const COutPoint &prevout = tx.vin[j].prevout;
+                    const CTxOut &txout = view.GetOutputFor(tx.vin[j]);
+                    unsigned char nType = ADDRESS_TYPE_NONE;
+                    uint160 hashBytes = 0;
+                    bool fIndexed = GetAddressIndexHash(txout.scriptPubKey, nType, hashBytes);
+
+                    if (fAddressIndex && fIndexed)
+                    {
+                        addressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->nHeight, i, hash, j, true), -txout.nValue));
+                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue()));
+                    }
+                    if (fSpentIndex)
+                        spentIndex.push_back(make_pair(CSpentIndexKey(prevout.hash, prevout.n),
+                                                       CSpentIndexValue(hash, j, pindex->nHeight, txout.nValue, fIndexed ? nType : (unsigned char)ADDRESS_TYPE_NONE, hashBytes)));
+                }
+            }
+        }
+
+        if (fAddressIndex)
+        {
+            for (unsigned int k = 0; k < tx.vout.size(); k++)
+            {
+                unsigned char nType;
+                uint160 hashBytes;
+                if (!GetAddressIndexHash(tx.vout[k].scriptPubKey, nType, hashBytes))
+                    continue;
+                addressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, pindex->nHeight, i, hash, k, false), tx.vout[k].nValue));
+                addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, hash, k),
+                                                        CAddressUnspentValue(tx.vout[k].nValue, tx.vout[k].scriptPubKey, pindex->nHeight)));
+            }
         }
 
         CTxUndo txundo;
-        UpdateCoins(tx, state, view, txundo, pindex->nHeight, block.GetTxHash(i));
+        UpdateCoins(tx, state, view, txundo, pindex->nHeight, hash);
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
-        vPos.push_back(std::make_pair(block.GetTxHash(i), pos));
+        vPos.push_back(std::make_pair(hash, pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime = GetTimeMicros() - nStart;
@@ -2339,6 +2423,18 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    if (fAddressIndex || fSpentIndex)
+    {
+        pblocktree->WriteAddressIndex(addressIndex);
+        pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex);
+        pblocktree->UpdateSpentIndex(spentIndex);
+        // while catching up (-reindex included), let the updates of many blocks
+        // pile up and go to disk together with the coins
+        if (!IsInitialBlockDownload() || pblocktree->GetIndexBatchSize() >= MAX_INDEX_BATCH_OPS)
+            if (!pblocktree->FlushIndexBatch())
+                return state.Abort(_("Failed to write address index"));
+    }
+
     // add this block to the view's block chain
     bool ret;
     ret = view.SetBestBlock(pindex->GetBlockHash());
@@ -2363,6 +2459,8 @@ bool static WriteChainState(CValidationState &state) {
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         FlushBlockFile();
+        if (!pblocktree->FlushIndexBatch())
+            return state.Abort(_("Failed to write address index"));
         pblocktree->Sync();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
@@ -2371,6 +2469,52 @@ bool static WriteChainState(CValidationState &state) {
     return true;
 }
 
+static CCriticalSection cs_chaintipsnapshot;
+static boost::shared_ptr<const CChainTipSnapshot> pchaintipsnapshot(new CChainTipSnapshot());
+
+boost::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot()
+{
+    LOCK(cs_chaintipsnapshot);
+    return pchaintipsnapshot;
+}
+
+void PublishChainTipSnapshot()
+{
+    CChainTipSnapshot* psnapshot = new CChainTipSnapshot();
+    CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip)
+    {
+        psnapshot->hashBestBlock = pindexTip->GetBlockHash();
+        psnapshot->nHeight = pindexTip->nHeight;
+        psnapshot->nBlockTime = pindexTip->GetBlockTime();
+        psnapshot->nBits = pindexTip->nBits;
+        psnapshot->nChainWork = pindexTip->nChainWork;
+        psnapshot->dVerificationProgress = Checkpoints::GuessVerificationProgress(pindexTip);
+    }
+    psnapshot->nMempoolTx = mempool.size();
+
+    // build outside the lock, so readers only ever wait for the pointer swap
+    boost::shared_ptr<const CChainTipSnapshot> pnew(psnapshot);
+    LOCK(cs_chaintipsnapshot);
+    psnapshot->nMasternodes = pchaintipsnapshot->nMasternodes;
+    psnapshot->nMasternodesEnabled = pchaintipsnapshot->nMasternodesEnabled;
+    pchaintipsnapshot.swap(pnew);
+}
+
+void PublishMasternodeCounts(int nMasternodes, int nMasternodesEnabled)
+{
+    {
+        LOCK(cs_chaintipsnapshot);
+        if (pchaintipsnapshot->nMasternodes == nMasternodes && pchaintipsnapshot->nMasternodesEnabled == nMasternodesEnabled)
+            return;
+        CChainTipSnapshot* psnapshot = new CChainTipSnapshot(*pchaintipsnapshot);
+        psnapshot->nMasternodes = nMasternodes;
+        psnapshot->nMasternodesEnabled = nMasternodesEnabled;
+        pchaintipsnapshot.reset(psnapshot);
+    }
+    uiInterface.NotifyMasternodeListChanged();
+}
+
 // Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
@@ -2383,6 +2527,7 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    PublishChainTipSnapshot();
     LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -2531,6 +2676,8 @@ bool DisconnectBlockAndInputs(CValidationState &state, CTransaction txLock)
     //remove anything conflicting in the memory pool
     list<CTransaction> txConflicted;
     mempool.removeConflicts(txLock, txConflicted);
+    if (!txConflicted.empty())
+        PublishChainTipSnapshot();
 
 
     // List of what to disconnect (typically nothing)
@@ -2836,10 +2983,11 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
+bool CheckBlockStructure(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
+    // They don't touch any global state, so they are safe to run without cs_main.
 
     // Size limits
     if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
@@ -2866,6 +3014,45 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                              REJECT_INVALID, "bad-cb-multiple");
 
 
+    // Check transactions
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (!CheckTransaction(tx, state))
+            return error("CheckBlock() : CheckTransaction failed");
+
+    // Build the merkle tree already. We need it anyway later, and it makes the
+    // block cache the transaction hashes, which means they don't need to be
+    // recalculated many times during this block's validation.
+    block.BuildMerkleTree();
+
+    // Check for duplicate txids. This is caught by ConnectInputs(),
+    // but catching it earlier avoids a potential DoS attack:
+    set<uint256> uniqueTx;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        uniqueTx.insert(block.GetTxHash(i));
+    }
+    if (uniqueTx.size() != block.vtx.size())
+        return state.DoS(100, error("CheckBlock() : duplicate transaction"),
+                         REJECT_INVALID, "bad-txns-duplicate", true);
+
+    unsigned int nSigOps = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nSigOps > MAX_BLOCK_SIGOPS)
+        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
+                         REJECT_INVALID, "bad-blk-sigops", true);
+
+    // Check merkle root
+    if (fCheckMerkleRoot && block.hashMerkleRoot != block.vMerkleTree.back())
+        return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
+                         REJECT_INVALID, "bad-txnmrklroot", true);
+
+    return true;
+}
+
+bool CheckBlockLocksAndPayments(const CBlock& block, CValidationState& state)
+{
     // ----------- instantX transaction scanning -----------
 
     if(IsSporkActive(SPORK_3_INSTANTX_BLOCK_FILTERING)){
@@ -2961,42 +3148,15 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         LogPrintf("CheckBlock() : skipping masternode payment checks\n");
     }
 
+    return true;
+}
 
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
-            return error("CheckBlock() : CheckTransaction failed");
-
-    // Build the merkle tree already. We need it anyway later, and it makes the
-    // block cache the transaction hashes, which means they don't need to be
-    // recalculated many times during this block's validation.
-    block.BuildMerkleTree();
-
-    // Check for duplicate txids. This is caught by ConnectInputs(),
-    // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    for (unsigned int i = 0; i < block.vtx.size(); i++) {
-        uniqueTx.insert(block.GetTxHash(i));
-    }
-    if (uniqueTx.size() != block.vtx.size())
-        return state.DoS(100, error("CheckBlock() : duplicate transaction"),
-                         REJECT_INVALID, "bad-txns-duplicate", true);
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-    {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
-    if (nSigOps > MAX_BLOCK_SIGOPS)
-        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
-                         REJECT_INVALID, "bad-blk-sigops", true);
-
-    // Check merkle root
-    if (fCheckMerkleRoot && block.hashMerkleRoot != block.vMerkleTree.back())
-        return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
-                         REJECT_INVALID, "bad-txnmrklroot", true);
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
+{
+    if (!CheckBlockStructure(block, state, fCheckPOW, fCheckMerkleRoot))
+        return false;
 
-    return true;
+    return CheckBlockLocksAndPayments(block, state);
 }
 
 bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
@@ -3116,10 +3276,11 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (chainActive.Tip()->GetBlockHash() == hash)
     {
+        int64_t nNow = GetTimeMicros();
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
             if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+                pnode->PushInventory(CInv(MSG_BLOCK, hash), nNow);
     }
 
     return true;
@@ -3162,7 +3323,7 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", chainActive.GetLocator(pindexBegin), hashEnd);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fStructureChecked)
 {
     AssertLockHeld(cs_main);
 
@@ -3184,7 +3345,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString()), 0, "duplicate");
 
     // Preliminary checks
-    if (!CheckBlock(*pblock, state))
+    if (fStructureChecked) {
+        if (!CheckBlockLocksAndPayments(*pblock, state))
+            return error("ProcessBlock() : CheckBlock FAILED");
+    } else if (!CheckBlock(*pblock, state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -3548,11 +3712,18 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have the address and spent indexes
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
     // Load pointer to end of best chain
     std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    PublishChainTipSnapshot();
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3640,6 +3811,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
     chainActive.SetTip(NULL);
+    PublishChainTipSnapshot();
     pindexBestInvalid = NULL;
 }
 
@@ -3661,6 +3833,10 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fSpentIndex = GetBoolArg("-spentindex", false);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3756,11 +3932,74 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+/** A block read from an external file on its way through the import pipeline */
+struct CImportBlock
 {
-    int64_t nStart = GetTimeMillis();
+    CBlock block;
+    uint64_t nBlockPos;
+    bool fChecked; // CheckBlockStructure has run (protected by CBlockImporter::cs)
+    bool fValid;   // ... and this was its result
+
+    CImportBlock() : nBlockPos(0), fChecked(false), fValid(false) {}
+};
+
+typedef boost::shared_ptr<CImportBlock> CImportBlockRef;
+
+/** Imports the blocks of one external block file (-reindex, -loadblock, bootstrap.dat).
+ *
+ *  The work is split into three stages connected by bounded queues:
+ *  - a reader thread scanning the file and deserializing blocks,
+ *  - a pool of worker threads running the context-free CheckBlockStructure
+ *    (X11 proof of work, transactions, merkle root) in parallel,
+ *  - the calling thread, which hands the checked blocks to ProcessBlock
+ *    under cs_main, strictly in file order.
+ *  Every block is pushed to the connect queue before the check queue, so the
+ *  connect stage always waits on a block that is already being checked.
+ */
+class CBlockImporter
+{
+private:
+    FILE* fileIn;
+    CDiskBlockPos* dbp;
+    int nCheckThreads;
+
+    CBoundedQueue<CImportBlockRef> queueCheck;
+    CBoundedQueue<CImportBlockRef> queueConnect;
+    boost::thread_group threadGroup;
+
+    boost::mutex cs;
+    boost::condition_variable condChecked;
+    std::string strReadError;
+
+    // Per-stage counters; the reader's are only touched by the reader thread
+    // and the connect stage's only by the calling thread, the check
+    // counters are protected by cs.
+    uint64_t nBlocksRead, nBytesRead, nReadMicros;
+    uint64_t nBlocksChecked, nBlocksRejected, nCheckMicros;
+    uint64_t nBlocksConnected, nConnectMicros, nStallMicros;
+
+    void ThreadRead();
+    void ThreadCheck();
+    void Stop();
+
+public:
+    CBlockImporter(FILE* fileInIn, CDiskBlockPos* dbpIn, int nCheckThreadsIn) :
+        fileIn(fileInIn), dbp(dbpIn), nCheckThreads(std::max(nCheckThreadsIn, 1)),
+        queueCheck(MAX_IMPORT_QUEUE_BLOCKS), queueConnect(MAX_IMPORT_QUEUE_BLOCKS),
+        nBlocksRead(0), nBytesRead(0), nReadMicros(0),
+        nBlocksChecked(0), nBlocksRejected(0), nCheckMicros(0),
+        nBlocksConnected(0), nConnectMicros(0), nStallMicros(0) {}
+
+    ~CBlockImporter() { Stop(); }
+
+    // Run the pipeline to completion, returns the number of blocks accepted by ProcessBlock
+    int Run();
+};
+
+void CBlockImporter::ThreadRead()
+{
+    RenameThread("unpay-loadblk-read");
 
-    int nLoaded = 0;
     try {
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nStartByte = 0;
@@ -3776,6 +4015,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
         while (blkdat.good() && !blkdat.eof()) {
             boost::this_thread::interruption_point();
 
+            int64_t nTimeStart = GetTimeMicros();
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
@@ -3798,34 +4038,127 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             }
             try {
                 // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                CImportBlockRef pimport(new CImportBlock());
+                pimport->nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(pimport->nBlockPos + nSize);
+                blkdat >> pimport->block;
                 nRewind = blkdat.GetPos();
+                nReadMicros += GetTimeMicros() - nTimeStart;
 
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
+                // pass it on to the next stages
+                if (pimport->nBlockPos >= nStartByte) {
+                    nBlocksRead++;
+                    nBytesRead += nSize;
+                    if (!queueConnect.Push(pimport) || !queueCheck.Push(pimport))
                         break;
                 }
             } catch (std::exception &e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
+    } catch (std::runtime_error &e) {
+        boost::unique_lock<boost::mutex> lock(cs);
+        strReadError = e.what();
+    } catch (...) {
+        queueCheck.Close();
+        queueConnect.Close();
+        throw;
+    }
+    queueCheck.Close();
+    queueConnect.Close();
+}
+
+void CBlockImporter::ThreadCheck()
+{
+    RenameThread("unpay-loadblk-check");
+
+    CImportBlockRef pimport;
+    while (queueCheck.Pop(pimport)) {
+        int64_t nTimeStart = GetTimeMicros();
+        CValidationState state;
+        bool fValid = CheckBlockStructure(pimport->block, state);
+        int64_t nTime = GetTimeMicros() - nTimeStart;
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        pimport->fValid = fValid;
+        pimport->fChecked = true;
+        nBlocksChecked++;
+        if (!fValid)
+            nBlocksRejected++;
+        nCheckMicros += nTime;
+        condChecked.notify_all();
+    }
+}
+
+void CBlockImporter::Stop()
+{
+    queueCheck.Abort();
+    queueConnect.Abort();
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+int CBlockImporter::Run()
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+    for (int i = 0; i < nCheckThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+    try {
+        CImportBlockRef pimport;
+        while (queueConnect.Pop(pimport)) {
+            boost::this_thread::interruption_point();
+
+            // wait for the check stage to catch up with this block
+            int64_t nTimeStart = GetTimeMicros();
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!pimport->fChecked)
+                    condChecked.wait(lock);
+            }
+            int64_t nTimeChecked = GetTimeMicros();
+            nStallMicros += nTimeChecked - nTimeStart;
+
+            // process block
+            if (pimport->fValid) {
+                LOCK(cs_main);
+                if (dbp)
+                    dbp->nPos = pimport->nBlockPos;
+                CValidationState state;
+                if (ProcessBlock(state, NULL, &pimport->block, dbp, true))
+                    nLoaded++;
+                nBlocksConnected++;
+                nConnectMicros += GetTimeMicros() - nTimeChecked;
+                if (state.IsError())
+                    break;
+            }
+        }
+        Stop();
         fclose(fileIn);
+        if (!strReadError.empty())
+            AbortNode(_("Error: system error: ") + strReadError);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
     }
+
+    if (nBlocksRead > 0) {
+        boost::unique_lock<boost::mutex> lock(cs);
+        LogPrintf("Import pipeline: read %u blocks (%u bytes) in %dms, checked %u (%u rejected) in %dms on %d threads, connected %u in %dms (%dms waiting for checks)\n",
+            nBlocksRead, nBytesRead, nReadMicros / 1000, nBlocksChecked, nBlocksRejected, nCheckMicros / 1000, nCheckThreads,
+            nBlocksConnected, nConnectMicros / 1000, nStallMicros / 1000);
+    }
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+    return nLoaded;
+}
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    CBlockImporter importer(fileIn, dbp, nScriptCheckThreads);
+    return importer.Run() > 0;
 }
 
 
@@ -3925,7 +4258,8 @@ bool static AlreadyHave(const CInv& inv)
         return mapTxLockReq.count(inv.hash) ||
                mapTxLockReqRejected.count(inv.hash);
     case MSG_TXLOCK_VOTE:
-        return mapTxLockVote.count(inv.hash);
+        return mapTxLockVote.count(inv.hash) ||
+               setTxLockVoteRejected.count(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
     case MSG_MASTERNODE_WINNER:
@@ -3999,7 +4333,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(CNode::InventoryKnownKey(CInv(MSG_TX, pair.second))))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -5046,9 +5380,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
+                    // Periodically clear addrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
+                        pnode->addrKnown.clear();
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -5071,9 +5405,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                if (!pto->addrKnown.contains(addr.GetKey()))
                 {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000)
@@ -5120,50 +5454,73 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Announced in batches, most urgent relay class first. Lock requests,
+        // votes and blocks go out right away, and so do transactions when it
+        // is this peer's turn to get the trickled ones; the rest waits for
+        // the peer's randomized flush timer.
+        int64_t nNowInv = GetTimeMicros();
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
+        CRelayLatency latency[RELAY_CLASSES];
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+            bool fFlushTimer = nNowInv >= pto->nNextInvSend;
+            if (fFlushTimer || !pto->vInventoryToSend[RELAY_INSTANTX].empty() || !pto->vInventoryToSend[RELAY_BLOCK].empty() ||
+                (fSendTrickle && !pto->vInventoryToSend[RELAY_TX].empty()))
             {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
+                if (fFlushTimer)
+                    pto->nNextInvSend = nNowInv + GetRand(2 * INVENTORY_FLUSH_INTERVAL);
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                for (int nClass = 0; nClass < RELAY_CLASSES; nClass++)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
+                    if (pto->vInventoryToSend[nClass].empty())
                         continue;
-                    }
-                }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
+                    vector<CQueuedInv> vInvWait;
+                    BOOST_FOREACH(const CQueuedInv& queued, pto->vInventoryToSend[nClass])
                     {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
+                        const CInv& inv = queued.inv;
+                        uint256 hashKnown = CNode::InventoryKnownKey(inv);
+                        if (pto->filterInventoryKnown.contains(hashKnown))
+                            continue;
+
+                        // trickle out tx inv to protect privacy
+                        if (inv.type == MSG_TX && !fSendTrickle)
+                        {
+                            // 1/4 of tx invs blast to all immediately
+                            static uint256 hashSalt;
+                            if (hashSalt == 0)
+                                hashSalt = GetRandHash();
+                            uint256 hashRand = inv.hash ^ hashSalt;
+                            hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                            bool fTrickleWait = ((hashRand & 3) != 0);
+
+                            if (fTrickleWait)
+                            {
+                                vInvWait.push_back(queued);
+                                continue;
+                            }
+                        }
+
+                        // the same inventory may be queued by several relay sources,
+                        // marking it known here announces it once
+                        pto->filterInventoryKnown.insert(hashKnown);
+                        latency[nClass].Add(nNowInv - queued.nTime);
+                        vInv.push_back(inv);
+                        if (vInv.size() >= 1000)
+                        {
+                            pto->PushMessage("inv", vInv);
+                            vInv.clear();
+                        }
                     }
+                    pto->vInventoryToSend[nClass].swap(vInvWait);
                 }
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
+        for (int nClass = 0; nClass < RELAY_CLASSES; nClass++)
+            if (latency[nClass].nCount)
+                CNode::RecordRelayLatency(nClass, latency[nClass]);
 
 
         // Detect stalled peers. Require that blocks are in flight, we haven't
@@ -5197,9 +5554,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+        vector<CInv> vAskFor;
+        if (!pto->fDisconnect)
+            pto->queueAskFor.PopDue(nNow / ASKFOR_TICK, vAskFor);
+        BOOST_FOREACH(const CInv& inv, vAskFor)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(inv))
             {
                 if (fDebug)
@@ -5211,7 +5570,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     vGetData.clear();
                 }
             }
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
@@ -30,6 +30,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 // Define difficulty retarget algorithms
 enum DiffMode {
     DIFF_DEFAULT = 0, // Default to invalid 0
@@ -63,6 +65,8 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Number of queued address and spent index updates that are written out even during initial block download */
+static const unsigned int MAX_INDEX_BATCH_OPS = 100000;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 10;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
@@ -71,6 +75,8 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of blocks buffered between the stages of the external block import pipeline */
+static const unsigned int MAX_IMPORT_QUEUE_BLOCKS = 64;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds before considering a block download peer unresponsive. */
@@ -106,6 +112,8 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
 extern unsigned int nCoinCacheSize;
 
 extern bool fLargeWorkForkFound;
@@ -142,8 +150,8 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block. fStructureChecked skips CheckBlockStructure if the caller already ran it. */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fStructureChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -625,6 +633,13 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
 // Context-independent validity checks
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
+// The part of CheckBlock that only looks at the block itself (size, proof of work, transactions, merkle root).
+// Doesn't require cs_main, so it may run on worker threads ahead of ProcessBlock.
+bool CheckBlockStructure(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+
+// The part of CheckBlock that depends on instantX locks and masternode payments
+bool CheckBlockLocksAndPayments(const CBlock& block, CValidationState& state);
+
 // Store block on disk
 // if dbp is provided, the file is known to already reside on disk
 bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL);
@@ -1082,6 +1097,33 @@ extern CChain chainActive;
 /** The currently best known chain of headers (some of which may be invalid). */
 extern CChain chainMostWork;
 
+/** Chain tip state for read-only RPCs, published as a whole after every tip
+  * and mempool change. A published snapshot is never modified, so readers
+  * can use it without cs_main and always see a consistent tip.
+  */
+struct CChainTipSnapshot
+{
+    uint256 hashBestBlock;
+    int nHeight;
+    int64_t nBlockTime;
+    unsigned int nBits;
+    uint256 nChainWork;
+    double dVerificationProgress;
+    unsigned int nMempoolTx;
+    int nMasternodes;
+    int nMasternodesEnabled;
+
+    CChainTipSnapshot() : hashBestBlock(0), nHeight(-1), nBlockTime(0), nBits(0), nChainWork(0),
+                          dVerificationProgress(0), nMempoolTx(0), nMasternodes(0), nMasternodesEnabled(0) {}
+};
+
+/** The last published chain tip snapshot, never NULL */
+boost::shared_ptr<const CChainTipSnapshot> GetChainTipSnapshot();
+/** Publish the current tip and mempool state (requires cs_main) */
+void PublishChainTipSnapshot();
+/** Publish new masternode counts, keeping the rest of the snapshot */
+void PublishMasternodeCounts(int nMasternodes, int nMasternodesEnabled);
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
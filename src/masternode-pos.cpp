@@ -66,10 +66,13 @@ void ProcessMessageMasternodePOS(CNode* pfrom, std::string& strCommand, CDataStr
         CInv inv(MSG_MASTERNODE_SCANNING_ERROR, mnse.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapMasternodeScanningErrors.count(mnse.GetHash())){
-            return;
+        {
+            LOCK(cs_main);
+            if(mapMasternodeScanningErrors.count(mnse.GetHash())){
+                return;
+            }
+            mapMasternodeScanningErrors.insert(make_pair(mnse.GetHash(), mnse));
         }
-        mapMasternodeScanningErrors.insert(make_pair(mnse.GetHash(), mnse));
 
         if(!mnse.IsValid())
         {
@@ -120,26 +123,44 @@ void ProcessMessageMasternodePOS(CNode* pfrom, std::string& strCommand, CDataStr
 // Returns how many masternodes are allowed to scan each block
 int GetCountScanningPerBlock()
 {
-    return std::max(1, mnodeman.CountMasternodesAboveProtocol(MIN_MASTERNODE_POS_PROTO_VERSION)/100);
+    return GetCountScanningPerBlock(mnodeman.CountMasternodesAboveProtocol(MIN_MASTERNODE_POS_PROTO_VERSION));
+}
+
+int GetCountScanningPerBlock(int nCountEnabled)
+{
+    return std::max(1, nCountEnabled/100);
 }
 
 
 void CMasternodeScanning::CleanMasternodeScanningErrors()
 {
-    if(chainActive.Tip() == NULL) return;
+    {
+        LOCK(cs_main);
+
+        if(chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CMasternodeScanningError>::iterator it = mapMasternodeScanningErrors.begin();
+        std::map<uint256, CMasternodeScanningError>::iterator it = mapMasternodeScanningErrors.begin();
 
-    while(it != mapMasternodeScanningErrors.end()) {
-        if(GetTime() > it->second.nExpiration){ //keep them for an hour
-            LogPrintf("Removing old masternode scanning error %s\n", it->second.GetHash().ToString().c_str());
+        while(it != mapMasternodeScanningErrors.end()) {
+            if(GetTime() > it->second.nExpiration){ //keep them for an hour
+                LogPrintf("Removing old masternode scanning error %s\n", it->second.GetHash().ToString().c_str());
 
-            mapMasternodeScanningErrors.erase(it++);
+                mapMasternodeScanningErrors.erase(it++);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<COutPoint, std::pair<int64_t, bool> >::iterator it = mapResults.begin();
+    while(it != mapResults.end()) {
+        if(GetTime() - it->second.first > MASTERNODE_POS_CACHE_SECONDS){
+            mapResults.erase(it++);
         } else {
             it++;
         }
     }
-
 }
 
 // Check other masternodes to make sure they're running correctly
@@ -152,33 +173,223 @@ void CMasternodeScanning::DoMasternodePOSChecks()
 
     int nBlockHeight = chainActive.Tip()->nHeight-5;
 
-    int a = mnodeman.GetMasternodeRank(activeMasternode.vin, nBlockHeight, MIN_MASTERNODE_POS_PROTO_VERSION);
-    if(a == -1 || a > GetCountScanningPerBlock()){
+    // rank everyone once, we need our place among the enabled masternodes and
+    // the target's place among all of them
+    int nCountEnabled = 0;
+    std::vector<CTxIn> vecRanked;
+    int a = mnodeman.GetMasternodeRankAndOrder(activeMasternode.vin, nBlockHeight, MIN_MASTERNODE_POS_PROTO_VERSION, nCountEnabled, vecRanked);
+    if(a == -1 || a > GetCountScanningPerBlock(nCountEnabled)){
         // we don't need to do anything this block
         return;
     }
 
     // The lowest ranking nodes (Masternode A) check the highest ranking nodes (Masternode B)
-    CMasternode* pmn = mnodeman.GetMasternodeByRank(mnodeman.CountMasternodesAboveProtocol(MIN_MASTERNODE_POS_PROTO_VERSION)-a, nBlockHeight, MIN_MASTERNODE_POS_PROTO_VERSION, false);
+    int b = nCountEnabled - a;
+    if(b < 1 || b > (int)vecRanked.size()) return;
+    CMasternode* pmn = mnodeman.Find(vecRanked[b-1]);
     if(pmn == NULL) return;
 
-    // -- first check : Port is open
+    // -- first check : Port is open, probed from ThreadMasternodePOS
 
-    if(!ConnectNode((CAddress)pmn->addr, NULL, true)){
-        // we couldn't connect to the node, let's send a scanning error
-        CMasternodeScanningError mnse(activeMasternode.vin, pmn->vin, SCANNING_ERROR_NO_RESPONSE, nBlockHeight);
-        mnse.Sign();
-        mapMasternodeScanningErrors.insert(make_pair(mnse.GetHash(), mnse));
-        mnse.Relay();
+    CProbeRequest req;
+    req.vin = pmn->vin;
+    req.addr = pmn->addr;
+    req.nBlockHeight = nBlockHeight;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if(queueRequests.size() >= MASTERNODE_POS_MAX_QUEUED) {
+        LogPrintf("CMasternodeScanning::DoMasternodePOSChecks() - Too many pending scans, dropping %s\n", queueRequests.front().addr.ToString());
+        queueRequests.pop_front();
+    }
+    queueRequests.push_back(req);
+    condRequest.notify_one();
+}
+
+bool CMasternodeScanning::GetCachedResult(const CTxIn& vin, bool& fOpen)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    std::map<COutPoint, std::pair<int64_t, bool> >::iterator it = mapResults.find(vin.prevout);
+    if(it == mapResults.end() || GetTime() - it->second.first > MASTERNODE_POS_CACHE_SECONDS) return false;
+
+    fOpen = it->second.second;
+    return true;
+}
+
+void CMasternodeScanning::StartProbe(const CProbeRequest& req, std::vector<CProbe>& vProbes)
+{
+    bool fOpen;
+    if(GetCachedResult(req.vin, fOpen)) {
+        FinishProbe(req, fOpen, true);
+        return;
+    }
+
+    // proxied connections need the socks handshake, let netbase do it
+    proxyType proxy;
+    if(GetProxy(req.addr.GetNetwork(), proxy)) {
+        SOCKET hSocket;
+        fOpen = ConnectSocket(req.addr, hSocket);
+        if(fOpen) closesocket(hSocket);
+        FinishProbe(req, fOpen, false);
+        return;
+    }
+
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if(!req.addr.GetSockAddr((struct sockaddr*)&sockaddr, &len)) {
+        LogPrintf("CMasternodeScanning::StartProbe() - Cannot probe %s: unsupported network\n", req.addr.ToString());
+        return;
     }
 
-    // success
-    CMasternodeScanningError mnse(activeMasternode.vin, pmn->vin, SCANNING_SUCCESS, nBlockHeight);
-    mnse.Sign();
-    mapMasternodeScanningErrors.insert(make_pair(mnse.GetHash(), mnse));
+    SOCKET hSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if(hSocket == INVALID_SOCKET) return;
+#ifdef SO_NOSIGPIPE
+    int set = 1;
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&set, sizeof(int));
+#endif
+
+#ifdef WIN32
+    u_long fNonblock = 1;
+    if(ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
+#else
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
+    if(fcntl(hSocket, F_SETFL, fFlags | O_NONBLOCK) == -1)
+#endif
+    {
+        closesocket(hSocket);
+        return;
+    }
+
+    if(connect(hSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR) {
+        // WSAEINVAL is here because some legacy version of winsock uses it
+        int nErr = WSAGetLastError();
+        if(nErr != WSAEINPROGRESS && nErr != WSAEWOULDBLOCK && nErr != WSAEINVAL) {
+            closesocket(hSocket);
+#ifdef WIN32
+            FinishProbe(req, nErr == WSAEISCONN, false);
+#else
+            FinishProbe(req, false, false);
+#endif
+            return;
+        }
+    } else {
+        closesocket(hSocket);
+        FinishProbe(req, true, false);
+        return;
+    }
+
+    CProbe probe;
+    probe.req = req;
+    probe.hSocket = hSocket;
+    probe.nStart = GetTimeMillis();
+    vProbes.push_back(probe);
+}
+
+void CMasternodeScanning::FinishProbe(const CProbeRequest& req, bool fOpen, bool fCached)
+{
+    if(fDebug) LogPrintf("CMasternodeScanning::FinishProbe() - %s port %s%s\n", req.addr.ToString(), fOpen ? "open" : "closed", fCached ? " (cached)" : "");
+
+    if(!fCached) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapResults[req.vin.prevout] = std::make_pair(GetTime(), fOpen);
+    }
+
+    CTxIn vinMasternodeB = req.vin;
+    CMasternodeScanningError mnse(activeMasternode.vin, vinMasternodeB, fOpen ? SCANNING_SUCCESS : SCANNING_ERROR_NO_RESPONSE, req.nBlockHeight);
+    if(!mnse.Sign()) return;
+    {
+        LOCK(cs_main);
+        mapMasternodeScanningErrors.insert(make_pair(mnse.GetHash(), mnse));
+    }
     mnse.Relay();
 }
 
+void CMasternodeScanning::ThreadProbe()
+{
+    std::vector<CProbe> vProbes;
+
+    try {
+        while(true)
+        {
+            // take as many requests as we have probe slots for
+            std::vector<CProbeRequest> vRequests;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while(vProbes.empty() && queueRequests.empty())
+                    condRequest.wait(lock);
+                while(!queueRequests.empty() && vProbes.size() + vRequests.size() < MASTERNODE_POS_MAX_PROBES) {
+                    vRequests.push_back(queueRequests.front());
+                    queueRequests.pop_front();
+                }
+            }
+            BOOST_FOREACH(const CProbeRequest& req, vRequests)
+                StartProbe(req, vProbes);
+
+            if(vProbes.empty()) continue;
+
+            fd_set fdsetSend;
+            fd_set fdsetError;
+            FD_ZERO(&fdsetSend);
+            FD_ZERO(&fdsetError);
+            SOCKET hSocketMax = 0;
+            BOOST_FOREACH(const CProbe& probe, vProbes) {
+                FD_SET(probe.hSocket, &fdsetSend);
+                FD_SET(probe.hSocket, &fdsetError);
+                hSocketMax = max(hSocketMax, probe.hSocket);
+            }
+
+            // wake up regularly to pick up new requests and expire slow probes
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 250000;
+            int nSelect = select(hSocketMax + 1, NULL, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
+            if(nSelect == SOCKET_ERROR) {
+                LogPrintf("CMasternodeScanning::ThreadProbe() - select() failed: %s\n", NetworkErrorString(WSAGetLastError()));
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(250);
+            }
+
+            int64_t nNow = GetTimeMillis();
+            std::vector<CProbe>::iterator it = vProbes.begin();
+            while(it != vProbes.end()) {
+                bool fOpen = false;
+                if(FD_ISSET(it->hSocket, &fdsetSend) || FD_ISSET(it->hSocket, &fdsetError)) {
+                    int nRet = 0;
+                    socklen_t nRetSize = sizeof(nRet);
+#ifdef WIN32
+                    fOpen = getsockopt(it->hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) != SOCKET_ERROR && nRet == 0;
+#else
+                    fOpen = getsockopt(it->hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) != SOCKET_ERROR && nRet == 0;
+#endif
+                } else if(nNow - it->nStart < nConnectTimeout) {
+                    it++;
+                    continue;
+                }
+
+                CProbeRequest req = it->req;
+                closesocket(it->hSocket);
+                it = vProbes.erase(it);
+                FinishProbe(req, fOpen, false);
+            }
+        }
+    }
+    catch (boost::thread_interrupted) {
+        BOOST_FOREACH(CProbe& probe, vProbes)
+            closesocket(probe.hSocket);
+        throw;
+    }
+}
+
+void ThreadMasternodePOS()
+{
+    if(fLiteMode || !fMasterNode) return;
+
+    RenameThread("unpay-mnpos");
+    mnscan.ThreadProbe();
+}
+
 bool CMasternodeScanningError::SignatureValid()
 {
     std::string errorMessage;
@@ -246,10 +457,5 @@ void CMasternodeScanningError::Relay()
 {
     CInv inv(MSG_MASTERNODE_SCANNING_ERROR, GetHash());
 
-    vector<CInv> vInv;
-    vInv.push_back(inv);
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
-    }
+    RelayInventory(inv);
 }
\ No newline at end of file
@@ -16,6 +16,11 @@
 #include "base58.h"
 #include "main.h"
 
+#include <deque>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 using namespace std;
 using namespace boost;
 
@@ -40,17 +45,61 @@ static const int MASTERNODE_SCANNING_ERROR_THESHOLD = 6;
 #define SCANNING_ERROR_IX_NO_RESPONSE          3
 #define SCANNING_ERROR_MAX                     3
 
+// port probes in flight at the same time
+#define MASTERNODE_POS_MAX_PROBES              8
+// scans waiting for a probe slot
+#define MASTERNODE_POS_MAX_QUEUED              16
+// how long the result of a probe is reused for the same masternode
+#define MASTERNODE_POS_CACHE_SECONDS           (10*60)
+
 void ProcessMessageMasternodePOS(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
+/** Proof-of-service scanning of the other masternodes.
+ *
+ *  DoMasternodePOSChecks runs from block processing and only picks the
+ *  masternode to check. The port probe is a non-blocking connect made by
+ *  ThreadMasternodePOS, which keeps up to MASTERNODE_POS_MAX_PROBES of them
+ *  in flight and signs and relays the result once the probe completes or
+ *  times out. Results are reused for MASTERNODE_POS_CACHE_SECONDS.
+ */
 class CMasternodeScanning
 {
+private:
+    struct CProbeRequest
+    {
+        CTxIn vin;
+        CService addr;
+        int nBlockHeight;
+    };
+
+    struct CProbe
+    {
+        CProbeRequest req;
+        SOCKET hSocket;
+        int64_t nStart;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condRequest;
+    std::deque<CProbeRequest> queueRequests;
+    // masternode -> (time of the probe, port was open)
+    std::map<COutPoint, std::pair<int64_t, bool> > mapResults;
+
+    bool GetCachedResult(const CTxIn& vin, bool& fOpen);
+    void StartProbe(const CProbeRequest& req, std::vector<CProbe>& vProbes);
+    void FinishProbe(const CProbeRequest& req, bool fOpen, bool fCached);
+
 public:
     void DoMasternodePOSChecks();
     void CleanMasternodeScanningErrors();
+    void ThreadProbe();
 };
 
 // Returns how many masternodes are allowed to scan each block
 int GetCountScanningPerBlock();
+int GetCountScanningPerBlock(int nCountEnabled);
+
+void ThreadMasternodePOS();
 
 class CMasternodeScanningError
 {
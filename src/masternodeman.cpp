@@ -9,6 +9,7 @@
 #include "core.h"
 #include "util.h"
 #include "addrman.h"
+#include "checkqueue.h"
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 
@@ -34,6 +35,95 @@ struct CompareValueOnlyMN
     }
 };
 
+//
+// CMasternodeListEntry
+//
+
+CMasternodeListEntry::CMasternodeListEntry()
+{
+    sigTime = 0;
+    lastTimeSeen = 0;
+    protocolVersion = 0;
+    donationPercentage = 0;
+}
+
+CMasternodeListEntry::CMasternodeListEntry(const CMasternode& mn)
+{
+    vin = mn.vin;
+    addr = mn.addr;
+    sig = mn.sig;
+    sigTime = mn.sigTime;
+    pubkey = mn.pubkey;
+    pubkey2 = mn.pubkey2;
+    lastTimeSeen = mn.lastTimeSeen;
+    protocolVersion = mn.protocolVersion;
+    donationAddress = mn.donationAddress;
+    donationPercentage = mn.donationPercentage;
+}
+
+uint256 CMasternodeListEntry::GetHash() const
+{
+    // lastTimeSeen differs from node to node and isn't signed
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << vin.prevout << addr << sig << sigTime << pubkey << pubkey2 << protocolVersion << donationAddress << donationPercentage;
+    return ss.GetHash();
+}
+
+bool CMasternodeListEntry::VerifySignature() const
+{
+    std::string vchPubKey(pubkey.begin(), pubkey.end());
+    std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
+
+    std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion)  + donationAddress.ToString() + boost::lexical_cast<std::string>(donationPercentage);
+
+    std::vector<unsigned char> vchSig(sig);
+    std::string errorMessage = "";
+    return darkSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage);
+}
+
+/** Checks the signature of one list sync entry */
+class CMasternodeListEntryCheck
+{
+private:
+    const CMasternodeListEntry* pentry;
+
+public:
+    CMasternodeListEntryCheck() : pentry(NULL) {}
+    CMasternodeListEntryCheck(const CMasternodeListEntry* pentryIn) : pentry(pentryIn) {}
+
+    bool operator()() { return pentry->VerifySignature(); }
+
+    void swap(CMasternodeListEntryCheck& check) { std::swap(pentry, check.pentry); }
+};
+
+static CCheckQueue<CMasternodeListEntryCheck> listcheckqueue(16);
+
+void ThreadMasternodeListCheck() {
+    RenameThread("unpay-mnlcheck");
+    listcheckqueue.Thread();
+}
+
+// Verify the signatures of a list sync chunk, spread over the list check threads
+static bool VerifyListEntries(const std::vector<CMasternodeListEntry>& vEntries)
+{
+    if(!nScriptCheckThreads) {
+        BOOST_FOREACH(const CMasternodeListEntry& entry, vEntries)
+            if(!entry.VerifySignature()) return false;
+        return true;
+    }
+
+    std::vector<CMasternodeListEntryCheck> vChecks;
+    vChecks.reserve(vEntries.size());
+    BOOST_FOREACH(const CMasternodeListEntry& entry, vEntries)
+        vChecks.push_back(CMasternodeListEntryCheck(&entry));
+
+    // the workers read our entries, so don't leave before they are done
+    boost::this_thread::disable_interruption di;
+    CCheckQueueControl<CMasternodeListEntryCheck> control(&listcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
 //
 // CMasternodeDB
 //
@@ -41,10 +131,172 @@ struct CompareValueOnlyMN
 CMasternodeDB::CMasternodeDB()
 {
     pathMN = GetDataDir() / "mncache.dat";
+    pathJournal = GetDataDir() / "mncache.log";
     strMagicMessage = "MasternodeCache";
+    strJournalMagicMessage = "MasternodeJournal";
+    hashWrittenState = 0;
+    hashSnapshot = 0;
+    nSnapshotSize = 0;
+    nJournalSize = 0;
+    fSynced = false;
+}
+
+// mncache.log record types
+enum {
+    MNJ_ENTRIES = 1, // added or changed Masternodes
+    MNJ_SEEN = 2,    // new timestamps of otherwise unchanged Masternodes
+    MNJ_REMOVED = 3, // vins of removed Masternodes
+    MNJ_STATE = 4    // list request tracking and dsq count
+};
+
+// a record is its serialized contents followed by their hash
+static void AppendJournalRecord(CDataStream& ssJournal, const CDataStream& ssRecord)
+{
+    std::vector<unsigned char> vchRecord(ssRecord.begin(), ssRecord.end());
+    ssJournal << vchRecord;
+    ssJournal << Hash(vchRecord.begin(), vchRecord.end());
+}
+
+void CMasternodeDB::GetState(const CMasternodeMan& mnodemanIn, std::map<COutPoint, uint256>& mapBody, std::map<COutPoint, std::pair<int64_t, int64_t> >& mapSeen, uint256& hashState) const
+{
+    LOCK(mnodemanIn.cs);
+
+    // the timestamps change with every ping, they're journaled on their own
+    mapBody.clear();
+    mapSeen.clear();
+    BOOST_FOREACH(const CMasternode& mn, mnodemanIn.vMasternodes)
+    {
+        CMasternode body(mn);
+        body.lastTimeSeen = 0;
+        body.lastDseep = 0;
+        CHashWriter ss(SER_DISK, CLIENT_VERSION);
+        ss << body;
+        mapBody[mn.vin.prevout] = ss.GetHash();
+        mapSeen[mn.vin.prevout] = make_pair(mn.lastTimeSeen, mn.lastDseep);
+    }
+
+    CHashWriter ss(SER_DISK, CLIENT_VERSION);
+    ss << mnodemanIn.mAskedUsForMasternodeList << mnodemanIn.mWeAskedForMasternodeList << mnodemanIn.mWeAskedForMasternodeListEntry << mnodemanIn.nDsqCount;
+    hashState = ss.GetHash();
 }
 
 bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+{
+    if (!fSynced)
+    {
+        // we don't know what is on disk, don't overwrite a file we can't read
+        CMasternodeDB mndbVerify;
+        CMasternodeMan tempMnodeman;
+
+        LogPrintf("Verifying mncache.dat format...\n");
+        CMasternodeDB::ReadResult readResult = mndbVerify.Read(tempMnodeman, true);
+        if (readResult == CMasternodeDB::FileError)
+            LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
+        else if (readResult != CMasternodeDB::Ok)
+        {
+            LogPrintf("Error reading mncache.dat: ");
+            if(readResult == CMasternodeDB::IncorrectFormat)
+                LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+            else
+            {
+                LogPrintf("file format is unknown or invalid, please fix it manually\n");
+                return false;
+            }
+        }
+        return WriteSnapshot(mnodemanToSave);
+    }
+
+    // fold the journal into a new snapshot once replaying it costs more than reading the snapshot
+    if (nJournalSize > std::max(nSnapshotSize, (uint64_t)MASTERNODES_JOURNAL_MIN_COMPACT_SIZE))
+        return WriteSnapshot(mnodemanToSave);
+
+    int64_t nStart = GetTimeMillis();
+
+    std::map<COutPoint, uint256> mapBody;
+    std::map<COutPoint, std::pair<int64_t, int64_t> > mapSeen;
+    uint256 hashState;
+
+    std::vector<CMasternode> vChanged;
+    std::vector<std::pair<COutPoint, std::pair<int64_t, int64_t> > > vSeen;
+    std::vector<COutPoint> vRemoved;
+    CDataStream ssJournal(SER_DISK, CLIENT_VERSION);
+    {
+        LOCK(mnodemanToSave.cs);
+        GetState(mnodemanToSave, mapBody, mapSeen, hashState);
+
+        BOOST_FOREACH(const CMasternode& mn, mnodemanToSave.vMasternodes)
+        {
+            const COutPoint& outpoint = mn.vin.prevout;
+            std::map<COutPoint, uint256>::const_iterator it = mapWrittenBody.find(outpoint);
+            if (it == mapWrittenBody.end() || (*it).second != mapBody[outpoint])
+                vChanged.push_back(mn);
+            else if (mapWrittenSeen[outpoint] != mapSeen[outpoint])
+                vSeen.push_back(make_pair(outpoint, mapSeen[outpoint]));
+        }
+
+        if (hashState != hashWrittenState)
+        {
+            CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+            ssRecord << (unsigned char)MNJ_STATE;
+            ssRecord << mnodemanToSave.mAskedUsForMasternodeList << mnodemanToSave.mWeAskedForMasternodeList << mnodemanToSave.mWeAskedForMasternodeListEntry << mnodemanToSave.nDsqCount;
+            AppendJournalRecord(ssJournal, ssRecord);
+        }
+    }
+
+    for (std::map<COutPoint, uint256>::const_iterator it = mapWrittenBody.begin(); it != mapWrittenBody.end(); ++it)
+        if (!mapBody.count((*it).first))
+            vRemoved.push_back((*it).first);
+
+    if (!vChanged.empty())
+    {
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        ssRecord << (unsigned char)MNJ_ENTRIES << vChanged;
+        AppendJournalRecord(ssJournal, ssRecord);
+    }
+    if (!vSeen.empty())
+    {
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        ssRecord << (unsigned char)MNJ_SEEN << vSeen;
+        AppendJournalRecord(ssJournal, ssRecord);
+    }
+    if (!vRemoved.empty())
+    {
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        ssRecord << (unsigned char)MNJ_REMOVED << vRemoved;
+        AppendJournalRecord(ssJournal, ssRecord);
+    }
+
+    if (ssJournal.empty())
+        return true;
+
+    FILE *file = fopen(pathJournal.string().c_str(), "ab");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("%s : Failed to open file %s", __func__, pathJournal.string());
+
+    try {
+        fileout << ssJournal;
+    }
+    catch (std::exception &e) {
+        // a partially written record is dropped when the journal is replayed
+        fSynced = false;
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    nJournalSize += ssJournal.size();
+    mapWrittenBody.swap(mapBody);
+    mapWrittenSeen.swap(mapSeen);
+    hashWrittenState = hashState;
+
+    LogPrintf("Appended %d changed, %d seen and %d removed Masternodes to mncache.log  %dms\n",
+              (int)vChanged.size(), (int)vSeen.size(), (int)vRemoved.size(), GetTimeMillis() - nStart);
+
+    return true;
+}
+
+bool CMasternodeDB::WriteSnapshot(const CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
@@ -52,15 +304,26 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
     ssMasternodes << strMagicMessage; // masternode cache file specific magic message
     ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
+
+    std::map<COutPoint, uint256> mapBody;
+    std::map<COutPoint, std::pair<int64_t, int64_t> > mapSeen;
+    uint256 hashState;
+    {
+        // keep the list from changing between the snapshot and the state we
+        // remember for it, the file is written once the lock is released
+        LOCK(mnodemanToSave.cs);
+        ssMasternodes << mnodemanToSave;
+        GetState(mnodemanToSave, mapBody, mapSeen, hashState);
+    }
     uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
     ssMasternodes << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE *file = fopen(pathMN.string().c_str(), "wb");
+    // write the snapshot next to the old one and swap it in once it's complete
+    boost::filesystem::path pathTmp = pathMN.string() + ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
     if (!fileout)
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -72,13 +335,45 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     FileCommit(fileout);
     fileout.fclose();
 
+    fSynced = false;
+    if (!RenameOver(pathTmp, pathMN))
+        return error("%s : Rename-into-place failed", __func__);
+    hashSnapshot = hash;
+    nSnapshotSize = ssMasternodes.size();
+
+    // start an empty journal for the new snapshot; a journal left over from
+    // the previous one is ignored on startup as it names a different snapshot
+    CDataStream ssJournal(SER_DISK, CLIENT_VERSION);
+    ssJournal << strJournalMagicMessage;
+    ssJournal << FLATDATA(Params().MessageStart());
+    ssJournal << hashSnapshot;
+
+    file = fopen(pathJournal.string().c_str(), "wb");
+    CAutoFile journalout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!journalout)
+        return error("%s : Failed to open file %s", __func__, pathJournal.string());
+    try {
+        journalout << ssJournal;
+    }
+    catch (std::exception &e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(journalout);
+    journalout.fclose();
+    nJournalSize = ssJournal.size();
+
+    mapWrittenBody.swap(mapBody);
+    mapWrittenSeen.swap(mapSeen);
+    hashWrittenState = hashState;
+    fSynced = true;
+
     LogPrintf("Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToSave.ToString());
 
     return true;
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
+CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
     // open input file, and associate with CAutoFile
@@ -90,6 +385,8 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
         return FileError;
     }
 
+    fSynced = false;
+
     // use file size to size memory buffer
     int fileSize = boost::filesystem::file_size(pathMN);
     int dataSize = fileSize - sizeof(uint256);
@@ -148,28 +445,184 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
         ssMasternodes >> mnodemanToLoad;
     }
     catch (std::exception &e) {
-        mnodemanToLoad.Clear();
+        if (!fDryRun)
+            mnodemanToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
 
+    // the snapshot is readable, leave the journal alone
+    if (fDryRun)
+        return Ok;
+
+    hashSnapshot = hashIn;
+    nSnapshotSize = fileSize;
+
+    // apply the changes dumped since the snapshot; without a journal that
+    // matches the snapshot the next dump writes a new snapshot
+    int nRecords = ReplayJournal(mnodemanToLoad);
+    GetState(mnodemanToLoad, mapWrittenBody, mapWrittenSeen, hashWrittenState);
+    fSynced = nRecords >= 0;
+
     mnodemanToLoad.CheckAndRemove(); // clean out expired
-    LogPrintf("Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrintf("Loaded info from mncache.dat and %d journal records  %dms\n", std::max(nRecords, 0), GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToLoad.ToString());
 
     return Ok;
 }
 
-void DumpMasternodes()
+// Returns the number of records applied, or -1 if there is no journal for the loaded snapshot
+int CMasternodeDB::ReplayJournal(CMasternodeMan& mnodemanToLoad)
 {
-    int64_t nStart = GetTimeMillis();
+    nJournalSize = 0;
+
+    FILE *file = fopen(pathJournal.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return -1;
+
+    // the journal is bounded by the snapshot size, read it in one go
+    uint64_t nFileSize = boost::filesystem::file_size(pathJournal);
+    vector<unsigned char> vchData(nFileSize);
+    try {
+        if (nFileSize > 0)
+            filein.read((char *)&vchData[0], nFileSize);
+    }
+    catch (std::exception &e) {
+        error("%s : I/O error - %s", __func__, e.what());
+        return -1;
+    }
+    filein.fclose();
+
+    CDataStream ssJournal(vchData, SER_DISK, CLIENT_VERSION);
+
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    uint256 hashSnapshotTmp;
+    try {
+        ssJournal >> strMagicMessageTmp >> FLATDATA(pchMsgTmp) >> hashSnapshotTmp;
+    }
+    catch (std::exception &e) {
+        error("%s : Invalid journal header", __func__);
+        return -1;
+    }
+    if (strJournalMagicMessage != strMagicMessageTmp || memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+    {
+        error("%s : Invalid journal magic", __func__);
+        return -1;
+    }
+    if (hashSnapshotTmp != hashSnapshot)
+    {
+        LogPrintf("mncache.log belongs to a different snapshot, ignoring it\n");
+        return -1;
+    }
+    nJournalSize = nFileSize - ssJournal.size();
+
+    // apply records up to the first one that is incomplete or corrupted,
+    // e.g. because we crashed while appending it
+    int nRecords = 0;
+    while (!ssJournal.empty())
+    {
+        std::vector<unsigned char> vchRecord;
+        uint256 hashRecord;
+        try {
+            ssJournal >> vchRecord >> hashRecord;
+            if (Hash(vchRecord.begin(), vchRecord.end()) != hashRecord)
+                break;
+            ApplyJournalRecord(mnodemanToLoad, vchRecord);
+        }
+        catch (std::exception &e) {
+            break;
+        }
+        nJournalSize = nFileSize - ssJournal.size();
+        nRecords++;
+    }
+
+    if (nJournalSize < nFileSize)
+    {
+        LogPrintf("mncache.log: dropping %d bytes of incomplete records\n", (int)(nFileSize - nJournalSize));
+        try {
+            boost::filesystem::resize_file(pathJournal, nJournalSize);
+        }
+        catch (std::exception &e) {
+            error("%s : Failed to truncate %s - %s", __func__, pathJournal.string(), e.what());
+            return -1;
+        }
+    }
+
+    return nRecords;
+}
+
+void CMasternodeDB::ApplyJournalRecord(CMasternodeMan& mnodemanToLoad, const std::vector<unsigned char>& vchRecord)
+{
+    CDataStream ssRecord(vchRecord, SER_DISK, CLIENT_VERSION);
+    unsigned char nType;
+    ssRecord >> nType;
 
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
+    LOCK(mnodemanToLoad.cs);
+    std::vector<CMasternode>& vMasternodes = mnodemanToLoad.vMasternodes;
 
-    LogPrintf("Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman);
-    // there was an error and it was not an error on file openning => do not proceed
+    if (nType == MNJ_ENTRIES)
+    {
+        std::vector<CMasternode> vChanged;
+        ssRecord >> vChanged;
+        BOOST_FOREACH(const CMasternode& mn, vChanged)
+        {
+            CMasternode* pmn = mnodemanToLoad.Find(mn.vin);
+            if (pmn != NULL)
+                *pmn = mn;
+            else
+                vMasternodes.push_back(mn);
+        }
+    }
+    else if (nType == MNJ_SEEN)
+    {
+        std::vector<std::pair<COutPoint, std::pair<int64_t, int64_t> > > vSeen;
+        ssRecord >> vSeen;
+        for (unsigned int i = 0; i < vSeen.size(); i++)
+        {
+            CMasternode* pmn = mnodemanToLoad.Find(CTxIn(vSeen[i].first));
+            if (pmn == NULL) continue;
+            pmn->lastTimeSeen = vSeen[i].second.first;
+            pmn->lastDseep = vSeen[i].second.second;
+        }
+    }
+    else if (nType == MNJ_REMOVED)
+    {
+        std::vector<COutPoint> vRemoved;
+        ssRecord >> vRemoved;
+        std::set<COutPoint> setRemoved(vRemoved.begin(), vRemoved.end());
+        vector<CMasternode>::iterator it = vMasternodes.begin();
+        while (it != vMasternodes.end()) {
+            if (setRemoved.count((*it).vin.prevout))
+                it = vMasternodes.erase(it);
+            else
+                ++it;
+        }
+    }
+    else if (nType == MNJ_STATE)
+    {
+        ssRecord >> mnodemanToLoad.mAskedUsForMasternodeList >> mnodemanToLoad.mWeAskedForMasternodeList >> mnodemanToLoad.mWeAskedForMasternodeListEntry >> mnodemanToLoad.nDsqCount;
+    }
+    else
+        throw std::runtime_error("unknown journal record type");
+}
+
+// the cache files as last read or written, constructed on first use once the data directory is known
+static CMasternodeDB& GetMasternodeDB()
+{
+    static CMasternodeDB mndb;
+    return mndb;
+}
+
+// protects GetMasternodeDB()
+static CCriticalSection cs_mncache;
+
+void LoadMasternodes()
+{
+    LOCK(cs_mncache);
+
+    CMasternodeDB::ReadResult readResult = GetMasternodeDB().Read(mnodeman);
     if (readResult == CMasternodeDB::FileError)
         LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
     else if (readResult != CMasternodeDB::Ok)
@@ -178,18 +631,21 @@ void DumpMasternodes()
         if(readResult == CMasternodeDB::IncorrectFormat)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
-        {
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
     }
-    LogPrintf("Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+}
+
+void DumpMasternodes()
+{
+    LOCK(cs_mncache);
 
+    int64_t nStart = GetTimeMillis();
+    GetMasternodeDB().Write(mnodeman);
     LogPrintf("Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
 CMasternodeMan::CMasternodeMan() {
+    nEnabled = 0;
     nDsqCount = 0;
 }
 
@@ -206,6 +662,8 @@ bool CMasternodeMan::Add(CMasternode &mn)
     {
         if(fDebug) LogPrintf("CMasternodeMan: Adding new Masternode %s - %i now\n", mn.addr.ToString().c_str(), size() + 1);
         vMasternodes.push_back(mn);
+        nEnabled++;
+        PublishCounts();
         return true;
     }
 
@@ -216,8 +674,12 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+    nEnabled = 0;
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
         mn.Check();
+        if (mn.IsEnabled()) nEnabled++;
+    }
+    PublishCounts();
 }
 
 void CMasternodeMan::CheckAndRemove()
@@ -236,6 +698,7 @@ void CMasternodeMan::CheckAndRemove()
             ++it;
         }
     }
+    PublishCounts();
 
     // check who's asked for the Masternode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
@@ -247,6 +710,16 @@ void CMasternodeMan::CheckAndRemove()
         }
     }
 
+    // offered digest chunks run out with the list request they answered
+    map<CNetAddr, int>::iterator it3 = mListChunksSent.begin();
+    while(it3 != mListChunksSent.end()){
+        if(!mAskedUsForMasternodeList.count((*it3).first)) {
+            mListChunksSent.erase(it3++);
+        } else {
+            ++it3;
+        }
+    }
+
     // check who we asked for the Masternode list
     it1 = mWeAskedForMasternodeList.begin();
     while(it1 != mWeAskedForMasternodeList.end()){
@@ -276,11 +749,16 @@ void CMasternodeMan::Clear()
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
+    mListChunksSent.clear();
     nDsqCount = 0;
+    nEnabled = 0;
+    PublishCounts();
 }
 
 int CMasternodeMan::CountEnabled()
 {
+    LOCK(cs);
+
     int i = 0;
 
     BOOST_FOREACH(CMasternode& mn, vMasternodes) {
@@ -316,11 +794,75 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
             return;
         }
     }
-    pnode->PushMessage("dseg", CTxIn());
+    if(pnode->nVersion >= MIN_MASTERNODE_LIST_SYNC_PROTO_VERSION) {
+        // send our list digest, the peer answers with the digests of its entries if they differ
+        std::vector<std::pair<COutPoint, uint256> > vInv;
+        pnode->PushMessage("mnlsync", GetListInventory(vInv));
+    } else {
+        pnode->PushMessage("dseg", CTxIn());
+    }
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
+bool CMasternodeMan::CheckListRequest(CNode* pfrom)
+{
+    LOCK(cs);
+
+    //local network
+    if(pfrom->addr.IsRFC1918() || Params().NetworkID() != CChainParams::MAIN) return true;
+
+    std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
+    if (i != mAskedUsForMasternodeList.end())
+    {
+        int64_t t = (*i).second;
+        if (GetTime() < t) {
+            Misbehaving(pfrom->GetId(), 34);
+            LogPrintf("dseg - peer already asked me for the list\n");
+            return false;
+        }
+    }
+    int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
+    mAskedUsForMasternodeList[pfrom->addr] = askAgain;
+    return true;
+}
+
+bool CMasternodeMan::CheckListEntriesRequest(CNode* pfrom)
+{
+    LOCK(cs);
+
+    //local network
+    if(pfrom->addr.IsRFC1918() || Params().NetworkID() != CChainParams::MAIN) return true;
+
+    // every digest chunk we sent answers one entry request
+    std::map<CNetAddr, int>::iterator i = mListChunksSent.find(pfrom->addr);
+    if (i == mListChunksSent.end() || (*i).second <= 0)
+    {
+        Misbehaving(pfrom->GetId(), 34);
+        LogPrintf("mnlget - peer asked for more entries than we offered\n");
+        return false;
+    }
+    (*i).second--;
+    return true;
+}
+
+uint256 CMasternodeMan::GetListInventory(std::vector<std::pair<COutPoint, uint256> >& vInv)
+{
+    LOCK(cs);
+
+    // the same entries dseg hands out
+    vInv.clear();
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        if(mn.addr.IsRFC1918() || !mn.IsEnabled()) continue;
+        vInv.push_back(make_pair(mn.vin.prevout, CMasternodeListEntry(mn).GetHash()));
+    }
+    sort(vInv.begin(), vInv.end());
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << vInv;
+    return ss.GetHash();
+}
+
 CMasternode *CMasternodeMan::Find(const CTxIn &vin)
 {
     LOCK(cs);
@@ -451,8 +993,48 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
     return -1;
 }
 
+int CMasternodeMan::GetMasternodeRankAndOrder(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, int& nCountEnabled, std::vector<CTxIn>& vecRanked)
+{
+    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    std::set<COutPoint> setEnabled;
+
+    nCountEnabled = 0;
+    vecRanked.clear();
+
+    //make sure we know about this block
+    uint256 hash = 0;
+    if(!GetBlockHash(hash, nBlockHeight)) return -1;
+
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+
+        if(mn.protocolVersion < minProtocol) continue;
+        mn.Check();
+        if(mn.IsEnabled()) setEnabled.insert(mn.vin.prevout);
+
+        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        unsigned int n2 = 0;
+        memcpy(&n2, &n, sizeof(n2));
+
+        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+    }
+
+    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
+
+    int rank = -1;
+    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
+        vecRanked.push_back(s.second);
+        if(!setEnabled.count(s.second.prevout)) continue;
+        nCountEnabled++;
+        if(s.second == vin) rank = nCountEnabled;
+    }
+
+    return rank;
+}
+
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
+    LOCK(cs);
+
     std::vector<pair<unsigned int, CMasternode> > vecMasternodeScores;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
@@ -541,200 +1123,204 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
-void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+void CMasternodeMan::ProcessEntry(CNode* pfrom, CMasternodeListEntry& entry, int count, int current, bool fFromListSync)
 {
+    CTxIn& vin = entry.vin;
+    CService& addr = entry.addr;
+    vector<unsigned char>& vchSig = entry.sig;
+    int64_t sigTime = entry.sigTime;
+    CPubKey& pubkey = entry.pubkey;
+    CPubKey& pubkey2 = entry.pubkey2;
+    int64_t lastUpdated = entry.lastTimeSeen;
+    int protocolVersion = entry.protocolVersion;
+    CScript& donationAddress = entry.donationAddress;
+    int& donationPercentage = entry.donationPercentage;
+
+    // make sure signature isn't in the future (past is OK)
+    if (sigTime > GetAdjustedTime() + 60 * 60) {
+        LogPrintf("dsee - Signature rejected, too far into the future %s\n", vin.ToString().c_str());
+        return;
+    }
 
-    if(fLiteMode) return; //disable all Darksend/Masternode related functionality
-    if(IsInitialBlockDownload()) return;
+    bool isLocal = addr.IsRFC1918() || addr.IsLocal();
+    if(RegTest()) isLocal = false;
 
-    LOCK(cs_process_message);
+    if(donationPercentage < 0 || donationPercentage > 100){
+        LogPrintf("dsee - donation percentage out of range %d\n", donationPercentage);
+        return;
+    }
 
-    if (strCommand == "dsee") { //DarkSend Election Entry
+    if(protocolVersion < nMasternodeMinProtocol) {
+        LogPrintf("dsee - ignoring outdated Masternode %s protocol version %d\n", vin.ToString().c_str(), protocolVersion);
+        return;
+    }
 
-        CTxIn vin;
-        CService addr;
-        CPubKey pubkey;
-        CPubKey pubkey2;
-        vector<unsigned char> vchSig;
-        int64_t sigTime;
-        int count;
-        int current;
-        int64_t lastUpdated;
-        int protocolVersion;
-        CScript donationAddress;
-        int donationPercentage;
-        std::string strMessage;
+    CScript pubkeyScript;
+    pubkeyScript.SetDestination(pubkey.GetID());
 
-        // 70047 and greater
-        vRecv >> vin >> addr >> vchSig >> sigTime >> pubkey >> pubkey2 >> count >> current >> lastUpdated >> protocolVersion >> donationAddress >> donationPercentage;
+    if(pubkeyScript.size() != 25) {
+        LogPrintf("dsee - pubkey the wrong size\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        // make sure signature isn't in the future (past is OK)
-        if (sigTime > GetAdjustedTime() + 60 * 60) {
-            LogPrintf("dsee - Signature rejected, too far into the future %s\n", vin.ToString().c_str());
-            return;
-        }
+    CScript pubkeyScript2;
+    pubkeyScript2.SetDestination(pubkey2.GetID());
 
-        bool isLocal = addr.IsRFC1918() || addr.IsLocal();
-        if(RegTest()) isLocal = false;
+    if(pubkeyScript2.size() != 25) {
+        LogPrintf("dsee - pubkey2 the wrong size\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        std::string vchPubKey(pubkey.begin(), pubkey.end());
-        std::string vchPubKey2(pubkey2.begin(), pubkey2.end());
+    if(!vin.scriptSig.empty()) {
+        LogPrintf("dsee - Ignore Not Empty ScriptSig %s\n",vin.ToString().c_str());
+        return;
+    }
 
-        strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion)  + donationAddress.ToString() + boost::lexical_cast<std::string>(donationPercentage);
+    // list sync verifies the signatures of a whole chunk up front
+    if(!fFromListSync && !entry.VerifySignature()){
+        LogPrintf("dsee - Got bad Masternode address signature\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        if(donationPercentage < 0 || donationPercentage > 100){
-            LogPrintf("dsee - donation percentage out of range %d\n", donationPercentage);
-            return;
-        }
+    if(Params().NetworkID() == CChainParams::MAIN){
+        if(addr.GetPort() != 9999) return;
+    } else if(addr.GetPort() == 9999) return;
 
-        if(protocolVersion < nMasternodeMinProtocol) {
-            LogPrintf("dsee - ignoring outdated Masternode %s protocol version %d\n", vin.ToString().c_str(), protocolVersion);
-            return;
+    //search existing Masternode list, this is where we update existing Masternodes with new dsee broadcasts
+    CMasternode* pmn = this->Find(vin);
+    // if we are masternode but with undefined vin and this dsee is ours (matches our Masternode privkey) then just skip this part
+    if(pmn != NULL && !(fMasterNode && activeMasternode.vin == CTxIn() && pubkey2 == activeMasternode.pubKeyMasternode))
+    {
+        // count == -1 when it's a new entry
+        //   e.g. We don't want the entry relayed/time updated when we're syncing the list
+        // mn.pubkey = pubkey, IsVinAssociatedWithPubkey is validated once below,
+        //   after that they just need to match
+        // list sync only fills in newer announcements, it's never relayed
+        bool fUpdate = fFromListSync ? pmn->pubkey == pubkey
+                                     : count == -1 && pmn->pubkey == pubkey && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS);
+        if(fUpdate){
+            if(!fFromListSync) pmn->UpdateLastSeen();
+
+            if(pmn->sigTime < sigTime){ //take the newest entry
+                LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
+                pmn->pubkey2 = pubkey2;
+                pmn->sigTime = sigTime;
+                pmn->sig = vchSig;
+                pmn->protocolVersion = protocolVersion;
+                pmn->addr = addr;
+                pmn->donationAddress = donationAddress;
+                pmn->donationPercentage = donationPercentage;
+                pmn->Check();
+                if(pmn->IsEnabled() && !fFromListSync)
+                    mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+            }
         }
 
-        CScript pubkeyScript;
-        pubkeyScript.SetDestination(pubkey.GetID());
+        return;
+    }
 
-        if(pubkeyScript.size() != 25) {
-            LogPrintf("dsee - pubkey the wrong size\n");
-            Misbehaving(pfrom->GetId(), 100);
-            return;
-        }
+    // make sure the vout that was signed is related to the transaction that spawned the Masternode
+    //  - this is expensive, so it's only done once per Masternode
+    if(!darkSendSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
+        LogPrintf("dsee - Got mismatched pubkey and vin\n");
+        Misbehaving(pfrom->GetId(), 100);
+        return;
+    }
 
-        CScript pubkeyScript2;
-        pubkeyScript2.SetDestination(pubkey2.GetID());
+    if(fDebug) LogPrintf("dsee - Got NEW Masternode entry %s\n", addr.ToString().c_str());
 
-        if(pubkeyScript2.size() != 25) {
-            LogPrintf("dsee - pubkey2 the wrong size\n");
-            Misbehaving(pfrom->GetId(), 100);
-            return;
-        }
+    // make sure it's still unspent
+    //  - this is checked later by .check() in many places and by ThreadCheckDarkSendPool()
 
-        if(!vin.scriptSig.empty()) {
-            LogPrintf("dsee - Ignore Not Empty ScriptSig %s\n",vin.ToString().c_str());
-            return;
-        }
+    CValidationState state;
+    CTransaction tx = CTransaction();
+    CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
+    tx.vin.push_back(vin);
+    tx.vout.push_back(vout);
+    if(AcceptableInputs(mempool, state, tx)){
+        if(fDebug) LogPrintf("dsee - Accepted Masternode entry %i %i\n", count, current);
 
-        std::string errorMessage = "";
-        if(!darkSendSigner.VerifyMessage(pubkey, vchSig, strMessage, errorMessage)){
-            LogPrintf("dsee - Got bad Masternode address signature\n");
-            Misbehaving(pfrom->GetId(), 100);
+        if(GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS){
+            LogPrintf("dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
+            Misbehaving(pfrom->GetId(), 20);
             return;
         }
 
-        if(Params().NetworkID() == CChainParams::MAIN){
-            if(addr.GetPort() != 9999) return;
-        } else if(addr.GetPort() == 9999) return;
-
-        //search existing Masternode list, this is where we update existing Masternodes with new dsee broadcasts
-        CMasternode* pmn = this->Find(vin);
-        // if we are masternode but with undefined vin and this dsee is ours (matches our Masternode privkey) then just skip this part
-        if(pmn != NULL && !(fMasterNode && activeMasternode.vin == CTxIn() && pubkey2 == activeMasternode.pubKeyMasternode))
+        // verify that sig time is legit in past
+        // should be at least not earlier than block when 1000 UNP tx got MASTERNODE_MIN_CONFIRMATIONS
+        uint256 hashBlock = 0;
+        GetTransaction(vin.prevout.hash, tx, hashBlock, true);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end() && (*mi).second)
         {
-            // count == -1 when it's a new entry
-            //   e.g. We don't want the entry relayed/time updated when we're syncing the list
-            // mn.pubkey = pubkey, IsVinAssociatedWithPubkey is validated once below,
-            //   after that they just need to match
-            if(count == -1 && pmn->pubkey == pubkey && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS)){
-                pmn->UpdateLastSeen();
-
-                if(pmn->sigTime < sigTime){ //take the newest entry
-                    LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
-                    pmn->pubkey2 = pubkey2;
-                    pmn->sigTime = sigTime;
-                    pmn->sig = vchSig;
-                    pmn->protocolVersion = protocolVersion;
-                    pmn->addr = addr;
-                    pmn->donationAddress = donationAddress;
-                    pmn->donationPercentage = donationPercentage;
-                    pmn->Check();
-                    if(pmn->IsEnabled())
-                        mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
-                }
+            CBlockIndex* pMNIndex = (*mi).second; // block for 1000 UNP tx -> 1 confirmation
+            CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+            if(pConfIndex->GetBlockTime() > sigTime)
+            {
+                LogPrintf("dsee - Bad sigTime %d for Masternode %20s %105s (%i conf block is at %d)\n",
+                          sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
+                return;
             }
-
-            return;
         }
 
-        // make sure the vout that was signed is related to the transaction that spawned the Masternode
-        //  - this is expensive, so it's only done once per Masternode
-        if(!darkSendSigner.IsVinAssociatedWithPubkey(vin, pubkey)) {
-            LogPrintf("dsee - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 100);
-            return;
-        }
 
-        if(fDebug) LogPrintf("dsee - Got NEW Masternode entry %s\n", addr.ToString().c_str());
+        // use this as a peer
+        addrman.Add(CAddress(addr), pfrom->addr, 2*60*60);
 
-        // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckDarkSendPool()
+        //doesn't support multisig addresses
+        if(donationAddress.IsPayToScriptHash()){
+            donationAddress = CScript();
+            donationPercentage = 0;
+        }
 
-        CValidationState state;
-        CTransaction tx = CTransaction();
-        CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-        if(AcceptableInputs(mempool, state, tx)){
-            if(fDebug) LogPrintf("dsee - Accepted Masternode entry %i %i\n", count, current);
+        // add our Masternode
+        CMasternode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2, protocolVersion, donationAddress, donationPercentage);
+        mn.UpdateLastSeen(lastUpdated);
+        this->Add(mn);
 
-            if(GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS){
-                LogPrintf("dsee - Input must have least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
-                Misbehaving(pfrom->GetId(), 20);
-                return;
-            }
+        // if it matches our Masternode privkey, then we've been remotely activated
+        if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION){
+            activeMasternode.EnableHotColdMasterNode(vin, addr);
+        }
 
-            // verify that sig time is legit in past
-            // should be at least not earlier than block when 1000 UNP tx got MASTERNODE_MIN_CONFIRMATIONS
-            uint256 hashBlock = 0;
-            GetTransaction(vin.prevout.hash, tx, hashBlock, true);
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second)
-            {
-                CBlockIndex* pMNIndex = (*mi).second; // block for 1000 UNP tx -> 1 confirmation
-                CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if(pConfIndex->GetBlockTime() > sigTime)
-                {
-                    LogPrintf("dsee - Bad sigTime %d for Masternode %20s %105s (%i conf block is at %d)\n",
-                              sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
-                    return;
-                }
-            }
+        if(count == -1 && !isLocal)
+            mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
 
+    } else {
+        LogPrintf("dsee - Rejected Masternode entry %s\n", addr.ToString().c_str());
 
-            // use this as a peer
-            addrman.Add(CAddress(addr), pfrom->addr, 2*60*60);
+        int nDoS = 0;
+        if (state.IsInvalid(nDoS))
+        {
+            LogPrintf("dsee - %s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
+                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
+            if (nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
 
-            //doesn't support multisig addresses
-            if(donationAddress.IsPayToScriptHash()){
-                donationAddress = CScript();
-                donationPercentage = 0;
-            }
+void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
 
-            // add our Masternode
-            CMasternode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2, protocolVersion, donationAddress, donationPercentage);
-            mn.UpdateLastSeen(lastUpdated);
-            this->Add(mn);
+    if(fLiteMode) return; //disable all Darksend/Masternode related functionality
+    if(IsInitialBlockDownload()) return;
 
-            // if it matches our Masternode privkey, then we've been remotely activated
-            if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION){
-                activeMasternode.EnableHotColdMasterNode(vin, addr);
-            }
+    LOCK(cs_process_message);
 
-            if(count == -1 && !isLocal)
-                mnodeman.RelayMasternodeEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+    if (strCommand == "dsee") { //DarkSend Election Entry
 
-        } else {
-            LogPrintf("dsee - Rejected Masternode entry %s\n", addr.ToString().c_str());
+        CMasternodeListEntry entry;
+        int count;
+        int current;
 
-            int nDoS = 0;
-            if (state.IsInvalid(nDoS))
-            {
-                LogPrintf("dsee - %s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
-                    pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
-                if (nDoS > 0)
-                    Misbehaving(pfrom->GetId(), nDoS);
-            }
-        }
+        // 70047 and greater
+        vRecv >> entry.vin >> entry.addr >> entry.sig >> entry.sigTime >> entry.pubkey >> entry.pubkey2 >> count >> current >> entry.lastTimeSeen >> entry.protocolVersion >> entry.donationAddress >> entry.donationPercentage;
+
+        ProcessEntry(pfrom, entry, count, current, false);
     }
 
     else if (strCommand == "dseep") { //DarkSend Election Entry Ping
@@ -848,22 +1434,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> vin;
 
         if(vin == CTxIn()) { //only should ask for this once
-            //local network
-            if(!pfrom->addr.IsRFC1918() && Params().NetworkID() == CChainParams::MAIN)
-            {
-                std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
-                if (i != mAskedUsForMasternodeList.end())
-                {
-                    int64_t t = (*i).second;
-                    if (GetTime() < t) {
-                        Misbehaving(pfrom->GetId(), 34);
-                        LogPrintf("dseg - peer already asked me for the list\n");
-                        return;
-                    }
-                }
-                int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-                mAskedUsForMasternodeList[pfrom->addr] = askAgain;
-            }
+            if(!CheckListRequest(pfrom)) return;
         } //else, asking for a specific node which is ok
 
         int count = this->size();
@@ -890,6 +1461,135 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrintf("dseg - Sent %d Masternode entries to %s\n", i, pfrom->addr.ToString().c_str());
     }
 
+    else if (strCommand == "mnlsync") { //Masternode list sync: send the digests of our entries
+
+        uint256 hashList;
+        vRecv >> hashList;
+
+        if(!CheckListRequest(pfrom)) return;
+
+        std::vector<std::pair<COutPoint, uint256> > vInv;
+        uint256 hashOurs = GetListInventory(vInv);
+
+        // nothing to do if the peer already has the same list, still let it know
+        if(hashOurs == hashList) vInv.clear();
+
+        int nChunks = 0;
+        for(unsigned int i = 0; i < vInv.size() || nChunks == 0; i += MASTERNODE_LIST_CHUNK_SIZE) {
+            std::vector<std::pair<COutPoint, uint256> > vChunk(vInv.begin() + i, vInv.begin() + std::min(vInv.size(), (size_t)i + MASTERNODE_LIST_CHUNK_SIZE));
+            pfrom->PushMessage("mnlinv", hashOurs, (int)vInv.size(), vChunk);
+            nChunks++;
+        }
+        {
+            LOCK(cs);
+            mListChunksSent[pfrom->addr] = nChunks;
+        }
+
+        LogPrintf("mnlsync - Sent %d Masternode digests in %d chunks to %s\n", (int)vInv.size(), nChunks, pfrom->addr.ToString().c_str());
+    }
+
+    else if (strCommand == "mnlinv") { //Masternode list sync: digests of the peer's entries
+
+        uint256 hashList;
+        int count;
+        std::vector<std::pair<COutPoint, uint256> > vInv;
+        vRecv >> hashList >> count >> vInv;
+
+        if(vInv.size() > MASTERNODE_LIST_CHUNK_SIZE) {
+            Misbehaving(pfrom->GetId(), 20);
+            return;
+        }
+
+        // request entries we don't have, or have in a different version
+        std::vector<COutPoint> vRequest;
+        {
+            LOCK(cs);
+
+            // only accept digests we asked for
+            std::map<CNetAddr, int64_t>::iterator it = mWeAskedForMasternodeList.find(pfrom->addr);
+            if(it == mWeAskedForMasternodeList.end() || GetTime() >= (*it).second) return;
+
+            BOOST_FOREACH(const PAIRTYPE(COutPoint, uint256)& item, vInv)
+            {
+                std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(item.first);
+                if(i != mWeAskedForMasternodeListEntry.end() && GetTime() < (*i).second) continue; // we've asked recently
+
+                CMasternode* pmn = Find(CTxIn(item.first));
+                if(pmn != NULL && CMasternodeListEntry(*pmn).GetHash() == item.second) continue;
+
+                vRequest.push_back(item.first);
+                mWeAskedForMasternodeListEntry[item.first] = GetTime() + MASTERNODE_MIN_DSEEP_SECONDS;
+            }
+        }
+
+        if(fDebug) LogPrintf("mnlinv - %s has %d Masternodes, asking for %d of %d\n", pfrom->addr.ToString().c_str(), count, (int)vRequest.size(), (int)vInv.size());
+        if(!vRequest.empty()) pfrom->PushMessage("mnlget", vRequest);
+    }
+
+    else if (strCommand == "mnlget") { //Masternode list sync: send the requested entries
+
+        std::vector<COutPoint> vRequest;
+        vRecv >> vRequest;
+
+        if(vRequest.size() > MASTERNODE_LIST_CHUNK_SIZE) {
+            Misbehaving(pfrom->GetId(), 20);
+            return;
+        }
+
+        if(!CheckListEntriesRequest(pfrom)) return;
+
+        std::vector<CMasternodeListEntry> vEntries;
+        {
+            LOCK(cs);
+            BOOST_FOREACH(const COutPoint& outpoint, vRequest)
+            {
+                CMasternode* pmn = Find(CTxIn(outpoint));
+                if(pmn == NULL || pmn->addr.IsRFC1918() || !pmn->IsEnabled()) continue;
+                vEntries.push_back(CMasternodeListEntry(*pmn));
+            }
+        }
+
+        pfrom->PushMessage("mnlentries", this->size(), vEntries);
+        if(fDebug) LogPrintf("mnlget - Sent %d Masternode entries to %s\n", (int)vEntries.size(), pfrom->addr.ToString().c_str());
+    }
+
+    else if (strCommand == "mnlentries") { //Masternode list sync: a chunk of entries we asked for
+
+        int count;
+        std::vector<CMasternodeListEntry> vEntries;
+        vRecv >> count >> vEntries;
+
+        if(vEntries.size() > MASTERNODE_LIST_CHUNK_SIZE) {
+            Misbehaving(pfrom->GetId(), 20);
+            return;
+        }
+
+        // drop anything unsolicited or late before spending time on signatures,
+        // an answered request is gone so the same entry isn't taken twice
+        std::vector<CMasternodeListEntry> vRequested;
+        {
+            LOCK(cs);
+            BOOST_FOREACH(const CMasternodeListEntry& entry, vEntries)
+            {
+                std::map<COutPoint, int64_t>::iterator it = mWeAskedForMasternodeListEntry.find(entry.vin.prevout);
+                if(it == mWeAskedForMasternodeListEntry.end() || GetTime() >= (*it).second) continue;
+                mWeAskedForMasternodeListEntry.erase(it);
+                vRequested.push_back(entry);
+            }
+        }
+
+        if(!VerifyListEntries(vRequested)) {
+            LogPrintf("mnlentries - Got bad Masternode address signature from %s\n", pfrom->addr.ToString().c_str());
+            Misbehaving(pfrom->GetId(), 100);
+            return;
+        }
+
+        for(unsigned int i = 0; i < vRequested.size(); i++)
+            ProcessEntry(pfrom, vRequested[i], count, i, true);
+
+        LogPrintf("mnlentries - Processed %d Masternode entries from %s\n", (int)vRequested.size(), pfrom->addr.ToString().c_str());
+    }
+
 }
 
 void CMasternodeMan::RelayMasternodeEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64_t nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64_t lastUpdated, const int protocolVersion, CScript donationAddress, int donationPercentage)
@@ -914,10 +1614,19 @@ void CMasternodeMan::Remove(CTxIn vin)
     while(it != vMasternodes.end()){
         if((*it).vin == vin){
             if(fDebug) LogPrintf("CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
+            if((*it).IsEnabled() && nEnabled > 0) nEnabled--;
             vMasternodes.erase(it);
             break;
         }
+        ++it;
     }
+    PublishCounts();
+}
+
+void CMasternodeMan::PublishCounts()
+{
+    LOCK(cs);
+    PublishMasternodeCounts(vMasternodes.size(), nEnabled);
 }
 
 std::string CMasternodeMan::ToString() const
@@ -18,21 +18,56 @@
 
 #define MASTERNODES_DUMP_SECONDS               (15*60)
 #define MASTERNODES_DSEG_SECONDS               (3*60*60)
+#define MASTERNODE_LIST_CHUNK_SIZE             500
+#define MASTERNODES_JOURNAL_MIN_COMPACT_SIZE   (256*1024)
+
+// peers starting with this version sync the Masternode list in chunks (mnlsync) instead of dseg
+static const int MIN_MASTERNODE_LIST_SYNC_PROTO_VERSION = 70077;
 
 using namespace std;
 
 class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
+void LoadMasternodes();
 void DumpMasternodes();
+/** Run an instance of the Masternode list signature checking thread */
+void ThreadMasternodeListCheck();
 
 /** Access to the MN database (mncache.dat)
+ *
+ * mncache.dat is a checksummed snapshot of the whole Masternode list. Dumps
+ * only append what changed since the last dump to the journal (mncache.log);
+ * once the journal outgrows the snapshot, both are compacted into a new
+ * snapshot. A CMasternodeDB remembers what it last read or wrote, so use the
+ * same instance for loading and dumping (see LoadMasternodes/DumpMasternodes).
  */
 class CMasternodeDB
 {
 private:
     boost::filesystem::path pathMN;
+    boost::filesystem::path pathJournal;
     std::string strMagicMessage;
+    std::string strJournalMagicMessage;
+
+    // what the files on disk add up to: the hash of each Masternode without
+    // its timestamps, the timestamps, and the hash of the remaining state
+    std::map<COutPoint, uint256> mapWrittenBody;
+    std::map<COutPoint, std::pair<int64_t, int64_t> > mapWrittenSeen;
+    uint256 hashWrittenState;
+
+    // checksum of the snapshot the journal applies to
+    uint256 hashSnapshot;
+    uint64_t nSnapshotSize;
+    uint64_t nJournalSize;
+    // false until the files on disk are known to match the state above
+    bool fSynced;
+
+    void GetState(const CMasternodeMan &mnodemanIn, std::map<COutPoint, uint256>& mapBody, std::map<COutPoint, std::pair<int64_t, int64_t> >& mapSeen, uint256& hashState) const;
+    bool WriteSnapshot(const CMasternodeMan &mnodemanToSave);
+    int ReplayJournal(CMasternodeMan& mnodemanToLoad);
+    void ApplyJournalRecord(CMasternodeMan& mnodemanToLoad, const std::vector<unsigned char>& vchRecord);
+
 public:
     enum ReadResult {
         Ok,
@@ -46,12 +81,55 @@ public:
 
     CMasternodeDB();
     bool Write(const CMasternodeMan &mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad);
+    /// Load the snapshot and replay the journal; with fDryRun only check that the snapshot can be read
+    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+};
+
+/** The signed announcement of a Masternode, as exchanged during list sync
+ */
+class CMasternodeListEntry
+{
+public:
+    CTxIn vin;
+    CService addr;
+    std::vector<unsigned char> sig;
+    int64_t sigTime;
+    CPubKey pubkey;
+    CPubKey pubkey2;
+    int64_t lastTimeSeen;
+    int protocolVersion;
+    CScript donationAddress;
+    int donationPercentage;
+
+    CMasternodeListEntry();
+    CMasternodeListEntry(const CMasternode& mn);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vin);
+        READWRITE(addr);
+        READWRITE(sig);
+        READWRITE(sigTime);
+        READWRITE(pubkey);
+        READWRITE(pubkey2);
+        READWRITE(lastTimeSeen);
+        READWRITE(protocolVersion);
+        READWRITE(donationAddress);
+        READWRITE(donationPercentage);
+    )
+
+    /// Digest of the signed fields, identical on every node that knows this announcement
+    uint256 GetHash() const;
+
+    /// Check the signature made with pubkey (what dsee does)
+    bool VerifySignature() const;
 };
 
 class CMasternodeMan
 {
 private:
+    friend class CMasternodeDB;
+
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
@@ -63,6 +141,25 @@ private:
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // digest chunks we sent a peer for its last list request and it may still ask entries for
+    std::map<CNetAddr, int> mListChunksSent;
+    // enabled Masternodes as counted by the last Check, kept up to date by Add and Remove
+    int nEnabled;
+
+    // rate limit full list requests, returns false if the peer asked too often
+    bool CheckListRequest(CNode* pfrom);
+
+    // rate limit list sync entry requests, returns false if the peer asked for more than we offered
+    bool CheckListEntriesRequest(CNode* pfrom);
+
+    // sorted (vin, entry digest) pairs of the Masternodes we hand out, returns the list digest
+    uint256 GetListInventory(std::vector<std::pair<COutPoint, uint256> >& vInv);
+
+    // validate and add or update an announced Masternode
+    void ProcessEntry(CNode* pfrom, CMasternodeListEntry& entry, int count, int current, bool fFromListSync);
+
+    // publish the number of Masternodes and enabled ones in the chain tip snapshot, without recounting them
+    void PublishCounts();
 
 public:
     // keep track of dsq count to prevent masternodes from gaming darksend queue
@@ -119,11 +216,13 @@ public:
     /// Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
 
-    std::vector<CMasternode> GetFullMasternodeVector() { Check(); return vMasternodes; }
+    std::vector<CMasternode> GetFullMasternodeVector() { LOCK(cs); Check(); return vMasternodes; }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol=0);
     int GetMasternodeRank(const CTxIn &vin, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
+    /// Rank of vin among the enabled Masternodes like GetMasternodeRank, also returning how many are enabled and all of them in rank order, from one scoring pass
+    int GetMasternodeRankAndOrder(const CTxIn &vin, int64_t nBlockHeight, int minProtocol, int& nCountEnabled, std::vector<CTxIn>& vecRanked);
 
     void ProcessMasternodeConnections();
 
@@ -412,6 +412,8 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_relayLatency;
+CRelayLatency CNode::relayLatency[RELAY_CLASSES];
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -696,6 +698,93 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 }
 
 
+void CAskForQueue::Add(int64_t nDue, const CInv& inv)
+{
+    int nId;
+    if (vFree.empty()) {
+        nId = vInv.size();
+        vInv.push_back(inv);
+    } else {
+        nId = vFree.back();
+        vFree.pop_back();
+        vInv[nId] = inv;
+    }
+    wheel.Add(nDue, nId);
+}
+
+void CAskForQueue::PopDue(int64_t nNow, std::vector<CInv>& vDue)
+{
+    std::vector<int> vFired;
+    wheel.Advance(nNow, vFired);
+    BOOST_FOREACH(int nId, vFired)
+    {
+        vDue.push_back(vInv[nId]);
+        vFree.push_back(nId);
+    }
+    // don't hold on to the memory of a burst
+    if (wheel.Size() == 0) {
+        std::vector<CInv>().swap(vInv);
+        std::vector<int>().swap(vFree);
+    }
+}
+
+
+int GetRelayClass(const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TXLOCK_REQUEST:
+    case MSG_TXLOCK_VOTE:
+        return RELAY_INSTANTX;
+    case MSG_BLOCK:
+    case MSG_FILTERED_BLOCK:
+        return RELAY_BLOCK;
+    case MSG_TX:
+        return RELAY_TX;
+    default:
+        return RELAY_MASTERNODE;
+    }
+}
+
+const char* GetRelayClassName(int nClass)
+{
+    switch (nClass)
+    {
+    case RELAY_INSTANTX: return "instantx";
+    case RELAY_BLOCK: return "block";
+    case RELAY_MASTERNODE: return "masternode";
+    case RELAY_TX: return "tx";
+    default: return "unknown";
+    }
+}
+
+CRelayLatency::CRelayLatency() : nCount(0), nTotalMicros(0), nMaxMicros(0)
+{
+    memset(vCount, 0, sizeof(vCount));
+}
+
+void CRelayLatency::Add(int64_t nMicros)
+{
+    nMicros = std::max(nMicros, (int64_t)0);
+    int nBucket = 0;
+    for (int64_t nMillis = nMicros / 1000; nMillis > 0 && nBucket < BUCKETS - 1; nMillis >>= 1)
+        nBucket++;
+    vCount[nBucket]++;
+    nCount++;
+    nTotalMicros += nMicros;
+    nMaxMicros = std::max(nMaxMicros, nMicros);
+}
+
+void CRelayLatency::Add(const CRelayLatency& other)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vCount[i] += other.vCount[i];
+    nCount += other.nCount;
+    nTotalMicros += other.nTotalMicros;
+    nMaxMicros = std::max(nMaxMicros, other.nMaxMicros);
+}
+
+
 
 
 
@@ -1842,6 +1931,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         mapRelay.insert(std::make_pair(inv, ss));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
+    int64_t nNow = GetTimeMicros();
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1851,12 +1941,21 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         if (pnode->pfilter)
         {
             if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
-                pnode->PushInventory(inv);
+                pnode->PushInventory(inv, nNow);
         } else
-            pnode->PushInventory(inv);
+            pnode->PushInventory(inv, nNow);
     }
 }
 
+// Queue inventory for all peers, it goes out with their next inv batch
+void RelayInventory(const CInv& inv)
+{
+    int64_t nNow = GetTimeMicros();
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        pnode->PushInventory(inv, nNow);
+}
+
 
 void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool relayToAll)
 {
@@ -1898,6 +1997,18 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::RecordRelayLatency(int nClass, const CRelayLatency& latency)
+{
+    LOCK(cs_relayLatency);
+    relayLatency[nClass].Add(latency);
+}
+
+CRelayLatency CNode::GetRelayLatency(int nClass)
+{
+    LOCK(cs_relayLatency);
+    return relayLatency[nClass];
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
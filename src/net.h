@@ -10,9 +10,9 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
+#include "scheduler.h"
 #include "sync.h"
 #include "uint256.h"
 #include "util.h"
@@ -39,8 +39,12 @@ namespace boost {
 
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
-/** The maximum number of entries in mapAskFor */
+/** The maximum number of entries in a peer's ask-for queue */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Resolution of the ask-for queue, in microseconds */
+static const int64_t ASKFOR_TICK = 100 * 1000;
+/** Average delay between inventory announcements to a peer, in microseconds */
+static const int64_t INVENTORY_FLUSH_INTERVAL = 100 * 1000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 
@@ -189,6 +193,76 @@ public:
 };
 
 
+/** Relay classes, announced to a peer in this order */
+enum RelayClass
+{
+    RELAY_INSTANTX = 0,     // lock requests and votes
+    RELAY_BLOCK,
+    RELAY_MASTERNODE,       // sporks and masternode messages
+    RELAY_TX,
+
+    RELAY_CLASSES
+};
+
+int GetRelayClass(const CInv& inv);
+const char* GetRelayClassName(int nClass);
+
+/** Inventory waiting to be announced to a peer, with the time it was queued */
+struct CQueuedInv
+{
+    CInv inv;
+    int64_t nTime;
+
+    CQueuedInv(const CInv& invIn, int64_t nTimeIn) : inv(invIn), nTime(nTimeIn) {}
+};
+
+/** Relay latency histogram: time from queueing inventory for a peer until it is announced.
+  *
+  * Bucket i counts latencies below 2^i milliseconds that don't fit a lower
+  * bucket, the last bucket also counts everything slower.
+  */
+class CRelayLatency
+{
+public:
+    static const int BUCKETS = 16;
+
+    uint64_t vCount[BUCKETS];
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+
+    CRelayLatency();
+
+    void Add(int64_t nMicros);
+    void Add(const CRelayLatency& other);
+};
+
+
+/** Inventory to request from a peer, each at the earliest tick it may be requested.
+  *
+  * Kept in a timer wheel, so queueing a request and taking the due ones
+  * don't reorganize a tree. Requests due at the same tick come out in the
+  * order they were added.
+  */
+class CAskForQueue
+{
+private:
+    CTimerWheel wheel;
+    std::vector<CInv> vInv;         // queued inventory by timer id
+    std::vector<int> vFree;         // timer ids not in use
+
+public:
+    CAskForQueue(int64_t nStart) : wheel(nStart) {}
+
+    void Add(int64_t nDue, const CInv& inv);
+    // Take the requests due up to and including tick nNow, in order
+    void PopDue(int64_t nNow, std::vector<CInv>& vDue);
+
+    size_t size() const { return wheel.Size(); }
+    bool empty() const { return wheel.Size() == 0; }
+};
+
+
 
 
 
@@ -263,15 +337,16 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
-    // inventory based relay
-    mruset<CInv> setInventoryKnown;
-    std::vector<CInv> vInventoryToSend;
+    // inventory based relay, known inventory is keyed by InventoryKnownKey()
+    CRollingBloomFilter filterInventoryKnown;
+    std::vector<CQueuedInv> vInventoryToSend[RELAY_CLASSES];
+    int64_t nNextInvSend;
     CCriticalSection cs_inventory;
-    std::multimap<int64_t, CInv> mapAskFor;
+    CAskForQueue queueAskFor;
 
     // Ping time measurement
     uint64_t nPingNonceSent;
@@ -279,7 +354,11 @@ public:
     int64_t nPingUsecTime;
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) :
+        ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+        addrKnown(5000, 0.001, insecure_rand()),
+        filterInventoryKnown(SendBufferSize() / 1000, 0.000001, insecure_rand()),
+        queueAskFor(GetTimeMicros() / ASKFOR_TICK)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -310,8 +389,8 @@ public:
         fStartSync = false;
         fGetAddr = false;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         pfilter = new CBloomFilter();
+        nNextInvSend = 0;
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
@@ -348,6 +427,10 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Relay latency by relay class
+    static CCriticalSection cs_relayLatency;
+    static CRelayLatency relayLatency[RELAY_CLASSES];
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -398,7 +481,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -406,7 +489,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -416,30 +499,41 @@ public:
     }
 
 
+    // A lock request and its transaction share a hash, so the type is part of the key
+    static uint256 InventoryKnownKey(const CInv& inv)
+    {
+        return inv.hash ^ uint256((uint64_t)inv.type);
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(InventoryKnownKey(inv));
         }
     }
 
-    void PushInventory(const CInv& inv)
+    // Queue inventory for the next announcement, see SendMessages()
+    void PushInventory(const CInv& inv, int64_t nNow)
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (!filterInventoryKnown.contains(InventoryKnownKey(inv)))
+                vInventoryToSend[GetRelayClass(inv)].push_back(CQueuedInv(inv, nNow));
         }
     }
 
+    void PushInventory(const CInv& inv)
+    {
+        PushInventory(inv, GetTimeMicros());
+    }
+
     void AskFor(const CInv& inv)
     {
-        if (mapAskFor.size() > MAPASKFOR_MAX_SZ)
+        if (queueAskFor.size() > MAPASKFOR_MAX_SZ)
             return;
 
-        // We're using mapAskFor as a priority queue,
-        // the key is the earliest time the request can be sent
+        // Requests are queued at the earliest time they can be sent
         int64_t nRequestTime;
         limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
         if (it != mapAlreadyAskedFor.end())
@@ -461,7 +555,7 @@ public:
             mapAlreadyAskedFor.update(it, nRequestTime);
         else
             mapAlreadyAskedFor.insert(std::make_pair(inv, nRequestTime));
-        mapAskFor.insert(std::make_pair(nRequestTime, inv));
+        queueAskFor.Add(nRequestTime / ASKFOR_TICK, inv);
     }
 
 
@@ -783,11 +877,15 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    static void RecordRelayLatency(int nClass, const CRelayLatency& latency);
+    static CRelayLatency GetRelayLatency(int nClass);
 };
 
 
 
 class CTransaction;
+void RelayInventory(const CInv& inv);
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool relayToAll=false);
@@ -9,11 +9,9 @@
 
 #include "alert.h"
 #include "chainparams.h"
-#include "checkpoints.h"
 #include "main.h"
 #include "net.h"
 #include "ui_interface.h"
-#include "masternodeman.h"
 
 #include <stdint.h>
 
@@ -27,16 +25,29 @@ ClientModel::ClientModel(OptionsModel *optionsModel, QObject *parent) :
     QObject(parent), optionsModel(optionsModel),
     cachedNumBlocks(0), cachedMasternodeCountString(""),
     cachedReindexing(0), cachedImporting(0),
-    numBlocksAtStartup(-1), pollTimer(0)
+    numBlocksAtStartup(-1), pollTimer(0), blocksTimer(0), masternodesTimer(0),
+    blocksChangedQueued(0), masternodesChangedQueued(0)
 {
+    // The traffic counters have no change notification, but reading them
+    // doesn't take any of the core locks
     pollTimer = new QTimer(this);
     connect(pollTimer, SIGNAL(timeout()), this, SLOT(updateTimer()));
     pollTimer->start(MODEL_UPDATE_DELAY);
 
-    pollMnTimer = new QTimer(this);
-    connect(pollMnTimer, SIGNAL(timeout()), this, SLOT(updateMnTimer()));
+    // Blocks and masternode list changes are notified by the core, often in
+    // bursts (initial block download, a masternode list sync). A notification
+    // starts a single-shot timer, and everything that arrives before it fires
+    // is handled by one update.
+    blocksTimer = new QTimer(this);
+    blocksTimer->setSingleShot(true);
+    connect(blocksTimer, SIGNAL(timeout()), this, SLOT(updateNumBlocks()));
+    blocksTimer->start(MODEL_UPDATE_DELAY);
+
+    masternodesTimer = new QTimer(this);
+    masternodesTimer->setSingleShot(true);
+    connect(masternodesTimer, SIGNAL(timeout()), this, SLOT(updateMasternodes()));
     // no need to update as frequent as data for balances/txes/blocks
-    pollMnTimer->start(MODEL_UPDATE_DELAY * 4);
+    masternodesTimer->start(MODEL_UPDATE_DELAY * 4);
 
     subscribeToCoreSignals();
 }
@@ -62,13 +73,13 @@ int ClientModel::getNumConnections(unsigned int flags) const
 
 QString ClientModel::getMasternodeCountString() const
 {
-    return QString::number((int)mnodeman.CountEnabled()) + " / " + QString::number((int)mnodeman.size());
+    boost::shared_ptr<const CChainTipSnapshot> psnapshot = GetChainTipSnapshot();
+    return QString::number(psnapshot->nMasternodesEnabled) + " / " + QString::number(psnapshot->nMasternodes);
 }
 
 int ClientModel::getNumBlocks() const
 {
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshot()->nHeight;
 }
 
 int ClientModel::getNumBlocksAtStartup()
@@ -89,29 +100,26 @@ quint64 ClientModel::getTotalBytesSent() const
 
 QDateTime ClientModel::getLastBlockDate() const
 {
-    LOCK(cs_main);
-    if (chainActive.Tip())
-        return QDateTime::fromTime_t(chainActive.Tip()->GetBlockTime());
+    boost::shared_ptr<const CChainTipSnapshot> psnapshot = GetChainTipSnapshot();
+    if (psnapshot->nHeight >= 0)
+        return QDateTime::fromTime_t(psnapshot->nBlockTime);
     else
         return QDateTime::fromTime_t(Params().GenesisBlock().nTime); // Genesis block's time of current network
 }
 
 double ClientModel::getVerificationProgress() const
 {
-    LOCK(cs_main);
-    return Checkpoints::GuessVerificationProgress(chainActive.Tip());
+    return GetChainTipSnapshot()->dVerificationProgress;
 }
 
 void ClientModel::updateTimer()
 {
-    // Get required lock upfront. This avoids the GUI from getting stuck on
-    // periodical polls if the core is holding the locks for a longer time -
-    // for example, during a wallet rescan.
-    TRY_LOCK(cs_main, lockMain);
-    if(!lockMain)
-        return;
-    // Some quantities (such as number of blocks) change so fast that we don't want to be notified for each change.
-    // Periodically check and update with a timer.
+    emit bytesChanged(getTotalBytesRecv(), getTotalBytesSent());
+}
+
+void ClientModel::updateNumBlocks()
+{
+    // Read from the chain tip snapshot, so this never waits for cs_main
     int newNumBlocks = getNumBlocks();
 
     // check for changed number of blocks we have, number of blocks peers claim to have, reindexing state and importing state
@@ -124,18 +132,10 @@ void ClientModel::updateTimer()
 
         emit numBlocksChanged(newNumBlocks);
     }
-
-    emit bytesChanged(getTotalBytesRecv(), getTotalBytesSent());
 }
 
-void ClientModel::updateMnTimer()
+void ClientModel::updateMasternodes()
 {
-    // Get required lock upfront. This avoids the GUI from getting stuck on
-    // periodical polls if the core is holding the locks for a longer time -
-    // for example, during a wallet rescan.
-    TRY_LOCK(cs_main, lockMain);
-    if(!lockMain)
-        return;
     QString newMasternodeCountString = getMasternodeCountString();
 
     if (cachedMasternodeCountString != newMasternodeCountString)
@@ -146,6 +146,33 @@ void ClientModel::updateMnTimer()
     }
 }
 
+void ClientModel::queueBlocksChanged()
+{
+    // Only one update is queued until the GUI thread has picked it up
+    if (blocksChangedQueued.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "startBlocksTimer", Qt::QueuedConnection);
+}
+
+void ClientModel::queueMasternodeListChanged()
+{
+    if (masternodesChangedQueued.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "startMasternodesTimer", Qt::QueuedConnection);
+}
+
+void ClientModel::startBlocksTimer()
+{
+    blocksChangedQueued.fetchAndStoreOrdered(0);
+    if (!blocksTimer->isActive())
+        blocksTimer->start(MODEL_UPDATE_DELAY);
+}
+
+void ClientModel::startMasternodesTimer()
+{
+    masternodesChangedQueued.fetchAndStoreOrdered(0);
+    if (!masternodesTimer->isActive())
+        masternodesTimer->start(MODEL_UPDATE_DELAY * 4);
+}
+
 void ClientModel::updateNumConnections(int numConnections)
 {
     emit numConnectionsChanged(numConnections);
@@ -231,8 +258,12 @@ QString ClientModel::formatClientStartupTime() const
 // Handlers for core signals
 static void NotifyBlocksChanged(ClientModel *clientmodel)
 {
-    // This notification is too frequent. Don't trigger a signal.
-    // Don't remove it, though, as it might be useful later.
+    clientmodel->queueBlocksChanged();
+}
+
+static void NotifyMasternodeListChanged(ClientModel *clientmodel)
+{
+    clientmodel->queueMasternodeListChanged();
 }
 
 static void NotifyNumConnectionsChanged(ClientModel *clientmodel, int newNumConnections)
@@ -255,6 +286,7 @@ void ClientModel::subscribeToCoreSignals()
     // Connect signals to client
     uiInterface.NotifyBlocksChanged.connect(boost::bind(NotifyBlocksChanged, this));
     uiInterface.NotifyNumConnectionsChanged.connect(boost::bind(NotifyNumConnectionsChanged, this, _1));
+    uiInterface.NotifyMasternodeListChanged.connect(boost::bind(NotifyMasternodeListChanged, this));
     uiInterface.NotifyAlertChanged.connect(boost::bind(NotifyAlertChanged, this, _1, _2));
 }
 
@@ -263,5 +295,6 @@ void ClientModel::unsubscribeFromCoreSignals()
     // Disconnect signals from client
     uiInterface.NotifyBlocksChanged.disconnect(boost::bind(NotifyBlocksChanged, this));
     uiInterface.NotifyNumConnectionsChanged.disconnect(boost::bind(NotifyNumConnectionsChanged, this, _1));
+    uiInterface.NotifyMasternodeListChanged.disconnect(boost::bind(NotifyMasternodeListChanged, this));
     uiInterface.NotifyAlertChanged.disconnect(boost::bind(NotifyAlertChanged, this, _1, _2));
 }
@@ -6,6 +6,7 @@
 #ifndef CLIENTMODEL_H
 #define CLIENTMODEL_H
 
+#include <QAtomicInt>
 #include <QObject>
 
 class AddressTableModel;
@@ -71,6 +72,10 @@ public:
     QString clientName() const;
     QString formatClientStartupTime() const;
 
+    //! Queue a block or masternode list update, may be called from any thread
+    void queueBlocksChanged();
+    void queueMasternodeListChanged();
+
 private:
     OptionsModel *optionsModel;
 
@@ -82,7 +87,10 @@ private:
     int numBlocksAtStartup;
 
     QTimer *pollTimer;
-    QTimer *pollMnTimer;
+    QTimer *blocksTimer;
+    QTimer *masternodesTimer;
+    QAtomicInt blocksChangedQueued;
+    QAtomicInt masternodesChangedQueued;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
@@ -99,9 +107,14 @@ signals:
 
 public slots:
     void updateTimer();
-    void updateMnTimer();
+    void updateNumBlocks();
+    void updateMasternodes();
     void updateNumConnections(int numConnections);
     void updateAlert(const QString &hash, int status);
+
+private slots:
+    void startBlocksTimer();
+    void startMasternodesTimer();
 };
 
 #endif // CLIENTMODEL_H
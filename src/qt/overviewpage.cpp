@@ -25,6 +25,9 @@
 #define DECORATION_SIZE 48
 #define ICON_OFFSET 16
 #define NUM_ITEMS 5
+// Recent transactions looked at to find NUM_ITEMS that are not conflicted,
+// doubled for as long as too many of them are
+#define NUM_RECENT_ITEMS (NUM_ITEMS * 4)
 
 class TxViewDelegate : public QAbstractItemDelegate
 {
@@ -111,6 +114,7 @@ OverviewPage::OverviewPage(QWidget *parent) :
     currentUnconfirmedBalance(-1),
     currentImmatureBalance(-1),
     txdelegate(new TxViewDelegate()),
+    recent(0),
     filter(0)
 {
     ui->setupUi(this);
@@ -159,7 +163,7 @@ OverviewPage::OverviewPage(QWidget *parent) :
 void OverviewPage::handleTransactionClicked(const QModelIndex &index)
 {
     if(filter)
-        emit transactionClicked(filter->mapToSource(index));
+        emit transactionClicked(recent->mapToSource(filter->mapToSource(index)));
 }
 
 OverviewPage::~OverviewPage()
@@ -204,14 +208,35 @@ void OverviewPage::setClientModel(ClientModel *model)
     }
 }
 
+void OverviewPage::updateRecentLimit()
+{
+    // Look further back while conflicted transactions leave fewer than
+    // NUM_ITEMS of the recent ones to show
+    int limit = filter->sourceLimit();
+    while(filter->rowCount() < NUM_ITEMS && limit < recent->rowCount())
+    {
+        limit *= 2;
+        filter->setSourceLimit(limit);
+    }
+}
+
 void OverviewPage::setWalletModel(WalletModel *model)
 {
     this->walletModel = model;
     if(model && model->getOptionsModel())
     {
         // Set up transaction list
+        // Hiding conflicted transactions needs their status, so only the most
+        // recent ones are filtered on it. Sorting by date needs no status.
+        recent = new TransactionFilterProxy(this);
+        recent->setSourceModel(model->getTransactionTableModel());
+        recent->setDynamicSortFilter(true);
+        recent->setSortRole(Qt::EditRole);
+        recent->sort(TransactionTableModel::Date, Qt::DescendingOrder);
+
         filter = new TransactionFilterProxy();
-        filter->setSourceModel(model->getTransactionTableModel());
+        filter->setSourceModel(recent);
+        filter->setSourceLimit(NUM_RECENT_ITEMS);
         filter->setLimit(NUM_ITEMS);
         filter->setDynamicSortFilter(true);
         filter->setSortRole(Qt::EditRole);
@@ -221,6 +246,14 @@ void OverviewPage::setWalletModel(WalletModel *model)
         ui->listTransactions->setModel(filter);
         ui->listTransactions->setModelColumn(TransactionTableModel::ToAddress);
 
+        // After filter has seen the change, so its row count is current
+        connect(recent, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(updateRecentLimit()));
+        connect(recent, SIGNAL(rowsRemoved(QModelIndex,int,int)), this, SLOT(updateRecentLimit()));
+        connect(recent, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(updateRecentLimit()));
+        connect(recent, SIGNAL(layoutChanged()), this, SLOT(updateRecentLimit()));
+        connect(recent, SIGNAL(modelReset()), this, SLOT(updateRecentLimit()));
+        updateRecentLimit();
+
         // Keep up to date with wallet
         setBalance(model->getBalance(), model->getUnconfirmedBalance(), model->getImmatureBalance(), model->getAnonymizedBalance());
         connect(model, SIGNAL(balanceChanged(qint64, qint64, qint64, qint64)), this, SLOT(setBalance(qint64, qint64, qint64, qint64)));
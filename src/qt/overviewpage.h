@@ -58,6 +58,7 @@ private:
     int cachedNumBlocks;
 
     TxViewDelegate *txdelegate;
+    TransactionFilterProxy *recent;
     TransactionFilterProxy *filter;
 
 private slots:
@@ -67,6 +68,7 @@ private slots:
     void updateDisplayUnit();
     void handleTransactionClicked(const QModelIndex &index);
     void updateAlerts(const QString &warnings);
+    void updateRecentLimit();
 };
 
 #endif // OVERVIEWPAGE_H
@@ -24,12 +24,16 @@ TransactionFilterProxy::TransactionFilterProxy(QObject *parent) :
     typeFilter(COMMON_TYPES),
     minAmount(0),
     limitRows(-1),
+    limitSourceRows(-1),
     showInactive(true)
 {
 }
 
 bool TransactionFilterProxy::filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const
 {
+    if(limitSourceRows != -1 && sourceRow >= limitSourceRows)
+        return false;
+
     QModelIndex index = sourceModel()->index(sourceRow, 0, sourceParent);
 
     int type = index.data(TransactionTableModel::TypeRole).toInt();
@@ -37,10 +41,7 @@ bool TransactionFilterProxy::filterAcceptsRow(int sourceRow, const QModelIndex &
     QString address = index.data(TransactionTableModel::AddressRole).toString();
     QString label = index.data(TransactionTableModel::LabelRole).toString();
     qint64 amount = llabs(index.data(TransactionTableModel::AmountRole).toLongLong());
-    int status = index.data(TransactionTableModel::StatusRole).toInt();
 
-    if(!showInactive && status == TransactionStatus::Conflicted)
-        return false;
     if(!(TYPE(type) & typeFilter))
         return false;
     if(datetime < dateFrom || datetime > dateTo)
@@ -49,6 +50,9 @@ bool TransactionFilterProxy::filterAcceptsRow(int sourceRow, const QModelIndex &
         return false;
     if(amount < minAmount)
         return false;
+    // The status is computed on demand, only ask for it when filtering on it
+    if(!showInactive && index.data(TransactionTableModel::StatusRole).toInt() == TransactionStatus::Conflicted)
+        return false;
 
     return true;
 }
@@ -89,6 +93,20 @@ void TransactionFilterProxy::setShowInactive(bool showInactive)
     invalidateFilter();
 }
 
+int TransactionFilterProxy::sourceLimit() const
+{
+    return limitSourceRows;
+}
+
+void TransactionFilterProxy::setSourceLimit(int limit)
+{
+    this->limitSourceRows = limit;
+    // Rows inserted or removed in the source shift others across the limit
+    connect(sourceModel(), SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(invalidate()), Qt::UniqueConnection);
+    connect(sourceModel(), SIGNAL(rowsRemoved(QModelIndex,int,int)), this, SLOT(invalidate()), Qt::UniqueConnection);
+    invalidateFilter();
+}
+
 int TransactionFilterProxy::rowCount(const QModelIndex &parent) const
 {
     if(limitRows != -1)
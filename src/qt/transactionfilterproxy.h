@@ -41,6 +41,12 @@ public:
     /** Set whether to show conflicted transactions. */
     void setShowInactive(bool showInactive);
 
+    /** Only consider the first limit rows of the source model, -1 if unlimited.
+        Call after setSourceModel, with a source that is sorted already.
+     */
+    void setSourceLimit(int limit);
+    int sourceLimit() const;
+
     int rowCount(const QModelIndex &parent = QModelIndex()) const;
 
 protected:
@@ -53,6 +59,7 @@ private:
     quint32 typeFilter;
     qint64 minAmount;
     int limitRows;
+    int limitSourceRows;
     bool showInactive;
 };
 
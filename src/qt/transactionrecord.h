@@ -20,7 +20,8 @@ class TransactionStatus
 public:
     TransactionStatus():
         countsForBalance(false), sortKey(""),
-        matures_in(0), status(Offline), depth(0), open_for(0), cur_num_blocks(-1)
+        matures_in(0), status(Offline), depth(0), open_for(0), cur_num_blocks(-1),
+        needsUpdate(false)
     { }
 
     enum Status {
@@ -62,6 +63,9 @@ public:
 
     //** Know when to update transaction for ix locks **/
     int cur_num_ix_locks;
+
+    /** Status was asked for, but the core held the locks */
+    bool needsUpdate;
 };
 
 /** UI model for a transaction. A core transaction can be represented by multiple UI transactions if it has
@@ -19,11 +19,17 @@
 #include "util.h"
 #include "wallet.h"
 
+#include <QAtomicInt>
 #include <QColor>
 #include <QDateTime>
 #include <QDebug>
 #include <QIcon>
 #include <QList>
+#include <QMutex>
+#include <QThread>
+
+// Wallet transactions decomposed by the loader per cs_main/cs_wallet acquisition
+static const int TX_LOAD_PAGE_SIZE = 500;
 
 // Amount column is right-aligned it contains numbers
 static int column_alignments[] = {
@@ -51,13 +57,93 @@ struct TxLessThan
     }
 };
 
+/* Object for reading the wallet transactions into the model in a separate
+   thread, a page at a time, so a large wallet doesn't hold up the window.
+*/
+class TransactionTableLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TransactionTableLoader(CWallet *wallet) : wallet(wallet), fStop(0) {}
+
+    /* A page of records, for the wallet transactions up to and including hashLast */
+    struct Page
+    {
+        QList<TransactionRecord> records;
+        uint256 hashLast;
+        bool fLast;
+    };
+
+    void stop() { fStop.fetchAndStoreOrdered(1); }
+    QList<Page> takePages();
+
+public slots:
+    void load();
+
+signals:
+    void pagesLoaded();
+
+private:
+    CWallet *wallet;
+    QAtomicInt fStop;
+    QMutex mutex;
+    QList<Page> pages;
+};
+
+#include "transactiontablemodel.moc"
+
+QList<TransactionTableLoader::Page> TransactionTableLoader::takePages()
+{
+    QMutexLocker locker(&mutex);
+    QList<Page> ret;
+    ret.swap(pages);
+    return ret;
+}
+
+void TransactionTableLoader::load()
+{
+    Page page;
+    page.hashLast = 0;
+    page.fLast = false;
+    while(!page.fLast && !fStop.testAndSetOrdered(1, 1))
+    {
+        LOCK2(cs_main, wallet->cs_wallet);
+        page.records.clear();
+        std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.upper_bound(page.hashLast);
+        for(int n = 0; n < TX_LOAD_PAGE_SIZE && it != wallet->mapWallet.end(); ++n, ++it)
+        {
+            if(TransactionRecord::showTransaction(it->second))
+            {
+                // The status is cheap while we hold the locks, and the views sort by it
+                QList<TransactionRecord> records = TransactionRecord::decomposeTransaction(wallet, it->second);
+                for(QList<TransactionRecord>::iterator rec = records.begin(); rec != records.end(); ++rec)
+                    rec->updateStatus(it->second);
+                page.records.append(records);
+            }
+            page.hashLast = it->first;
+        }
+        page.fLast = (it == wallet->mapWallet.end());
+
+        // Queued with the locks held: the model sees this page before any
+        // notification about a change made after it was read
+        {
+            QMutexLocker locker(&mutex);
+            pages.append(page);
+        }
+        emit pagesLoaded();
+    }
+}
+
 // Private implementation
 class TransactionTablePriv
 {
 public:
     TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent) :
         wallet(wallet),
-        parent(parent)
+        parent(parent),
+        hashLoaded(0),
+        fLoaded(false)
     {
     }
 
@@ -70,20 +156,24 @@ public:
      */
     QList<TransactionRecord> cachedWallet;
 
-    /* Query entire wallet anew from core.
+    /* Until fLoaded, only the wallet transactions up to hashLoaded are in
+     * cachedWallet; the loader reads the others in their current state.
+     */
+    uint256 hashLoaded;
+    bool fLoaded;
+
+    /* Append a page read by the loader.
      */
-    void refreshWallet()
+    void appendPage(const TransactionTableLoader::Page &page)
     {
-        qDebug() << "TransactionTablePriv::refreshWallet";
-        cachedWallet.clear();
+        if(!page.records.isEmpty())
         {
-            LOCK2(cs_main, wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
-            {
-                if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
-            }
+            parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size()+page.records.size()-1);
+            cachedWallet.append(page.records);
+            parent->endInsertRows();
         }
+        hashLoaded = page.hashLast;
+        fLoaded = page.fLast;
     }
 
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
@@ -96,6 +186,9 @@ public:
 
         qDebug() << "TransactionTablePriv::updateWallet : " + QString::fromStdString(hash.ToString()) + " " + QString::number(status);
 
+        if(!fLoaded && hash > hashLoaded)
+            return; // not read by the loader yet
+
         // Find bounds of this transaction in model
         QList<TransactionRecord>::iterator lower = qLowerBound(
             cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
@@ -138,6 +231,8 @@ public:
                 // Added -- insert at the right position
                 QList<TransactionRecord> toInsert =
                         TransactionRecord::decomposeTransaction(wallet, mi->second);
+                for(QList<TransactionRecord>::iterator rec = toInsert.begin(); rec != toInsert.end(); ++rec)
+                    rec->updateStatus(mi->second);
                 if(!toInsert.isEmpty()) /* only if something to insert */
                 {
                     parent->beginInsertRows(QModelIndex(), lowerIndex, lowerIndex+toInsert.size()-1);
@@ -163,12 +258,31 @@ public:
             parent->endRemoveRows();
             break;
         case CT_UPDATED:
-            // Miscellaneous updates -- nothing to do, status update will take care of this, and is only computed for
-            // visible transactions.
+            // Miscellaneous updates -- the status is only computed for visible transactions. Make sure it
+            // is computed anew, the block might have been swapped for another one at the same height.
+            if(inModel)
+            {
+                for(QList<TransactionRecord>::iterator it = lower; it != upper; ++it)
+                    it->status.cur_num_blocks = -1;
+                emit parent->dataChanged(parent->index(lowerIndex, TransactionTableModel::Status),
+                                         parent->index(upperIndex-1, TransactionTableModel::Amount));
+            }
             break;
         }
     }
 
+    /* Whether the status shown for a row can change with a new block. Confirmed rows
+       look the same whatever their depth, and rows invalidated by CT_UPDATED get their
+       status when they are asked for. Rows asked for while the core held the locks are
+       retried.
+     */
+    bool statusMayChange(int idx)
+    {
+        const TransactionStatus &status = cachedWallet[idx].status;
+        return status.needsUpdate ||
+               (status.cur_num_blocks != -1 && status.status != TransactionStatus::Confirmed);
+    }
+
     int size()
     {
         return cachedWallet.size();
@@ -178,30 +292,7 @@ public:
     {
         if(idx >= 0 && idx < cachedWallet.size())
         {
-            TransactionRecord *rec = &cachedWallet[idx];
-
-            // Get required locks upfront. This avoids the GUI from getting
-            // stuck if the core is holding the locks for a longer time - for
-            // example, during a wallet rescan.
-            //
-            // If a status update is needed (blocks came in since last check),
-            //  update the status of this transaction from the wallet. Otherwise,
-            // simply re-use the cached status.
-            TRY_LOCK(cs_main, lockMain);
-            if(lockMain)
-            {
-                TRY_LOCK(wallet->cs_wallet, lockWallet);
-                if(lockWallet && rec->statusUpdateNeeded())
-                {
-                    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
-
-                    if(mi != wallet->mapWallet.end())
-                    {
-                        rec->updateStatus(mi->second);
-                    }
-                }
-            }
-            return rec;
+            return &cachedWallet[idx];
         }
         else
         {
@@ -209,6 +300,37 @@ public:
         }
     }
 
+    void updateStatus(TransactionRecord *rec)
+    {
+        // Get required locks upfront. This avoids the GUI from getting
+        // stuck if the core is holding the locks for a longer time - for
+        // example, during a wallet rescan.
+        //
+        // If a status update is needed (blocks came in since last check),
+        //  update the status of this transaction from the wallet. Otherwise,
+        // simply re-use the cached status.
+        //
+        // If the locks are busy the row is marked, so the next updateConfirmations
+        // refreshes it.
+        bool fLocked = false;
+        TRY_LOCK(cs_main, lockMain);
+        if(lockMain)
+        {
+            TRY_LOCK(wallet->cs_wallet, lockWallet);
+            fLocked = lockWallet;
+            if(lockWallet && rec->statusUpdateNeeded())
+            {
+                std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
+
+                if(mi != wallet->mapWallet.end())
+                {
+                    rec->updateStatus(mi->second);
+                }
+            }
+        }
+        rec->status.needsUpdate = !fLocked;
+    }
+
     QString describe(TransactionRecord *rec, int unit)
     {
         {
@@ -228,23 +350,46 @@ TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel *paren
         wallet(wallet),
         walletModel(parent),
         priv(new TransactionTablePriv(wallet, this)),
-        fProcessingQueuedTransactions(false)
+        fProcessingQueuedTransactions(false),
+        loader(0), loaderThread(0)
 {
     columns << QString() << tr("Date") << tr("Type") << tr("Address") << tr("Amount");
 
-    priv->refreshWallet();
-
     connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
 
     subscribeToCoreSignals();
+
+    // Changes from here on are either notified or read by the loader
+    loaderThread = new QThread(this);
+    loader = new TransactionTableLoader(wallet);
+    loader->moveToThread(loaderThread);
+    connect(loader, SIGNAL(pagesLoaded()), this, SLOT(loadPages()));
+    connect(loaderThread, SIGNAL(started()), loader, SLOT(load()));
+    connect(loaderThread, SIGNAL(finished()), loader, SLOT(deleteLater()));
+    loaderThread->start();
 }
 
 TransactionTableModel::~TransactionTableModel()
 {
     unsubscribeFromCoreSignals();
+
+    loader->stop();
+    loaderThread->quit();
+    loaderThread->wait();
+
     delete priv;
 }
 
+void TransactionTableModel::loadPages()
+{
+    // Loaded transactions are not new, don't notify about them
+    bool fWasProcessingQueuedTransactions = fProcessingQueuedTransactions;
+    fProcessingQueuedTransactions = true;
+    foreach(const TransactionTableLoader::Page &page, loader->takePages())
+        priv->appendPage(page);
+    fProcessingQueuedTransactions = fWasProcessingQueuedTransactions;
+}
+
 void TransactionTableModel::updateTransaction(const QString &hash, int status, bool showTransaction)
 {
     uint256 updated;
@@ -257,10 +402,22 @@ void TransactionTableModel::updateConfirmations()
 {
     // Blocks came in since last poll.
     // Invalidate status (number of confirmations) and (possibly) description
-    //  for all rows. Qt is smart enough to only actually request the data for the
-    //  visible rows.
-    emit dataChanged(index(0, Status), index(priv->size()-1, Status));
-    emit dataChanged(index(0, ToAddress), index(priv->size()-1, ToAddress));
+    //  for the rows whose status may change. Invalidating all rows would make
+    //  sorting and filtering proxies compute the status of every transaction.
+    int first = -1;
+    for(int i = 0; i <= priv->size(); i++)
+    {
+        bool fChange = (i < priv->size() && priv->statusMayChange(i));
+        if(fChange && first < 0)
+        {
+            first = i;
+        }
+        else if(!fChange && first >= 0)
+        {
+            emit dataChanged(index(first, Status), index(i-1, Amount));
+            first = -1;
+        }
+    }
 }
 
 int TransactionTableModel::rowCount(const QModelIndex &parent) const
@@ -500,11 +657,33 @@ QString TransactionTableModel::formatTooltip(const TransactionRecord *rec) const
     return tooltip;
 }
 
+// Whether the data for a role and column depends on the transaction status,
+// which is only computed when it is asked for
+static bool roleNeedsStatus(int role, int column)
+{
+    switch(role)
+    {
+    case Qt::DecorationRole:
+    case Qt::EditRole:
+        return column == TransactionTableModel::Status;
+    case Qt::DisplayRole:
+        return column == TransactionTableModel::Amount;
+    case Qt::ToolTipRole:
+    case Qt::ForegroundRole:
+    case TransactionTableModel::ConfirmedRole:
+    case TransactionTableModel::StatusRole:
+        return true;
+    }
+    return false;
+}
+
 QVariant TransactionTableModel::data(const QModelIndex &index, int role) const
 {
     if(!index.isValid())
         return QVariant();
     TransactionRecord *rec = static_cast<TransactionRecord*>(index.internalPointer());
+    if(roleNeedsStatus(role, index.column()))
+        priv->updateStatus(rec);
 
     switch(role)
     {
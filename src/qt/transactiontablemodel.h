@@ -9,11 +9,16 @@
 #include <QStringList>
 
 class TransactionRecord;
+class TransactionTableLoader;
 class TransactionTablePriv;
 class WalletModel;
 
 class CWallet;
 
+QT_BEGIN_NAMESPACE
+class QThread;
+QT_END_NAMESPACE
+
 /** UI model for the transaction table of a wallet.
  */
 class TransactionTableModel : public QAbstractTableModel
@@ -73,6 +78,8 @@ private:
     QStringList columns;
     TransactionTablePriv *priv;
     bool fProcessingQueuedTransactions;
+    TransactionTableLoader *loader;
+    QThread *loaderThread;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
@@ -96,6 +103,10 @@ public slots:
     /* Needed to update fProcessingQueuedTransactions through a QueuedConnection */
     void setProcessingQueuedTransactions(bool value) { fProcessingQueuedTransactions = value; }
 
+private slots:
+    /* Add the transactions read by the loader so far */
+    void loadPages();
+
     friend class TransactionTablePriv;
 };
 
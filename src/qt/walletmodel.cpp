@@ -24,27 +24,77 @@
 
 #include <QDebug>
 #include <QSet>
+#include <QThread>
 #include <QTimer>
 
+/* Object for computing the wallet balances in a separate thread, so the GUI
+   thread never waits for cs_main or cs_wallet to get them.
+*/
+class WalletBalanceWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit WalletBalanceWorker(CWallet *wallet) : wallet(wallet) {}
+
+public slots:
+    void request();
+
+signals:
+    void reply(qint64 balance, qint64 unconfirmedBalance, qint64 immatureBalance, qint64 anonymizedBalance,
+               int numTransactions, int txLocks);
+
+private:
+    CWallet *wallet;
+};
+
+#include "walletmodel.moc"
+
+void WalletBalanceWorker::request()
+{
+    CWalletBalances balances = wallet->GetBalances();
+    int numTransactions;
+    {
+        LOCK(wallet->cs_wallet);
+        numTransactions = wallet->mapWallet.size();
+    }
+    emit reply(balances.nTrusted, balances.nUnconfirmed, balances.nImmature, balances.nAnonymized,
+               numTransactions, nCompleteTXLocks);
+}
+
 WalletModel::WalletModel(CWallet *wallet, OptionsModel *optionsModel, QObject *parent) :
     QObject(parent), wallet(wallet), optionsModel(optionsModel), addressTableModel(0),
     transactionTableModel(0),
     recentRequestsTableModel(0),
     cachedBalance(0), cachedUnconfirmedBalance(0), cachedImmatureBalance(0),
-    cachedNumTransactions(0),
+    cachedAnonymizedBalance(0), cachedNumTransactions(0), cachedTxLocks(0),
     cachedEncryptionStatus(Unencrypted),
-    cachedNumBlocks(0)
+    cachedNumBlocks(0),
+    balanceUpdateQueued(0), fBalanceRequested(false), fBalanceRequestPending(false)
 {
-    fForceCheckBalanceChanged = false;
-
     addressTableModel = new AddressTableModel(wallet, this);
     transactionTableModel = new TransactionTableModel(wallet, this);
     recentRequestsTableModel = new RecentRequestsTableModel(wallet, this);
 
-    // This timer will be fired repeatedly to update the balance
-    pollTimer = new QTimer(this);
-    connect(pollTimer, SIGNAL(timeout()), this, SLOT(pollBalanceChanged()));
-    pollTimer->start(MODEL_UPDATE_DELAY);
+    balanceThread = new QThread(this);
+    WalletBalanceWorker *worker = new WalletBalanceWorker(wallet);
+    worker->moveToThread(balanceThread);
+    connect(this, SIGNAL(balanceRequested()), worker, SLOT(request()));
+    connect(worker, SIGNAL(reply(qint64,qint64,qint64,qint64,int,int)),
+            this, SLOT(updateBalance(qint64,qint64,qint64,qint64,int,int)));
+    // Delete the worker in its own thread once the thread is asked to stop
+    connect(balanceThread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+    balanceThread->start();
+
+    // Started by block and wallet transaction notifications; a rescan
+    // changes many transactions but only updates the balance once per delay
+    balanceTimer = new QTimer(this);
+    balanceTimer->setSingleShot(true);
+    connect(balanceTimer, SIGNAL(timeout()), this, SLOT(pollBalanceChanged()));
+    balanceTimer->start(MODEL_UPDATE_DELAY);
+
+    // Anonymized balance depends on the darksend rounds
+    connect(optionsModel, SIGNAL(darksendRoundsChanged(int)), this, SLOT(startBalanceTimer()));
 
     subscribeToCoreSignals();
 }
@@ -52,6 +102,10 @@ WalletModel::WalletModel(CWallet *wallet, OptionsModel *optionsModel, QObject *p
 WalletModel::~WalletModel()
 {
     unsubscribeFromCoreSignals();
+
+    // Wait for a running balance request, its reply is dropped with this object
+    balanceThread->quit();
+    balanceThread->wait();
 }
 
 qint64 WalletModel::getBalance(const CCoinControl *coinControl) const
@@ -106,61 +160,71 @@ void WalletModel::updateStatus()
         emit encryptionStatusChanged(newEncryptionStatus);
 }
 
-void WalletModel::pollBalanceChanged()
+void WalletModel::queueBalanceUpdate()
 {
-    // Get required locks upfront. This avoids the GUI from getting stuck on
-    // periodical polls if the core is holding the locks for a longer time -
-    // for example, during a wallet rescan.
-    TRY_LOCK(cs_main, lockMain);
-    if(!lockMain)
-        return;
-    TRY_LOCK(wallet->cs_wallet, lockWallet);
-    if(!lockWallet)
-        return;
+    // Only one update is queued until the GUI thread has picked it up
+    if(balanceUpdateQueued.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "startBalanceTimer", Qt::QueuedConnection);
+}
 
-    if(chainActive.Height() != cachedNumBlocks || nDarksendRounds != cachedDarksendRounds || cachedTxLocks != nCompleteTXLocks)
-    {
-        // Balance and number of transactions might have changed
-        cachedNumBlocks = chainActive.Height();
-        cachedDarksendRounds = nDarksendRounds;
+void WalletModel::startBalanceTimer()
+{
+    balanceUpdateQueued.fetchAndStoreOrdered(0);
+    if(!balanceTimer->isActive())
+        balanceTimer->start(MODEL_UPDATE_DELAY);
+}
 
-        checkBalanceChanged();
+void WalletModel::pollBalanceChanged()
+{
+    // The chain tip snapshot is read without cs_main
+    int newNumBlocks = GetChainTipSnapshot()->nHeight;
+    if(newNumBlocks != cachedNumBlocks)
+    {
+        cachedNumBlocks = newNumBlocks;
         if(transactionTableModel){
             transactionTableModel->updateConfirmations();
         }
     }
+
+    // Balance and number of transactions might have changed
+    if(fBalanceRequested)
+    {
+        fBalanceRequestPending = true;
+        return;
+    }
+    fBalanceRequested = true;
+    emit balanceRequested();
 }
 
-void WalletModel::checkBalanceChanged()
+void WalletModel::updateBalance(qint64 newBalance, qint64 newUnconfirmedBalance, qint64 newImmatureBalance, qint64 newAnonymizedBalance,
+                                int newNumTransactions, int newTxLocks)
 {
-    qint64 newBalance = getBalance();
-    qint64 newUnconfirmedBalance = getUnconfirmedBalance();
-    qint64 newImmatureBalance = getImmatureBalance();
-    qint64 newAnonymizedBalance = getAnonymizedBalance();
+    fBalanceRequested = false;
 
-    if(cachedBalance != newBalance || cachedUnconfirmedBalance != newUnconfirmedBalance || cachedImmatureBalance != newImmatureBalance|| cachedAnonymizedBalance != newAnonymizedBalance || cachedTxLocks != nCompleteTXLocks)
+    if(cachedBalance != newBalance || cachedUnconfirmedBalance != newUnconfirmedBalance || cachedImmatureBalance != newImmatureBalance|| cachedAnonymizedBalance != newAnonymizedBalance || cachedTxLocks != newTxLocks)
     {
         cachedBalance = newBalance;
         cachedUnconfirmedBalance = newUnconfirmedBalance;
         cachedImmatureBalance = newImmatureBalance;
         cachedAnonymizedBalance = newAnonymizedBalance;
-        cachedTxLocks = nCompleteTXLocks;
+        cachedTxLocks = newTxLocks;
 
         emit balanceChanged(newBalance, newUnconfirmedBalance, newImmatureBalance, newAnonymizedBalance);
     }
-}
 
-void WalletModel::updateTransaction()
-{
-    // Balance and number of transactions might have changed
-    checkBalanceChanged();
-
-    int newNumTransactions = getNumTransactions();
     if(cachedNumTransactions != newNumTransactions)
     {
         cachedNumTransactions = newNumTransactions;
         emit numTransactionsChanged(newNumTransactions);
     }
+
+    // Something changed while the worker was busy
+    if(fBalanceRequestPending)
+    {
+        fBalanceRequestPending = false;
+        fBalanceRequested = true;
+        emit balanceRequested();
+    }
 }
 
 void WalletModel::updateAddressBook(const QString &address, const QString &label,
@@ -483,7 +547,13 @@ static void NotifyTransactionChanged(WalletModel *walletmodel, CWallet *wallet,
     Q_UNUSED(wallet);
     Q_UNUSED(hash);
     Q_UNUSED(status);
-    QMetaObject::invokeMethod(walletmodel, "updateTransaction", Qt::QueuedConnection);
+    walletmodel->queueBalanceUpdate();
+}
+
+static void NotifyBlocksChanged(WalletModel *walletmodel)
+{
+    // Confirmations, and with them the balances, changed
+    walletmodel->queueBalanceUpdate();
 }
 
 static void ShowProgress(WalletModel *walletmodel, const std::string &title, int nProgress)
@@ -501,6 +571,7 @@ void WalletModel::subscribeToCoreSignals()
     wallet->NotifyAddressBookChanged.connect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5, _6));
     wallet->NotifyTransactionChanged.connect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
     wallet->ShowProgress.connect(boost::bind(ShowProgress, this, _1, _2));
+    uiInterface.NotifyBlocksChanged.connect(boost::bind(NotifyBlocksChanged, this));
 }
 
 void WalletModel::unsubscribeFromCoreSignals()
@@ -510,6 +581,7 @@ void WalletModel::unsubscribeFromCoreSignals()
     wallet->NotifyAddressBookChanged.disconnect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5, _6));
     wallet->NotifyTransactionChanged.disconnect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
     wallet->ShowProgress.disconnect(boost::bind(ShowProgress, this, _1, _2));
+    uiInterface.NotifyBlocksChanged.disconnect(boost::bind(NotifyBlocksChanged, this));
 }
 
 // WalletModel::UnlockContext implementation
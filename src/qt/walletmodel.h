@@ -15,6 +15,7 @@
 #include <map>
 #include <vector>
 
+#include <QAtomicInt>
 #include <QObject>
 
 class AddressTableModel;
@@ -32,6 +33,7 @@ class CWallet;
 class uint256;
 
 QT_BEGIN_NAMESPACE
+class QThread;
 class QTimer;
 QT_END_NAMESPACE
 
@@ -200,9 +202,11 @@ public:
     void loadReceiveRequests(std::vector<std::string>& vReceiveRequests);
     bool saveReceiveRequest(const std::string &sAddress, const int64_t nId, const std::string &sRequest);
 
+    // Queue a balance update, may be called from any thread
+    void queueBalanceUpdate();
+
 private:
     CWallet *wallet;
-    bool fForceCheckBalanceChanged;
 
     // Wallet has an options model for wallet-specific options
     // (transaction fee, for example)
@@ -219,15 +223,19 @@ private:
     qint64 cachedAnonymizedBalance;
     qint64 cachedNumTransactions;
     int cachedTxLocks;
-    int cachedDarksendRounds;
     EncryptionStatus cachedEncryptionStatus;
     int cachedNumBlocks;
 
-    QTimer *pollTimer;
+    // Balances are computed by a worker on its own thread, at most one
+    // request at a time; changes arriving meanwhile trigger one more
+    QThread *balanceThread;
+    QTimer *balanceTimer;
+    QAtomicInt balanceUpdateQueued;
+    bool fBalanceRequested;
+    bool fBalanceRequestPending;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
-    void checkBalanceChanged();
 
 signals:
     // Signal that balance in wallet changed
@@ -253,15 +261,22 @@ signals:
     // Show progress dialog e.g. for rescan
     void showProgress(const QString &title, int nProgress);
 
+    // Ask the balance worker for new balances
+    void balanceRequested();
+
 public slots:
     /* Wallet status might have changed */
     void updateStatus();
-    /* New transaction, or transaction changed status */
-    void updateTransaction();
     /* New, updated or removed address book entry */
     void updateAddressBook(const QString &address, const QString &label, bool isMine, const QString &purpose, int status);
-    /* Current, immature or unconfirmed balance might have changed - emit 'balanceChanged' if so */
+    /* Current, immature or unconfirmed balance might have changed - request new balances */
     void pollBalanceChanged();
+    /* New balances from the balance worker - emit 'balanceChanged' if they changed */
+    void updateBalance(qint64 balance, qint64 unconfirmedBalance, qint64 immatureBalance, qint64 anonymizedBalance,
+                       int numTransactions, int txLocks);
+
+private slots:
+    void startBalanceTimer();
 };
 
 #endif // WALLETMODEL_H
@@ -30,10 +30,18 @@ double GetDifficulty(const CBlockIndex* blockindex)
             blockindex = chainActive.Tip();
     }
 
-    int nShift = (blockindex->nBits >> 24) & 0xff;
+    return GetDifficultyFromBits(blockindex->nBits);
+}
+
+double GetDifficultyFromBits(unsigned int nBits)
+{
+    if (nBits == 0)
+        return 1.0;
+
+    int nShift = (nBits >> 24) & 0xff;
 
     double dDiff =
-        (double)0x0000ffff / (double)(blockindex->nBits & 0x00ffffff);
+        (double)0x0000ffff / (double)(nBits & 0x00ffffff);
 
     while (nShift < 29)
     {
@@ -107,7 +115,7 @@ Value getblockcount(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    return chainActive.Height();
+    return GetChainTipSnapshot()->nHeight;
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -123,7 +131,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSnapshot()->hashBestBlock.GetHex();
 }
 
 Value getdifficulty(const Array& params, bool fHelp)
@@ -139,7 +147,7 @@ Value getdifficulty(const Array& params, bool fHelp)
             + HelpExampleRpc("getdifficulty", "")
         );
 
-    return GetDifficulty();
+    return GetDifficultyFromBits(GetChainTipSnapshot()->nBits);
 }
 
 
@@ -181,6 +189,7 @@ Value getrawmempool(const Array& params, bool fHelp)
 
     if (fVerbose)
     {
+        int nHeight = GetChainTipSnapshot()->nHeight;
         LOCK(mempool.cs);
         Object o;
         BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
@@ -193,7 +202,7 @@ Value getrawmempool(const Array& params, bool fHelp)
             info.push_back(Pair("time", e.GetTime()));
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("currentpriority", e.GetPriority(nHeight)));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -520,18 +529,17 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockchaininfo", "")
         );
 
-    proxyType proxy;
-    GetProxy(NET_IPV4, proxy);
+    boost::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
 
     Object obj;
     std::string chain = Params().DataDir();
     if(chain.empty())
         chain = "main";
     obj.push_back(Pair("chain",         chain));
-    obj.push_back(Pair("blocks",        (int)chainActive.Height()));
-    obj.push_back(Pair("bestblockhash", chainActive.Tip()->GetBlockHash().GetHex()));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
-    obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
-    obj.push_back(Pair("chainwork",     chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("blocks",        tip->nHeight));
+    obj.push_back(Pair("bestblockhash", tip->hashBestBlock.GetHex()));
+    obj.push_back(Pair("difficulty",    GetDifficultyFromBits(tip->nBits)));
+    obj.push_back(Pair("verificationprogress", tip->dVerificationProgress));
+    obj.push_back(Pair("chainwork",     tip->nChainWork.GetHex()));
     return obj;
 }
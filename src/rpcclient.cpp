@@ -6,6 +6,7 @@
 
 #include "rpcclient.h"
 
+#include "rpcjson.h"
 #include "rpcprotocol.h"
 #include "util.h"
 #include "ui_interface.h"
@@ -84,7 +85,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ReadJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -180,6 +181,9 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "keypoolrefill"          && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getrawmempool"          && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "spork"                  && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddressdeltas"       && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddressdeltas"       && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<int64_t>(params[1]);
 
     return params;
 }
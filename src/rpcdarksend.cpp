@@ -10,7 +10,9 @@
 #include "activemasternode.h"
 #include "masternodeman.h"
 #include "masternodeconfig.h"
+#include "instantx.h"
 #include "rpcserver.h"
+#include "scheduler.h"
 #include <boost/lexical_cast.hpp>
 
 #include <fstream>
@@ -91,7 +93,7 @@ Value masternode(const Array& params, bool fHelp)
 
     if (fHelp  ||
         (strCommand != "start" && strCommand != "start-alias" && strCommand != "start-many" && strCommand != "stop" && strCommand != "stop-alias" && strCommand != "stop-many" && strCommand != "list" && strCommand != "list-conf" && strCommand != "count"  && strCommand != "enforce"
-            && strCommand != "debug" && strCommand != "current" && strCommand != "winners" && strCommand != "genkey" && strCommand != "connect" && strCommand != "outputs" && strCommand != "vote-many" && strCommand != "vote"))
+            && strCommand != "debug" && strCommand != "current" && strCommand != "winners" && strCommand != "genkey" && strCommand != "connect" && strCommand != "outputs" && strCommand != "vote-many" && strCommand != "vote" && strCommand != "sigcache"))
         throw runtime_error(
                 "masternode \"command\"... ( \"passphrase\" )\n"
                 "Set of commands to execute masternode related actions\n"
@@ -105,6 +107,7 @@ Value masternode(const Array& params, bool fHelp)
                 "  genkey       - Generate new masternodeprivkey\n"
                 "  enforce      - Enforce masternode payments\n"
                 "  outputs      - Print masternode compatible outputs\n"
+                "  sigcache     - Print statistics of the verified signature cache\n"
                 "  start        - Start masternode configured in unpay.conf\n"
                 "  start-alias  - Start single masternode by assigned alias configured in masternode.conf\n"
                 "  start-many   - Start all masternodes configured in masternode.conf\n"
@@ -118,6 +121,24 @@ Value masternode(const Array& params, bool fHelp)
                 "  vote         - Vote on a Unpay initiative\n"
                 );
 
+    // counts are read from the chain tip snapshot, without any locks
+    if (strCommand == "count")
+    {
+        if (params.size() > 2){
+            throw runtime_error(
+            "too many parameters\n");
+        }
+        boost::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+        if (params.size() == 2)
+        {
+            if(params[1] == "enabled") return tip->nMasternodesEnabled;
+            if(params[1] == "both") return boost::lexical_cast<std::string>(tip->nMasternodesEnabled) + " / " + boost::lexical_cast<std::string>(tip->nMasternodes);
+        }
+        return tip->nMasternodes;
+    }
+
+    // the other commands use the locks CRPCTable::execute used to take for them
+    LOCK2(cs_main, pwalletMain->cs_wallet);
 
     if (strCommand == "stop")
     {
@@ -266,18 +287,18 @@ Value masternode(const Array& params, bool fHelp)
         return masternodelist(newParams, fHelp);
     }
 
-    if (strCommand == "count")
+    if (strCommand == "sigcache")
     {
-        if (params.size() > 2){
-            throw runtime_error(
-            "too many parameters\n");
-        }
-        if (params.size() == 2)
-        {
-            if(params[1] == "enabled") return mnodeman.CountEnabled();
-            if(params[1] == "both") return boost::lexical_cast<std::string>(mnodeman.CountEnabled()) + " / " + boost::lexical_cast<std::string>(mnodeman.size());
-        }
-        return mnodeman.size();
+        int nSize;
+        uint64_t nHits, nRecoveries;
+        darkSendSigner.GetCacheStats(nSize, nHits, nRecoveries);
+
+        Object obj;
+        obj.push_back(Pair("size",          nSize));
+        obj.push_back(Pair("maxsize",       DARKSEND_SIGCACHE_SIZE));
+        obj.push_back(Pair("hits",          nHits));
+        obj.push_back(Pair("recoveries",    nRecoveries));
+        return obj;
     }
 
     if (strCommand == "start")
@@ -718,7 +739,11 @@ Value masternodelist(const Array& params, bool fHelp)
 
     Object obj;
     if (strMode == "rank") {
-        std::vector<pair<int, CMasternode> > vMasternodeRanks = mnodeman.GetMasternodeRanks(chainActive.Tip()->nHeight);
+        std::vector<pair<int, CMasternode> > vMasternodeRanks;
+        {
+            LOCK(cs_main);
+            vMasternodeRanks = mnodeman.GetMasternodeRanks(chainActive.Tip()->nHeight);
+        }
         BOOST_FOREACH(PAIRTYPE(int, CMasternode)& s, vMasternodeRanks) {
             std::string strAddr = s.second.addr.ToString();
             if(strFilter !="" && strAddr.find(strFilter) == string::npos) continue;
@@ -817,3 +842,85 @@ Value masternodelist(const Array& params, bool fHelp)
     return obj;
 
 }
+
+Value getschedulerinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getschedulerinfo\n"
+            "Returns an array of objects with statistics about the Darksend and Masternode maintenance tasks.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\" : \"name\",     (string) the task name\n"
+            "    \"period\" : n,          (numeric) seconds between runs\n"
+            "    \"lock\" : \"lock\",     (string) the lock held while the task runs, if any\n"
+            "    \"runs\" : n,            (numeric) number of completed runs\n"
+            "    \"overruns\" : n,        (numeric) runs skipped because the previous one was still busy\n"
+            "    \"lastms\" : n,          (numeric) duration of the last run in milliseconds\n"
+            "    \"maxms\" : n,           (numeric) longest run in milliseconds\n"
+            "    \"avgms\" : n,           (numeric) average run in milliseconds\n"
+            "    \"running\" : true|false (boolean) if the task is running right now\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getschedulerinfo", "")
+            + HelpExampleRpc("getschedulerinfo", "")
+        );
+
+    Array ret;
+    BOOST_FOREACH(const CScheduler::CTaskInfo& info, maintenanceScheduler.GetTaskInfo())
+    {
+        Object obj;
+        obj.push_back(Pair("name",      info.strName));
+        obj.push_back(Pair("period",    info.nPeriod));
+        obj.push_back(Pair("lock",      info.strLock));
+        obj.push_back(Pair("runs",      (uint64_t)info.nRuns));
+        obj.push_back(Pair("overruns",  (uint64_t)info.nOverruns));
+        obj.push_back(Pair("lastms",    info.nLastMillis));
+        obj.push_back(Pair("maxms",     info.nMaxMillis));
+        obj.push_back(Pair("avgms",     info.nRuns ? info.nTotalMillis / (int64_t)info.nRuns : 0));
+        obj.push_back(Pair("running",   info.fRunning));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+Value getinstantxinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getinstantxinfo\n"
+            "Returns an object containing the InstantX state kept in memory.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"locks\" : n,             (numeric) transaction locks being tracked\n"
+            "  \"completelocks\" : n,     (numeric) locks completed since startup\n"
+            "  \"requests\" : n,          (numeric) lock requests accepted to the mempool\n"
+            "  \"rejectedrequests\" : n,  (numeric) lock requests rejected from the mempool\n"
+            "  \"votes\" : n,             (numeric) votes belonging to tracked locks\n"
+            "  \"lockedinputs\" : n,      (numeric) inputs held by locks\n"
+            "  \"expired\" : n,           (numeric) locks expired since startup\n"
+            "  \"evicted\" : n,           (numeric) locks and requests dropped because of the memory limits\n"
+            "  \"rejectedvotes\" : n      (numeric) votes rejected since startup\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getinstantxinfo", "")
+            + HelpExampleRpc("getinstantxinfo", "")
+        );
+
+    LOCK(cs_main);
+
+    Object obj;
+    obj.push_back(Pair("locks",             (int)mapTxLocks.size()));
+    obj.push_back(Pair("completelocks",     nCompleteTXLocks));
+    obj.push_back(Pair("requests",          (int)mapTxLockReq.size()));
+    obj.push_back(Pair("rejectedrequests",  (int)mapTxLockReqRejected.size()));
+    obj.push_back(Pair("votes",             (int)mapTxLockVote.size()));
+    obj.push_back(Pair("lockedinputs",      (int)mapLockedInputs.size()));
+    obj.push_back(Pair("expired",           nTxLocksExpired));
+    obj.push_back(Pair("evicted",           nTxLocksEvicted));
+    obj.push_back(Pair("rejectedvotes",     nTxLockVotesRejected));
+    return obj;
+}
@@ -0,0 +1,497 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcjson.h"
+
+#include <iomanip>
+#include <limits>
+#include <locale>
+#include <sstream>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+using namespace json_spirit;
+
+//
+// Writer
+//
+
+static const char pszHexDigits[] = "0123456789ABCDEF";
+
+static void WriteJSONString(const string& str, string& strOut)
+{
+    strOut += '"';
+    const char* pbegin = str.data();
+    const char* pend = pbegin + str.size();
+    for (const char* p = pbegin; p < pend; p++)
+    {
+        unsigned char c = *p;
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+            continue;
+
+        strOut.append(pbegin, p);
+        pbegin = p + 1;
+        switch (c)
+        {
+            case '"':  strOut += "\\\""; break;
+            case '\\': strOut += "\\\\"; break;
+            case '\b': strOut += "\\b";  break;
+            case '\f': strOut += "\\f";  break;
+            case '\n': strOut += "\\n";  break;
+            case '\r': strOut += "\\r";  break;
+            case '\t': strOut += "\\t";  break;
+            default:
+            {
+                // everything else that isn't printable ASCII, one byte at a time
+                char buf[6] = { '\\', 'u', '0', '0', pszHexDigits[c >> 4], pszHexDigits[c & 0xf] };
+                strOut.append(buf, 6);
+            }
+        }
+    }
+    strOut.append(pbegin, pend);
+    strOut += '"';
+}
+
+static void WriteJSONUInt(uint64_t n, bool fNegative, string& strOut)
+{
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+    if (fNegative)
+        *--p = '-';
+    strOut.append(p, buf + sizeof(buf));
+}
+
+void WriteJSON(const Value& value, string& strOut)
+{
+    switch (value.type())
+    {
+        case obj_type:
+        {
+            const Object& obj = value.get_obj();
+            strOut += '{';
+            for (Object::const_iterator it = obj.begin(); it != obj.end(); ++it)
+            {
+                if (it != obj.begin())
+                    strOut += ',';
+                WriteJSONString(it->name_, strOut);
+                strOut += ':';
+                WriteJSON(it->value_, strOut);
+            }
+            strOut += '}';
+            break;
+        }
+        case array_type:
+        {
+            const Array& arr = value.get_array();
+            strOut += '[';
+            for (Array::const_iterator it = arr.begin(); it != arr.end(); ++it)
+            {
+                if (it != arr.begin())
+                    strOut += ',';
+                WriteJSON(*it, strOut);
+            }
+            strOut += ']';
+            break;
+        }
+        case str_type:
+            WriteJSONString(value.get_str(), strOut);
+            break;
+        case bool_type:
+            strOut += value.get_bool() ? "true" : "false";
+            break;
+        case int_type:
+            if (value.is_uint64())
+                WriteJSONUInt(value.get_uint64(), false, strOut);
+            else if (value.get_int64() < 0)
+                WriteJSONUInt(-(uint64_t)value.get_int64(), true, strOut);
+            else
+                WriteJSONUInt(value.get_int64(), false, strOut);
+            break;
+        case real_type:
+        {
+            // same as std::fixed with a precision of 8 in the json_spirit writer, the
+            // classic locale keeps the decimal point whatever LC_NUMERIC is set to
+            ostringstream os;
+            os.imbue(locale::classic());
+            os << fixed << setprecision(8) << value.get_real();
+            strOut += os.str();
+            break;
+        }
+        case null_type:
+            strOut += "null";
+            break;
+    }
+}
+
+string WriteJSON(const Value& value)
+{
+    string strOut;
+    WriteJSON(value, strOut);
+    return strOut;
+}
+
+//
+// Reader
+//
+
+static inline void SkipSpace(const char*& p, const char* pend)
+{
+    while (p < pend && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == '\f' || *p == '\v'))
+        p++;
+}
+
+static inline int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Value of the nDigits characters at p read as hex, like the json_spirit reader
+// does it: anything that is not a hex digit counts as 0
+static unsigned int ReadHex(const char* p, int nDigits)
+{
+    unsigned int nRet = 0;
+    for (int i = 0; i < nDigits; i++)
+        nRet = (nRet << 4) | max(HexDigit(p[i]), 0);
+    return nRet;
+}
+
+// p points at the opening quote
+static bool ReadString(const char*& p, const char* pend, string& strRet)
+{
+    strRet.clear();
+    if (p == pend || *p != '"')
+        return false;
+    p++;
+
+    // find the closing quote, one that is preceded by an even number of backslashes
+    const char* pquote = p;
+    while (true)
+    {
+        pquote = (const char*)memchr(pquote, '"', pend - pquote);
+        if (!pquote)
+            return false;
+        const char* pbackslash = pquote;
+        while (pbackslash > p && pbackslash[-1] == '\\')
+            pbackslash--;
+        if ((pquote - pbackslash) % 2 == 0)
+            break;
+        pquote++;
+    }
+
+    // json_spirit's grammar takes \x and \X as a hex escape of one or two digits
+    // that must fit a signed char, and rejects the text if they don't
+    for (const char* q = p; (q = (const char*)memchr(q, '\\', pquote - q)) != NULL; q += 2)
+    {
+        if (q[1] != 'x' && q[1] != 'X')
+            continue;
+        int nDigits = 0;
+        while (nDigits < 2 && q + 2 + nDigits < pquote && HexDigit(q[2 + nDigits]) >= 0)
+            nDigits++;
+        if (nDigits == 0 || ReadHex(q + 2, nDigits) > 0x7f)
+            return false;
+    }
+
+    // Escape sequences are decoded the way json_spirit decodes them. \x and \u
+    // take the next 2 and 4 characters when the string has that many left, and
+    // are dropped otherwise. An unknown escaped character is dropped.
+    while (true)
+    {
+        // copy the run up to the next escape or the closing quote in one go
+        const char* pescape = (const char*)memchr(p, '\\', pquote - p);
+        // a backslash left last, after \x or \u took the one it escaped, stays as it is
+        if (!pescape || pescape == pquote - 1)
+        {
+            strRet.append(p, pquote);
+            p = pquote + 1;
+            return true;
+        }
+        strRet.append(p, pescape);
+        p = pescape + 1;
+
+        switch (*p)
+        {
+            case 't':  strRet += '\t'; break;
+            case 'b':  strRet += '\b'; break;
+            case 'f':  strRet += '\f'; break;
+            case 'n':  strRet += '\n'; break;
+            case 'r':  strRet += '\r'; break;
+            case '\\': strRet += '\\'; break;
+            case '/':  strRet += '/';  break;
+            case '"':  strRet += '"';  break;
+            case 'x':
+                if (pquote - p >= 3)
+                {
+                    strRet += (char)ReadHex(p + 1, 2);
+                    p += 2;
+                }
+                break;
+            case 'u':
+                if (pquote - p >= 5)
+                {
+                    strRet += (char)ReadHex(p + 1, 4);
+                    p += 4;
+                }
+                break;
+            default:
+                break;
+        }
+        p++;
+    }
+}
+
+static bool ReadNumber(const char*& p, const char* pend, Value& valRet)
+{
+    const char* pbegin = p;
+    bool fNegative = false;
+    if (p < pend && (*p == '-' || *p == '+'))
+        fNegative = (*p++ == '-');
+
+    // integer part, kept as an unsigned number while it fits
+    uint64_t n = 0;
+    bool fOverflow = false;
+    const char* pdigits = p;
+    while (p < pend && *p >= '0' && *p <= '9')
+    {
+        unsigned int nDigit = *p++ - '0';
+        if (n > (numeric_limits<uint64_t>::max() - nDigit) / 10)
+            fOverflow = true;
+        n = n * 10 + nDigit;
+    }
+    bool fDigits = p > pdigits;
+
+    bool fReal = false;
+    if (p < pend && *p == '.')
+    {
+        fReal = true;
+        const char* pfraction = ++p;
+        while (p < pend && *p >= '0' && *p <= '9')
+            p++;
+        fDigits = fDigits || p > pfraction;
+    }
+    if (!fDigits)
+        return false;
+    if (p < pend && (*p == 'e' || *p == 'E'))
+    {
+        fReal = true;
+        p++;
+        if (p < pend && (*p == '-' || *p == '+'))
+            p++;
+        const char* pexponent = p;
+        while (p < pend && *p >= '0' && *p <= '9')
+            p++;
+        if (p == pexponent)
+            return false;
+    }
+
+    if (fReal)
+    {
+        // not strtod, which expects the decimal point of LC_NUMERIC
+        istringstream is(string(pbegin, p));
+        is.imbue(locale::classic());
+        double d;
+        if (!(is >> d))
+        {
+            // the syntax is checked already, so it is out of range: json_spirit gives infinity
+            d = fNegative ? -numeric_limits<double>::infinity() : numeric_limits<double>::infinity();
+        }
+        valRet = Value(d);
+        return true;
+    }
+
+    if (fOverflow)
+        return false;
+    if (fNegative)
+    {
+        if (n > (uint64_t)numeric_limits<int64_t>::max() + 1)
+            return false;
+        valRet = Value((int64_t)(0 - n));
+    }
+    else if (n > (uint64_t)numeric_limits<int64_t>::max())
+        valRet = Value(n);
+    else
+        valRet = Value((int64_t)n);
+    return true;
+}
+
+static bool ReadLiteral(const char*& p, const char* pend, const char* pszLiteral, size_t nLength)
+{
+    if ((size_t)(pend - p) < nLength || memcmp(p, pszLiteral, nLength) != 0)
+        return false;
+    p += nLength;
+    return true;
+}
+
+// Count the elements of every array and object, in the order they are opened,
+// so they can be reserved up front. Growing a vector of values would copy all
+// of the values already in it. Only a hint: malformed input gives wrong counts.
+static void CountElements(const char* p, const char* pend, vector<unsigned int>& vCounts)
+{
+    vector<unsigned int> vOpen;
+    for (; p < pend; p++)
+    {
+        char c = *p;
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+            continue;
+        if (c == ']' || c == '}')
+        {
+            if (!vOpen.empty())
+                vOpen.pop_back();
+            continue;
+        }
+        if (!vOpen.empty())
+        {
+            unsigned int& nCount = vCounts[vOpen.back()];
+            if (c == ',')
+                nCount++;
+            else if (nCount == 0)
+                nCount = 1;
+        }
+        if (c == '[' || c == '{')
+        {
+            vOpen.push_back(vCounts.size());
+            vCounts.push_back(0);
+        }
+        else if (c == '"')
+        {
+            // skip to the closing quote, the one not preceded by an odd number of backslashes
+            const char* pstart = ++p;
+            while ((p = (const char*)memchr(p, '"', pend - p)) != NULL)
+            {
+                const char* pescape = p;
+                while (pescape > pstart && *(pescape - 1) == '\\')
+                    pescape--;
+                if ((p - pescape) % 2 == 0)
+                    break;
+                p++;
+            }
+            if (!p)
+                return;
+        }
+    }
+}
+
+bool ReadJSON(const string& strJSON, Value& valRet)
+{
+    const char* p = strJSON.data();
+    const char* pend = p + strJSON.size();
+
+    // the containers being filled, innermost last. Their elements are added
+    // in place, so a pointer stays valid until the container is closed.
+    vector<Value*> vOpen;
+    bool fFirst = true;
+    string str;
+
+    vector<unsigned int> vCounts;
+    CountElements(p, pend, vCounts);
+    unsigned int nOpened = 0;
+    unsigned int nCount;
+
+    valRet = Value::null;
+    while (true)
+    {
+        SkipSpace(p, pend);
+
+        // find the place of the next value
+        Value* pvalue;
+        if (vOpen.empty())
+        {
+            // like read_string, anything after the first value is ignored
+            if (!fFirst)
+                return true;
+            pvalue = &valRet;
+        }
+        else
+        {
+            Value& container = *vOpen.back();
+            bool fObject = (container.type() == obj_type);
+            if (p < pend && *p == (fObject ? '}' : ']'))
+            {
+                p++;
+                vOpen.pop_back();
+                fFirst = false;
+                continue;
+            }
+            if (!fFirst)
+            {
+                if (p == pend || *p != ',')
+                    return false;
+                p++;
+                SkipSpace(p, pend);
+            }
+            if (fObject)
+            {
+                if (!ReadString(p, pend, str))
+                    return false;
+                SkipSpace(p, pend);
+                if (p == pend || *p != ':')
+                    return false;
+                p++;
+                SkipSpace(p, pend);
+                Object& obj = container.get_obj();
+                obj.push_back(Pair(string(), Value::null));
+                obj.back().name_.swap(str);
+                pvalue = &obj.back().value_;
+            }
+            else
+            {
+                Array& arr = container.get_array();
+                arr.push_back(Value::null);
+                pvalue = &arr.back();
+            }
+        }
+
+        if (p == pend)
+            return false;
+        switch (*p)
+        {
+            case '{':
+            case '[':
+                if (vOpen.size() >= MAX_JSON_DEPTH)
+                    return false;
+                nCount = (nOpened < vCounts.size() ? vCounts[nOpened++] : 0);
+                if (*p++ == '{') {
+                    *pvalue = Object();
+                    pvalue->get_obj().reserve(nCount);
+                } else {
+                    *pvalue = Array();
+                    pvalue->get_array().reserve(nCount);
+                }
+                vOpen.push_back(pvalue);
+                fFirst = true;
+                continue;
+            case '"':
+                if (!ReadString(p, pend, str))
+                    return false;
+                *pvalue = Value(str);
+                break;
+            case 't':
+                if (!ReadLiteral(p, pend, "true", 4))
+                    return false;
+                *pvalue = Value(true);
+                break;
+            case 'f':
+                if (!ReadLiteral(p, pend, "false", 5))
+                    return false;
+                *pvalue = Value(false);
+                break;
+            case 'n':
+                if (!ReadLiteral(p, pend, "null", 4))
+                    return false;
+                break;
+            default:
+                if (!ReadNumber(p, pend, *pvalue))
+                    return false;
+        }
+        fFirst = false;
+    }
+}
@@ -0,0 +1,35 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef RPCJSON_H
+#define RPCJSON_H
+
+#include <string>
+
+#include "json/json_spirit_value.h"
+
+// Containers nested deeper than this are rejected by ReadJSON
+static const unsigned int MAX_JSON_DEPTH = 512;
+
+/** Append the compact JSON text of value to strOut.
+  *
+  * The output is byte for byte what json_spirit::write_string(value, false)
+  * produces, reals always with a decimal point whatever the locale, but is
+  * written straight into strOut instead of going through an ostringstream and
+  * a copy of the whole text.
+  */
+void WriteJSON(const json_spirit::Value& value, std::string& strOut);
+std::string WriteJSON(const json_spirit::Value& value);
+
+/** Parse the JSON text in strJSON into valRet.
+  *
+  * Accepts what json_spirit::read_string accepts and builds the same values,
+  * down to its lenient escape sequences ("\u12" is "12") and infinity for out
+  * of range reals, using an explicit stack instead of a recursive descent and
+  * without copying containers once they are built. Numbers are read in the
+  * classic locale. Returns false on malformed input.
+  */
+bool ReadJSON(const std::string& strJSON, json_spirit::Value& valRet);
+
+#endif
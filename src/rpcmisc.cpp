@@ -12,11 +12,13 @@
 #include "rpcserver.h"
 #include "util.h"
 #include "spork.h"
+#include "txdb.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #include "walletdb.h"
 #endif
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -41,6 +43,7 @@ Value getinfo(const Array& params, bool fHelp)
             "  \"walletversion\": xxxxx,     (numeric) the wallet version\n"
             "  \"balance\": xxxxxxx,         (numeric) the total unpay balance of the wallet\n"
             "  \"darksend_balance\": xxxxxx, (numeric) the anonymized unpay balance of the wallet\n"
+            "  \"balance_height\": xxxxxx,   (numeric) the number of blocks the balances are computed at, may be behind blocks while the node is busy\n"
             "  \"blocks\": xxxxxx,           (numeric) the current number of blocks processed in the server\n"
             "  \"timeoffset\": xxxxx,        (numeric) the time offset\n"
             "  \"connections\": xxxxx,       (numeric) the number of connections\n"
@@ -59,33 +62,47 @@ Value getinfo(const Array& params, bool fHelp)
             + HelpExampleRpc("getinfo", "")
         );
 
+    // chain state comes from the tip snapshot and the wallet part only holds
+    // cs_wallet, so dashboards polling this don't hold up block processing
+    boost::shared_ptr<const CChainTipSnapshot> tip = GetChainTipSnapshot();
+
     proxyType proxy;
     GetProxy(NET_IPV4, proxy);
 
+    int nConnections;
+    {
+        LOCK(cs_vNodes);
+        nConnections = vNodes.size();
+    }
+
     Object obj;
     obj.push_back(Pair("version",       (int)CLIENT_VERSION));
     obj.push_back(Pair("protocolversion",(int)PROTOCOL_VERSION));
 #ifdef ENABLE_WALLET
     if (pwalletMain) {
+        int nBalanceHeight;
+        CWalletBalances balances = pwalletMain->GetBalancesNoWait(nBalanceHeight);
         obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
-        obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
+        obj.push_back(Pair("balance",       ValueFromAmount(balances.nTrusted)));
         if(!fLiteMode)
-            obj.push_back(Pair("darksend_balance",       ValueFromAmount(pwalletMain->GetAnonymizedBalance())));
+            obj.push_back(Pair("darksend_balance",       ValueFromAmount(balances.nAnonymized)));
+        obj.push_back(Pair("balance_height", nBalanceHeight));
     }
 #endif
-    obj.push_back(Pair("blocks",        (int)chainActive.Height()));
+    obj.push_back(Pair("blocks",        tip->nHeight));
     obj.push_back(Pair("timeoffset",    GetTimeOffset()));
-    obj.push_back(Pair("connections",   (int)vNodes.size()));
+    obj.push_back(Pair("connections",   nConnections));
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
+    obj.push_back(Pair("difficulty",    GetDifficultyFromBits(tip->nBits)));
     obj.push_back(Pair("testnet",       TestNet()));
 #ifdef ENABLE_WALLET
     if (pwalletMain) {
         obj.push_back(Pair("keypoololdest", pwalletMain->GetOldestKeyPoolTime()));
+        LOCK(pwalletMain->cs_wallet);
         obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
     }
     if (pwalletMain && pwalletMain->IsCrypted())
-        obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+        obj.push_back(Pair("unlocked_until", GetWalletUnlockTime()));
     obj.push_back(Pair("paytxfee",      ValueFromAmount(nTransactionFee)));
 #endif
     obj.push_back(Pair("relayfee",      ValueFromAmount(CTransaction::nMinRelayTxFee)));
@@ -145,6 +162,23 @@ Value spork(const Array& params, bool fHelp)
             it++;
         }
         return ret;
+    } else if(params.size() == 1 && params[0].get_str() == "times"){
+        Object ret;
+        for(int nSporkID = SPORK_START; nSporkID <= SPORK_END; nSporkID++) {
+            std::string strName = sporkManager.GetSporkNameByID(nSporkID);
+            if(strName == "Unknown") continue;
+
+            int64_t nTimeSigned, nTimeUpdated;
+            sporkTable.GetUpdateTimes(nSporkID, nTimeSigned, nTimeUpdated);
+
+            Object obj;
+            obj.push_back(Pair("value",     sporkTable.GetValue(nSporkID)));
+            obj.push_back(Pair("active",    IsSporkActive(nSporkID)));
+            obj.push_back(Pair("signed",    nTimeSigned));
+            obj.push_back(Pair("updated",   nTimeUpdated));
+            ret.push_back(Pair(strName, obj));
+        }
+        return ret;
     } else if (params.size() == 2){
         int nSporkID = sporkManager.GetSporkIDByName(params[0].get_str());
         if(nSporkID == -1){
@@ -165,7 +199,8 @@ Value spork(const Array& params, bool fHelp)
 
     throw runtime_error(
         "spork <name> [<value>]\n"
-        "<name> is the corresponding spork name, or 'show' to show all current spork settings"
+        "<name> is the corresponding spork name, or 'show' to show all current spork settings,\n"
+        "or 'times' to show when each spork was signed and last updated (0 while using the default)\n"
         "<value> is a epoch datetime to enable or disable spork"
         + HelpRequiringPassphrase());
 }
@@ -374,3 +409,244 @@ Value verifymessage(const Array& params, bool fHelp)
 
     return (pubkey.GetID() == keyID);
 }
+
+// The addresses passed to the address index calls: one address, an array of
+// them, or an object with an "addresses" array
+static void ParseIndexAddresses(const Value& value, std::vector<std::pair<unsigned char, uint160> >& vAddresses)
+{
+    Array arr;
+    if (value.type() == str_type)
+        arr.push_back(value);
+    else if (value.type() == array_type)
+        arr = value.get_array();
+    else if (value.type() == obj_type && find_value(value.get_obj(), "addresses").type() == array_type)
+        arr = find_value(value.get_obj(), "addresses").get_array();
+    else
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an array of addresses");
+
+    BOOST_FOREACH(const Value& v, arr)
+    {
+        CBitcoinAddress address(v.get_str());
+        CTxDestination dest = address.Get();
+        if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+            vAddresses.push_back(make_pair((unsigned char)ADDRESS_TYPE_PUBKEYHASH, (uint160)*pkeyID));
+        else if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+            vAddresses.push_back(make_pair((unsigned char)ADDRESS_TYPE_SCRIPTHASH, (uint160)*pscriptID));
+        else
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Unpay address");
+    }
+}
+
+static string AddressFromIndex(unsigned char nType, const uint160& hashBytes)
+{
+    if (nType == ADDRESS_TYPE_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+static bool AddressIndexLess(const std::pair<CAddressIndexKey, int64_t>& a, const std::pair<CAddressIndexKey, int64_t>& b)
+{
+    if (a.first.nBlockHeight != b.first.nBlockHeight)
+        return a.first.nBlockHeight < b.first.nBlockHeight;
+    return a.first.nTxIndex < b.first.nTxIndex;
+}
+
+static void ReadAddressIndex(const Value& value, int nStart, int nEnd, std::vector<std::pair<CAddressIndexKey, int64_t> >& vIndex)
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex -reindex");
+
+    std::vector<std::pair<unsigned char, uint160> > vAddresses;
+    ParseIndexAddresses(value, vAddresses);
+
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+        if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, vIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+    if (vAddresses.size() > 1)
+        std::stable_sort(vIndex.begin(), vIndex.end(), AddressIndexLess);
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"|[\"address\",...]\n"
+            "\nReturns the balance of one or more addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"   (string or array, required) The unpay address, or an array of them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\" : x.xxx,   (numeric) The current balance\n"
+            "  \"received\" : x.xxx   (numeric) The total amount received, including change\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"")
+            + HelpExampleRpc("getaddressbalance", "[\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]")
+        );
+
+    std::vector<std::pair<CAddressIndexKey, int64_t> > vIndex;
+    ReadAddressIndex(params[0], 0, 0, vIndex);
+
+    int64_t nBalance = 0;
+    int64_t nReceived = 0;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        nBalance += vIndex[i].second;
+        if (vIndex[i].second > 0)
+            nReceived += vIndex[i].second;
+    }
+
+    Object ret;
+    ret.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    ret.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return ret;
+}
+
+Value getaddressdeltas(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressdeltas \"address\"|[\"address\",...] ( start end )\n"
+            "\nReturns all changes to the balance of one or more addresses, oldest first (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"   (string or array, required) The unpay address, or an array of them\n"
+            "2. start       (numeric, optional) Only include blocks from this height on\n"
+            "3. end         (numeric, optional) Only include blocks up to this height\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"amount\" : x.xxx,        (numeric) The change in balance, negative for spends\n"
+            "    \"txid\" : \"hash\",         (string) The transaction id\n"
+            "    \"index\" : n,             (numeric) The input or output index\n"
+            "    \"blockindex\" : n,        (numeric) The position of the transaction in its block\n"
+            "    \"height\" : n,            (numeric) The block height\n"
+            "    \"address\" : \"address\"    (string) The unpay address\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressdeltas", "\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"")
+            + HelpExampleCli("getaddressdeltas", "\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\" 1000 2000")
+            + HelpExampleRpc("getaddressdeltas", "[\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"], 1000, 2000")
+        );
+
+    int nStart = 0;
+    int nEnd = 0;
+    if (params.size() > 1)
+        nStart = params[1].get_int();
+    if (params.size() > 2)
+        nEnd = params[2].get_int();
+    if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start or end height");
+
+    std::vector<std::pair<CAddressIndexKey, int64_t> > vIndex;
+    ReadAddressIndex(params[0], nStart, nEnd, vIndex);
+
+    Array ret;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        const CAddressIndexKey& key = vIndex[i].first;
+        Object delta;
+        delta.push_back(Pair("amount", ValueFromAmount(vIndex[i].second)));
+        delta.push_back(Pair("txid", key.txhash.GetHex()));
+        delta.push_back(Pair("index", (int)key.nIndex));
+        delta.push_back(Pair("blockindex", (int)key.nTxIndex));
+        delta.push_back(Pair("height", key.nBlockHeight));
+        delta.push_back(Pair("address", AddressFromIndex(key.nType, key.hashBytes)));
+        ret.push_back(delta);
+    }
+    return ret;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\"|[\"address\",...]\n"
+            "\nReturns the unspent outputs of one or more addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"   (string or array, required) The unpay address, or an array of them\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\" : \"address\",   (string) The unpay address\n"
+            "    \"txid\" : \"hash\",         (string) The transaction id\n"
+            "    \"outputIndex\" : n,       (numeric) The output index\n"
+            "    \"script\" : \"hex\",        (string) The script\n"
+            "    \"amount\" : x.xxx,        (numeric) The value of the output\n"
+            "    \"height\" : n             (numeric) The height of the block the output is in\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"")
+            + HelpExampleRpc("getaddressutxos", "[\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]")
+        );
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex -reindex");
+
+    std::vector<std::pair<unsigned char, uint160> > vAddresses;
+    ParseIndexAddresses(params[0], vAddresses);
+
+    Array ret;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        if (!pblocktree->ReadAddressUnspentIndex(vAddresses[i].first, vAddresses[i].second, vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+        string strAddress = AddressFromIndex(vAddresses[i].first, vAddresses[i].second);
+        for (unsigned int j = 0; j < vUnspent.size(); j++)
+        {
+            Object utxo;
+            utxo.push_back(Pair("address", strAddress));
+            utxo.push_back(Pair("txid", vUnspent[j].first.txhash.GetHex()));
+            utxo.push_back(Pair("outputIndex", (int)vUnspent[j].first.nIndex));
+            utxo.push_back(Pair("script", HexStr(vUnspent[j].second.script.begin(), vUnspent[j].second.script.end())));
+            utxo.push_back(Pair("amount", ValueFromAmount(vUnspent[j].second.nSatoshis)));
+            utxo.push_back(Pair("height", vUnspent[j].second.nBlockHeight));
+            ret.push_back(utxo);
+        }
+    }
+    return ret;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo \"txid\" index\n"
+            "\nReturns the transaction input that spends an output (requires -spentindex).\n"
+            "\nArguments:\n"
+            "1. \"txid\"      (string, required) The transaction id of the output\n"
+            "2. index       (numeric, required) The output index\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\" : \"hash\",   (string) The id of the spending transaction\n"
+            "  \"index\" : n,       (numeric) The input index in the spending transaction\n"
+            "  \"height\" : n       (numeric) The height of the block the spending transaction is in\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getspentinfo", "\"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\" 0")
+            + HelpExampleRpc("getspentinfo", "\"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", 0")
+        );
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled, restart with -spentindex -reindex");
+
+    uint256 txid = ParseHashV(params[0], "txid");
+    int nIndex = params[1].get_int();
+    if (nIndex < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output index");
+
+    CSpentIndexValue value;
+    if (!pblocktree->ReadSpentIndex(CSpentIndexKey(txid, nIndex), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object ret;
+    ret.push_back(Pair("txid", value.txid.GetHex()));
+    ret.push_back(Pair("index", (int)value.nInputIndex));
+    ret.push_back(Pair("height", value.nBlockHeight));
+    return ret;
+}
@@ -335,6 +335,50 @@ Value getnettotals(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getrelayinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getrelayinfo\n"
+            "\nReturns inventory relay latency by relay class, from queueing inventory for a peer\n"
+            "until it is announced. Classes are announced in the order listed.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"class\" : \"class\",    (string) instantx, block, masternode or tx\n"
+            "    \"announced\" : n,        (numeric) inventory announced to peers since startup\n"
+            "    \"avgms\" : n,            (numeric) average latency in milliseconds\n"
+            "    \"maxms\" : n,            (numeric) highest latency in milliseconds\n"
+            "    \"histogram\" : [n,...]   (array) announcements below 1, 2, 4, ... milliseconds,\n"
+            "                              the last entry also counts everything slower\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrelayinfo", "")
+            + HelpExampleRpc("getrelayinfo", "")
+        );
+
+    Array ret;
+    for (int nClass = 0; nClass < RELAY_CLASSES; nClass++)
+    {
+        CRelayLatency latency = CNode::GetRelayLatency(nClass);
+
+        Array histogram;
+        for (int i = 0; i < CRelayLatency::BUCKETS; i++)
+            histogram.push_back((uint64_t)latency.vCount[i]);
+
+        Object obj;
+        obj.push_back(Pair("class",     GetRelayClassName(nClass)));
+        obj.push_back(Pair("announced", (uint64_t)latency.nCount));
+        obj.push_back(Pair("avgms",     latency.nCount ? latency.nTotalMicros / (int64_t)latency.nCount / 1000 : 0));
+        obj.push_back(Pair("maxms",     latency.nMaxMicros / 1000));
+        obj.push_back(Pair("histogram", histogram));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 Value getnetworkinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
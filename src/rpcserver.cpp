@@ -7,8 +7,10 @@
 #include "rpcserver.h"
 
 #include "base58.h"
+#include "boundedqueue.h"
 #include "init.h"
 #include "main.h"
+#include "rpcjson.h"
 #include "ui_interface.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
@@ -23,6 +25,7 @@
 #include <boost/foreach.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
 #include "json/json_spirit_writer_template.h"
 
@@ -41,6 +44,64 @@ static boost::thread_group* rpc_worker_group = NULL;
 static boost::asio::io_service::work *rpc_dummy_work = NULL;
 static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
 
+struct RPCWorkItem;
+// Requests read off the connections wait here for one of the rpc_exec_group workers
+static CBoundedQueue< boost::shared_ptr<RPCWorkItem> >* rpc_work_queue = NULL;
+static boost::thread_group* rpc_exec_group = NULL;
+
+// Longest request line and headers a connection may send
+static const size_t MAX_HTTP_HEADERS_SIZE = 65536;
+
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    uint64_t nErrors;
+    // calls refused because of the concurrency limit
+    uint64_t nRejected;
+    int nInFlight;
+    int nMaxInFlight;
+    int64_t nExecMicrosTotal;
+    int64_t nExecMicrosMax;
+    // time spent in rpc_work_queue before a worker picked the request up
+    uint64_t nWaits;
+    int64_t nWaitMicrosTotal;
+    int64_t nWaitMicrosMax;
+    // calls run under cs_main by CRPCTable::execute, with the time spent
+    // waiting for and holding it
+    uint64_t nLocked;
+    int64_t nLockWaitMicrosTotal;
+    int64_t nLockWaitMicrosMax;
+    int64_t nLockHeldMicrosTotal;
+    int64_t nLockHeldMicrosMax;
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nRejected(0), nInFlight(0), nMaxInFlight(0),
+                        nExecMicrosTotal(0), nExecMicrosMax(0), nWaits(0), nWaitMicrosTotal(0), nWaitMicrosMax(0),
+                        nLocked(0), nLockWaitMicrosTotal(0), nLockWaitMicrosMax(0), nLockHeldMicrosTotal(0), nLockHeldMicrosMax(0) {}
+};
+
+static CCriticalSection cs_rpcstats;
+static map<string, CRPCMethodStats> mapRPCStats;
+static uint64_t nRPCQueueRejected = 0;
+static size_t nRPCQueuePeak = 0;
+
+// Calls of one method allowed to run at the same time, 0 for no limit
+static int nRPCMethodLimit = 0;
+// Threads a batch may use to run its thread safe calls side by side
+static int nRPCBatchThreads = 1;
+// Open connections and the most allowed at once
+static int nRPCConnections = 0;
+static int nRPCMaxConnections = 1;
+// Seconds a connection may sit waiting for (the rest of) a request
+static int nRPCIdleTimeout = 30;
+
+// Failed authentication attempts are answered one after the other, this far
+// apart, however many connections they come in on ...
+static const int64_t RPC_AUTH_FAIL_DELAY_MILLIS = 250;
+// ... and dropped without an answer once this many are waiting
+static const int RPC_AUTH_FAIL_MAX_PENDING = 40;
+static CCriticalSection cs_rpcauthfail;
+static int64_t nRPCNextAuthFailReply = 0;
+
 void RPCTypeCheck(const Array& params,
                   const list<Value_type>& typesExpected,
                   bool fAllowNull)
@@ -214,6 +275,86 @@ Value stop(const Array& params, bool fHelp)
     return "Unpay server stopping";
 }
 
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns an object with statistics about the RPC server and the methods called.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"workers\" : n,           (numeric) threads executing requests\n"
+            "  \"queue\" : n,             (numeric) requests waiting for a worker\n"
+            "  \"queuemax\" : n,          (numeric) requests allowed to wait before new ones are refused\n"
+            "  \"queuepeak\" : n,         (numeric) most requests seen waiting at once\n"
+            "  \"queuerejected\" : n,     (numeric) requests refused because the queue was full\n"
+            "  \"methodlimit\" : n,       (numeric) calls of one method allowed at the same time, 0 for no limit\n"
+            "  \"connections\" : n,       (numeric) open connections\n"
+            "  \"maxconnections\" : n,    (numeric) connections allowed at once before new ones are refused\n"
+            "  \"methods\" : [\n"
+            "    {\n"
+            "      \"name\" : \"name\",     (string) the method name\n"
+            "      \"calls\" : n,         (numeric) completed calls\n"
+            "      \"errors\" : n,        (numeric) completed calls that failed\n"
+            "      \"rejected\" : n,      (numeric) calls refused because of the method limit\n"
+            "      \"inflight\" : n,      (numeric) calls running right now\n"
+            "      \"maxinflight\" : n,   (numeric) most calls seen running at once\n"
+            "      \"avgexecus\" : n,     (numeric) average execution time in microseconds\n"
+            "      \"maxexecus\" : n,     (numeric) longest execution time in microseconds\n"
+            "      \"avgwaitus\" : n,     (numeric) average time waiting for a worker in microseconds\n"
+            "      \"maxwaitus\" : n,     (numeric) longest time waiting for a worker in microseconds\n"
+            "      \"locked\" : n,        (numeric) calls run with cs_main held for the whole call\n"
+            "      \"avglockwaitus\" : n, (numeric) average time waiting for cs_main in microseconds\n"
+            "      \"maxlockwaitus\" : n, (numeric) longest time waiting for cs_main in microseconds\n"
+            "      \"avglockus\" : n,     (numeric) average time cs_main was held in microseconds\n"
+            "      \"maxlockus\" : n      (numeric) longest time cs_main was held in microseconds\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcinfo", "")
+            + HelpExampleRpc("getrpcinfo", "")
+        );
+
+    Object obj;
+    obj.push_back(Pair("workers",       rpc_exec_group ? (int)rpc_exec_group->size() : 0));
+    obj.push_back(Pair("queue",         rpc_work_queue ? (int)rpc_work_queue->Size() : 0));
+    obj.push_back(Pair("queuemax",      rpc_work_queue ? (int)rpc_work_queue->MaxSize() : 0));
+
+    LOCK(cs_rpcstats);
+    obj.push_back(Pair("queuepeak",     (uint64_t)nRPCQueuePeak));
+    obj.push_back(Pair("queuerejected", nRPCQueueRejected));
+    obj.push_back(Pair("methodlimit",   nRPCMethodLimit));
+    obj.push_back(Pair("connections",   nRPCConnections));
+    obj.push_back(Pair("maxconnections", nRPCMaxConnections));
+
+    Array methods;
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapRPCStats)
+    {
+        const CRPCMethodStats& stats = item.second;
+        Object method;
+        method.push_back(Pair("name",          item.first));
+        method.push_back(Pair("calls",         stats.nCalls));
+        method.push_back(Pair("errors",        stats.nErrors));
+        method.push_back(Pair("rejected",      stats.nRejected));
+        method.push_back(Pair("inflight",      stats.nInFlight));
+        method.push_back(Pair("maxinflight",   stats.nMaxInFlight));
+        method.push_back(Pair("avgexecus",     stats.nCalls ? stats.nExecMicrosTotal / (int64_t)stats.nCalls : 0));
+        method.push_back(Pair("maxexecus",     stats.nExecMicrosMax));
+        method.push_back(Pair("avgwaitus",     stats.nWaits ? stats.nWaitMicrosTotal / (int64_t)stats.nWaits : 0));
+        method.push_back(Pair("maxwaitus",     stats.nWaitMicrosMax));
+        method.push_back(Pair("locked",        stats.nLocked));
+        method.push_back(Pair("avglockwaitus", stats.nLocked ? stats.nLockWaitMicrosTotal / (int64_t)stats.nLocked : 0));
+        method.push_back(Pair("maxlockwaitus", stats.nLockWaitMicrosMax));
+        method.push_back(Pair("avglockus",     stats.nLocked ? stats.nLockHeldMicrosTotal / (int64_t)stats.nLocked : 0));
+        method.push_back(Pair("maxlockus",     stats.nLockHeldMicrosMax));
+        methods.push_back(method);
+    }
+    obj.push_back(Pair("methods", methods));
+    return obj;
+}
+
 
 
 //
@@ -225,28 +366,30 @@ static const CRPCCommand vRPCCommands[] =
 { //  name                      actor (function)         okSafeMode threadSafe reqWallet
   //  ------------------------  -----------------------  ---------- ---------- ---------
     /* Overall control/query calls */
-    { "getinfo",                &getinfo,                true,      false,      false }, /* uses wallet if enabled */
+    { "getinfo",                &getinfo,                true,      true,       false }, /* uses wallet if enabled */
     { "help",                   &help,                   true,      true,       false },
     { "stop",                   &stop,                   true,      true,       false },
+    { "getrpcinfo",             &getrpcinfo,             true,      true,       false },
 
     /* P2P networking */
     { "getnetworkinfo",         &getnetworkinfo,         true,      false,      false },
     { "addnode",                &addnode,                true,      true,       false },
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
-    { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
+    { "getconnectioncount",     &getconnectioncount,     true,      true,       false },
     { "getnettotals",           &getnettotals,           true,      true,       false },
+    { "getrelayinfo",           &getrelayinfo,           true,      true,       false },
     { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
     { "ping",                   &ping,                   true,      false,      false },
 
     /* Block chain and UTXO */
-    { "getblockchaininfo",      &getblockchaininfo,      true,      false,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
-    { "getblockcount",          &getblockcount,          true,      false,      false },
+    { "getblockchaininfo",      &getblockchaininfo,      true,      true,       false },
+    { "getbestblockhash",       &getbestblockhash,       true,      true,       false },
+    { "getblockcount",          &getblockcount,          true,      true,       false },
     { "getblock",               &getblock,               false,     false,      false },
     { "getblockheader",         &getblockheader,         false,     false,      false },
     { "getblockhash",           &getblockhash,           false,     false,      false },
-    { "getdifficulty",          &getdifficulty,          true,      false,      false },
-    { "getrawmempool",          &getrawmempool,          true,      false,      false },
+    { "getdifficulty",          &getdifficulty,          true,      true,       false },
+    { "getrawmempool",          &getrawmempool,          true,      true,       false },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
     { "verifychain",            &verifychain,            true,      false,      false },
@@ -270,10 +413,18 @@ static const CRPCCommand vRPCCommands[] =
     { "validateaddress",        &validateaddress,        true,      false,      false }, /* uses wallet if enabled */
     { "verifymessage",          &verifymessage,          false,     false,      false },
 
+    /* Address index */
+    { "getaddressbalance",      &getaddressbalance,      true,      false,      false },
+    { "getaddressdeltas",       &getaddressdeltas,       true,      false,      false },
+    { "getaddressutxos",        &getaddressutxos,        true,      false,      false },
+    { "getspentinfo",           &getspentinfo,           true,      false,      false },
+
     /* Unpay features */
     { "spork",                  &spork,                  true,      false,      false },
-    { "masternode",             &masternode,             true,      false,      true  },
-    { "masternodelist",         &masternodelist,         true,      false,      false },
+    { "masternode",             &masternode,             true,      true,       true  },
+    { "masternodelist",         &masternodelist,         true,      true,       false },
+    { "getschedulerinfo",       &getschedulerinfo,       true,      true,       false },
+    { "getinstantxinfo",        &getinstantxinfo,        true,      true,       false },
 #ifdef ENABLE_WALLET
     { "darksend",               &darksend,               false,     false,      true  },
 
@@ -294,8 +445,8 @@ static const CRPCCommand vRPCCommands[] =
     { "gettransaction",         &gettransaction,         false,     false,      true },
     { "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
     { "getwalletinfo",          &getwalletinfo,          true,      false,      true },
-    { "importprivkey",          &importprivkey,          false,     false,      true },
-    { "importwallet",           &importwallet,           false,     false,      true },
+    { "importprivkey",          &importprivkey,          false,     true,       true },
+    { "importwallet",           &importwallet,           false,     true,       true },
     { "keepass",                &keepass,                false,     false,      true },
     { "keypoolrefill",          &keypoolrefill,          true,      false,      true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
@@ -358,15 +509,15 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+static void ErrorReply(const Object& objError, const Value& id, string& strHeader, string& strBody)
 {
     // Send error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
-    string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    strBody = JSONRPCReply(Value::null, objError, id);
+    strHeader = HTTPReplyHeader(nStatus, strBody.size(), false);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -392,33 +543,129 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
+// A complete HTTP request taken off a connection's read buffer
+struct HTTPRequest
+{
+    int nProto;
+    string strMethod;
+    string strURI;
+    map<string, string> mapHeaders;
+    string strBody;
+};
+
+// Take the first complete request off the front of strBuffer. Returns 1 if
+// one was read, 0 if more data is needed and -1 if the request is malformed.
+static int ReadHTTPRequest(string& strBuffer, HTTPRequest& req)
+{
+    // skip blank lines some clients leave after a body
+    size_t nStart = strBuffer.find_first_not_of("\r\n");
+    if (nStart == string::npos) {
+        strBuffer.clear();
+        return 0;
+    }
+    strBuffer.erase(0, nStart);
+
+    size_t nHeaderEnd = strBuffer.find("\n\r\n");
+    size_t nSeparator = 3;
+    size_t nHeaderEndLF = strBuffer.find("\n\n");
+    if (nHeaderEndLF != string::npos && (nHeaderEnd == string::npos || nHeaderEndLF < nHeaderEnd)) {
+        nHeaderEnd = nHeaderEndLF;
+        nSeparator = 2;
+    }
+    if (nHeaderEnd == string::npos)
+        return strBuffer.size() > MAX_HTTP_HEADERS_SIZE ? -1 : 0;
+    if (nHeaderEnd > MAX_HTTP_HEADERS_SIZE)
+        return -1;
+
+    // the request line and headers are parsed the same way as before
+    const size_t nBodyStart = nHeaderEnd + nSeparator;
+    std::istringstream stream(strBuffer.substr(0, nBodyStart));
+    req.mapHeaders.clear();
+    if (!ReadHTTPRequestLine(stream, req.nProto, req.strMethod, req.strURI))
+        return -1;
+    int nLen = ReadHTTPHeaders(stream, req.mapHeaders);
+    if (nLen < 0 || nLen > (int)MAX_SIZE)
+        return -1;
+    if (strBuffer.size() < nBodyStart + nLen)
+        return 0;
+
+    req.strBody.assign(strBuffer, nBodyStart, nLen);
+    strBuffer.erase(0, nBodyStart + nLen);
+
+    string& strConnection = req.mapHeaders["connection"];
+    if (strConnection != "close" && strConnection != "keep-alive")
+        strConnection = req.nProto >= 1 ? "keep-alive" : "close";
+    return 1;
+}
+
 class AcceptedConnection
 {
 public:
     virtual ~AcceptedConnection() {}
 
-    virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
+
+    // Send the reply to the request being serviced, nDelayMillis from now.
+    // strHeader and strBody are taken over. Afterwards the next request is
+    // read, or the connection is closed if fKeepAlive is false. May be
+    // called from any thread.
+    virtual void reply(std::string& strHeader, std::string& strBody, bool fKeepAlive, int nDelayMillis) = 0;
+
+    // Close the connection without a reply, only on the connection's strand
     virtual void close() = 0;
 };
 
+struct RPCBatchRun;
+
+// A request waiting in rpc_work_queue for a worker, or a worker asked to
+// help with the calls of a batch another worker is running
+struct RPCWorkItem
+{
+    boost::shared_ptr<AcceptedConnection> conn;
+    string strRequest;
+    bool fKeepAlive;
+    int64_t nQueuedMicros;
+    boost::shared_ptr<RPCBatchRun> batch;
+
+    RPCWorkItem() : fKeepAlive(false), nQueuedMicros(0) {}
+};
+
+static void RPCDispatchRequest(boost::shared_ptr<AcceptedConnection> conn, HTTPRequest& req);
+static void ThreadRPCWorker();
+
+/**
+ * An RPC connection serviced by asynchronous reads and writes on the
+ * io_service threads, so idle keep-alive connections don't hold on to a
+ * thread. All handlers of one connection run on its strand. Requests are
+ * handed to the RPC workers one at a time and pipelined requests wait in
+ * the read buffer, so replies go out in request order. A connection that
+ * waits longer than -rpcidletimeout for a request is closed.
+ */
 template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class AcceptedConnectionImpl : public AcceptedConnection,
+                               public boost::enable_shared_from_this< AcceptedConnectionImpl<Protocol> >
 {
 public:
     AcceptedConnectionImpl(
             asio::io_service& io_service,
             ssl::context &context,
-            bool fUseSSL) :
+            bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+        strand(io_service),
+        timer(io_service),
+        idleTimer(io_service),
+        fUseSSL(fUseSSLIn),
+        fCounted(false),
+        fKeepAlive(false)
     {
     }
 
-    virtual std::iostream& stream()
+    ~AcceptedConnectionImpl()
     {
-        return _stream;
+        if (fCounted) {
+            LOCK(cs_rpcstats);
+            nRPCConnections--;
+        }
     }
 
     virtual std::string peer_address_to_string() const
@@ -426,27 +673,175 @@ public:
         return peer.address().to_string();
     }
 
-    virtual void close()
+    // Start servicing the connection once it has been accepted. Returns
+    // false if -rpcmaxconnections are already open.
+    bool start()
     {
-        _stream.close();
+        {
+            LOCK(cs_rpcstats);
+            if (nRPCConnections >= nRPCMaxConnections)
+                return false;
+            nRPCConnections++;
+            fCounted = true;
+        }
+        if (fUseSSL) {
+            wait_idle();
+            sslStream.async_handshake(ssl::stream_base::server,
+                strand.wrap(boost::bind(&AcceptedConnectionImpl::handle_handshake, this->shared_from_this(),
+                    asio::placeholders::error)));
+        }
+        else
+            read_some();
+        return true;
+    }
+
+    virtual void reply(std::string& strHeader, std::string& strBody, bool fKeepAliveIn, int nDelayMillis)
+    {
+        boost::shared_ptr<string> pHeader(new string());
+        boost::shared_ptr<string> pBody(new string());
+        pHeader->swap(strHeader);
+        pBody->swap(strBody);
+        strand.post(boost::bind(&AcceptedConnectionImpl::send, this->shared_from_this(),
+            pHeader, pBody, fKeepAliveIn, nDelayMillis));
+    }
+
+    void close()
+    {
+        boost::system::error_code ec;
+        idleTimer.cancel(ec);
+        sslStream.lowest_layer().close(ec);
     }
 
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
-};
+    asio::io_service::strand strand;
+    deadline_timer timer;
+    deadline_timer idleTimer;
+    bool fUseSSL;
+    // Whether the connection is counted in nRPCConnections
+    bool fCounted;
+
+    // Received data not yet taken off as requests
+    string strBuffer;
+    char pchRead[8192];
+
+    // The reply being written
+    string strReplyHeader;
+    string strReplyBody;
+    bool fKeepAlive;
+
+    // Close the connection if nothing arrives within nRPCIdleTimeout seconds
+    void wait_idle()
+    {
+        idleTimer.expires_from_now(posix_time::seconds(nRPCIdleTimeout));
+        idleTimer.async_wait(strand.wrap(boost::bind(&AcceptedConnectionImpl::handle_idle, this->shared_from_this(),
+            asio::placeholders::error)));
+    }
+
+    void handle_idle(const boost::system::error_code& error)
+    {
+        // a wait that was cancelled or re-armed in the meantime is not a timeout
+        if (error == asio::error::operation_aborted || idleTimer.expires_at() > deadline_timer::traits_type::now())
+            return;
+        LogPrint("rpc", "ThreadRPCServer closing idle connection from %s\n", peer_address_to_string());
+        close();
+    }
+
+    void handle_handshake(const boost::system::error_code& error)
+    {
+        if (error)
+            close();
+        else
+            read_some();
+    }
+
+    void read_some()
+    {
+        wait_idle();
+        if (fUseSSL)
+            sslStream.async_read_some(asio::buffer(pchRead),
+                strand.wrap(boost::bind(&AcceptedConnectionImpl::handle_read, this->shared_from_this(),
+                    asio::placeholders::error, asio::placeholders::bytes_transferred)));
+        else
+            sslStream.next_layer().async_read_some(asio::buffer(pchRead),
+                strand.wrap(boost::bind(&AcceptedConnectionImpl::handle_read, this->shared_from_this(),
+                    asio::placeholders::error, asio::placeholders::bytes_transferred)));
+    }
 
-void ServiceConnection(AcceptedConnection *conn);
+    void handle_read(const boost::system::error_code& error, size_t nBytes)
+    {
+        boost::system::error_code ec;
+        idleTimer.cancel(ec);
+        if (error) {
+            close();
+            return;
+        }
+        strBuffer.append(pchRead, nBytes);
+        process();
+    }
+
+    // Hand the next buffered request to the workers, or read more of it
+    void process()
+    {
+        HTTPRequest req;
+        int nRet = ReadHTTPRequest(strBuffer, req);
+        if (nRet > 0)
+            RPCDispatchRequest(this->shared_from_this(), req);
+        else if (nRet == 0)
+            read_some();
+        else
+            close();
+    }
+
+    void send(boost::shared_ptr<string> pHeader, boost::shared_ptr<string> pBody, bool fKeepAliveIn, int nDelayMillis)
+    {
+        strReplyHeader.swap(*pHeader);
+        strReplyBody.swap(*pBody);
+        fKeepAlive = fKeepAliveIn;
+        if (nDelayMillis > 0) {
+            timer.expires_from_now(posix_time::milliseconds(nDelayMillis));
+            timer.async_wait(strand.wrap(boost::bind(&AcceptedConnectionImpl::write_reply, this->shared_from_this())));
+        } else {
+            write_reply();
+        }
+    }
+
+    void write_reply()
+    {
+        // header and body go out in one write without being joined first
+        vector<asio::const_buffer> vBuffers;
+        vBuffers.push_back(asio::buffer(strReplyHeader));
+        vBuffers.push_back(asio::buffer(strReplyBody));
+        if (fUseSSL)
+            asio::async_write(sslStream, vBuffers,
+                strand.wrap(boost::bind(&AcceptedConnectionImpl::handle_write, this->shared_from_this(),
+                    asio::placeholders::error)));
+        else
+            asio::async_write(sslStream.next_layer(), vBuffers,
+                strand.wrap(boost::bind(&AcceptedConnectionImpl::handle_write, this->shared_from_this(),
+                    asio::placeholders::error)));
+    }
+
+    void handle_write(const boost::system::error_code& error)
+    {
+        string().swap(strReplyHeader);
+        string().swap(strReplyBody);
+        if (error || !fKeepAlive || ShutdownRequested()) {
+            close();
+            return;
+        }
+        process();
+    }
+};
 
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error);
 
 /**
@@ -479,33 +874,40 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
-
     if (error)
     {
         // TODO: Actually handle errors
         LogPrintf("%s: Error: %s\n", __func__, error.message());
     }
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before servicing the connection, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    else if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-        if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        conn->close();
+        if (!fUseSSL) {
+            string strHeader = HTTPReply(HTTP_FORBIDDEN, "", false), strBody;
+            conn->reply(strHeader, strBody, false, 0);
+        } else {
+            conn->close();
+        }
     }
-    else {
-        ServiceConnection(conn.get());
-        conn->close();
+    else if (!conn->start())
+    {
+        LogPrint("rpc", "ThreadRPCServer too many connections, refusing %s\n", conn->peer.address().to_string());
+        if (!fUseSSL) {
+            string strHeader = HTTPReply(HTTP_SERVICE_UNAVAILABLE, "", false), strBody;
+            conn->reply(strHeader, strBody, false, 0);
+        } else {
+            conn->close();
+        }
     }
 }
 
@@ -624,8 +1026,20 @@ void StartRPCThreads()
         return;
     }
 
+    // The workers execute the requests; the io_service threads only move
+    // bytes, so one or two of them are enough for any number of connections.
+    int nWorkers = max((int)GetArg("-rpcthreads", 4), 1);
+    nRPCMethodLimit = max((int)GetArg("-rpcmethodlimit", 0), 0);
+    nRPCBatchThreads = nRPCMethodLimit > 0 ? min(nRPCMethodLimit, nWorkers) : nWorkers;
+    nRPCMaxConnections = max((int)GetArg("-rpcmaxconnections", 64), 1);
+    nRPCIdleTimeout = max((int)GetArg("-rpcidletimeout", 30), 1);
+    rpc_work_queue = new CBoundedQueue< boost::shared_ptr<RPCWorkItem> >(max((int)GetArg("-rpcworkqueue", 16), 1));
+    rpc_exec_group = new boost::thread_group();
+    for (int i = 0; i < nWorkers; i++)
+        rpc_exec_group->create_thread(&ThreadRPCWorker);
+
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
+    for (int i = 0; i < min(nWorkers, 2); i++)
         rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
 }
 
@@ -665,11 +1079,23 @@ void StopRPCThreads()
     }
     deadlineTimers.clear();
 
+    // Stop the io_service threads first, so nothing dispatches into the
+    // work queue any more
     rpc_io_service->stop();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
+
+    // Then let the workers finish what they are running; queued requests
+    // are dropped. Replies they post are destroyed with the io_service.
+    if (rpc_work_queue != NULL)
+        rpc_work_queue->Abort();
+    if (rpc_exec_group != NULL)
+        rpc_exec_group->join_all();
+    delete rpc_exec_group; rpc_exec_group = NULL;
+    delete rpc_work_queue; rpc_work_queue = NULL;
+
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 }
@@ -734,95 +1160,255 @@ void JSONRequest::parse(const Value& valRequest)
         throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
 }
 
-
-static Object JSONRPCExecOne(const Value& req)
+// Account the time a request spent in the work queue to the method it calls
+static void RecordRPCQueueWait(const string& strMethod, int64_t nWaitMicros)
 {
-    Object rpc_result;
+    if (nWaitMicros < 0 || !tableRPC[strMethod])
+        return;
+    LOCK(cs_rpcstats);
+    CRPCMethodStats& stats = mapRPCStats[strMethod];
+    stats.nWaits++;
+    stats.nWaitMicrosTotal += nWaitMicros;
+    stats.nWaitMicrosMax = max(stats.nWaitMicrosMax, nWaitMicros);
+}
 
+static void JSONRPCExecOne(const Value& req, string& strReply, int64_t nWaitMicros)
+{
     JSONRequest jreq;
     try {
         jreq.parse(req);
+        RecordRPCQueueWait(jreq.strMethod, nWaitMicros);
 
         Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        WriteJSONRPCReply(result, Value::null, jreq.id, strReply);
     }
     catch (Object& objError)
     {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
+        WriteJSONRPCReply(Value::null, objError, jreq.id, strReply);
     }
     catch (std::exception& e)
     {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        WriteJSONRPCReply(Value::null, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, strReply);
     }
+}
 
-    return rpc_result;
+// Whether req calls a thread safe command, which can run alongside other
+// thread safe calls of the same batch
+static bool IsThreadSafeRequest(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->threadSafe;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+// A run of thread safe calls of a batch. The worker running the batch
+// works through them itself and queues helpers so that idle rpc_exec_group
+// workers can join in; nobody ever waits for a call no one has picked up.
+struct RPCBatchRun
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    const Array* pvReq;
+    vector<string>* pvReplies;
+    int64_t nWaitMicros;
+
+    boost::mutex mutex;
+    boost::condition_variable condDone;
+    // next call to hand out, end of the run and calls being executed
+    size_t nNext;
+    size_t nEnd;
+    int nRunning;
+
+    RPCBatchRun(const Array& vReq, vector<string>& vReplies, size_t nBegin, size_t nEndIn, int64_t nWaitMicrosIn) :
+        pvReq(&vReq), pvReplies(&vReplies), nWaitMicros(nWaitMicrosIn), nNext(nBegin), nEnd(nEndIn), nRunning(0) {}
+};
 
-    return write_string(Value(ret), false) + "\n";
+// Execute calls of the run until none are left to hand out. Helpers that
+// get here after the run is over return without touching the batch.
+static void RPCBatchRunCalls(RPCBatchRun& run)
+{
+    while (true)
+    {
+        size_t nReq;
+        {
+            boost::unique_lock<boost::mutex> lock(run.mutex);
+            if (run.nNext >= run.nEnd)
+                return;
+            nReq = run.nNext++;
+            run.nRunning++;
+        }
+        JSONRPCExecOne((*run.pvReq)[nReq], (*run.pvReplies)[nReq], run.nWaitMicros);
+        {
+            boost::unique_lock<boost::mutex> lock(run.mutex);
+            if (--run.nRunning == 0 && run.nNext >= run.nEnd)
+                run.condDone.notify_all();
+        }
+    }
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+static string JSONRPCExecBatch(const Array& vReq, int64_t nWaitMicros)
 {
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
+    vector<string> vReplies(vReq.size());
+    size_t nReq = 0;
+    while (nReq < vReq.size())
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+        // Runs of thread safe calls are spread over up to nRPCBatchThreads
+        // workers; any other call is a barrier and runs on its own, in order.
+        size_t nEnd = nReq;
+        while (nEnd < vReq.size() && IsThreadSafeRequest(vReq[nEnd]))
+            nEnd++;
+        size_t nThreads = min(nEnd - nReq, (size_t)max(nRPCBatchThreads, 1));
+        if (nThreads > 1)
+        {
+            boost::shared_ptr<RPCBatchRun> run(new RPCBatchRun(vReq, vReplies, nReq, nEnd, nWaitMicros));
+            for (size_t i = 1; i < nThreads; i++)
+            {
+                // helpers only take free room in the queue, requests come first
+                boost::shared_ptr<RPCWorkItem> helper(new RPCWorkItem());
+                helper->batch = run;
+                if (!rpc_work_queue->TryPush(helper))
+                    break;
+            }
+            RPCBatchRunCalls(*run);
+            {
+                boost::unique_lock<boost::mutex> lock(run->mutex);
+                while (run->nRunning > 0)
+                    run->condDone.wait(lock);
+            }
+            nReq = nEnd;
+        }
+        else
+        {
+            JSONRPCExecOne(vReq[nReq], vReplies[nReq], nWaitMicros);
+            nReq++;
+        }
+    }
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+    size_t nSize = 3;
+    BOOST_FOREACH(const string& strReply, vReplies)
+        nSize += strReply.size() + 1;
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+    string strReply;
+    strReply.reserve(nSize);
+    strReply += '[';
+    for (unsigned int reqIdx = 0; reqIdx < vReplies.size(); reqIdx++)
+    {
+        if (reqIdx > 0)
+            strReply += ',';
+        strReply += vReplies[reqIdx];
+    }
+    strReply += "]\n";
+    return strReply;
+}
 
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
+// Milliseconds to hold back the answer to a failed authentication attempt,
+// or -1 if too many are waiting already
+static int GetAuthFailDelay()
+{
+    LOCK(cs_rpcauthfail);
+    int64_t nNow = GetTimeMillis();
+    int64_t nReply = std::max(nNow, nRPCNextAuthFailReply) + RPC_AUTH_FAIL_DELAY_MILLIS;
+    if (nReply - nNow > RPC_AUTH_FAIL_MAX_PENDING * RPC_AUTH_FAIL_DELAY_MILLIS)
+        return -1;
+    nRPCNextAuthFailReply = nReply;
+    return nReply - nNow;
+}
+
+// Called on the connection's strand for every complete request read
+static void RPCDispatchRequest(boost::shared_ptr<AcceptedConnection> conn, HTTPRequest& req)
+{
+    string strHeader, strBody;
+
+    if (req.strURI != "/") {
+        strHeader = HTTPReply(HTTP_NOT_FOUND, "", false);
+        conn->reply(strHeader, strBody, false, 0);
+        return;
+    }
+
+    // Check authorization
+    if (req.mapHeaders.count("authorization") == 0)
+    {
+        strHeader = HTTPReply(HTTP_UNAUTHORIZED, "", false);
+        conn->reply(strHeader, strBody, false, 0);
+        return;
+    }
+    if (!HTTPAuthorized(req.mapHeaders))
+    {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
+        /* Deter brute-forcing short passwords.
+           If this results in a DoS the user really
+           shouldn't have their RPC port exposed.
+           The reply is delayed on a timer, without holding up a thread,
+           and the delays of all connections add up, so opening more
+           connections doesn't buy more guesses. */
+        int nDelayMillis = 0;
+        if (mapArgs["-rpcpassword"].size() < 20)
+            nDelayMillis = GetAuthFailDelay();
+        if (nDelayMillis < 0) {
+            conn->close();
+            return;
         }
+        strHeader = HTTPReply(HTTP_UNAUTHORIZED, "", false);
+        conn->reply(strHeader, strBody, false, nDelayMillis);
+        return;
+    }
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+    boost::shared_ptr<RPCWorkItem> item(new RPCWorkItem());
+    item->conn = conn;
+    item->strRequest.swap(req.strBody);
+    item->fKeepAlive = req.mapHeaders["connection"] != "close";
+    item->nQueuedMicros = GetTimeMicros();
+    if (!rpc_work_queue->TryPush(item))
+    {
+        // Refuse straight away rather than let requests pile up behind a busy server
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            LOCK(cs_rpcstats);
+            nRPCQueueRejected++;
         }
-        if (!HTTPAuthorized(mapHeaders))
+        LogPrint("rpc", "ThreadRPCServer work queue depth exceeded, refusing request from %s\n", conn->peer_address_to_string());
+        strBody = JSONRPCReply(Value::null, JSONRPCError(RPC_MISC_ERROR, "Work queue depth exceeded"), Value::null);
+        strHeader = HTTPReplyHeader(HTTP_SERVICE_UNAVAILABLE, strBody.size(), item->fKeepAlive);
+        conn->reply(strHeader, strBody, item->fKeepAlive, 0);
+        return;
+    }
+
+    size_t nDepth = rpc_work_queue->Size();
+    LOCK(cs_rpcstats);
+    nRPCQueuePeak = max(nRPCQueuePeak, nDepth);
+}
+
+static void ThreadRPCWorker()
+{
+    RenameThread("unpay-rpcworker");
+
+    boost::shared_ptr<RPCWorkItem> item;
+    while (rpc_work_queue->Pop(item))
+    {
+        if (item->batch)
         {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-            /* Deter brute-forcing short passwords.
-               If this results in a DoS the user really
-               shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            RPCBatchRunCalls(*item->batch);
+            item.reset();
+            continue;
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+
+        int64_t nWaitMicros = GetTimeMicros() - item->nQueuedMicros;
+        bool fKeepAlive = item->fKeepAlive;
+        string strHeader, strReply;
 
         JSONRequest jreq;
         try
         {
             // Parse request
             Value valRequest;
-            if (!read_string(strRequest, valRequest))
+            if (!ReadJSON(item->strRequest, valRequest))
                 throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-            string strReply;
-
             // singleton request
             if (valRequest.type() == obj_type) {
                 jreq.parse(valRequest);
+                RecordRPCQueueWait(jreq.strMethod, nWaitMicros);
 
                 Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
@@ -831,25 +1417,107 @@ void ServiceConnection(AcceptedConnection *conn)
 
             // array of requests
             } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
+                strReply = JSONRPCExecBatch(valRequest.get_array(), nWaitMicros);
             else
                 throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+            strHeader = HTTPReplyHeader(HTTP_OK, strReply.size(), fKeepAlive);
         }
         catch (Object& objError)
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            ErrorReply(objError, jreq.id, strHeader, strReply);
+            fKeepAlive = false;
         }
         catch (std::exception& e)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, strHeader, strReply);
+            fKeepAlive = false;
         }
+
+        item->conn->reply(strHeader, strReply, fKeepAlive, 0);
+        item.reset();
     }
 }
 
+/** Counts a call as in flight for as long as it exists and records its
+  * duration in the method's statistics. Throws if the method is already at
+  * its concurrency limit. */
+class CRPCCallRecorder
+{
+private:
+    const string& strMethod;
+    int64_t nStart;
+
+public:
+    bool fSuccess;
+    // set by CRPCLockTimer if execute() took cs_main for the call
+    int64_t nLockRequested;
+    int64_t nLockAcquired;
+    int64_t nLockReleased;
+
+    CRPCCallRecorder(const string& strMethodIn) : strMethod(strMethodIn), fSuccess(false),
+                                                  nLockRequested(0), nLockAcquired(0), nLockReleased(0)
+    {
+        LOCK(cs_rpcstats);
+        CRPCMethodStats& stats = mapRPCStats[strMethod];
+        if (nRPCMethodLimit > 0 && stats.nInFlight >= nRPCMethodLimit) {
+            stats.nRejected++;
+            throw JSONRPCError(RPC_MISC_ERROR, strprintf("Too many concurrent %s calls, try again later", strMethod));
+        }
+        stats.nInFlight++;
+        stats.nMaxInFlight = max(stats.nMaxInFlight, stats.nInFlight);
+        nStart = GetTimeMicros();
+    }
+
+    ~CRPCCallRecorder()
+    {
+        int64_t nElapsed = GetTimeMicros() - nStart;
+        LOCK(cs_rpcstats);
+        CRPCMethodStats& stats = mapRPCStats[strMethod];
+        stats.nInFlight--;
+        stats.nCalls++;
+        if (!fSuccess)
+            stats.nErrors++;
+        stats.nExecMicrosTotal += nElapsed;
+        stats.nExecMicrosMax = max(stats.nExecMicrosMax, nElapsed);
+        if (nLockAcquired > 0 && nLockReleased > 0)
+        {
+            int64_t nLockWait = nLockAcquired - nLockRequested;
+            int64_t nLockHeld = nLockReleased - nLockAcquired;
+            stats.nLocked++;
+            stats.nLockWaitMicrosTotal += nLockWait;
+            stats.nLockWaitMicrosMax = max(stats.nLockWaitMicrosMax, nLockWait);
+            stats.nLockHeldMicrosTotal += nLockHeld;
+            stats.nLockHeldMicrosMax = max(stats.nLockHeldMicrosMax, nLockHeld);
+        }
+    }
+};
+
+/** Times how long a call waits for and then holds the locks execute() takes
+  * for it. Declared in front of the lock, so it goes out of scope after the
+  * lock has been released. */
+class CRPCLockTimer
+{
+private:
+    CRPCCallRecorder& recorder;
+
+public:
+    CRPCLockTimer(CRPCCallRecorder& recorderIn) : recorder(recorderIn)
+    {
+        recorder.nLockRequested = GetTimeMicros();
+    }
+
+    void Acquired()
+    {
+        recorder.nLockAcquired = GetTimeMicros();
+    }
+
+    ~CRPCLockTimer()
+    {
+        recorder.nLockReleased = GetTimeMicros();
+    }
+};
+
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
 {
     // Find method
@@ -867,6 +1535,7 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    CRPCCallRecorder recorder(pcmd->name);
     try
     {
         // Execute
@@ -876,19 +1545,26 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
                 result = pcmd->actor(params, false);
 #ifdef ENABLE_WALLET
             else if (!pwalletMain) {
+                CRPCLockTimer lockTimer(recorder);
                 LOCK(cs_main);
+                lockTimer.Acquired();
                 result = pcmd->actor(params, false);
             } else {
+                CRPCLockTimer lockTimer(recorder);
                 LOCK2(cs_main, pwalletMain->cs_wallet);
+                lockTimer.Acquired();
                 result = pcmd->actor(params, false);
             }
 #else // ENABLE_WALLET
             else {
+                CRPCLockTimer lockTimer(recorder);
                 LOCK(cs_main);
+                lockTimer.Acquired();
                 result = pcmd->actor(params, false);
             }
 #endif // !ENABLE_WALLET
         }
+        recorder.fSuccess = true;
         return result;
     }
     catch (std::exception& e)
@@ -28,6 +28,12 @@ using namespace json_spirit;
 int64_t nWalletUnlockTime;
 static CCriticalSection cs_nWalletUnlockTime;
 
+int64_t GetWalletUnlockTime()
+{
+    LOCK(cs_nWalletUnlockTime);
+    return nWalletUnlockTime;
+}
+
 std::string HelpRequiringPassphrase()
 {
     return pwalletMain && pwalletMain->IsCrypted()
@@ -97,9 +103,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
@@ -192,9 +195,6 @@ Value getrawchangeaddress(const Array& params, bool fHelp)
             + HelpExampleRpc("getrawchangeaddress", "")
        );
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     CReserveKey reservekey(pwalletMain);
     CPubKey vchPubKey;
     if (!reservekey.GetReservedKey(vchPubKey))
@@ -485,18 +485,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     // Tally
-    int64_t nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-    }
+    int64_t nAmount = pwalletMain->GetReceivedByAddress(address.Get(), nMinDepth);
 
     return  ValueFromAmount(nAmount);
 }
@@ -535,20 +524,9 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     int64_t nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-        }
-    }
+    BOOST_FOREACH(const CTxDestination& address, setAddress)
+        if (IsMine(*pwalletMain, address))
+            nAmount += pwalletMain->GetReceivedByAddress(address, nMinDepth);
 
     return (double)nAmount / (double)COIN;
 }
@@ -574,7 +552,7 @@ int64_t GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMi
     }
 
     // Tally internal accounting entries
-    nBalance += walletdb.GetAccountCreditDebit(strAccount);
+    nBalance += pwalletMain->GetAccountCreditDebit(strAccount);
 
     return nBalance;
 }
@@ -711,7 +689,8 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    if (!pwalletMain->AddAccountingEntry(debit, walletdb))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     // Credit
     CAccountingEntry credit;
@@ -721,7 +700,8 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    if (!pwalletMain->AddAccountingEntry(credit, walletdb))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
@@ -943,29 +923,36 @@ Value ListReceived(const Array& params, bool fByAccounts)
     if (params.size() > 1)
         fIncludeEmpty = params[1].get_bool();
 
-    // Tally
+    // Tally the addresses in the address book
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, CAddressBookData)& item, pwalletMain->mapAddressBook)
     {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+        const CTxDestination& address = item.first;
+        if (!IsMine(*pwalletMain, address))
             continue;
 
-        int nDepth = wtx.GetDepthInMainChain();
-        if (nDepth < nMinDepth)
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        BOOST_FOREACH(const uint256& hash, pwalletMain->GetAddressTxids(address))
         {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address) || !IsMine(*pwalletMain, address))
+            const CWalletTx& wtx = pwalletMain->mapWallet[hash];
+
+            if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+                continue;
+
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < nMinDepth)
                 continue;
 
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
-            item.txids.push_back(wtx.GetHash());
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                CTxDestination dest;
+                if (!ExtractDestination(txout.scriptPubKey, dest) || !(dest == address))
+                    continue;
+
+                tallyitem& item = mapTally[address];
+                item.nAmount += txout.nValue;
+                item.nConf = min(item.nConf, nDepth);
+                item.txids.push_back(hash);
+            }
         }
     }
 
@@ -1251,11 +1238,10 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems& txOrdered = pwalletMain->OrderedTxItems(strAccount);
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1344,7 +1330,7 @@ Value listaccounts(const Array& params, bool fHelp)
     }
 
     list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
+    pwalletMain->ListAccountCreditDebit("*", acentries);
     BOOST_FOREACH(const CAccountingEntry& entry, acentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
@@ -1416,12 +1402,21 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (pindex)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        // only the transactions above pindex or not in the main chain can be less deep
+        std::vector<const CWalletTx*> vpwtx;
+        pwalletMain->GetTxsAboveHeight(pindex->nHeight, vpwtx);
+        BOOST_FOREACH(const CWalletTx* pwtx, vpwtx)
+        {
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions);
+        }
+    }
+    else
+    {
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -1608,7 +1603,8 @@ Value walletpassphrase(const Array& params, bool fHelp)
     if (!pwalletMain->Unlock(strWalletPass, anonymizeOnly))
         throw JSONRPCError(RPC_WALLET_PASSPHRASE_INCORRECT, "Error: The wallet passphrase entered was incorrect.");
 
-    pwalletMain->TopUpKeyPool();
+    if (!pwalletMain->RequestKeyPoolTopUp())
+        pwalletMain->TopUpKeyPool();
 
     int64_t nSleepTime = params[1].get_int64();
     LOCK(cs_nWalletUnlockTime);
@@ -1907,6 +1903,17 @@ Value getwalletinfo(const Array& params, bool fHelp)
             "  \"keypoololdest\": xxxxxx,    (numeric) the timestamp (seconds since GMT epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
+            "  \"walletdb\": {               (object) wallet database write statistics\n"
+            "    \"batches\": n,             (numeric) write batches committed\n"
+            "    \"batchesfailed\": n,       (numeric) write batches that failed to commit\n"
+            "    \"commitlast\": n,          (numeric) duration of the last commit in milliseconds\n"
+            "    \"commitmax\": n,           (numeric) longest commit in milliseconds\n"
+            "    \"committotal\": n,         (numeric) total time spent committing in milliseconds\n"
+            "    \"flushes\": n,             (numeric) background flushes of the wallet file\n"
+            "    \"flushlast\": n,           (numeric) duration of the last flush in milliseconds\n"
+            "    \"flushmax\": n,            (numeric) longest flush in milliseconds\n"
+            "    \"flushtotal\": n           (numeric) total time spent flushing in milliseconds\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -1920,7 +1927,20 @@ Value getwalletinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("keypoololdest", pwalletMain->GetOldestKeyPoolTime()));
     obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
     if (pwalletMain->IsCrypted())
-        obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+        obj.push_back(Pair("unlocked_until", GetWalletUnlockTime()));
+
+    CWalletDBStats stats = GetWalletDBStats();
+    Object dbObj;
+    dbObj.push_back(Pair("batches",       (uint64_t)stats.nBatches));
+    dbObj.push_back(Pair("batchesfailed", (uint64_t)stats.nBatchesFailed));
+    dbObj.push_back(Pair("commitlast",    stats.nCommitMillisLast));
+    dbObj.push_back(Pair("commitmax",     stats.nCommitMillisMax));
+    dbObj.push_back(Pair("committotal",   stats.nCommitMillisTotal));
+    dbObj.push_back(Pair("flushes",       (uint64_t)stats.nFlushes));
+    dbObj.push_back(Pair("flushlast",     stats.nFlushMillisLast));
+    dbObj.push_back(Pair("flushmax",      stats.nFlushMillisMax));
+    dbObj.push_back(Pair("flushtotal",    stats.nFlushMillisTotal));
+    obj.push_back(Pair("walletdb", dbObj));
     return obj;
 }
 
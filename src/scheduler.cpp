@@ -0,0 +1,228 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scheduler.h"
+
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+CScheduler maintenanceScheduler;
+
+//
+// CTimerWheel
+//
+
+void CTimerWheel::Insert(int64_t nDue, int nId)
+{
+    if ((nDue >> WHEEL_BITS) == (nCurrent >> WHEEL_BITS))
+        vInner[nDue & (WHEEL_SLOTS - 1)].push_back(std::make_pair(nDue, nId));
+    else if ((nDue >> (2 * WHEEL_BITS)) == (nCurrent >> (2 * WHEEL_BITS)))
+        vOuter[(nDue >> WHEEL_BITS) & (WHEEL_SLOTS - 1)].push_back(std::make_pair(nDue, nId));
+    else
+        vOverflow.push_back(std::make_pair(nDue, nId));
+}
+
+void CTimerWheel::Add(int64_t nDue, int nId)
+{
+    Insert(std::max(nDue, nCurrent + 1), nId);
+    nSize++;
+}
+
+void CTimerWheel::Advance(int64_t nNow, std::vector<int>& vFired)
+{
+    // nothing can fire in between, skip straight to nNow
+    if (nSize == 0 && nNow > nCurrent)
+        nCurrent = nNow;
+
+    while (nCurrent < nNow)
+    {
+        nCurrent++;
+
+        // a new window starts: move its timers down a level
+        if ((nCurrent & (WHEEL_SLOTS - 1)) == 0)
+        {
+            if ((nCurrent & (WHEEL_SLOTS * WHEEL_SLOTS - 1)) == 0)
+            {
+                Slot vCascade;
+                vCascade.swap(vOverflow);
+                for (unsigned int i = 0; i < vCascade.size(); i++)
+                    Insert(vCascade[i].first, vCascade[i].second);
+            }
+
+            Slot vCascade;
+            vCascade.swap(vOuter[(nCurrent >> WHEEL_BITS) & (WHEEL_SLOTS - 1)]);
+            for (unsigned int i = 0; i < vCascade.size(); i++)
+                Insert(vCascade[i].first, vCascade[i].second);
+        }
+
+        Slot vDue;
+        vDue.swap(vInner[nCurrent & (WHEEL_SLOTS - 1)]);
+        for (unsigned int i = 0; i < vDue.size(); i++)
+            vFired.push_back(vDue[i].second);
+        nSize -= vDue.size();
+    }
+}
+
+//
+// CMonotonicMillis
+//
+
+int64_t CMonotonicMillis::Get(int64_t nWallMillis)
+{
+    if (nWallMillis < nLast)
+        nOffset += nLast - nWallMillis;
+    nLast = nWallMillis;
+    return nWallMillis + nOffset;
+}
+
+//
+// CScheduler
+//
+
+CScheduler::CScheduler() : nStart(0)
+{
+}
+
+int64_t CScheduler::GetClockMillis()
+{
+    return clock.Get(GetTimeMillis());
+}
+
+void CScheduler::ScheduleEvery(const std::string& strName, Function fn, int64_t nPeriod, int64_t nDelay, CCriticalSection* pLock, const std::string& strLock)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    CTask task;
+    task.info.strName = strName;
+    task.info.nPeriod = std::max(nPeriod, (int64_t)1);
+    task.info.strLock = strLock;
+    task.info.nRuns = 0;
+    task.info.nOverruns = 0;
+    task.info.nLastMillis = 0;
+    task.info.nMaxMillis = 0;
+    task.info.nTotalMillis = 0;
+    task.info.fRunning = false;
+    task.fn = fn;
+    task.pLock = pLock;
+
+    vTasks.push_back(task);
+    wheel.Add(wheel.Current() + std::max(nDelay, (int64_t)1), vTasks.size() - 1);
+}
+
+void CScheduler::ThreadWorker()
+{
+    RenameThread("unpay-scheduler");
+
+    while (true)
+    {
+        int nId;
+        Function fn;
+        CCriticalSection* pLock;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queueReady.empty())
+                condReady.wait(lock);
+            nId = queueReady.front();
+            queueReady.pop_front();
+            fn = vTasks[nId].fn;
+            pLock = vTasks[nId].pLock;
+        }
+
+        int64_t nTaskStart = GetTimeMillis();
+        try {
+            if (pLock) {
+                LOCK(*pLock);
+                fn();
+            } else {
+                fn();
+            }
+        }
+        catch (boost::thread_interrupted) {
+            throw;
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "CScheduler::ThreadWorker()");
+        }
+        catch (...) {
+            PrintExceptionContinue(NULL, "CScheduler::ThreadWorker()");
+        }
+        // only for the statistics, a clock step must not make it negative
+        int64_t nElapsed = std::max(GetTimeMillis() - nTaskStart, (int64_t)0);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            CTaskInfo& info = vTasks[nId].info;
+            info.nRuns++;
+            info.nLastMillis = nElapsed;
+            info.nMaxMillis = std::max(info.nMaxMillis, nElapsed);
+            info.nTotalMillis += nElapsed;
+            info.fRunning = false;
+            if (nElapsed > info.nPeriod * 1000)
+                LogPrint("scheduler", "CScheduler: task %s took %dms, longer than its period\n", info.strName, nElapsed);
+        }
+    }
+}
+
+void CScheduler::Run(int nWorkers)
+{
+    boost::thread_group threadGroup;
+    for (int i = 0; i < std::max(nWorkers, 1); i++)
+        threadGroup.create_thread(boost::bind(&CScheduler::ThreadWorker, this));
+
+    try {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nStart = GetClockMillis() - wheel.Current() * 1000;
+        }
+
+        while (true)
+        {
+            // sleep up to the next tick, measured from the start so we don't drift
+            int64_t nSleep;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nSleep = nStart + (wheel.Current() + 1) * 1000 - GetClockMillis();
+            }
+            MilliSleep(std::max(nSleep, (int64_t)0));
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            std::vector<int> vFired;
+            wheel.Advance((GetClockMillis() - nStart) / 1000, vFired);
+            BOOST_FOREACH(int nId, vFired)
+            {
+                CTaskInfo& info = vTasks[nId].info;
+                if (info.fRunning) {
+                    // still busy with the previous run, skip this one
+                    info.nOverruns++;
+                } else {
+                    info.fRunning = true;
+                    queueReady.push_back(nId);
+                }
+                wheel.Add(wheel.Current() + info.nPeriod, nId);
+            }
+            if (!vFired.empty())
+                condReady.notify_all();
+        }
+    }
+    catch (boost::thread_interrupted) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+}
+
+std::vector<CScheduler::CTaskInfo> CScheduler::GetTaskInfo() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+
+    std::vector<CTaskInfo> vInfo;
+    BOOST_FOREACH(const CTask& task, vTasks)
+        vInfo.push_back(task.info);
+    return vInfo;
+}
@@ -0,0 +1,141 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "sync.h"
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+
+/** Hierarchical timer wheel with a resolution of one tick.
+  *
+  * Timers due within the current 64 tick window sit in the inner wheel, one
+  * slot per tick. Timers due later within the current 4096 tick window sit in
+  * the outer wheel, one slot per 64 ticks, and are moved to the inner wheel
+  * when their window starts; anything further out waits in an overflow list.
+  * Adding a timer and advancing by one tick are O(1) amortized.
+  */
+class CTimerWheel
+{
+public:
+    static const int WHEEL_BITS = 6;
+    static const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+
+private:
+    typedef std::vector<std::pair<int64_t, int> > Slot;
+
+    Slot vInner[WHEEL_SLOTS];
+    Slot vOuter[WHEEL_SLOTS];
+    Slot vOverflow;
+
+    // the last tick that has been processed
+    int64_t nCurrent;
+    int nSize;
+
+    void Insert(int64_t nDue, int nId);
+
+public:
+    CTimerWheel(int64_t nStart = 0) : nCurrent(nStart), nSize(0) {}
+
+    // Fire nId at tick nDue, or at the next tick if nDue has already passed.
+    void Add(int64_t nDue, int nId);
+
+    // Process all ticks up to and including nNow, appending the timers that fire in order.
+    void Advance(int64_t nNow, std::vector<int>& vFired);
+
+    int64_t Current() const { return nCurrent; }
+    int Size() const { return nSize; }
+};
+
+/** Wall clock milliseconds made monotonic: when the clock is stepped back the
+  * step is absorbed, so the time returned never decreases and the schedule
+  * carries on instead of waiting for the clock to catch up.
+  */
+class CMonotonicMillis
+{
+private:
+    int64_t nLast;
+    int64_t nOffset;
+
+public:
+    CMonotonicMillis() : nLast(0), nOffset(0) {}
+
+    int64_t Get(int64_t nWallMillis);
+};
+
+/** Runs periodic maintenance tasks on a small pool of worker threads.
+  *
+  * Each task is registered with its own period and, optionally, a lock that is
+  * held while it runs, so tasks that don't need cs_main no longer wait behind
+  * the ones that do. A task is never run twice at the same time: if it is
+  * still running when it is due again that run is skipped and counted as an
+  * overrun.
+  */
+class CScheduler
+{
+public:
+    typedef boost::function<void()> Function;
+
+    struct CTaskInfo
+    {
+        std::string strName;
+        int64_t nPeriod;
+        std::string strLock;
+        uint64_t nRuns;
+        uint64_t nOverruns;
+        int64_t nLastMillis;
+        int64_t nMaxMillis;
+        int64_t nTotalMillis;
+        bool fRunning;
+    };
+
+private:
+    struct CTask
+    {
+        CTaskInfo info;
+        Function fn;
+        CCriticalSection* pLock;
+    };
+
+    mutable boost::mutex mutex;
+    boost::condition_variable condReady;
+
+    std::vector<CTask> vTasks;
+    std::deque<int> queueReady;
+    CTimerWheel wheel;
+    CMonotonicMillis clock;
+    // clock time at tick 0
+    int64_t nStart;
+
+    int64_t GetClockMillis();
+
+    void ThreadWorker();
+
+public:
+    CScheduler();
+
+    // Run fn every nPeriod seconds, the first time nDelay seconds after the
+    // scheduler starts. If pLock is given it is held while fn runs.
+    void ScheduleEvery(const std::string& strName, Function fn, int64_t nPeriod, int64_t nDelay = 0, CCriticalSection* pLock = NULL, const std::string& strLock = "");
+
+    // Drive the scheduler from the calling thread with nWorkers worker threads.
+    // Only returns by boost::thread_interrupted, after stopping the workers.
+    void Run(int nWorkers);
+
+    std::vector<CTaskInfo> GetTaskInfo() const;
+};
+
+// Darksend and Masternode maintenance
+extern CScheduler maintenanceScheduler;
+
+#endif
@@ -309,6 +309,7 @@ I ReadVarInt(Stream& is)
 #define FLATDATA(obj) REF(CFlatData((char*)&(obj), (char*)&(obj) + sizeof(obj)))
 #define VARINT(obj) REF(WrapVarInt(REF(obj)))
 #define LIMITED_STRING(obj,n) REF(LimitedString< n >(REF(obj)))
+#define BIGENDIAN32(obj) REF(WrapBigEndian32(REF(obj)))
 
 /** Wrapper for serializing arrays and POD.
  */
@@ -399,9 +400,44 @@ public:
     }
 };
 
+/** Wrapper for serializing a 32-bit integer big endian, so that keys in
+  * LevelDB sort by its (non-negative) value. */
+template<typename I>
+class CBigEndian32
+{
+protected:
+    I &n;
+public:
+    CBigEndian32(I& nIn) : n(nIn) { }
+
+    unsigned int GetSerializeSize(int, int) const {
+        return 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int, int) const {
+        unsigned char buf[4];
+        buf[0] = (unsigned char)((uint32_t)n >> 24);
+        buf[1] = (unsigned char)((uint32_t)n >> 16);
+        buf[2] = (unsigned char)((uint32_t)n >> 8);
+        buf[3] = (unsigned char)((uint32_t)n);
+        s.write((char*)buf, 4);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int, int) {
+        unsigned char buf[4];
+        s.read((char*)buf, 4);
+        n = (I)(((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3]);
+    }
+};
+
 template<typename I>
 CVarInt<I> WrapVarInt(I& n) { return CVarInt<I>(n); }
 
+template<typename I>
+CBigEndian32<I> WrapBigEndian32(I& n) { return CBigEndian32<I>(n); }
+
 //
 // Forward declarations
 //
@@ -20,6 +20,7 @@ class CSporkMessage;
 class CSporkManager;
 
 CSporkManager sporkManager;
+CSporkTable sporkTable;
 
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
@@ -56,6 +57,9 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
             return;
         }
 
+        // same acceptance rule as the table, so the two never disagree
+        if(CSporkTable::IsKnown(spork.nSporkID) && !sporkTable.Update(spork)) return;
+
         mapSporks[hash] = spork;
         mapSporksActive[spork.nSporkID] = spork;
         sporkManager.Relay(spork);
@@ -75,21 +79,60 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 
 }
 
+CSporkTable::CSporkTable()
+{
+    for(int i = 0; i < SPORK_COUNT; i++) {
+        vValue[i].store(0);
+        vTimeSigned[i] = 0;
+        vTimeUpdated[i] = 0;
+    }
+
+    vValue[SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT - SPORK_START].store(SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT_DEFAULT);
+    vValue[SPORK_2_INSTANTX - SPORK_START].store(SPORK_2_INSTANTX_DEFAULT);
+    vValue[SPORK_3_INSTANTX_BLOCK_FILTERING - SPORK_START].store(SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT);
+    vValue[SPORK_5_MAX_VALUE - SPORK_START].store(SPORK_5_MAX_VALUE_DEFAULT);
+    vValue[SPORK_7_MASTERNODE_SCANNING - SPORK_START].store(SPORK_7_MASTERNODE_SCANNING_DEFAULT);
+}
+
+bool CSporkTable::Update(const CSporkMessage& spork)
+{
+    if(!IsKnown(spork.nSporkID)) return false;
+
+    LOCK(cs);
+    int i = spork.nSporkID - SPORK_START;
+    if(spork.nTimeSigned <= vTimeSigned[i]) return false;
+
+    vTimeSigned[i] = spork.nTimeSigned;
+    vTimeUpdated[i] = GetTime();
+    vValue[i].store(spork.nValue, boost::memory_order_release);
+    return true;
+}
+
+int64_t CSporkTable::GetValue(int nSporkID) const
+{
+    return vValue[nSporkID - SPORK_START].load(boost::memory_order_acquire);
+}
+
+void CSporkTable::GetUpdateTimes(int nSporkID, int64_t& nTimeSignedRet, int64_t& nTimeUpdatedRet) const
+{
+    nTimeSignedRet = 0;
+    nTimeUpdatedRet = 0;
+    if(!IsKnown(nSporkID)) return;
+
+    LOCK(cs);
+    nTimeSignedRet = vTimeSigned[nSporkID - SPORK_START];
+    nTimeUpdatedRet = vTimeUpdated[nSporkID - SPORK_START];
+}
+
 // grab the spork, otherwise say it's off
 bool IsSporkActive(int nSporkID)
 {
     int64_t r = 0;
 
-    if(mapSporksActive.count(nSporkID)){
-        r = mapSporksActive[nSporkID].nValue;
+    if(CSporkTable::IsKnown(nSporkID)){
+        r = sporkTable.GetValue(nSporkID);
     } else {
-        if(nSporkID == SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT) r = SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT_DEFAULT;
-        if(nSporkID == SPORK_2_INSTANTX) r = SPORK_2_INSTANTX_DEFAULT;
-        if(nSporkID == SPORK_3_INSTANTX_BLOCK_FILTERING) r = SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT;
-        if(nSporkID == SPORK_5_MAX_VALUE) r = SPORK_5_MAX_VALUE_DEFAULT;
-        if(nSporkID == SPORK_7_MASTERNODE_SCANNING) r = SPORK_7_MASTERNODE_SCANNING;
-
-        if(r == 0) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
+        LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
     }
     if(r == 0) r = 4070908800; //return 2099-1-1 by default
 
@@ -99,21 +142,12 @@ bool IsSporkActive(int nSporkID)
 // grab the value of the spork on the network, or the default
 int GetSporkValue(int nSporkID)
 {
-    int r = 0;
-
-    if(mapSporksActive.count(nSporkID)){
-        r = mapSporksActive[nSporkID].nValue;
-    } else {
-        if(nSporkID == SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT) r = SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT_DEFAULT;
-        if(nSporkID == SPORK_2_INSTANTX) r = SPORK_2_INSTANTX_DEFAULT;
-        if(nSporkID == SPORK_3_INSTANTX_BLOCK_FILTERING) r = SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT;
-        if(nSporkID == SPORK_5_MAX_VALUE) r = SPORK_5_MAX_VALUE_DEFAULT;
-        if(nSporkID == SPORK_7_MASTERNODE_SCANNING) r = SPORK_7_MASTERNODE_SCANNING;
-
-        if(r == 0) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
+    if(!CSporkTable::IsKnown(nSporkID)){
+        LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
+        return 0;
     }
 
-    return r;
+    return sporkTable.GetValue(nSporkID);
 }
 
 void ExecuteSpork(int nSporkID, int nValue)
@@ -171,7 +205,8 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
     msg.nValue = nValue;
     msg.nTimeSigned = GetTime();
 
-    if(Sign(msg)){
+    // the table refuses a spork that isn't newer than the one it has, keep the maps in step with it
+    if(Sign(msg) && sporkTable.Update(msg)){
         Relay(msg);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
@@ -185,12 +220,7 @@ void CSporkManager::Relay(CSporkMessage& msg)
 {
     CInv inv(MSG_SPORK, msg.GetHash());
 
-    vector<CInv> vInv;
-    vInv.push_back(inv);
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
-    }
+    RelayInventory(inv);
 }
 
 bool CSporkManager::SetPrivKey(std::string strPrivKey)
@@ -27,6 +27,9 @@ using namespace boost;
 #define SPORK_6_NOTUSED                                       10005
 #define SPORK_7_MASTERNODE_SCANNING                           10006
 
+#define SPORK_START                                           SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT
+#define SPORK_END                                             SPORK_7_MASTERNODE_SCANNING
+
 #define SPORK_1_MASTERNODE_PAYMENTS_ENFORCEMENT_DEFAULT       1424217600  //2015-2-18
 #define SPORK_2_INSTANTX_DEFAULT                              978307200   //2001-1-1
 #define SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT              1424217600  //2015-2-18
@@ -35,6 +38,7 @@ using namespace boost;
 
 class CSporkMessage;
 class CSporkManager;
+class CSporkTable;
 
 #include "bignum.h"
 #include "net.h"
@@ -42,6 +46,7 @@ class CSporkManager;
 #include "util.h"
 #include "protocol.h"
 #include "darksend.h"
+#include <boost/atomic.hpp>
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -50,6 +55,7 @@ using namespace boost;
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
 extern CSporkManager sporkManager;
+extern CSporkTable sporkTable;
 
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 int GetSporkValue(int nSporkID);
@@ -83,6 +89,41 @@ public:
 };
 
 
+/** The current value of every known spork, indexed by nSporkID - SPORK_START.
+ *
+ *  The table starts out with the compiled defaults and is only written when a
+ *  newer signed spork is accepted. Each value is a single atomic, so
+ *  IsSporkActive and GetSporkValue take no lock at all and never see a half
+ *  written value. The times are only kept for the RPC and read under the lock.
+ */
+class CSporkTable
+{
+private:
+    static const int SPORK_COUNT = SPORK_END - SPORK_START + 1;
+
+    boost::atomic<int64_t> vValue[SPORK_COUNT];
+
+    // serializes writers, protects the times
+    mutable CCriticalSection cs;
+    int64_t vTimeSigned[SPORK_COUNT];
+    int64_t vTimeUpdated[SPORK_COUNT];
+
+    CSporkTable(const CSporkTable&);
+    void operator=(const CSporkTable&);
+
+public:
+    CSporkTable();
+
+    static bool IsKnown(int nSporkID) { return nSporkID >= SPORK_START && nSporkID <= SPORK_END; }
+
+    /// Value of a known spork, the default until the network tells us otherwise
+    int64_t GetValue(int nSporkID) const;
+    /// Take the value of a signed spork, returns false if we have a newer one
+    bool Update(const CSporkMessage& spork);
+    /// When the current value was signed and when we accepted it, 0 for the defaults
+    void GetUpdateTimes(int nSporkID, int64_t& nTimeSignedRet, int64_t& nTimeUpdatedRet) const;
+};
+
 class CSporkManager
 {
 private:
@@ -0,0 +1,138 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "txdb.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_write_erase_read)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint160 hashA(1), hashB(2);
+    uint256 txhash(3);
+
+    vector<pair<CAddressIndexKey, int64_t> > vWrite;
+    vWrite.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 5, 0, txhash, 0, false), 500));
+    vWrite.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 1, 0, txhash, 1, false), 100));
+    vWrite.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashA, 2, 1, txhash, 0, true), -100));
+    vWrite.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_PUBKEYHASH, hashB, 2, 0, txhash, 2, false), 7));
+    vWrite.push_back(make_pair(CAddressIndexKey(ADDRESS_TYPE_SCRIPTHASH, hashA, 3, 0, txhash, 3, false), 9));
+    db.WriteAddressIndex(vWrite);
+    BOOST_CHECK_EQUAL(db.GetIndexBatchSize(), vWrite.size());
+
+    // queued updates stay invisible until they are flushed
+    vector<pair<CAddressIndexKey, int64_t> > vRead;
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_TYPE_PUBKEYHASH, hashA, vRead));
+    BOOST_CHECK(vRead.empty());
+    BOOST_CHECK(db.FlushIndexBatch());
+    BOOST_CHECK_EQUAL(db.GetIndexBatchSize(), 0U);
+
+    // one address and type only, in block height order
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_TYPE_PUBKEYHASH, hashA, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 3U);
+    if (vRead.size() == 3) {
+        BOOST_CHECK_EQUAL(vRead[0].first.nBlockHeight, 1);
+        BOOST_CHECK_EQUAL(vRead[0].second, 100);
+        BOOST_CHECK_EQUAL(vRead[1].first.nBlockHeight, 2);
+        BOOST_CHECK(vRead[1].first.fSpending);
+        BOOST_CHECK_EQUAL(vRead[1].second, -100);
+        BOOST_CHECK_EQUAL(vRead[2].first.nBlockHeight, 5);
+    }
+
+    // height range
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_TYPE_PUBKEYHASH, hashA, vRead, 2, 4));
+    BOOST_CHECK_EQUAL(vRead.size(), 1U);
+
+    // erasing takes the entries out again
+    vector<pair<CAddressIndexKey, int64_t> > vErase(vWrite.begin() + 1, vWrite.begin() + 3);
+    db.EraseAddressIndex(vErase);
+    BOOST_CHECK(db.FlushIndexBatch());
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_TYPE_PUBKEYHASH, hashA, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 1U);
+    if (vRead.size() == 1)
+        BOOST_CHECK_EQUAL(vRead[0].first.nBlockHeight, 5);
+
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(ADDRESS_TYPE_PUBKEYHASH, hashB, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_unspent)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint160 hashA(1);
+    CScript script;
+    script << OP_TRUE;
+
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUpdate;
+    vUpdate.push_back(make_pair(CAddressUnspentKey(ADDRESS_TYPE_PUBKEYHASH, hashA, uint256(10), 0), CAddressUnspentValue(50, script, 4)));
+    vUpdate.push_back(make_pair(CAddressUnspentKey(ADDRESS_TYPE_PUBKEYHASH, hashA, uint256(11), 1), CAddressUnspentValue(60, script, 6)));
+    db.UpdateAddressUnspentIndex(vUpdate);
+    BOOST_CHECK(db.FlushIndexBatch());
+
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vRead;
+    BOOST_CHECK(db.ReadAddressUnspentIndex(ADDRESS_TYPE_PUBKEYHASH, hashA, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 2U);
+    if (vRead.size() == 2) {
+        BOOST_CHECK(vRead[0].first.txhash == uint256(10));
+        BOOST_CHECK_EQUAL(vRead[0].second.nSatoshis, 50);
+        BOOST_CHECK_EQUAL(vRead[0].second.nBlockHeight, 4);
+        BOOST_CHECK(vRead[0].second.script == script);
+    }
+
+    // a null value erases the entry
+    vUpdate.resize(1);
+    vUpdate[0].second = CAddressUnspentValue();
+    db.UpdateAddressUnspentIndex(vUpdate);
+    BOOST_CHECK(db.FlushIndexBatch());
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressUnspentIndex(ADDRESS_TYPE_PUBKEYHASH, hashA, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 1U);
+    if (vRead.size() == 1)
+        BOOST_CHECK(vRead[0].first.txhash == uint256(11));
+
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressUnspentIndex(ADDRESS_TYPE_SCRIPTHASH, hashA, vRead));
+    BOOST_CHECK(vRead.empty());
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_spent)
+{
+    CBlockTreeDB db(1 << 20, true);
+    CSpentIndexKey key(uint256(20), 1);
+
+    vector<pair<CSpentIndexKey, CSpentIndexValue> > vUpdate;
+    vUpdate.push_back(make_pair(key, CSpentIndexValue(uint256(21), 3, 7, 80, ADDRESS_TYPE_SCRIPTHASH, uint160(5))));
+    db.UpdateSpentIndex(vUpdate);
+
+    CSpentIndexValue value;
+    BOOST_CHECK(!db.ReadSpentIndex(key, value));
+    BOOST_CHECK(db.FlushIndexBatch());
+    BOOST_CHECK(db.ReadSpentIndex(key, value));
+    BOOST_CHECK(value.txid == uint256(21));
+    BOOST_CHECK_EQUAL(value.nInputIndex, 3U);
+    BOOST_CHECK_EQUAL(value.nBlockHeight, 7);
+    BOOST_CHECK_EQUAL(value.nSatoshis, 80);
+    BOOST_CHECK_EQUAL(value.nAddressType, ADDRESS_TYPE_SCRIPTHASH);
+    BOOST_CHECK(value.addressHash == uint160(5));
+    BOOST_CHECK(!db.ReadSpentIndex(CSpentIndexKey(uint256(20), 0), value));
+
+    // a null value erases the entry
+    vUpdate[0].second = CSpentIndexValue();
+    db.UpdateSpentIndex(vUpdate);
+    BOOST_CHECK(db.FlushIndexBatch());
+    BOOST_CHECK(!db.ReadSpentIndex(key, value));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,78 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Times the RPC JSON writer and parser against json_spirit.
+// Build and run it with: make -C src/test bench_unpay && src/test/bench_unpay
+
+#include "rpcjson.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+// A getblock-like reply: many transactions with hex payloads
+static Value LargeValue(int nTx)
+{
+    Array txs;
+    for (int i = 0; i < nTx; i++)
+    {
+        Object tx;
+        tx.push_back(Pair("txid", "00000000000000000000000000000000000000000000000000000000deadbeef"));
+        tx.push_back(Pair("hex", string(500, 'a')));
+        tx.push_back(Pair("amount", i * 0.01));
+        tx.push_back(Pair("confirmations", i));
+        tx.push_back(Pair("trusted", (i % 2) == 0));
+        txs.push_back(tx);
+    }
+    Object result;
+    result.push_back(Pair("height", 123456));
+    result.push_back(Pair("tx", txs));
+    return result;
+}
+
+static int64_t MicrosSince(const boost::posix_time::ptime& start)
+{
+    return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+}
+
+int main()
+{
+    Value value = LargeValue(5000);
+    boost::posix_time::ptime start;
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    string strSpirit = write_string(value, false);
+    int64_t nWriteSpirit = MicrosSince(start);
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    string strFast = WriteJSON(value);
+    int64_t nWriteFast = MicrosSince(start);
+
+    Value valueSpirit, valueFast;
+    start = boost::posix_time::microsec_clock::universal_time();
+    bool fReadSpirit = read_string(strSpirit, valueSpirit);
+    int64_t nReadSpirit = MicrosSince(start);
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    bool fReadFast = ReadJSON(strSpirit, valueFast);
+    int64_t nReadFast = MicrosSince(start);
+
+    if (strFast != strSpirit || !fReadSpirit || !fReadFast || WriteJSON(valueFast) != strSpirit)
+    {
+        fprintf(stderr, "rpcjson: output differs from json_spirit\n");
+        return 1;
+    }
+
+    printf("rpcjson: %u bytes, write %dus (json_spirit) / %dus, read %dus (json_spirit) / %dus\n",
+        (unsigned int)strSpirit.size(), (int)nWriteSpirit, (int)nWriteFast, (int)nReadSpirit, (int)nReadFast);
+    return 0;
+}
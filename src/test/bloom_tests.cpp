@@ -451,4 +451,37 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    CRollingBloomFilter rb(100, 0.01, 0);
+    vector<uint256> vHashes;
+    for (int i = 0; i < 300; i++)
+        vHashes.push_back(GetRandHash());
+
+    // the last 100 inserted are always remembered
+    for (int i = 0; i < 300; i++)
+    {
+        rb.insert(vHashes[i]);
+        for (int j = max(0, i - 99); j <= i; j += 7)
+            BOOST_CHECK(rb.contains(vHashes[j]));
+    }
+
+    // older ones are forgotten, but for false positives
+    int nOld = 0;
+    for (int i = 0; i < 100; i++)
+        if (rb.contains(vHashes[i]))
+            nOld++;
+    BOOST_CHECK(nOld < 10);
+
+    int nFalse = 0;
+    for (int i = 0; i < 1000; i++)
+        if (rb.contains(GetRandHash()))
+            nFalse++;
+    BOOST_CHECK(nFalse < 50);
+
+    rb.clear();
+    for (int i = 200; i < 300; i++)
+        BOOST_CHECK(!rb.contains(vHashes[i]));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
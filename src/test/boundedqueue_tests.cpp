@@ -0,0 +1,94 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "boundedqueue.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+static void Produce(CBoundedQueue<int>* pqueue, int nCount)
+{
+    for (int i = 0; i < nCount; i++)
+        pqueue->Push(i);
+    pqueue->Close();
+}
+
+BOOST_AUTO_TEST_SUITE(boundedqueue_tests)
+
+BOOST_AUTO_TEST_CASE(boundedqueue_fifo)
+{
+    CBoundedQueue<int> queue(4);
+    BOOST_CHECK(queue.Push(1));
+    BOOST_CHECK(queue.Push(2));
+    BOOST_CHECK(queue.Push(3));
+    BOOST_CHECK_EQUAL(queue.Size(), 3U);
+
+    int n = 0;
+    BOOST_CHECK(queue.Pop(n));
+    BOOST_CHECK_EQUAL(n, 1);
+
+    // closed queues refuse new elements but still hand out the remaining ones
+    queue.Close();
+    BOOST_CHECK(!queue.Push(4));
+    BOOST_CHECK(queue.Pop(n));
+    BOOST_CHECK_EQUAL(n, 2);
+    BOOST_CHECK(queue.Pop(n));
+    BOOST_CHECK_EQUAL(n, 3);
+    BOOST_CHECK(!queue.Pop(n));
+}
+
+BOOST_AUTO_TEST_CASE(boundedqueue_trypush)
+{
+    CBoundedQueue<int> queue(2);
+    BOOST_CHECK(queue.TryPush(1));
+    BOOST_CHECK(queue.TryPush(2));
+
+    // full: refused without blocking
+    BOOST_CHECK(!queue.TryPush(3));
+    BOOST_CHECK_EQUAL(queue.Size(), 2U);
+
+    int n = 0;
+    BOOST_CHECK(queue.Pop(n));
+    BOOST_CHECK(queue.TryPush(3));
+
+    queue.Close();
+    BOOST_CHECK(queue.Pop(n));
+    BOOST_CHECK(!queue.TryPush(4));
+    BOOST_CHECK(queue.Pop(n));
+    BOOST_CHECK_EQUAL(n, 3);
+}
+
+BOOST_AUTO_TEST_CASE(boundedqueue_abort)
+{
+    CBoundedQueue<int> queue(4);
+    queue.Push(1);
+    queue.Push(2);
+    queue.Abort();
+
+    int n = 0;
+    BOOST_CHECK(!queue.Pop(n));
+    BOOST_CHECK_EQUAL(queue.Size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(boundedqueue_threads)
+{
+    // a small queue forces the producer to block on the consumer
+    CBoundedQueue<int> queue(2);
+    boost::thread producer(boost::bind(&Produce, &queue, 1000));
+
+    std::vector<int> vReceived;
+    int n = 0;
+    while (queue.Pop(n))
+        vReceived.push_back(n);
+    producer.join();
+
+    BOOST_CHECK_EQUAL(vReceived.size(), 1000U);
+    for (unsigned int i = 0; i < vReceived.size(); i++)
+        BOOST_CHECK_EQUAL(vReceived[i], (int)i);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
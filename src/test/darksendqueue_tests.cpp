@@ -0,0 +1,63 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "darksend.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CDarksendQueue MakeQueue(unsigned int n, int nDenom, int64_t nTime)
+{
+    CDarksendQueue dsq;
+    dsq.vin = CTxIn(COutPoint(uint256(n), 0));
+    dsq.nDenom = nDenom;
+    dsq.time = nTime;
+    return dsq;
+}
+
+BOOST_AUTO_TEST_SUITE(darksendqueue_tests)
+
+BOOST_AUTO_TEST_CASE(darksendqueue_duplicates)
+{
+    int64_t nNow = GetTime();
+    CDarksendQueueStore store;
+
+    BOOST_CHECK(store.Add(MakeQueue(1, 2, nNow)));
+    BOOST_CHECK(store.Add(MakeQueue(2, 2, nNow)));
+    BOOST_CHECK(store.HasQueue(MakeQueue(1, 0, 0).vin));
+    BOOST_CHECK(!store.HasQueue(MakeQueue(3, 0, 0).vin));
+
+    // one open queue per Masternode, whatever the denomination
+    BOOST_CHECK(!store.Add(MakeQueue(1, 2, nNow)));
+    BOOST_CHECK(!store.Add(MakeQueue(1, 4, nNow)));
+    BOOST_CHECK_EQUAL(store.size(), 2);
+
+    store.Remove(MakeQueue(1, 2, nNow));
+    BOOST_CHECK(!store.HasQueue(MakeQueue(1, 0, 0).vin));
+    BOOST_CHECK(store.Add(MakeQueue(1, 4, nNow)));
+    BOOST_CHECK_EQUAL(store.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(darksendqueue_expiry)
+{
+    int64_t nNow = GetTime();
+    CDarksendQueueStore store;
+
+    store.Add(MakeQueue(1, 2, nNow + 20));
+    store.Add(MakeQueue(2, 2, nNow));
+    store.Add(MakeQueue(3, 2, nNow + 10));
+
+    std::vector<CDarksendQueue> vecQueues = store.GetQueues();
+    BOOST_CHECK_EQUAL(vecQueues.size(), 3U);
+    BOOST_CHECK(vecQueues[0].vin == MakeQueue(2, 0, 0).vin);
+    BOOST_CHECK(vecQueues[2].vin == MakeQueue(1, 0, 0).vin);
+
+    SetMockTime(nNow + DARKSEND_QUEUE_TIMEOUT + 11);
+    BOOST_CHECK_EQUAL(store.RemoveExpired(), 2);
+    BOOST_CHECK_EQUAL(store.size(), 1);
+    BOOST_CHECK(store.HasQueue(MakeQueue(1, 0, 0).vin));
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
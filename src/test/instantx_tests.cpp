@@ -0,0 +1,91 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "instantx.h"
+#include "core.h"
+
+#include <boost/test/unit_test.hpp>
+
+extern std::set<std::pair<int64_t, uint256> > setTxLockExpiry;
+
+BOOST_AUTO_TEST_SUITE(instantx_tests)
+
+BOOST_AUTO_TEST_CASE(instantx_complete_lock_survives_request_flood)
+{
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    CTransaction txLocked;
+    txLocked.vin.resize(1);
+    txLocked.vin[0].prevout.hash = GetRandHash();
+    txLocked.vout.resize(1);
+    txLocked.vout[0].nValue = 1*CENT;
+    uint256 hashLocked = txLocked.GetHash();
+
+    CTransaction txOpen;
+    txOpen.vin.resize(1);
+    txOpen.vin[0].prevout.hash = GetRandHash();
+    txOpen.vout.resize(1);
+    txOpen.vout[0].nValue = 1*CENT;
+    uint256 hashOpen = txOpen.GetHash();
+
+    AddTxLockRequest(txLocked, true);
+    AddTxLockRequest(txOpen, true);
+
+    CTransactionLock lock;
+    lock.nBlockHeight = 1;
+    lock.txHash = hashLocked;
+    lock.nExpiration = nStartTime + 60*60;
+    lock.nTimeout = nStartTime + 60*5;
+    lock.mapVotesByHeight[lock.nBlockHeight] = INSTANTX_SIGNATURES_REQUIRED;
+    mapTxLocks.insert(make_pair(hashLocked, lock));
+    mapLockedInputs.insert(make_pair(txLocked.vin[0].prevout, hashLocked));
+
+    // rejected requests only push out other rejected requests
+    for (unsigned int i = 0; i < INSTANTX_MAX_REJECTED_REQUESTS + 100; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        AddTxLockRequest(tx, false);
+    }
+    BOOST_CHECK(mapTxLockReqRejected.size() <= INSTANTX_MAX_REJECTED_REQUESTS);
+    BOOST_CHECK(mapTxLockReq.count(hashOpen));
+    BOOST_CHECK(mapTxLockReq.count(hashLocked));
+
+    // accepted requests push out the oldest open request, not the complete lock
+    for (unsigned int i = 0; i < INSTANTX_MAX_REQUESTS + 100; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        AddTxLockRequest(tx, true);
+    }
+    BOOST_CHECK(mapTxLockReq.size() <= INSTANTX_MAX_REQUESTS);
+    BOOST_CHECK(!mapTxLockReq.count(hashOpen));
+    BOOST_CHECK(mapTxLockReq.count(hashLocked));
+    BOOST_CHECK(mapTxLocks.count(hashLocked));
+    BOOST_CHECK(mapLockedInputs.count(txLocked.vin[0].prevout));
+    BOOST_CHECK(mapLockedInputs[txLocked.vin[0].prevout] == hashLocked);
+
+    // evicted requests don't leave their expiry entries behind
+    BOOST_CHECK_EQUAL(setTxLockExpiry.size(), mapTxLockReq.size() + mapTxLockReqRejected.size());
+
+    // an hour later everything is gone, the complete lock included
+    SetMockTime(nStartTime + 60*60 + 1);
+    CleanTransactionLocksList();
+    BOOST_CHECK(mapTxLockReq.empty());
+    BOOST_CHECK(mapTxLockReqRejected.empty());
+    BOOST_CHECK(mapTxLocks.empty());
+    BOOST_CHECK(mapLockedInputs.empty());
+    BOOST_CHECK(setTxLockExpiry.empty());
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,185 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CInv TxInv(int n)
+{
+    return CInv(MSG_TX, uint256(n));
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(askfor_same_tick_order)
+{
+    CAskForQueue queue(1000);
+    for (int i = 1; i <= 5; i++)
+        queue.Add(1010, TxInv(i));
+    queue.Add(1005, TxInv(6));
+    BOOST_CHECK_EQUAL(queue.size(), 6U);
+
+    vector<CInv> vDue;
+    queue.PopDue(1009, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 1U);
+    if (vDue.size() == 1)
+        BOOST_CHECK(vDue[0].hash == uint256(6));
+
+    // requests due at the same tick come out in the order they were added
+    vDue.clear();
+    queue.PopDue(1010, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 5U);
+    for (unsigned int i = 0; i < vDue.size(); i++)
+        BOOST_CHECK(vDue[i].hash == uint256(i + 1));
+    BOOST_CHECK(queue.empty());
+}
+
+BOOST_AUTO_TEST_CASE(askfor_past_due)
+{
+    CAskForQueue queue(1000);
+    queue.Add(500, TxInv(1));
+    queue.Add(1000, TxInv(2));
+
+    // nothing is handed out for the tick that was already processed
+    vector<CInv> vDue;
+    queue.PopDue(1000, vDue);
+    BOOST_CHECK(vDue.empty());
+    BOOST_CHECK_EQUAL(queue.size(), 2U);
+
+    // both are due on the next tick, in order
+    queue.PopDue(1001, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 2U);
+    if (vDue.size() == 2) {
+        BOOST_CHECK(vDue[0].hash == uint256(1));
+        BOOST_CHECK(vDue[1].hash == uint256(2));
+    }
+    BOOST_CHECK(queue.empty());
+}
+
+BOOST_AUTO_TEST_CASE(askfor_cascade)
+{
+    const int64_t nStart = 1000;
+    const int64_t nOuter = nStart + 2 * CTimerWheel::WHEEL_SLOTS;
+    const int64_t nOverflow = nStart + 2 * CTimerWheel::WHEEL_SLOTS * CTimerWheel::WHEEL_SLOTS;
+
+    CAskForQueue queue(nStart);
+    queue.Add(nOverflow, TxInv(1));
+    queue.Add(nOuter, TxInv(2));
+    queue.Add(nOverflow, TxInv(3));
+    queue.Add(nStart + 1, TxInv(4));
+    queue.Add(nOuter, TxInv(5));
+
+    vector<CInv> vDue;
+    queue.PopDue(nStart + 1, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 1U);
+
+    // the outer wheel entries come down to the inner wheel and fire on time
+    vDue.clear();
+    queue.PopDue(nOuter - 1, vDue);
+    BOOST_CHECK(vDue.empty());
+    queue.PopDue(nOuter, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 2U);
+    if (vDue.size() == 2) {
+        BOOST_CHECK(vDue[0].hash == uint256(2));
+        BOOST_CHECK(vDue[1].hash == uint256(5));
+    }
+
+    // the overflow entries cascade through both wheels, still in order
+    vDue.clear();
+    queue.PopDue(nOverflow - 1, vDue);
+    BOOST_CHECK(vDue.empty());
+    BOOST_CHECK_EQUAL(queue.size(), 2U);
+    queue.PopDue(nOverflow, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 2U);
+    if (vDue.size() == 2) {
+        BOOST_CHECK(vDue[0].hash == uint256(1));
+        BOOST_CHECK(vDue[1].hash == uint256(3));
+    }
+    BOOST_CHECK(queue.empty());
+
+    // the queue is usable again after it ran empty
+    queue.Add(nOverflow + 1, TxInv(6));
+    vDue.clear();
+    queue.PopDue(nOverflow + 1, vDue);
+    BOOST_CHECK_EQUAL(vDue.size(), 1U);
+    if (vDue.size() == 1)
+        BOOST_CHECK(vDue[0].hash == uint256(6));
+}
+
+BOOST_AUTO_TEST_CASE(relay_class)
+{
+    uint256 hash(1);
+    BOOST_CHECK_EQUAL(GetRelayClass(CInv(MSG_TXLOCK_REQUEST, hash)), RELAY_INSTANTX);
+    BOOST_CHECK_EQUAL(GetRelayClass(CInv(MSG_TXLOCK_VOTE, hash)), RELAY_INSTANTX);
+    BOOST_CHECK_EQUAL(GetRelayClass(CInv(MSG_BLOCK, hash)), RELAY_BLOCK);
+    BOOST_CHECK_EQUAL(GetRelayClass(CInv(MSG_FILTERED_BLOCK, hash)), RELAY_BLOCK);
+    BOOST_CHECK_EQUAL(GetRelayClass(CInv(MSG_SPORK, hash)), RELAY_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetRelayClass(CInv(MSG_MASTERNODE_WINNER, hash)), RELAY_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetRelayClass(CInv(MSG_TX, hash)), RELAY_TX);
+
+    BOOST_CHECK_EQUAL(string(GetRelayClassName(RELAY_INSTANTX)), "instantx");
+    BOOST_CHECK_EQUAL(string(GetRelayClassName(RELAY_TX)), "tx");
+    BOOST_CHECK_EQUAL(string(GetRelayClassName(RELAY_CLASSES)), "unknown");
+}
+
+BOOST_AUTO_TEST_CASE(relay_latency_buckets)
+{
+    // bucket i holds [2^(i-1), 2^i) milliseconds, bucket 0 everything below 1ms
+    const int64_t vBucketMicros[][2] = {
+        {-5, 0}, {0, 0}, {999, 0},
+        {1000, 1}, {1999, 1},
+        {2000, 2}, {3999, 2},
+        {4000, 3},
+        {16383999, CRelayLatency::BUCKETS - 2},
+        {16384000, CRelayLatency::BUCKETS - 1},
+        {3600 * 1000000LL, CRelayLatency::BUCKETS - 1},
+    };
+    const unsigned int nCases = sizeof(vBucketMicros) / sizeof(vBucketMicros[0]);
+    for (unsigned int i = 0; i < nCases; i++)
+    {
+        CRelayLatency latency;
+        latency.Add(vBucketMicros[i][0]);
+        BOOST_CHECK_EQUAL(latency.nCount, 1U);
+        for (int nBucket = 0; nBucket < CRelayLatency::BUCKETS; nBucket++)
+            BOOST_CHECK_MESSAGE(latency.vCount[nBucket] == (nBucket == vBucketMicros[i][1] ? 1U : 0U),
+                                vBucketMicros[i][0] << "us in bucket " << nBucket);
+    }
+
+    // negative latencies count as none
+    CRelayLatency latency;
+    latency.Add(-5);
+    BOOST_CHECK_EQUAL(latency.nTotalMicros, 0);
+    BOOST_CHECK_EQUAL(latency.nMaxMicros, 0);
+}
+
+BOOST_AUTO_TEST_CASE(relay_latency_merge)
+{
+    CRelayLatency a, b;
+    a.Add(500);
+    a.Add(3000);
+    b.Add(3500);
+    b.Add(20000000);
+
+    CRelayLatency merged;
+    merged.Add(a);
+    merged.Add(b);
+    BOOST_CHECK_EQUAL(merged.nCount, 4U);
+    BOOST_CHECK_EQUAL(merged.nTotalMicros, 500 + 3000 + 3500 + 20000000);
+    BOOST_CHECK_EQUAL(merged.nMaxMicros, 20000000);
+    BOOST_CHECK_EQUAL(merged.vCount[0], 1U);
+    BOOST_CHECK_EQUAL(merged.vCount[2], 2U);
+    BOOST_CHECK_EQUAL(merged.vCount[CRelayLatency::BUCKETS - 1], 1U);
+
+    // merging an empty histogram changes nothing
+    merged.Add(CRelayLatency());
+    BOOST_CHECK_EQUAL(merged.nCount, 4U);
+    BOOST_CHECK_EQUAL(merged.nMaxMicros, 20000000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,152 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcjson.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <clocale>
+#include <limits>
+#include <locale>
+#include <stdint.h>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+static Value SampleValue()
+{
+    string strAllBytes;
+    for (int i = 0; i < 256; i++)
+        strAllBytes += (char)i;
+
+    Array arr;
+    arr.push_back(0);
+    arr.push_back(-1);
+    arr.push_back(numeric_limits<int64_t>::max());
+    arr.push_back(numeric_limits<int64_t>::min());
+    arr.push_back(numeric_limits<uint64_t>::max());
+    arr.push_back(0.5);
+    arr.push_back(-21000000.12345678);
+    arr.push_back(true);
+    arr.push_back(false);
+    arr.push_back(Value::null);
+    arr.push_back(Array());
+    arr.push_back(Object());
+
+    Object obj;
+    obj.push_back(Pair("bytes", strAllBytes));
+    obj.push_back(Pair("", ""));
+    obj.push_back(Pair("esc\"aped\\", "a\"b\\c/d"));
+    obj.push_back(Pair("array", arr));
+    return obj;
+}
+
+// Decimal comma, as in the locales unpay-qt may run under
+struct CommaNumpunct : public numpunct<char>
+{
+    char do_decimal_point() const { return ','; }
+};
+
+BOOST_AUTO_TEST_SUITE(rpcjson_tests)
+
+BOOST_AUTO_TEST_CASE(rpcjson_write)
+{
+    Value value = SampleValue();
+    BOOST_CHECK_EQUAL(WriteJSON(value), write_string(value, false));
+
+    // appends to what is already there
+    string str = "x";
+    WriteJSON(Value(1), str);
+    BOOST_CHECK_EQUAL(str, "x1");
+}
+
+BOOST_AUTO_TEST_CASE(rpcjson_read)
+{
+    // round trip
+    Value value = SampleValue();
+    Value valueRead;
+    BOOST_CHECK(ReadJSON(write_string(value, false), valueRead));
+    BOOST_CHECK_EQUAL(write_string(valueRead, false), write_string(value, false));
+
+    // same values as the json_spirit reader
+    const char* pszValid[] = {
+        "{\"method\":\"getinfo\",\"params\":[],\"id\":1}",
+        " [ 1 , -2 , 3.5 , 1e3 , -0.25E-2 , \"s\" , true , false , null ] ",
+        "\"\\u0041\\x42\\t\\/\"",
+        "\"\\u12\"",
+        "\"\\x4\"",
+        "\"\\uzz41\\q\\x1\\\\\"",
+        "\"a\\\\\\\"b\"",
+        "\"\\x1\\\"\\x7f\\X1\"",
+        "[1e400,-1e400]",
+        "18446744073709551615",
+        "-9223372036854775808",
+        "{\"a\":{\"b\":[[],{}]}} trailing",
+    };
+    for (unsigned int i = 0; i < sizeof(pszValid) / sizeof(pszValid[0]); i++)
+    {
+        Value valueSpirit, valueFast;
+        BOOST_CHECK(read_string(string(pszValid[i]), valueSpirit));
+        BOOST_CHECK_MESSAGE(ReadJSON(pszValid[i], valueFast), pszValid[i]);
+        BOOST_CHECK_EQUAL(write_string(valueFast, false), write_string(valueSpirit, false));
+        BOOST_CHECK_EQUAL(valueFast.type(), valueSpirit.type());
+    }
+    BOOST_CHECK(ReadJSON("18446744073709551615", valueRead) && valueRead.is_uint64());
+    BOOST_CHECK(ReadJSON("1.0", valueRead) && valueRead.type() == real_type);
+    BOOST_CHECK(ReadJSON("1", valueRead) && valueRead.type() == int_type);
+
+    const char* pszInvalid[] = {
+        "",
+        "   ",
+        "{",
+        "[1,]",
+        "[1 2]",
+        "{\"a\" 1}",
+        "{1:2}",
+        "\"unterminated",
+        "tru",
+        "-",
+        "18446744073709551616",
+        "-9223372036854775809",
+        "\"\\x\"",
+        "\"\\xff\"",
+        "\"\\Xg\"",
+    };
+    for (unsigned int i = 0; i < sizeof(pszInvalid) / sizeof(pszInvalid[0]); i++)
+        BOOST_CHECK_MESSAGE(!ReadJSON(pszInvalid[i], valueRead), pszInvalid[i]);
+
+    // nesting is limited
+    string strDeep(MAX_JSON_DEPTH, '[');
+    strDeep += string(MAX_JSON_DEPTH, ']');
+    BOOST_CHECK(ReadJSON(strDeep, valueRead));
+    BOOST_CHECK(!ReadJSON("[" + strDeep + "]", valueRead));
+}
+
+BOOST_AUTO_TEST_CASE(rpcjson_locale)
+{
+    // unpay-qt calls setlocale(LC_ALL, ""), use a comma locale if this system has one
+    const char* pszLocales[] = {"de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", "fr_FR.utf8", "nl_NL.UTF-8"};
+    string strOldLocale = setlocale(LC_NUMERIC, NULL);
+    bool fCLocale = false;
+    for (unsigned int i = 0; i < sizeof(pszLocales) / sizeof(pszLocales[0]) && !fCLocale; i++)
+        fCLocale = setlocale(LC_NUMERIC, pszLocales[i]) != NULL && localeconv()->decimal_point[0] == ',';
+    if (!fCLocale)
+        BOOST_TEST_MESSAGE("rpcjson_locale: no comma decimal C locale installed, only the C++ locale is changed");
+    locale oldLocale = locale::global(locale(locale::classic(), new CommaNumpunct));
+
+    Value valueRead;
+    BOOST_CHECK_EQUAL(WriteJSON(Value(0.5)), "0.50000000");
+    BOOST_CHECK_EQUAL(WriteJSON(Value(-21000000.12345678)), "-21000000.12345678");
+    BOOST_CHECK(ReadJSON("0.5", valueRead) && valueRead.type() == real_type && valueRead.get_real() == 0.5);
+    BOOST_CHECK(ReadJSON("[1.25e2]", valueRead) && valueRead.get_array()[0].get_real() == 125.0);
+
+    locale::global(oldLocale);
+    setlocale(LC_NUMERIC, strOldLocale.c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,84 @@
+// Copyright (c) 2014-2015 The Unpay developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scheduler.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(scheduler_tests)
+
+BOOST_AUTO_TEST_CASE(timerwheel_order)
+{
+    CTimerWheel wheel;
+    wheel.Add(5, 1);
+    wheel.Add(3, 2);
+    wheel.Add(70, 3);     // outer wheel
+    wheel.Add(5000, 4);   // overflow
+    wheel.Add(0, 5);      // already passed, fires on the next tick
+    BOOST_CHECK_EQUAL(wheel.Size(), 5);
+
+    std::vector<int> vFired;
+    wheel.Advance(1, vFired);
+    BOOST_CHECK_EQUAL(vFired.size(), 1U);
+    BOOST_CHECK_EQUAL(vFired[0], 5);
+
+    vFired.clear();
+    wheel.Advance(69, vFired);
+    BOOST_CHECK_EQUAL(vFired.size(), 2U);
+    BOOST_CHECK_EQUAL(vFired[0], 2);
+    BOOST_CHECK_EQUAL(vFired[1], 1);
+
+    vFired.clear();
+    wheel.Advance(70, vFired);
+    BOOST_CHECK_EQUAL(vFired.size(), 1U);
+    BOOST_CHECK_EQUAL(vFired[0], 3);
+
+    vFired.clear();
+    wheel.Advance(4999, vFired);
+    BOOST_CHECK(vFired.empty());
+    wheel.Advance(5000, vFired);
+    BOOST_CHECK_EQUAL(vFired.size(), 1U);
+    BOOST_CHECK_EQUAL(vFired[0], 4);
+    BOOST_CHECK_EQUAL(wheel.Size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(timerwheel_periodic)
+{
+    // rescheduling from the fired callback, as CScheduler does
+    CTimerWheel wheel;
+    wheel.Add(7, 0);
+    wheel.Add(60, 1);
+
+    int nFired[2] = {0, 0};
+    for (int64_t nNow = 1; nNow <= 10000; nNow += 3)
+    {
+        std::vector<int> vFired;
+        wheel.Advance(nNow, vFired);
+        for (unsigned int i = 0; i < vFired.size(); i++) {
+            nFired[vFired[i]]++;
+            wheel.Add(wheel.Current() + (vFired[i] == 0 ? 7 : 60), vFired[i]);
+        }
+    }
+    BOOST_CHECK(nFired[0] >= 10000 / 10 && nFired[0] <= 10000 / 7);
+    BOOST_CHECK(nFired[1] >= 10000 / 63 && nFired[1] <= 10000 / 60);
+    BOOST_CHECK_EQUAL(wheel.Size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(monotonic_clock)
+{
+    CMonotonicMillis clock;
+    BOOST_CHECK_EQUAL(clock.Get(10000), 10000);
+    BOOST_CHECK_EQUAL(clock.Get(12000), 12000);
+
+    // stepped back an hour: time stands still for that step, then carries on
+    BOOST_CHECK_EQUAL(clock.Get(12000 - 3600 * 1000), 12000);
+    BOOST_CHECK_EQUAL(clock.Get(13000 - 3600 * 1000), 13000);
+
+    // stepped forward again
+    BOOST_CHECK_EQUAL(clock.Get(20000), 20000 + 3600 * 1000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
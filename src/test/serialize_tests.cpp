@@ -44,6 +44,27 @@ BOOST_AUTO_TEST_CASE(varints)
     }
 }
 
+BOOST_AUTO_TEST_CASE(bigendian32)
+{
+    CDataStream ss(SER_DISK, 0);
+    int n = 0x01020304;
+    ss << BIGENDIAN32(n);
+    BOOST_CHECK_EQUAL(::GetSerializeSize(BIGENDIAN32(n), 0, 0), 4U);
+    BOOST_CHECK(ss.size() == 4 && ss[0] == 1 && ss[1] == 2 && ss[2] == 3 && ss[3] == 4);
+    int j = 0;
+    ss >> BIGENDIAN32(j);
+    BOOST_CHECK_EQUAL(j, n);
+
+    // serialized values sort like the numbers
+    for (unsigned int i = 1; i < 100000000; i += 999983) {
+        unsigned int a = i - 1, b = i;
+        CDataStream ssa(SER_DISK, 0), ssb(SER_DISK, 0);
+        ssa << BIGENDIAN32(a);
+        ssb << BIGENDIAN32(b);
+        BOOST_CHECK(ssa.str() < ssb.str());
+    }
+}
+
 BOOST_AUTO_TEST_CASE(compactsize)
 {
     CDataStream ss(SER_DISK, 0);
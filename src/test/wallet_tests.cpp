@@ -4,6 +4,12 @@
 
 #include "wallet.h"
 
+#include "instantx.h"
+#include "walletdb.h"
+
+#include <algorithm>
+#include <list>
+#include <map>
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -21,6 +27,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -303,4 +311,304 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(keypool_refill)
+{
+    unsigned int nBefore;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        nBefore = pwalletMain->GetKeyPoolSize();
+    }
+
+    // refill across more than one write batch and check that every key landed
+    unsigned int nTarget = nBefore + 2 * KEYPOOL_BATCH_SIZE + 10;
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget - 1));
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget);
+    }
+    set<CKeyID> setAddress;
+    pwalletMain->GetAllReserveKeys(setAddress);
+    BOOST_CHECK_EQUAL(setAddress.size(), nTarget);
+
+    // a smaller target leaves the pool alone
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(1));
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget);
+    }
+
+    // a wallet whose file can't be opened must not keep any pool entries
+    CWallet walletNoFile("keypool_missing.dat");
+    BOOST_CHECK_THROW(walletNoFile.TopUpKeyPool(10), runtime_error);
+    {
+        LOCK(walletNoFile.cs_wallet);
+        BOOST_CHECK_EQUAL(walletNoFile.GetKeyPoolSize(), 0U);
+    }
+}
+
+// Puts back what receivedbyaddress_instantx changes in the node's global
+// state, also when the test case is aborted by an exception.
+struct InstantXStateRestorer
+{
+    int nInstantXDepthOld;
+    CTransaction tx;
+
+    InstantXStateRestorer(const CTransaction& txIn) : nInstantXDepthOld(nInstantXDepth), tx(txIn) {}
+
+    ~InstantXStateRestorer()
+    {
+        uint256 hash = tx.GetHash();
+        nInstantXDepth = nInstantXDepthOld;
+        mapTxLocks.erase(hash);
+        list<CTransaction> removed;
+        mempool.remove(tx, removed);
+        pwalletMain->EraseFromWallet(hash);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(receivedbyaddress_instantx)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKeyID keyID = pwalletMain->GenerateNewKey().GetID();
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(keyID);
+    uint256 hash = tx.GetHash();
+    BOOST_CHECK(!mapTxLocks.count(hash));
+    BOOST_CHECK(!mempool.exists(hash));
+    InstantXStateRestorer restorer(tx);
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, tx)));
+
+    // neither in a block nor in the mempool
+    BOOST_CHECK_EQUAL(pwalletMain->GetReceivedByAddress(keyID, 0), 0);
+
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 0, GetTime(), 0.0, chainActive.Height()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetReceivedByAddress(keyID, 0), 5 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetReceivedByAddress(keyID, 1), 0);
+
+    // an InstantX lock counts as nInstantXDepth confirmations
+    nInstantXDepth = 5;
+    CTransactionLock lock;
+    lock.nBlockHeight = chainActive.Height() + 1;
+    lock.txHash = hash;
+    lock.nExpiration = lock.nBlockHeight + 24;
+    lock.nTimeout = GetTime() + 60;
+    lock.mapVotesByHeight[lock.nBlockHeight] = INSTANTX_SIGNATURES_REQUIRED;
+    mapTxLocks.insert(make_pair(hash, lock));
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetReceivedByAddress(keyID, 1), 5 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetReceivedByAddress(keyID, 5), 5 * COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetReceivedByAddress(keyID, 6), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rescan_spend_before_funding)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKeyID keyID = pwalletMain->GenerateNewKey().GetID();
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.resize(1);
+    txFund.vout[0].nValue = 5 * COIN;
+    txFund.vout[0].scriptPubKey.SetDestination(keyID);
+    uint256 hashFund = txFund.GetHash();
+
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(hashFund, 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 5 * COIN;
+    txSpend.vout[0].scriptPubKey.SetDestination(keyOther.GetPubKey().GetID());
+    uint256 hashSpend = txSpend.GetHash();
+
+    CBlock blockFund, blockSpend;
+    blockFund.vtx.push_back(txFund);
+    blockSpend.vtx.push_back(txSpend);
+
+    // the block with the spend reaches the wallet before the scan finds the funding
+    pwalletMain->SyncTransaction(hashSpend, txSpend, &blockSpend);
+    BOOST_CHECK(!pwalletMain->mapWallet.count(hashSpend));
+    BOOST_CHECK(pwalletMain->AddToWalletIfInvolvingMe(hashFund, txFund, &blockFund, false));
+    BOOST_CHECK(!pwalletMain->IsSpent(hashFund, 0));
+
+    // the second pass over the spending block picks it up
+    std::set<uint256> setFound;
+    setFound.insert(hashFund);
+    BOOST_CHECK_EQUAL(pwalletMain->AddSpendsOf(setFound, blockSpend.vtx, &blockSpend, false), 1);
+    BOOST_CHECK(pwalletMain->mapWallet.count(hashSpend));
+    BOOST_CHECK(setFound.count(hashSpend));
+    BOOST_CHECK(pwalletMain->IsSpent(hashFund, 0));
+    BOOST_CHECK_EQUAL(pwalletMain->AddSpendsOf(setFound, blockSpend.vtx, &blockSpend, false), 0);
+
+    pwalletMain->EraseFromWallet(hashSpend);
+    pwalletMain->EraseFromWallet(hashFund);
+}
+
+// the accounts listtransactions shows a wallet transaction under
+static bool IsTxInAccount(const CWalletTx& wtx, const string& strAccount)
+{
+    if (strAccount == "*" || wtx.strFromAccount == strAccount)
+        return true;
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        if (!pwalletMain->IsMine(txout))
+            continue;
+        CTxDestination address;
+        if (!ExtractDestination(txout.scriptPubKey, address))
+            address = CNoDestination();
+        map<CTxDestination, CAddressBookData>::const_iterator mi = pwalletMain->mapAddressBook.find(address);
+        if ((mi != pwalletMain->mapAddressBook.end() ? mi->second.name : "") == strAccount)
+            return true;
+    }
+    return false;
+}
+
+// The activity log of an account the way listtransactions used to collect it:
+// a scan of every wallet transaction plus the accounting entries read from the
+// database. Other suites write accounting entries straight to the database, so
+// only the transactions in setTxids and the entries of strEntryAccount count.
+static vector<pair<int64_t, uint256> > ScanOrderedTxItems(const string& strAccount, const set<uint256>& setTxids, const string& strEntryAccount)
+{
+    vector<pair<int64_t, uint256> > vItems;
+    for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+        if (setTxids.count(it->first) && IsTxInAccount(it->second, strAccount))
+            vItems.push_back(make_pair(it->second.nOrderPos, it->first));
+    list<CAccountingEntry> acentries;
+    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit(strAccount, acentries);
+    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+        if (entry.strAccount == strEntryAccount)
+            vItems.push_back(make_pair(entry.nOrderPos, uint256(0)));
+    sort(vItems.begin(), vItems.end());
+    return vItems;
+}
+
+static vector<pair<int64_t, uint256> > IndexOrderedTxItems(const string& strAccount, const set<uint256>& setTxids, const string& strEntryAccount)
+{
+    vector<pair<int64_t, uint256> > vItems;
+    const CWallet::TxItems& txOrdered = pwalletMain->OrderedTxItems(strAccount);
+    for (CWallet::TxItems::const_iterator it = txOrdered.begin(); it != txOrdered.end(); ++it)
+    {
+        CWalletTx *const pwtx = (*it).second.first;
+        CAccountingEntry *const pacentry = (*it).second.second;
+        if (pwtx && setTxids.count(pwtx->GetHash()))
+            vItems.push_back(make_pair(it->first, pwtx->GetHash()));
+        else if (pacentry && pacentry->strAccount == strEntryAccount)
+            vItems.push_back(make_pair(it->first, uint256(0)));
+    }
+    return vItems;
+}
+
+// the transactions in setTxids listsinceblock returns for the block at nHeight,
+// from a scan of the whole wallet and from the height index
+static set<uint256> ScanTxsSinceHeight(int nHeight, const set<uint256>& setTxids)
+{
+    int nDepth = 1 + chainActive.Height() - nHeight;
+    set<uint256> setRet;
+    for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+        if (setTxids.count(it->first) && it->second.GetDepthInMainChain() < nDepth)
+            setRet.insert(it->first);
+    return setRet;
+}
+
+static set<uint256> IndexTxsSinceHeight(int nHeight, const set<uint256>& setTxids)
+{
+    int nDepth = 1 + chainActive.Height() - nHeight;
+    set<uint256> setRet;
+    vector<const CWalletTx*> vpwtx;
+    pwalletMain->GetTxsAboveHeight(nHeight, vpwtx);
+    BOOST_FOREACH(const CWalletTx* pwtx, vpwtx)
+        if (setTxids.count(pwtx->GetHash()) && pwtx->GetDepthInMainChain() < nDepth)
+            setRet.insert(pwtx->GetHash());
+    return setRet;
+}
+
+static void CheckTxIndex(const set<uint256>& setTxids)
+{
+    const char* accounts[] = {"*", "", "ordered-a", "ordered-b", "ordered-none"};
+    BOOST_FOREACH(const char* strAccount, accounts)
+        BOOST_CHECK_MESSAGE(ScanOrderedTxItems(strAccount, setTxids, "ordered-b") == IndexOrderedTxItems(strAccount, setTxids, "ordered-b"), strAccount);
+    for (int nHeight = -1; nHeight <= chainActive.Height(); nHeight++)
+        BOOST_CHECK(ScanTxsSinceHeight(nHeight, setTxids) == IndexTxsSinceHeight(nHeight, setTxids));
+}
+
+BOOST_AUTO_TEST_CASE(ordered_tx_index)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKeyID keyNamed = pwalletMain->GenerateNewKey().GetID();
+    CKeyID keyUnnamed = pwalletMain->GenerateNewKey().GetID();
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->SetAddressBook(keyNamed, "ordered-a", "receive"));
+
+    // build the per account index first, so the transactions below are
+    // added to it incrementally
+    BOOST_CHECK(pwalletMain->OrderedTxItems("ordered-a").empty());
+
+    // unconfirmed, to a labelled address
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(keyNamed);
+    CWalletTx wtxUnconfirmed(pwalletMain, tx);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxUnconfirmed));
+
+    // in the genesis block, to an unlabelled address
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout[0].scriptPubKey.SetDestination(keyUnnamed);
+    CWalletTx wtxConfirmed(pwalletMain, tx);
+    wtxConfirmed.hashBlock = chainActive.Genesis()->GetBlockHash();
+    wtxConfirmed.nIndex = 0;
+    wtxConfirmed.fMerkleVerified = true;
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxConfirmed));
+
+    // sent from an account to someone else
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout[0].scriptPubKey.SetDestination(keyOther.GetPubKey().GetID());
+    CWalletTx wtxSent(pwalletMain, tx);
+    wtxSent.strFromAccount = "ordered-b";
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxSent));
+
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CAccountingEntry entry;
+    entry.strAccount = "ordered-b";
+    entry.nCreditDebit = -1 * COIN;
+    entry.nTime = GetAdjustedTime();
+    entry.strOtherAccount = "ordered-a";
+    entry.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    BOOST_CHECK(pwalletMain->AddAccountingEntry(entry, walletdb));
+
+    set<uint256> setTxids;
+    setTxids.insert(wtxUnconfirmed.GetHash());
+    setTxids.insert(wtxConfirmed.GetHash());
+    setTxids.insert(wtxSent.GetHash());
+    CheckTxIndex(setTxids);
+    BOOST_CHECK(pwalletMain->OrderedTxItems("ordered-none").empty());
+    BOOST_CHECK_EQUAL(pwalletMain->OrderedTxItems("ordered-b").size(), 2U);
+
+    // the confirmed transaction is only listed since blocks below it
+    BOOST_CHECK(IndexTxsSinceHeight(-1, setTxids).count(wtxConfirmed.GetHash()));
+    BOOST_CHECK(!IndexTxsSinceHeight(0, setTxids).count(wtxConfirmed.GetHash()));
+    BOOST_CHECK(IndexTxsSinceHeight(0, setTxids).count(wtxUnconfirmed.GetHash()));
+
+    // labelling an address moves its transactions to that account
+    BOOST_CHECK(pwalletMain->SetAddressBook(keyUnnamed, "ordered-b", "receive"));
+    CheckTxIndex(setTxids);
+    BOOST_CHECK_EQUAL(pwalletMain->OrderedTxItems("ordered-b").size(), 3U);
+
+    pwalletMain->EraseFromWallet(wtxUnconfirmed.GetHash());
+    pwalletMain->EraseFromWallet(wtxConfirmed.GetHash());
+    pwalletMain->EraseFromWallet(wtxSent.GetHash());
+    CheckTxIndex(setTxids);
+    BOOST_CHECK_EQUAL(pwalletMain->OrderedTxItems("ordered-b").size(), 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -65,7 +65,7 @@ bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const u
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe), nIndexBatchOps(0) {
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -169,6 +169,136 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+void CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64_t> >&vect) {
+    LOCK(cs_indexBatch);
+    for (std::vector<std::pair<CAddressIndexKey, int64_t> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        indexBatch.Write(make_pair('a', it->first), it->second);
+    nIndexBatchOps += vect.size();
+}
+
+void CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64_t> >&vect) {
+    LOCK(cs_indexBatch);
+    for (std::vector<std::pair<CAddressIndexKey, int64_t> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        indexBatch.Erase(make_pair('a', it->first));
+    nIndexBatchOps += vect.size();
+}
+
+void CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >&vect) {
+    LOCK(cs_indexBatch);
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            indexBatch.Erase(make_pair('u', it->first));
+        else
+            indexBatch.Write(make_pair('u', it->first), it->second);
+    }
+    nIndexBatchOps += vect.size();
+}
+
+void CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
+    LOCK(cs_indexBatch);
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            indexBatch.Erase(make_pair('p', it->first));
+        else
+            indexBatch.Write(make_pair('p', it->first), it->second);
+    }
+    nIndexBatchOps += vect.size();
+}
+
+bool CBlockTreeDB::FlushIndexBatch() {
+    LOCK(cs_indexBatch);
+    if (nIndexBatchOps == 0)
+        return true;
+    if (!WriteBatch(indexBatch))
+        return false;
+    indexBatch.Clear();
+    nIndexBatchOps = 0;
+    return true;
+}
+
+unsigned int CBlockTreeDB::GetIndexBatchSize() const {
+    LOCK(cs_indexBatch);
+    return nIndexBatchOps;
+}
+
+bool CBlockTreeDB::ReadAddressIndex(unsigned char nType, const uint160 &hashBytes, std::vector<std::pair<CAddressIndexKey, int64_t> > &vect, int nStart, int nEnd) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexKey(nType, hashBytes, nStart, 0, uint256(0), 0, false));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType;
+            if (chType != 'a')
+                break;
+            ssKey >> key;
+            if (key.nType != nType || key.hashBytes != hashBytes || (nEnd > 0 && key.nBlockHeight > nEnd))
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64_t nValue;
+            ssValue >> nValue;
+            vect.push_back(make_pair(key, nValue));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(unsigned char nType, const uint160 &hashBytes, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressUnspentKey(nType, hashBytes, uint256(0), 0));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType;
+            if (chType != 'u')
+                break;
+            ssKey >> key;
+            if (key.nType != nType || key.hashBytes != hashBytes)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vect.push_back(make_pair(key, value));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+
+    return true;
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value) {
+    return Read(make_pair('p', key), value);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -6,8 +6,10 @@
 #ifndef BITCOIN_TXDB_LEVELDB_H
 #define BITCOIN_TXDB_LEVELDB_H
 
+#include "addressindex.h"
 #include "leveldbwrapper.h"
 #include "main.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -50,6 +52,11 @@ public:
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    // queued address and spent index updates, see FlushIndexBatch
+    mutable CCriticalSection cs_indexBatch;
+    CLevelDBBatch indexBatch;
+    unsigned int nIndexBatchOps;
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
@@ -61,6 +68,19 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    // Address and spent index updates are queued in order and only written
+    // by FlushIndexBatch(), so that many blocks can go to disk at once.
+    void WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64_t> > &vect);
+    void EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64_t> > &vect);
+    void UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    void UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vect);
+    bool FlushIndexBatch();
+    unsigned int GetIndexBatchSize() const;
+    // Readers only see what FlushIndexBatch() has written, which lags behind
+    // the chain tip during initial block download; they never flush themselves.
+    bool ReadAddressIndex(unsigned char nType, const uint160 &hashBytes, std::vector<std::pair<CAddressIndexKey, int64_t> > &vect, int nStart = 0, int nEnd = 0);
+    bool ReadAddressUnspentIndex(unsigned char nType, const uint160 &hashBytes, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    bool ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -86,6 +86,9 @@ public:
     /** Number of network connections changed. */
     boost::signals2::signal<void (int newNumConnections)> NotifyNumConnectionsChanged;
 
+    /** Number of (enabled) masternodes changed. */
+    boost::signals2::signal<void ()> NotifyMasternodeListChanged;
+
     /**
      * New, updated or cancelled alert.
      * @note called with lock cs_mapAlerts held.
@@ -7,7 +7,9 @@
 #include "wallet.h"
 
 #include "base58.h"
+#include "boundedqueue.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "net.h"
 #include "darksend.h"
@@ -15,6 +17,9 @@
 #include "instantx.h"
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include <openssl/rand.h>
 
 
@@ -55,13 +60,17 @@ CPubKey CWallet::GenerateNewKey()
     RandAddSeedPerfmon();
     CKey secret;
     secret.MakeNewKey(fCompressed);
+    return AddNewKey(secret, secret.GetPubKey());
+}
+
+CPubKey CWallet::AddNewKey(const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
 
     // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
+    if (secret.IsCompressed())
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
-    CPubKey pubkey = secret.GetPubKey();
-
     // Create new metadata
     int64_t nCreationTime = GetTime();
     mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
@@ -69,7 +78,7 @@ CPubKey CWallet::GenerateNewKey()
         nTimeFirstKey = nCreationTime;
 
     if (!AddKeyPubKey(secret, pubkey))
-        throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
+        throw std::runtime_error("CWallet::AddNewKey() : AddKey failed");
     return pubkey;
 }
 
@@ -81,9 +90,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey,
-                                                 secret.GetPrivKey(),
-                                                 mapKeyMetadata[pubkey.GetID()]);
+        CWalletBatch batch(this);
+        return batch.GetDB().WriteKey(pubkey,
+                                      secret.GetPrivKey(),
+                                      mapKeyMetadata[pubkey.GetID()]) && batch.Commit();
     }
     return true;
 }
@@ -102,9 +112,12 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
         else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
-                                                            vchCryptedSecret,
-                                                            mapKeyMetadata[vchPubKey.GetID()]);
+        {
+            CWalletBatch batch(this);
+            return batch.GetDB().WriteCryptedKey(vchPubKey,
+                                                 vchCryptedSecret,
+                                                 mapKeyMetadata[vchPubKey.GetID()]) && batch.Commit();
+        }
     }
     return false;
 }
@@ -130,7 +143,8 @@ bool CWallet::AddCScript(const CScript& redeemScript)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    CWalletBatch batch(this);
+    return batch.GetDB().WriteCScript(Hash160(redeemScript), redeemScript) && batch.Commit();
 }
 
 bool CWallet::LoadCScript(const CScript& redeemScript)
@@ -243,7 +257,11 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
                     return false;
                 if (!crypter.Encrypt(vMasterKey, pMasterKey.second.vchCryptedKey))
                     return false;
-                CWalletDB(strWalletFile).WriteMasterKey(pMasterKey.first, pMasterKey.second);
+                {
+                    CWalletBatch batch(this);
+                    batch.GetDB().WriteMasterKey(pMasterKey.first, pMasterKey.second);
+                    batch.Commit();
+                }
                 if (fWasLocked)
                     Lock();
 
@@ -268,8 +286,11 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
-    CWalletDB walletdb(strWalletFile);
-    walletdb.WriteBestBlock(loc);
+    if (!fFileBacked)
+        return;
+    CWalletBatch batch(this);
+    batch.GetDB().WriteBestBlock(loc);
+    batch.Commit();
 }
 
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
@@ -287,13 +308,16 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
     if (nVersion > nWalletMaxVersion)
         nWalletMaxVersion = nVersion;
 
-    if (fFileBacked)
+    if (fFileBacked && nWalletVersion > 40000)
     {
-        CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
-        if (nWalletVersion > 40000)
-            pwalletdb->WriteMinVersion(nWalletVersion);
-        if (!pwalletdbIn)
-            delete pwalletdb;
+        if (pwalletdbIn)
+            pwalletdbIn->WriteMinVersion(nWalletVersion);
+        else
+        {
+            CWalletBatch batch(this);
+            batch.GetDB().WriteMinVersion(nWalletVersion);
+            batch.Commit();
+        }
     }
 
     return true;
@@ -506,35 +530,341 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     int64_t nRet = nOrderPosNext++;
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
-    } else {
-        CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
+    } else if (fFileBacked) {
+        CWalletBatch batch(this);
+        batch.GetDB().WriteOrderPosNext(nOrderPosNext);
+        batch.Commit();
     }
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::GetTxAccounts(const CWalletTx& wtx, std::set<std::string>& setAccounts) const
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
+    // the accounts ListTransactions can show wtx under: the one it was sent
+    // from and those of the addresses it pays to us
+    setAccounts.insert(wtx.strFromAccount);
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        if (!IsMine(txout))
+            continue;
+        CTxDestination address;
+        if (!ExtractDestination(txout.scriptPubKey, address))
+            address = CNoDestination();
+        std::map<CTxDestination, CAddressBookData>::const_iterator mi = mapAddressBook.find(address);
+        setAccounts.insert(mi != mapAddressBook.end() ? mi->second.name : "");
+    }
+}
+
+void CWallet::AddToTxIndex(CWalletTx* pwtx)
+{
+    wtxOrdered.insert(make_pair(pwtx->nOrderPos, TxPair(pwtx, (CAccountingEntry*)0)));
+    if (!fAccountOrderedDirty)
+    {
+        std::set<std::string> setAccounts;
+        GetTxAccounts(*pwtx, setAccounts);
+        BOOST_FOREACH(const std::string& strAccount, setAccounts)
+            mapAccountOrdered[strAccount].insert(make_pair(pwtx->nOrderPos, TxPair(pwtx, (CAccountingEntry*)0)));
+    }
+    if (!fAddressIndexDirty)
+        AddToAddressIndex(*pwtx);
+    UpdateTxHeight(*pwtx);
+}
+
+void CWallet::RemoveFromTxIndex(CWalletTx* pwtx)
+{
+    std::pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second.first == pwtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
+    }
+    fAccountOrderedDirty = true;
+    fAddressIndexDirty = true;
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    uint256 hash = pwtx->GetHash();
+    std::map<uint256, int>::iterator mi = mapTxHeight.find(hash);
+    if (mi != mapTxHeight.end())
+    {
+        setTxByHeight.erase(make_pair(mi->second, hash));
+        mapTxHeight.erase(mi);
+    }
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+void CWallet::UpdateTxHeight(const CWalletTx& wtx)
+{
+    int nHeight = -1;
+    if (wtx.hashBlock != 0)
+    {
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+            nHeight = mi->second->nHeight;
+    }
+
+    uint256 hash = wtx.GetHash();
+    std::map<uint256, int>::iterator mi = mapTxHeight.find(hash);
+    if (mi != mapTxHeight.end())
+    {
+        if (mi->second == nHeight)
+            return;
+        setTxByHeight.erase(make_pair(mi->second, hash));
+        if (!fAddressIndexDirty)
+            TallyTxHeight(wtx, mi->second, false);
+        mi->second = nHeight;
+    }
+    else
+        mapTxHeight.insert(make_pair(hash, nHeight));
+    setTxByHeight.insert(make_pair(nHeight, hash));
+    if (!fAddressIndexDirty)
+        TallyTxHeight(wtx, nHeight, true);
+}
+
+void CWallet::BuildTxIndex()
+{
+    LOCK2(cs_main, cs_wallet);
+
+    laccentries.clear();
+    if (fFileBacked)
+        CWalletBatch(this).GetDB().ListAccountCreditDebit("*", laccentries);
+
+    wtxOrdered.clear();
+    setTxByHeight.clear();
+    mapTxHeight.clear();
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        UpdateTxHeight(*wtx);
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
     }
+    fAccountOrderedDirty = true;
+    fAddressIndexDirty = true;
+}
 
-    return txOrdered;
+void CWallet::RebuildAccountIndex()
+{
+    mapAccountOrdered.clear();
+    for (TxItems::iterator it = wtxOrdered.begin(); it != wtxOrdered.end(); ++it)
+    {
+        CWalletTx *const pwtx = (*it).second.first;
+        CAccountingEntry *const pacentry = (*it).second.second;
+        if (pwtx)
+        {
+            std::set<std::string> setAccounts;
+            GetTxAccounts(*pwtx, setAccounts);
+            BOOST_FOREACH(const std::string& strAccount, setAccounts)
+                mapAccountOrdered[strAccount].insert(*it);
+        }
+        else
+            mapAccountOrdered[pacentry->strAccount].insert(*it);
+    }
+    fAccountOrderedDirty = false;
+}
+
+const CWallet::TxItems& CWallet::OrderedTxItems(const std::string& strAccount)
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+
+    if (strAccount == "*")
+        return wtxOrdered;
+
+    if (fAccountOrderedDirty)
+        RebuildAccountIndex();
+    std::map<std::string, TxItems>::const_iterator mi = mapAccountOrdered.find(strAccount);
+    if (mi == mapAccountOrdered.end())
+    {
+        static const TxItems txEmpty;
+        return txEmpty;
+    }
+    return mi->second;
+}
+
+void CWallet::GetTxsAboveHeight(int nHeight, std::vector<const CWalletTx*>& vpwtx) const
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+
+    std::set<std::pair<int, uint256> >::const_iterator it = setTxByHeight.begin();
+    for (; it != setTxByHeight.end() && it->first == -1; ++it)
+        vpwtx.push_back(&mapWallet.find(it->second)->second);
+    for (it = setTxByHeight.lower_bound(make_pair(std::max(nHeight + 1, 0), uint256(0))); it != setTxByHeight.end(); ++it)
+        vpwtx.push_back(&mapWallet.find(it->second)->second);
+}
+
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb)
+{
+    AssertLockHeld(cs_wallet);
+    if (!walletdb.WriteAccountingEntry(acentry))
+        return false;
+
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    if (!fAccountOrderedDirty)
+        mapAccountOrdered[entry.strAccount].insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    return true;
+}
+
+int64_t CWallet::GetAccountCreditDebit(const std::string& strAccount)
+{
+    int64_t nCreditDebit = 0;
+    const TxItems& txOrdered = OrderedTxItems(strAccount);
+    for (TxItems::const_iterator it = txOrdered.begin(); it != txOrdered.end(); ++it)
+    {
+        CAccountingEntry *const pacentry = (*it).second.second;
+        if (pacentry)
+            nCreditDebit += pacentry->nCreditDebit;
+    }
+    return nCreditDebit;
+}
+
+void CWallet::ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& acentries)
+{
+    const TxItems& txOrdered = OrderedTxItems(strAccount);
+    for (TxItems::const_iterator it = txOrdered.begin(); it != txOrdered.end(); ++it)
+    {
+        CAccountingEntry *const pacentry = (*it).second.second;
+        if (pacentry)
+            acentries.push_back(*pacentry);
+    }
+}
+
+void CWallet::AddToAddressIndex(const CWalletTx& wtx)
+{
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        CTxDestination address;
+        if (!IsMine(wtx.vout[i]) || !ExtractDestination(wtx.vout[i].scriptPubKey, address))
+            continue;
+        CAddressTally& tally = mapAddressTally[address];
+        tally.setTxids.insert(hash);
+
+        // wallet transactions that were added before this one and spend it
+        std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+            tally.setSpends.insert(it->second);
+    }
+
+    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+        if (mi == mapWallet.end() || txin.prevout.n >= mi->second.vout.size())
+            continue;
+        const CTxOut& prevout = mi->second.vout[txin.prevout.n];
+        CTxDestination address;
+        if (!IsMine(prevout) || !ExtractDestination(prevout.scriptPubKey, address))
+            continue;
+        mapAddressTally[address].setSpends.insert(hash);
+    }
+}
+
+void CWallet::TallyTxHeight(const CWalletTx& wtx, int nHeight, bool fAdd)
+{
+    if (wtx.IsCoinBase())
+        return;
+
+    uint256 hash = wtx.GetHash();
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination address;
+        if (!IsMine(txout) || !ExtractDestination(txout.scriptPubKey, address))
+            continue;
+        CAddressTally& tally = mapAddressTally[address];
+        if (nHeight == -1)
+        {
+            if (fAdd)
+                tally.setUnconfirmed.insert(hash);
+            else
+                tally.setUnconfirmed.erase(hash);
+        }
+        else
+        {
+            int64_t& nReceived = tally.mapReceivedByHeight[nHeight];
+            nReceived += fAdd ? txout.nValue : -txout.nValue;
+            if (nReceived == 0)
+                tally.mapReceivedByHeight.erase(nHeight);
+
+            std::set<uint256>& setTxids = tally.mapTxidsByHeight[nHeight];
+            if (fAdd)
+                setTxids.insert(hash);
+            else
+                setTxids.erase(hash);
+            if (setTxids.empty())
+                tally.mapTxidsByHeight.erase(nHeight);
+        }
+    }
+}
+
+void CWallet::RebuildAddressIndex()
+{
+    mapAddressTally.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        AddToAddressIndex((*it).second);
+        std::map<uint256, int>::const_iterator mi = mapTxHeight.find((*it).first);
+        TallyTxHeight((*it).second, mi != mapTxHeight.end() ? mi->second : -1, true);
+    }
+    fAddressIndexDirty = false;
+}
+
+int64_t CWallet::GetReceivedByAddress(const CTxDestination& address, int nMinDepth)
+{
+    AssertLockHeld(cs_main); // chainActive
+    AssertLockHeld(cs_wallet); // mapWallet
+
+    if (fAddressIndexDirty)
+        RebuildAddressIndex();
+    std::map<CTxDestination, CAddressTally>::const_iterator mi = mapAddressTally.find(address);
+    if (mi == mapAddressTally.end())
+        return 0;
+    const CAddressTally& tally = (*mi).second;
+
+    // GetDepthInMainChain() adds nInstantXDepth for locked transactions with
+    // fewer than 6 confirmations. Blocks deeper than that are summed per
+    // height; the transactions in the blocks above and those not in a block
+    // are checked one by one.
+    int nDeepHeight = chainActive.Height() + 1 - 6;
+    int nMaxHeight = std::min(nDeepHeight, chainActive.Height() + 1 - nMinDepth);
+    int64_t nAmount = 0;
+    for (std::map<int, int64_t>::const_iterator it = tally.mapReceivedByHeight.begin();
+         it != tally.mapReceivedByHeight.end() && it->first <= nMaxHeight; ++it)
+        nAmount += it->second;
+
+    std::vector<uint256> vShallow(tally.setUnconfirmed.begin(), tally.setUnconfirmed.end());
+    for (std::map<int, std::set<uint256> >::const_iterator it = tally.mapTxidsByHeight.upper_bound(nDeepHeight);
+         it != tally.mapTxidsByHeight.end(); ++it)
+        vShallow.insert(vShallow.end(), it->second.begin(), it->second.end());
+
+    BOOST_FOREACH(const uint256& hash, vShallow)
+    {
+        const CWalletTx& wtx = mapWallet[hash];
+        if (!IsFinalTx(wtx) || wtx.GetDepthInMainChain() < nMinDepth)
+            continue;
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        {
+            CTxDestination dest;
+            if (ExtractDestination(txout.scriptPubKey, dest) && dest == address)
+                nAmount += txout.nValue;
+        }
+    }
+
+    return nAmount;
+}
+
+const std::set<uint256>& CWallet::GetAddressTxids(const CTxDestination& address)
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+
+    static const std::set<uint256> setEmpty;
+    if (fAddressIndexDirty)
+        RebuildAddressIndex();
+    std::map<CTxDestination, CAddressTally>::const_iterator mi = mapAddressTally.find(address);
+    return mi != mapAddressTally.end() ? (*mi).second.setTxids : setEmpty;
 }
 
 void CWallet::MarkDirty()
@@ -543,6 +873,12 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fBalancesRebuild = true;
+        // new keys may make transactions show up under other accounts and addresses
+        fAccountOrderedDirty = true;
+        fAddressIndexDirty = true;
+        // new keys may turn foreign inputs into ours
+        mapDarksendRounds.clear();
     }
 }
 
@@ -555,10 +891,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        InvalidateDarksendRounds(hash);
+        MarkBalancesDirty(hash);
     }
     else
     {
         LOCK(cs_wallet);
+        // order position and transaction go to disk together
+        CWalletBatch batch(this);
         // Inserts only if not already there, returns tx inserted or tx found
         pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
@@ -568,6 +908,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            AddToTxIndex(&wtx);
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -579,9 +920,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -637,6 +976,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                 wtx.fFromMe = wtxIn.fFromMe;
                 fUpdated = true;
             }
+            // also catches the block being disconnected, which leaves hashBlock alone
+            UpdateTxHeight(wtx);
         }
 
         //// debug print
@@ -646,9 +987,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
                 return false;
+        if (!batch.Commit())
+            return false;
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        if (fInsertedNew)
+            InvalidateDarksendRounds(hash);
+        MarkBalancesDirty(hash);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -661,7 +1007,6 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
             boost::thread t(runCommand, strCmd); // thread runs free
         }
-
     }
     return true;
 }
@@ -709,8 +1054,17 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        MarkBalancesDirty(hash);
+        InvalidateDarksendRounds(hash);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            RemoveFromTxIndex(&mi->second);
+            mapWallet.erase(mi);
+            CWalletBatch batch(this);
+            batch.GetDB().EraseTx(hash);
+            batch.Commit();
+        }
     }
     return;
 }
@@ -926,52 +1280,311 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, int64_t& nReceived,
 
 bool CWalletTx::WriteToDisk()
 {
-    return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
+    if (!pwallet->fFileBacked)
+        return true;
+    CWalletBatch batch(pwallet);
+    return batch.GetDB().WriteTx(GetHash(), *this) && batch.Commit();
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+/** A block on its way through a wallet rescan */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    std::vector<unsigned int> vMatches; // positions of transactions that may involve the wallet
+    std::vector<uint256> vMatchHashes;
+    bool fDone; // read and matched (protected by CWalletRescanner::cs)
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fDone(false) {}
+};
+
+typedef boost::shared_ptr<CRescanBlock> CRescanBlockRef;
+
+/** Rescans a range of the active chain for wallet transactions.
+ *
+ *  Worker threads read blocks ahead of the wallet and test every transaction
+ *  against a snapshot of the wallet's keys and transaction ids taken when
+ *  the scan starts. The test may give false positives but no false
+ *  negatives: outputs to plain key hashes are looked up in the snapshot,
+ *  other output scripts go through IsMine on the keystore, which has its own
+ *  lock. The calling thread then feeds only the matching transactions to
+ *  AddToWalletIfInvolvingMe, in chain order, taking cs_main and cs_wallet
+ *  one block at a time. Spends of transactions found during the scan itself
+ *  are caught there as well, since the snapshot can't know about them. Blocks
+ *  and mempool transactions that reached the wallet through SyncTransaction
+ *  while the scan ran are checked for such spends once more at the end.
+ */
+class CWalletRescanner
+{
+private:
+    CWallet* pwallet;
+    std::vector<CBlockIndex*> vBlocks;
+    int nThreads;
+
+    // snapshot taken under cs_wallet when the scan starts
+    std::set<CKeyID> setKeyIDs;
+    std::set<uint256> setWalletTxids;
+
+    CBoundedQueue<CRescanBlockRef> queueRead;
+    CBoundedQueue<CRescanBlockRef> queueUpdate;
+    boost::thread_group threadGroup;
+
+    boost::mutex cs;
+    boost::condition_variable condDone;
+
+    bool IsRelevant(const CTransaction& tx, const uint256& hash) const;
+    void ThreadFeed();
+    void ThreadMatch();
+    void Stop();
+
+public:
+    CWalletRescanner(CWallet* pwalletIn, int nThreadsIn) :
+        pwallet(pwalletIn), nThreads(std::max(nThreadsIn, 1)),
+        queueRead(MAX_RESCAN_QUEUE_BLOCKS), queueUpdate(MAX_RESCAN_QUEUE_BLOCKS) {}
+
+    ~CWalletRescanner() { Stop(); }
+
+    // Collect the blocks to scan and snapshot the wallet, returns false if there is nothing to do
+    bool Init(CBlockIndex* pindexStart);
+
+    // Run the scan, returns the number of transactions added or updated
+    int Run(bool fUpdate);
+};
+
+bool CWalletRescanner::Init(CBlockIndex* pindexStart)
+{
+    LOCK2(cs_main, pwallet->cs_wallet);
+
+    // no need to read and scan block, if block was created before
+    // our wallet birthday (as adjusted for block time variability)
+    CBlockIndex* pindex = pindexStart;
+    while (pindex && pwallet->nTimeFirstKey && (pindex->nTime < (pwallet->nTimeFirstKey - 7200)))
+        pindex = chainActive.Next(pindex);
+
+    for (; pindex; pindex = chainActive.Next(pindex))
+        vBlocks.push_back(pindex);
+
+    pwallet->GetKeys(setKeyIDs);
+    for (map<uint256, CWalletTx>::const_iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+        setWalletTxids.insert(it->first);
+
+    return !vBlocks.empty();
+}
+
+bool CWalletRescanner::IsRelevant(const CTransaction& tx, const uint256& hash) const
+{
+    if (setWalletTxids.count(hash))
+        return true;
+
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        const CScript& script = txout.scriptPubKey;
+        if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+            script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG) {
+            if (setKeyIDs.count(CKeyID(uint160(std::vector<unsigned char>(script.begin() + 3, script.begin() + 23)))))
+                return true;
+        } else if (::IsMine(*pwallet, script))
+            return true;
+    }
+
+    // anything spending one of our transactions may be from us
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setWalletTxids.count(txin.prevout.hash))
+            return true;
+
+    return false;
+}
+
+void CWalletRescanner::ThreadFeed()
+{
+    RenameThread("unpay-rescan-feed");
+
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+    {
+        CRescanBlockRef prescan(new CRescanBlock(pindex));
+        if (!queueUpdate.Push(prescan) || !queueRead.Push(prescan))
+            break;
+    }
+    queueRead.Close();
+    queueUpdate.Close();
+}
+
+void CWalletRescanner::ThreadMatch()
+{
+    RenameThread("unpay-rescan");
+
+    CRescanBlockRef prescan;
+    while (queueRead.Pop(prescan)) {
+        // block data of the active chain doesn't move, so no cs_main is needed to read it
+        ReadBlockFromDisk(prescan->block, prescan->pindex);
+        for (unsigned int i = 0; i < prescan->block.vtx.size(); i++) {
+            const CTransaction& tx = prescan->block.vtx[i];
+            uint256 hash = tx.GetHash();
+            if (IsRelevant(tx, hash)) {
+                prescan->vMatches.push_back(i);
+                prescan->vMatchHashes.push_back(hash);
+            }
+        }
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        prescan->fDone = true;
+        condDone.notify_all();
+    }
+}
+
+void CWalletRescanner::Stop()
+{
+    queueRead.Abort();
+    queueUpdate.Abort();
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+int CWalletRescanner::Run(bool fUpdate)
 {
     int ret = 0;
     int64_t nNow = GetTime();
 
-    CBlockIndex* pindex = pindexStart;
+    pwallet->ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    double dProgressStart = Checkpoints::GuessVerificationProgress(vBlocks.front(), false);
+    double dProgressTip = Checkpoints::GuessVerificationProgress(vBlocks.back(), false);
+
+    threadGroup.create_thread(boost::bind(&CWalletRescanner::ThreadFeed, this));
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CWalletRescanner::ThreadMatch, this));
+
+    // transactions added by this scan, whose spends the snapshot doesn't know about
+    std::set<uint256> setAdded;
+    // first height whose blocks reached the wallet through SyncTransaction instead of this scan
+    int nCatchUpHeight = vBlocks.back()->nHeight + 1;
+    CRescanBlockRef prescan;
+    while (queueUpdate.Pop(prescan))
     {
-        LOCK2(cs_main, cs_wallet);
+        CBlockIndex* pindex = prescan->pindex;
+        if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+            pwallet->ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-        // no need to read and scan block, if block was created before
-        // our wallet birthday (as adjusted for block time variability)
-        while (pindex && nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
-            pindex = chainActive.Next(pindex);
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!prescan->fDone)
+                condDone.wait(lock);
+        }
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        // pick up spends of transactions the matcher couldn't know about yet
+        std::vector<unsigned int> vMatches;
+        std::vector<uint256> vMatchHashes;
+        std::set<uint256> setBlockMatches;
+        for (unsigned int i = 0, j = 0; i < prescan->block.vtx.size(); i++)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            const CTransaction& tx = prescan->block.vtx[i];
+            if (j < prescan->vMatches.size() && prescan->vMatches[j] == i) {
+                vMatches.push_back(i);
+                vMatchHashes.push_back(prescan->vMatchHashes[j++]);
+                setBlockMatches.insert(vMatchHashes.back());
+                continue;
+            }
+            if (setAdded.empty() && setBlockMatches.empty())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                if (setAdded.count(txin.prevout.hash) || setBlockMatches.count(txin.prevout.hash)) {
+                    vMatches.push_back(i);
+                    vMatchHashes.push_back(tx.GetHash());
+                    setBlockMatches.insert(vMatchHashes.back());
+                    break;
+                }
+            }
+        }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        if (!vMatches.empty()) {
+            LOCK2(cs_main, pwallet->cs_wallet);
+            // a reorg may have disconnected the block since it was collected,
+            // the blocks that replace it reach the wallet through SyncTransaction
+            if (!chainActive.Contains(pindex)) {
+                LogPrintf("Rescan: block %s at height %d left the active chain, skipping it\n", pindex->GetBlockHash().ToString(), pindex->nHeight);
+                nCatchUpHeight = std::min(nCatchUpHeight, pindex->nHeight);
+                continue;
+            }
+            for (unsigned int i = 0; i < vMatches.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                const uint256& hash = vMatchHashes[i];
+                if (pwallet->AddToWalletIfInvolvingMe(hash, prescan->block.vtx[vMatches[i]], &prescan->block, fUpdate)) {
                     ret++;
+                    if (!setWalletTxids.count(hash))
+                        setAdded.insert(hash);
+                }
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+        }
+
+        if (GetTime() >= nNow + 60) {
+            nNow = GetTime();
+            LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+        }
+    }
+
+    // Blocks connected while the scan ran, the blocks that replaced skipped
+    // ones and the mempool went through SyncTransaction, possibly before the
+    // outputs they spend were found here. Those spends were dropped then, so
+    // look for them again now that all outputs are known.
+    if (!setAdded.empty()) {
+        LOCK2(cs_main, pwallet->cs_wallet);
+        for (CBlockIndex* pindex = chainActive[nCatchUpHeight]; pindex; pindex = chainActive.Next(pindex))
+        {
+            CBlock block;
+            if (ReadBlockFromDisk(block, pindex))
+                ret += pwallet->AddSpendsOf(setAdded, block.vtx, &block, fUpdate);
+        }
+
+        std::vector<CTransaction> vMempool;
+        {
+            LOCK(mempool.cs);
+            for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+                vMempool.push_back(mi->second.GetTx());
+        }
+        // mempool transactions are in no particular order, repeat until nothing is added
+        int nAdded;
+        while ((nAdded = pwallet->AddSpendsOf(setAdded, vMempool, NULL, fUpdate)) > 0)
+            ret += nAdded;
+    }
+
+    pwallet->ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    return ret;
+}
+
+int CWallet::AddSpendsOf(std::set<uint256>& setTxids, const std::vector<CTransaction>& vtx, const CBlock* pblock, bool fUpdate)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    int ret = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (!setTxids.count(txin.prevout.hash))
+                continue;
+            uint256 hash = tx.GetHash();
+            if (!setTxids.count(hash) && AddToWalletIfInvolvingMe(hash, tx, pblock, fUpdate)) {
+                setTxids.insert(hash);
+                ret++;
             }
+            break;
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
     return ret;
 }
 
+// Scan the block chain (starting in pindexStart) for transactions
+// from or to us. If fUpdate is true, found transactions that already
+// exist in the wallet will be updated.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    CWalletRescanner rescanner(this, nScriptCheckThreads);
+    if (!rescanner.Init(pindexStart))
+        return 0;
+    return rescanner.Run(fUpdate);
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     LOCK2(cs_main, cs_wallet);
@@ -1001,7 +1614,7 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if(strCommand == "txlreq"){
-                mapTxLockReq.insert(make_pair(hash, ((CTransaction)*this)));
+                AddTxLockRequest(((CTransaction)*this), true);
                 CreateNewLock(((CTransaction)*this));
                 RelayTransactionLockReq(((CTransaction)*this), hash, true);
             } else {
@@ -1072,179 +1685,390 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64_t CWallet::GetBalance() const
+void CWallet::InvalidateDarksendRounds(const uint256& hash)
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_wallet);
+
+    // walk down the wallet transactions spending this one; a transaction
+    // without cached rounds can't have contributed to any further entries
+    std::vector<uint256> vToDo(1, hash);
+    std::set<uint256> setDone;
+    while (!vToDo.empty())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        uint256 hashTx = vToDo.back();
+        vToDo.pop_back();
+        if (!setDone.insert(hashTx).second)
+            continue;
+
+        map<COutPoint, int>::iterator it = mapDarksendRounds.lower_bound(COutPoint(hashTx, 0));
+        if (hashTx != hash && (it == mapDarksendRounds.end() || it->first.hash != hashTx))
+            continue;
+        while (it != mapDarksendRounds.end() && it->first.hash == hashTx)
+            mapDarksendRounds.erase(it++);
+
+        // the rounds feed into the anonymized balances
+        if (hashTx != hash)
+            setBalancesDirty.insert(hashTx);
+
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+        if (mi == mapWallet.end())
+            continue;
+        for (unsigned int i = 0; i < (*mi).second.vout.size(); i++)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hashTx, i));
+            for (TxSpends::const_iterator sit = range.first; sit != range.second; ++sit)
+                vToDo.push_back(sit->second);
         }
     }
+}
 
-    return nTotal;
+int CWallet::GetInputDarksendRounds(CTxIn in) const
+{
+    LOCK(cs_wallet);
+    return GetOutpointDarksendRounds(in.prevout);
 }
 
-int64_t CWallet::GetAnonymizedBalance() const
+// darksend ancestry this far below the outpoint asked for isn't walked any further
+static const int DARKSEND_ROUNDS_MAX_DEPTH = 17;
+
+int CWallet::GetOutpointDarksendRounds(const COutPoint& outpoint) const
 {
-    if(fLiteMode) return 0;
+    AssertLockHeld(cs_wallet);
 
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+    map<COutPoint, int>::const_iterator mi = mapDarksendRounds.find(outpoint);
+    if (mi != mapDarksendRounds.end())
+        return (*mi).second;
+
+    // Depth-first over the darksend ancestry without recursing: an outpoint is
+    // only resolved once the rounds of all our inputs of its transaction are
+    // known, so long mixing chains are computed bottom-up exactly once.
+    // As in the recursive version, an outpoint DARKSEND_ROUNDS_MAX_DEPTH levels
+    // down counts as that many rounds without looking further. What is derived
+    // from such a cut depends on where the walk started, so it is only kept
+    // for this call in mapCut and never cached.
+    map<COutPoint, int> mapCut;
+    std::vector<std::pair<COutPoint, int> > vStack(1, make_pair(outpoint, 0));
+    while (!vStack.empty())
+    {
+        const COutPoint out = vStack.back().first;
+        const int nDepth = vStack.back().second;
+        if (mapDarksendRounds.count(out) || mapCut.count(out)) {
+            vStack.pop_back();
+            continue;
+        }
+        if (nDepth >= DARKSEND_ROUNDS_MAX_DEPTH) {
+            mapCut[out] = nDepth;
+            vStack.pop_back();
+            continue;
+        }
 
-            if (pcoin->IsTrusted())
+        int nRounds;
+        bool fCut = false;
+        map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(out.hash);
+        if (mit == mapWallet.end())
+            nRounds = -1;
+        else
+        {
+            const CWalletTx& wtx = (*mit).second;
+            if (out.n >= wtx.vout.size())
+                nRounds = -4;
+            else if (IsCollateralAmount(wtx.vout[out.n].nValue))
+                nRounds = -3;
+            else if (!IsDenominatedAmount(wtx.vout[out.n].nValue)) // make sure the final output is non-denominate
+                nRounds = -2;
+            else
             {
-                uint256 hash = (*it).first;
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                {
-                    CTxIn vin = CTxIn(hash, i);
+                bool fAllDenoms = true;
+                BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+                    fAllDenoms = fAllDenoms && IsDenominatedAmount(txout.nValue);
 
-                    if(IsSpent(hash, i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin)) continue;
+                // this one is denominated but there is another non-denominated output found in the same tx
+                if (!fAllDenoms)
+                    nRounds = 0;
+                else
+                {
+                    // only denoms here so let's look up, our inputs first
+                    bool fMissing = false;
+                    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+                        if (IsMine(txin) && !mapDarksendRounds.count(txin.prevout) && !mapCut.count(txin.prevout)) {
+                            vStack.push_back(make_pair(txin.prevout, nDepth + 1));
+                            fMissing = true;
+                        }
+                    if (fMissing)
+                        continue;
 
-                    int rounds = GetInputDarksendRounds(vin);
-                    if(rounds >= nDarksendRounds){
-                        nTotal += pcoin->vout[i].nValue;
+                    // denom found, find the shortest chain
+                    int nShortest = -1;
+                    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+                    {
+                        if (!IsMine(txin))
+                            continue;
+                        int n;
+                        map<COutPoint, int>::const_iterator it = mapDarksendRounds.find(txin.prevout);
+                        if (it != mapDarksendRounds.end())
+                            n = (*it).second;
+                        else {
+                            n = mapCut[txin.prevout];
+                            fCut = true;
+                        }
+                        if (n >= 0 && (nShortest == -1 || n < nShortest))
+                            nShortest = n;
                     }
+                    nRounds = nShortest + 1; // +1 to the shortest one, or we are the first one in that chain
                 }
             }
         }
+
+        if (fCut)
+            mapCut[out] = nRounds;
+        else
+            mapDarksendRounds[out] = nRounds;
+        if (fDebug) LogPrintf("GetOutpointDarksendRounds UPDATED   %s %3d %d\n", out.hash.ToString(), out.n, nRounds);
+        vStack.pop_back();
     }
 
-    return nTotal;
+    mi = mapDarksendRounds.find(outpoint);
+    return mi != mapDarksendRounds.end() ? (*mi).second : mapCut[outpoint];
 }
 
-double CWallet::GetAverageAnonymizedRounds() const
+void CWallet::MarkBalancesDirty(const uint256& hash)
 {
-    double fTotal = 0;
-    double fCount = 0;
+    AssertLockHeld(cs_wallet);
+    setBalancesDirty.insert(hash);
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = (*mi).second;
 
+    // the spent state of the outputs it spends changes ...
+    if (!wtx.IsCoinBase())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            if (mapWallet.count(txin.prevout.hash))
+                setBalancesDirty.insert(txin.prevout.hash);
+    }
 
-            if (pcoin->IsTrusted())
-            {
-                uint256 hash = (*it).first;
+    // ... and so may the trust and darksend rounds of wallet transactions spending it
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+            setBalancesDirty.insert(it->second);
+    }
+}
 
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+void CWallet::UpdateTxBalances(const uint256& hash) const
+{
+    map<uint256, CWalletBalances>::iterator mbi = mapTxBalances.find(hash);
+    if (mbi != mapTxBalances.end()) {
+        balances -= (*mbi).second;
+        mapTxBalances.erase(mbi);
+    }
+    setBalancesVolatile.erase(hash);
 
-                    CTxIn vin = CTxIn(hash, i);
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx* pcoin = &(*mi).second;
 
-                    if(IsSpent(hash, i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin)) continue;
+    CWalletBalances txBalances;
+    bool fFinal = IsFinalTx(*pcoin);
+    bool fTrusted = pcoin->IsTrusted();
+    int nDepth = pcoin->GetDepthInMainChain(false);
 
-                    int rounds = GetInputDarksendRounds(vin);
-                    fTotal += (float)rounds;
-                    fCount += 1;
-                }
+    if (fTrusted)
+        txBalances.nTrusted = pcoin->GetAvailableCredit(false);
+    if (!fFinal || (!fTrusted && pcoin->GetDepthInMainChain() == 0))
+        txBalances.nUnconfirmed = pcoin->GetAvailableCredit(false);
+    txBalances.nImmature = pcoin->GetImmatureCredit(false);
+
+    // skip conflicted
+    if (nDepth >= 0)
+    {
+        bool fUnconfirmed = (!fFinal || (!fTrusted && nDepth == 0));
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        {
+            if (IsSpent(hash, i) || !IsMine(pcoin->vout[i]))
+                continue;
+
+            int64_t nValue = pcoin->vout[i].nValue;
+            bool fDenom = IsDenominatedAmount(nValue);
+            txBalances.nDenominated[fDenom][fUnconfirmed] += nValue;
+
+            if (fTrusted && fDenom) {
+                int rounds = GetInputDarksendRounds(CTxIn(hash, i));
+                if (rounds >= nDarksendRounds)
+                    txBalances.nAnonymized += nValue;
+                txBalances.nNormalizedAnonymized += nValue * rounds / nDarksendRounds;
+                txBalances.nDenomRounds += rounds;
+                txBalances.nDenomOutputs++;
             }
         }
     }
 
-    if(fCount == 0) return 0;
+    mapTxBalances[hash] = txBalances;
+    balances += txBalances;
+
+    if (!fFinal || nDepth < 1 || pcoin->GetBlocksToMaturity() > 0)
+        setBalancesVolatile.insert(hash);
+}
+
+void CWallet::UpdateTxCoins(const uint256& hash) const
+{
+    map<uint256, std::vector<CoinIndex::iterator> >::iterator mci = mapTxCoins.find(hash);
+    if (mci != mapTxCoins.end()) {
+        BOOST_FOREACH(const CoinIndex::iterator& it, (*mci).second)
+            mapAvailableCoins.erase(it);
+        mapTxCoins.erase(mci);
+    }
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = (*mi).second;
 
-    return fTotal/fCount;
+    std::vector<CoinIndex::iterator> vCoins;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (wtx.vout[i].nValue > 0 && IsMine(wtx.vout[i]) && !IsSpent(hash, i))
+            vCoins.push_back(mapAvailableCoins.insert(make_pair(wtx.vout[i].nValue, COutPoint(hash, i))));
+    if (!vCoins.empty())
+        mapTxCoins[hash].swap(vCoins);
 }
 
-int64_t CWallet::GetNormalizedAnonymizedBalance() const
+void CWallet::UpdateBalances() const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
+    // a reorg or a new -darksendrounds setting may change any contribution
+    if (fBalancesRebuild || nBalancesDarksendRounds != nDarksendRounds ||
+        (pindexBalances && !chainActive.Contains(pindexBalances)))
     {
-        LOCK2(cs_main, cs_wallet);
+        mapTxBalances.clear();
+        setBalancesVolatile.clear();
+        setBalancesDirty.clear();
+        balances.SetNull();
+        mapAvailableCoins.clear();
+        mapTxCoins.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setBalancesDirty.insert((*it).first);
+        fBalancesRebuild = false;
+    }
+    else if (pindexBalances != chainActive.Tip())
+    {
+        // new blocks only affect transactions that aren't confirmed and mature yet,
+        // and the outputs they spend
+        BOOST_FOREACH(const uint256& hash, setBalancesVolatile)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
+            setBalancesDirty.insert(hash);
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+            if (mi != mapWallet.end() && !(*mi).second.IsCoinBase())
             {
-                uint256 hash = (*it).first;
-
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-
-                    CTxIn vin = CTxIn(hash, i);
-
-                    if(IsSpent(hash, i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin)) continue;
-
-                    int rounds = GetInputDarksendRounds(vin);
-                    nTotal += pcoin->vout[i].nValue * rounds / nDarksendRounds;
-                }
+                BOOST_FOREACH(const CTxIn& txin, (*mi).second.vin)
+                    if (mapWallet.count(txin.prevout.hash))
+                        setBalancesDirty.insert(txin.prevout.hash);
             }
         }
     }
+    pindexBalances = chainActive.Tip();
+    nBalancesDarksendRounds = nDarksendRounds;
 
-    return nTotal;
+    std::set<uint256> setDirty;
+    setDirty.swap(setBalancesDirty);
+    BOOST_FOREACH(const uint256& hash, setDirty)
+    {
+        UpdateTxCoins(hash);
+        UpdateTxBalances(hash);
+    }
 }
 
-int64_t CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) const
+int64_t CWallet::GetBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            int nDepth = pcoin->GetDepthInMainChain(false);
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nTrusted;
+}
 
-            // skip conflicted
-            if(nDepth < 0) continue;
+int64_t CWallet::GetAnonymizedBalance() const
+{
+    if(fLiteMode) return 0;
 
-            bool unconfirmed = (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && nDepth == 0));
-            if(onlyUnconfirmed != unconfirmed) continue;
-            uint256 hash = (*it).first;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nAnonymized;
+}
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                if(IsSpent(hash, i)) continue;
-                if(!IsMine(pcoin->vout[i])) continue;
-                if(onlyDenom != IsDenominatedAmount(pcoin->vout[i].nValue)) continue;
+double CWallet::GetAverageAnonymizedRounds() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
 
-                nTotal += pcoin->vout[i].nValue;
-            }
-        }
-    }
+    if(balances.nDenomOutputs == 0) return 0;
 
+    return (double)balances.nDenomRounds / balances.nDenomOutputs;
+}
 
+int64_t CWallet::GetNormalizedAnonymizedBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nNormalizedAnonymized;
+}
 
-    return nTotal;
+int64_t CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nDenominated[onlyDenom][onlyUnconfirmed];
 }
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nUnconfirmed;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balances.nImmature;
+}
+
+CWalletBalances CWallet::GetBalances() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+
+    CWalletBalances ret = balances;
+    if(fLiteMode) ret.nAnonymized = 0;
+    return ret;
+}
+
+CWalletBalances CWallet::GetBalancesNoWait(int& nHeightRet) const
+{
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        TRY_LOCK(cs_main, lockMain);
+        LOCK(cs_wallet);
+        // never computed yet, nothing to fall back on
+        if (lockMain || pindexBalances != NULL)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
+            if (lockMain)
+                UpdateBalances();
+
+            CWalletBalances ret = balances;
+            if(fLiteMode) ret.nAnonymized = 0;
+            nHeightRet = pindexBalances ? pindexBalances->nHeight : -1;
+            return ret;
         }
     }
-    return nTotal;
+
+    LOCK2(cs_main, cs_wallet);
+    CWalletBalances ret = GetBalances();
+    nHeightRet = pindexBalances ? pindexBalances->nHeight : -1;
+    return ret;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1254,47 +2078,63 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        UpdateBalances();
 
-            if (!IsFinalTx(*pcoin))
-                continue;
+        if (coin_type == ONLY_DENOMINATED) {
+            // denominations are exact amounts, only look at those
+            BOOST_FOREACH(int64_t v, darkSendDenominations)
+                AvailableCoinsInRange(vCoins, v, v, fOnlyConfirmed, coinControl, coin_type, useIX);
+        } else {
+            AvailableCoinsInRange(vCoins, 1, MAX_MONEY, fOnlyConfirmed, coinControl, coin_type, useIX);
+        }
+    }
+}
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+// append the spendable COutputs with a value between nMinValue and nMaxValue (inclusive)
+void CWallet::AvailableCoinsInRange(vector<COutput>& vCoins, int64_t nMinValue, int64_t nMaxValue, bool fOnlyConfirmed, const CCoinControl *coinControl, AvailableCoinsType coin_type, bool useIX) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+    // transactions looked at so far: whether they can be spent from, and their depth
+    map<const CWalletTx*, pair<bool, int> > mapTxs;
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (useIX && nDepth < 6)
-                continue;
+    CoinIndex::const_iterator itEnd = mapAvailableCoins.upper_bound(nMaxValue);
+    for (CoinIndex::const_iterator it = mapAvailableCoins.lower_bound(nMinValue); it != itEnd; ++it)
+    {
+        const COutPoint& outpoint = (*it).second;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &(*mi).second;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if(coin_type == ONLY_DENOMINATED) {
-                    //should make this a vector
-
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if(coin_type == ONLY_NONDENOMINATED || coin_type == ONLY_NONDENOMINATED_NOTMN) {
-                    found = true;
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if(found && coin_type == ONLY_NONDENOMINATED_NOTMN) found = (pcoin->vout[i].nValue != 1000*COIN); // do not use MN funds
-                } else {
-                    found = true;
-                }
-                if(!found) continue;
+        map<const CWalletTx*, pair<bool, int> >::iterator itTx = mapTxs.find(pcoin);
+        if (itTx == mapTxs.end())
+        {
+            int nDepth = pcoin->GetDepthInMainChain(false);
+            bool fSpendable = IsFinalTx(*pcoin) &&
+                              (!fOnlyConfirmed || pcoin->IsTrusted()) &&
+                              !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) &&
+                              // do not use IX for inputs that have less then 6 blockchain confirmations
+                              !(useIX && nDepth < 6);
+            itTx = mapTxs.insert(make_pair(pcoin, make_pair(fSpendable, nDepth))).first;
+        }
+        if (!(*itTx).second.first)
+            continue;
+        int nDepth = (*itTx).second.second;
 
-                if (!(IsSpent(wtxid, i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth));
-            }
+        int64_t nValue = (*it).first;
+        if (coin_type == ONLY_DENOMINATED) {
+            if (!IsDenominatedAmount(nValue)) continue;
+        } else if (coin_type == ONLY_NONDENOMINATED || coin_type == ONLY_NONDENOMINATED_NOTMN) {
+            if (IsCollateralAmount(nValue)) continue; // do not use collateral amounts
+            if (IsDenominatedAmount(nValue)) continue;
+            if (coin_type == ONLY_NONDENOMINATED_NOTMN && nValue == 1000*COIN) continue; // do not use MN funds
         }
+
+        if (!IsLockedCoin(outpoint.hash, outpoint.n) &&
+            (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(outpoint.hash, outpoint.n)))
+                vCoins.push_back(COutput(pcoin, outpoint.n, nDepth));
     }
 }
 
@@ -1660,7 +2500,9 @@ bool CWallet::SelectCoinsCollateral(std::vector<CTxIn>& setCoinsRet, int64_t& nV
     vector<COutput> vCoins;
 
     //printf(" selecting coins for collateral\n");
-    AvailableCoins(vCoins);
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    AvailableCoinsInRange(vCoins, DARKSEND_COLLATERAL, DARKSEND_COLLATERAL * 5, true, NULL, ALL_COINS, false);
 
     //printf("found coins %d\n", (int)vCoins.size());
 
@@ -1688,24 +2530,20 @@ int CWallet::CountInputsWithAmount(int64_t nInputAmount)
 {
     int64_t nTotal = 0;
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted()){
-                int nDepth = pcoin->GetDepthInMainChain(false);
+        LOCK2(cs_main, cs_wallet);
+        UpdateBalances();
+        if(!IsDenominatedAmount(nInputAmount)) return 0;
 
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                    COutput out = COutput(pcoin, i, nDepth);
-                    CTxIn vin = CTxIn(out.tx->GetHash(), out.i);
+        pair<CoinIndex::const_iterator, CoinIndex::const_iterator> range = mapAvailableCoins.equal_range(nInputAmount);
+        for (CoinIndex::const_iterator it = range.first; it != range.second; ++it)
+        {
+            const CWalletTx* pcoin = GetWalletTx((*it).second.hash);
+            if (!pcoin || !pcoin->IsTrusted()) continue;
 
-                    if(out.tx->vout[out.i].nValue != nInputAmount) continue;
-                    if(!IsDenominatedAmount(pcoin->vout[i].nValue)) continue;
-                    if(IsSpent(out.tx->GetHash(), i) || !IsMine(pcoin->vout[i]) || !IsDenominated(vin)) continue;
+            CTxIn vin = CTxIn((*it).second);
+            if(!IsDenominated(vin)) continue;
 
-                    nTotal++;
-                }
-            }
+            nTotal++;
         }
     }
 
@@ -1715,7 +2553,11 @@ int CWallet::CountInputsWithAmount(int64_t nInputAmount)
 bool CWallet::HasCollateralInputs() const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins);
+    {
+        LOCK2(cs_main, cs_wallet);
+        UpdateBalances();
+        AvailableCoinsInRange(vCoins, DARKSEND_COLLATERAL, DARKSEND_COLLATERAL * 5, true, NULL, ALL_COINS, false);
+    }
 
     int nFound = 0;
     BOOST_FOREACH(const COutput& out, vCoins)
@@ -2022,10 +2864,8 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+            // The key pool and wallet updates are committed together at the end of this scope
+            CWalletBatch batch(this);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -2046,8 +2886,8 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 updated_hahes.insert(txin.prevout.hash);
             }
-            if (fFileBacked)
-                delete pwalletdb;
+            if (!batch.Commit())
+                LogPrintf("CommitTransaction() : Error: writing the transaction to the wallet failed\n");
         }
 
         // Track how many getdata requests our transaction gets
@@ -2305,6 +3145,8 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    BuildTxIndex();
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -2342,6 +3184,8 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
         LOCK(cs_wallet); // mapAddressBook
         std::map<CTxDestination, CAddressBookData>::iterator mi = mapAddressBook.find(address);
         fUpdated = mi != mapAddressBook.end();
+        if ((fUpdated ? mi->second.name : "") != strName)
+            fAccountOrderedDirty = true;
         mapAddressBook[address].name = strName;
         if (!strPurpose.empty()) /* update purpose only if requested */
             mapAddressBook[address].purpose = strPurpose;
@@ -2350,9 +3194,10 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
     if (!fFileBacked)
         return false;
-    if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
+    CWalletBatch batch(this);
+    if (!strPurpose.empty() && !batch.GetDB().WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
         return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    return batch.GetDB().WriteName(CBitcoinAddress(address).ToString(), strName) && batch.Commit();
 }
 
 bool CWallet::DelAddressBook(const CTxDestination& address)
@@ -2364,11 +3209,16 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
         {
             // Delete destdata tuples associated with address
             std::string strAddress = CBitcoinAddress(address).ToString();
+            CWalletBatch batch(this);
             BOOST_FOREACH(const PAIRTYPE(string, string) &item, mapAddressBook[address].destdata)
             {
-                CWalletDB(strWalletFile).EraseDestData(strAddress, item.first);
+                batch.GetDB().EraseDestData(strAddress, item.first);
             }
+            batch.Commit();
         }
+        std::map<CTxDestination, CAddressBookData>::iterator mi = mapAddressBook.find(address);
+        if (mi != mapAddressBook.end() && !mi->second.name.empty())
+            fAccountOrderedDirty = true;
         mapAddressBook.erase(address);
     }
 
@@ -2376,8 +3226,9 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
 
     if (!fFileBacked)
         return false;
-    CWalletDB(strWalletFile).ErasePurpose(CBitcoinAddress(address).ToString());
-    return CWalletDB(strWalletFile).EraseName(CBitcoinAddress(address).ToString());
+    CWalletBatch batch(this);
+    batch.GetDB().ErasePurpose(CBitcoinAddress(address).ToString());
+    return batch.GetDB().EraseName(CBitcoinAddress(address).ToString()) && batch.Commit();
 }
 
 bool CWallet::GetTransaction(const uint256 &hashTx, CWalletTx& wtx)
@@ -2398,7 +3249,8 @@ bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
 {
     if (fFileBacked)
     {
-        if (!CWalletDB(strWalletFile).WriteDefaultKey(vchPubKey))
+        CWalletBatch batch(this);
+        if (!batch.GetDB().WriteDefaultKey(vchPubKey) || !batch.Commit())
             return false;
     }
     vchDefaultKey = vchPubKey;
@@ -2413,26 +3265,150 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
-        BOOST_FOREACH(int64_t nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
+        {
+            CWalletBatch batch(this);
+            BOOST_FOREACH(int64_t nIndex, setKeyPool)
+                batch.GetDB().ErasePool(nIndex);
+            if (!batch.Commit())
+                return false;
+        }
         setKeyPool.clear();
 
         if (IsLocked())
             return false;
 
+        // a transaction per KEYPOOL_BATCH_SIZE keys, one for a large -keypool could run out of database locks
         int64_t nKeys = max(GetArg("-keypool", 1000), (int64_t) 0);
-        for (int i = 0; i < nKeys; i++)
+        for (int64_t nBegin = 0; nBegin < nKeys; nBegin += KEYPOOL_BATCH_SIZE)
         {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+            int64_t nEnd = std::min(nBegin + (int64_t)KEYPOOL_BATCH_SIZE, nKeys);
+            CWalletBatch batch(this);
+            for (int64_t nIndex = nBegin + 1; nIndex <= nEnd; nIndex++)
+                batch.GetDB().WritePool(nIndex, CKeyPool(GenerateNewKey()));
+            if (!batch.Commit())
+                return false;
+            for (int64_t nIndex = nBegin + 1; nIndex <= nEnd; nIndex++)
+                setKeyPool.insert(nIndex);
         }
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
 }
 
+/** Generates one key pair into the vectors of a key pool refill */
+class CKeyGenCheck
+{
+private:
+    CKey* pkey;
+    CPubKey* ppubkey;
+    bool fCompressed;
+
+public:
+    CKeyGenCheck() : pkey(NULL), ppubkey(NULL), fCompressed(false) {}
+    CKeyGenCheck(CKey* pkeyIn, CPubKey* ppubkeyIn, bool fCompressedIn) :
+        pkey(pkeyIn), ppubkey(ppubkeyIn), fCompressed(fCompressedIn) {}
+
+    bool operator()()
+    {
+        pkey->MakeNewKey(fCompressed);
+        *ppubkey = pkey->GetPubKey();
+        return true;
+    }
+
+    void swap(CKeyGenCheck& check)
+    {
+        std::swap(pkey, check.pkey);
+        std::swap(ppubkey, check.ppubkey);
+        std::swap(fCompressed, check.fCompressed);
+    }
+};
+
+/** Worker threads generating the keys of one key pool refill.
+ *
+ *  The threads are started once for the whole refill, the calling thread
+ *  joins them for every batch of keys.
+ */
+class CKeyPoolGenerator
+{
+private:
+    CCheckQueue<CKeyGenCheck> queue;
+    boost::thread_group threadGroup;
+
+public:
+    CKeyPoolGenerator(size_t nKeys) : queue(16)
+    {
+        size_t nThreads = std::min((size_t)std::max((int)boost::thread::hardware_concurrency(), 1), std::max(nKeys, (size_t)1));
+        for (size_t i = 1; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CKeyGenCheck>::Thread, &queue));
+    }
+
+    ~CKeyPoolGenerator()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+
+    // Fill vKeys with fresh keys
+    void MakeNewKeys(std::vector<CKey>& vKeys, std::vector<CPubKey>& vPubKeys, bool fCompressed)
+    {
+        RandAddSeedPerfmon();
+        vPubKeys.resize(vKeys.size());
+
+        std::vector<CKeyGenCheck> vChecks;
+        vChecks.reserve(vKeys.size());
+        for (size_t i = 0; i < vKeys.size(); i++)
+            vChecks.push_back(CKeyGenCheck(&vKeys[i], &vPubKeys[i], fCompressed));
+
+        // the workers write into our vectors, so don't leave before they are done
+        boost::this_thread::disable_interruption di;
+        CCheckQueueControl<CKeyGenCheck> control(&queue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+};
+
+bool CWallet::AddKeysToPool(const std::vector<CKey>& vKeys, const std::vector<CPubKey>& vPubKeys)
+{
+    LOCK(cs_wallet);
+
+    // the wallet may have been locked while the keys were generated
+    if (IsLocked())
+        return false;
+
+    // keys that made it into the pool are committed, if that fails they leave the pool again
+    std::vector<int64_t> vAdded;
+    bool fAllAdded = true;
+    try {
+        CWalletBatch batch(this);
+        for (unsigned int i = 0; i < vKeys.size(); i++)
+        {
+            int64_t nIndex = 1;
+            if (!setKeyPool.empty())
+                nIndex = *(--setKeyPool.end()) + 1;
+            if (!batch.GetDB().WritePool(nIndex, CKeyPool(AddNewKey(vKeys[i], vPubKeys[i]))))
+            {
+                fAllAdded = false;
+                break;
+            }
+            setKeyPool.insert(nIndex);
+            vAdded.push_back(nIndex);
+        }
+        if (!batch.Commit())
+        {
+            BOOST_FOREACH(int64_t nIndex, vAdded)
+                setKeyPool.erase(nIndex);
+            return false;
+        }
+    }
+    catch (...) {
+        BOOST_FOREACH(int64_t nIndex, vAdded)
+            setKeyPool.erase(nIndex);
+        throw;
+    }
+    LogPrintf("keypool added %u keys, size=%u\n", vAdded.size(), setKeyPool.size());
+    return fAllAdded;
+}
+
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
     {
@@ -2441,8 +3417,6 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         if (kpSize > 0)
@@ -2450,16 +3424,15 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", 1000), (int64_t) 0);
 
+        CKeyPoolGenerator generator(setKeyPool.size() < nTargetSize + 1 ? nTargetSize + 1 - setKeyPool.size() : 0);
         while (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
+            std::vector<CKey> vKeys(std::min((size_t)KEYPOOL_BATCH_SIZE, (nTargetSize + 1) - setKeyPool.size()));
+            std::vector<CPubKey> vPubKeys;
+            generator.MakeNewKeys(vKeys, vPubKeys, CanSupportFeature(FEATURE_COMPRPUBKEY));
+            if (!AddKeysToPool(vKeys, vPubKeys))
+                throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+            double dProgress = 100.f * setKeyPool.size() / (nTargetSize + 1);
             std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
             uiInterface.InitMessage(strMsg);
         }
@@ -2467,6 +3440,97 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
     return true;
 }
 
+bool CWallet::RequestKeyPoolTopUp()
+{
+    LOCK(cs_wallet);
+    boost::unique_lock<boost::mutex> lock(mutexKeyPool);
+    if (!fKeyPoolFiller)
+        return false;
+
+    int64_t nTargetSize = max(GetArg("-keypool", 1000), (int64_t) 0);
+    if ((int64_t)setKeyPool.size() < GetArg("-keypoollow", nTargetSize / 2) + 1)
+    {
+        fKeyPoolRequested = true;
+        condKeyPool.notify_one();
+    }
+    return true;
+}
+
+void CWallet::FillKeyPool()
+{
+    size_t nMissing;
+    {
+        LOCK(cs_wallet);
+        unsigned int nTargetSize = max(GetArg("-keypool", 1000), (int64_t) 0);
+        nMissing = setKeyPool.size() < nTargetSize + 1 ? nTargetSize + 1 - setKeyPool.size() : 0;
+    }
+    if (nMissing == 0)
+        return;
+    CKeyPoolGenerator generator(nMissing);
+
+    while (true)
+    {
+        std::vector<CKey> vKeys;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return;
+            unsigned int nTargetSize = max(GetArg("-keypool", 1000), (int64_t) 0);
+            if (setKeyPool.size() >= nTargetSize + 1)
+                return;
+            vKeys.resize(std::min((size_t)KEYPOOL_BATCH_SIZE, (nTargetSize + 1) - setKeyPool.size()));
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        }
+
+        // generate without holding cs_wallet so addresses can be handed out meanwhile
+        std::vector<CPubKey> vPubKeys;
+        generator.MakeNewKeys(vKeys, vPubKeys, fCompressed);
+        boost::this_thread::interruption_point();
+
+        if (!AddKeysToPool(vKeys, vPubKeys))
+        {
+            if (!IsLocked())
+                LogPrintf("CWallet::FillKeyPool() : adding generated keys failed\n");
+            return;
+        }
+    }
+}
+
+void CWallet::ThreadKeyPoolFiller()
+{
+    RenameThread("unpay-keypool");
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexKeyPool);
+        fKeyPoolFiller = true;
+        fKeyPoolRequested = true;
+    }
+
+    try {
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutexKeyPool);
+                while (!fKeyPoolRequested)
+                    condKeyPool.wait(lock);
+                fKeyPoolRequested = false;
+            }
+            try {
+                FillKeyPool();
+            }
+            catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadKeyPoolFiller()");
+            }
+        }
+    }
+    catch (boost::thread_interrupted) {
+        boost::unique_lock<boost::mutex> lock(mutexKeyPool);
+        fKeyPoolFiller = false;
+        throw;
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -2474,18 +3538,24 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
+        // Leave generating keys to the background filler unless the pool ran dry
         if (!IsLocked())
-            TopUpKeyPool();
+        {
+            if (!RequestKeyPoolTopUp())
+                TopUpKeyPool();
+            else if (setKeyPool.empty())
+                TopUpKeyPool(1);
+        }
 
         // Get the oldest key
         if(setKeyPool.empty())
             return;
 
-        CWalletDB walletdb(strWalletFile);
+        CWalletBatch batch(this);
 
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
-        if (!walletdb.ReadPool(nIndex, keypool))
+        if (!batch.GetDB().ReadPool(nIndex, keypool))
             throw runtime_error("ReserveKeyFromKeyPool() : read failed");
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
@@ -2498,10 +3568,10 @@ int64_t CWallet::AddReserveKey(const CKeyPool& keypool)
 {
     {
         LOCK2(cs_main, cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        CWalletBatch batch(this);
 
         int64_t nIndex = 1 + *(--setKeyPool.end());
-        if (!walletdb.WritePool(nIndex, keypool))
+        if (!batch.GetDB().WritePool(nIndex, keypool) || !batch.Commit())
             throw runtime_error("AddReserveKey() : writing added key failed");
         setKeyPool.insert(nIndex);
         return nIndex;
@@ -2514,8 +3584,9 @@ void CWallet::KeepKey(int64_t nIndex)
     // Remove from key pool
     if (fFileBacked)
     {
-        CWalletDB walletdb(strWalletFile);
-        walletdb.ErasePool(nIndex);
+        CWalletBatch batch(this);
+        batch.GetDB().ErasePool(nIndex);
+        batch.Commit();
     }
     LogPrintf("keypool keep %d\n", nIndex);
 }
@@ -2565,10 +3636,13 @@ std::map<CTxDestination, int64_t> CWallet::GetAddressBalances()
     map<CTxDestination, int64_t> balances;
 
     {
-        LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+        LOCK2(cs_main, cs_wallet);
+        // the coin index holds exactly our unspent outputs
+        UpdateBalances();
+        for (CoinIndex::const_iterator it = mapAvailableCoins.begin(); it != mapAvailableCoins.end(); ++it)
         {
-            CWalletTx *pcoin = &walletEntry.second;
+            const COutPoint& outpoint = (*it).second;
+            const CWalletTx *pcoin = &mapWallet[outpoint.hash];
 
             if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
                 continue;
@@ -2580,20 +3654,11 @@ std::map<CTxDestination, int64_t> CWallet::GetAddressBalances()
             if (nDepth < (pcoin->IsFromMe() ? 0 : 1))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
-                    continue;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
-                    continue;
-
-                int64_t n = IsSpent(walletEntry.first, i) ? 0 : pcoin->vout[i].nValue;
+            CTxDestination addr;
+            if(!ExtractDestination(pcoin->vout[outpoint.n].scriptPubKey, addr))
+                continue;
 
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-                balances[addr] += n;
-            }
+            balances[addr] += pcoin->vout[outpoint.n].nValue;
         }
     }
 
@@ -2606,15 +3671,22 @@ set< set<CTxDestination> > CWallet::GetAddressGroupings()
     set< set<CTxDestination> > groupings;
     set<CTxDestination> grouping;
 
-    BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
-    {
-        CWalletTx *pcoin = &walletEntry.second;
+    if (fAddressIndexDirty)
+        RebuildAddressIndex();
 
-        if (pcoin->vin.size() > 0)
+    // only the transactions spending our outputs group addresses together
+    set<uint256> setDone;
+    for (map<CTxDestination, CAddressTally>::const_iterator mi = mapAddressTally.begin(); mi != mapAddressTally.end(); ++mi)
+    {
+        BOOST_FOREACH(const uint256& hash, (*mi).second.setSpends)
         {
+            if (!setDone.insert(hash).second)
+                continue;
+            const CWalletTx *pcoin = &mapWallet[hash];
+
             bool any_mine = false;
             // group all input addresses with each other
-            BOOST_FOREACH(CTxIn txin, pcoin->vin)
+            BOOST_FOREACH(const CTxIn& txin, pcoin->vin)
             {
                 CTxDestination address;
                 if(!IsMine(txin)) /* If this input isn't mine, ignore it */
@@ -2628,7 +3700,7 @@ set< set<CTxDestination> > CWallet::GetAddressGroupings()
             // group change with input addresses
             if (any_mine)
             {
-               BOOST_FOREACH(CTxOut txout, pcoin->vout)
+               BOOST_FOREACH(const CTxOut& txout, pcoin->vout)
                    if (IsChange(txout))
                    {
                        CTxDestination txoutAddr;
@@ -2645,16 +3717,12 @@ set< set<CTxDestination> > CWallet::GetAddressGroupings()
         }
 
         // group lone addrs by themselves
-        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            if (IsMine(pcoin->vout[i]))
-            {
-                CTxDestination address;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
-                groupings.insert(grouping);
-                grouping.clear();
-            }
+        if (!(*mi).second.setTxids.empty())
+        {
+            grouping.insert((*mi).first);
+            groupings.insert(grouping);
+            grouping.clear();
+        }
     }
 
     set< set<CTxDestination>* > uniqueGroupings; // a set of pointers to groups of addresses
@@ -2744,17 +3812,68 @@ void CReserveKey::ReturnKey()
     vchPubKey = CPubKey();
 }
 
+CWalletBatch::CWalletBatch(const CWallet* pwalletIn) : pwallet(pwalletIn), pwalletdb(NULL), fOwner(false), fTxn(false)
+{
+    ENTER_CRITICAL_SECTION(pwallet->cs_wallet);
+    if (pwallet->pwalletdbBatch) {
+        pwalletdb = pwallet->pwalletdbBatch;
+        return;
+    }
+    if (!pwallet->fFileBacked)
+        return;
+
+    try {
+        pwalletdb = new CWalletDB(pwallet->strWalletFile);
+    }
+    catch (...) {
+        LEAVE_CRITICAL_SECTION(pwallet->cs_wallet);
+        throw;
+    }
+    fOwner = true;
+
+    fTxn = pwalletdb->TxnBegin();
+    if (!fTxn)
+        LogPrintf("CWalletBatch : TxnBegin failed, writing without a transaction\n");
+    pwallet->pwalletdbBatch = pwalletdb;
+}
+
+CWalletBatch::~CWalletBatch()
+{
+    if (fOwner) {
+        // not committed, don't leave half of the writes behind
+        if (fTxn && !pwalletdb->TxnAbort())
+            LogPrintf("CWalletBatch : aborting wallet writes failed\n");
+        if (pwallet->pwalletdbBatch == pwalletdb)
+            pwallet->pwalletdbBatch = NULL;
+        delete pwalletdb;
+    }
+    LEAVE_CRITICAL_SECTION(pwallet->cs_wallet);
+}
+
+bool CWalletBatch::Commit()
+{
+    if (!fOwner || !fTxn)
+        return true;
+    fTxn = false;
+
+    int64_t nStart = GetTimeMillis();
+    bool fSuccess = pwalletdb->TxnCommit();
+    RecordWalletDBCommit(GetTimeMillis() - nStart, fSuccess);
+    if (!fSuccess)
+        LogPrintf("CWalletBatch::Commit() : committing wallet writes failed\n");
+    return fSuccess;
+}
+
 void CWallet::GetAllReserveKeys(set<CKeyID>& setAddress) const
 {
     setAddress.clear();
 
-    CWalletDB walletdb(strWalletFile);
-
     LOCK2(cs_main, cs_wallet);
+    CWalletBatch batch(this);
     BOOST_FOREACH(const int64_t& id, setKeyPool)
     {
         CKeyPool keypool;
-        if (!walletdb.ReadPool(id, keypool))
+        if (!batch.GetDB().ReadPool(id, keypool))
             throw runtime_error("GetAllReserveKeyHashes() : read failed");
         assert(keypool.vchPubKey.IsValid());
         CKeyID keyID = keypool.vchPubKey.GetID();
@@ -2771,6 +3890,7 @@ bool CWallet::UpdatedTransaction(const uint256 &hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()){
+            MarkBalancesDirty(hashTx);
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -2874,7 +3994,8 @@ bool CWallet::AddDestData(const CTxDestination &dest, const std::string &key, co
     mapAddressBook[dest].destdata.insert(std::make_pair(key, value));
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteDestData(CBitcoinAddress(dest).ToString(), key, value);
+    CWalletBatch batch(this);
+    return batch.GetDB().WriteDestData(CBitcoinAddress(dest).ToString(), key, value) && batch.Commit();
 }
 
 bool CWallet::EraseDestData(const CTxDestination &dest, const std::string &key)
@@ -2883,7 +4004,8 @@ bool CWallet::EraseDestData(const CTxDestination &dest, const std::string &key)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).EraseDestData(CBitcoinAddress(dest).ToString(), key);
+    CWalletBatch batch(this);
+    return batch.GetDB().EraseDestData(CBitcoinAddress(dest).ToString(), key) && batch.Commit();
 }
 
 bool CWallet::LoadDestData(const CTxDestination &dest, const std::string &key, const std::string &value)
@@ -16,6 +16,7 @@
 #include "walletdb.h"
 
 #include <algorithm>
+#include <list>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -24,6 +25,9 @@
 #include <utility>
 #include <vector>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 // Settings
 extern int64_t nTransactionFee;
 extern bool bSpendZeroConfChange;
@@ -32,6 +36,10 @@ extern bool bSpendZeroConfChange;
 static const int64_t DEFAULT_TRANSACTION_FEE = 0;
 // -paytxfee will warn if called with a higher fee than this amount (in satoshis) per KB
 static const int nHighTransactionFeeWarning = 0.01 * COIN;
+// Maximum number of blocks read ahead of the wallet during a rescan
+static const unsigned int MAX_RESCAN_QUEUE_BLOCKS = 64;
+// Number of keys generated and written at a time when filling the key pool
+static const unsigned int KEYPOOL_BATCH_SIZE = 100;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -103,15 +111,94 @@ public:
     StringMap destdata;
 };
 
+/** Balance totals of (a part of) the wallet, as reported by the CWallet balance queries */
+class CWalletBalances
+{
+public:
+    int64_t nTrusted;              // GetBalance
+    int64_t nUnconfirmed;          // GetUnconfirmedBalance
+    int64_t nImmature;             // GetImmatureBalance
+    int64_t nAnonymized;           // GetAnonymizedBalance
+    int64_t nNormalizedAnonymized; // GetNormalizedAnonymizedBalance
+    int64_t nDenomRounds;          // darksend rounds of the trusted denominated outputs ...
+    int64_t nDenomOutputs;         // ... and their number, for GetAverageAnonymizedRounds
+    int64_t nDenominated[2][2];    // GetDenominatedBalance, indexed by [onlyDenom][onlyUnconfirmed]
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nTrusted = 0;
+        nUnconfirmed = 0;
+        nImmature = 0;
+        nAnonymized = 0;
+        nNormalizedAnonymized = 0;
+        nDenomRounds = 0;
+        nDenomOutputs = 0;
+        nDenominated[0][0] = nDenominated[0][1] = nDenominated[1][0] = nDenominated[1][1] = 0;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nTrusted += b.nTrusted;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nAnonymized += b.nAnonymized;
+        nNormalizedAnonymized += b.nNormalizedAnonymized;
+        nDenomRounds += b.nDenomRounds;
+        nDenomOutputs += b.nDenomOutputs;
+        for (int i = 0; i < 2; i++)
+            for (int j = 0; j < 2; j++)
+                nDenominated[i][j] += b.nDenominated[i][j];
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nAnonymized -= b.nAnonymized;
+        nNormalizedAnonymized -= b.nNormalizedAnonymized;
+        nDenomRounds -= b.nDenomRounds;
+        nDenomOutputs -= b.nDenomOutputs;
+        for (int i = 0; i < 2; i++)
+            for (int j = 0; j < 2; j++)
+                nDenominated[i][j] -= b.nDenominated[i][j];
+        return *this;
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
 class CWallet : public CCryptoKeyStore, public CWalletInterface
 {
+public:
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::multimap<int64_t, TxPair > TxItems;
+
 private:
 
     CWalletDB *pwalletdbEncryption;
 
+    // open write batch of this wallet, see CWalletBatch; protected by cs_wallet
+    mutable CWalletDB *pwalletdbBatch;
+    friend class CWalletBatch;
+
+    // wakes up the background key pool filler, see ThreadKeyPoolFiller
+    boost::mutex mutexKeyPool;
+    boost::condition_variable condKeyPool;
+    bool fKeyPoolFiller;
+    bool fKeyPoolRequested;
+
+    CPubKey AddNewKey(const CKey& secret, const CPubKey& pubkey);
+    bool AddKeysToPool(const std::vector<CKey>& vKeys, const std::vector<CPubKey>& vPubKeys);
+    void FillKeyPool();
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -131,6 +218,86 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Balance index: what each transaction contributes to the balance totals,
+    // and the totals themselves. Wallet changes only mark transactions dirty;
+    // UpdateBalances() folds the changes in when the balances are queried.
+    mutable std::map<uint256, CWalletBalances> mapTxBalances;
+    mutable CWalletBalances balances;
+    // transactions whose contribution has to be recomputed
+    mutable std::set<uint256> setBalancesDirty;
+    // transactions whose contribution may change with the next block (unconfirmed, immature)
+    mutable std::set<uint256> setBalancesVolatile;
+    mutable const CBlockIndex* pindexBalances;
+    mutable int nBalancesDarksendRounds;
+    mutable bool fBalancesRebuild;
+
+    void MarkBalancesDirty(const uint256& hash);
+    void UpdateTxBalances(const uint256& hash) const;
+    void UpdateBalances() const;
+
+    // Darksend round cache: how deep the darksend chain behind an outpoint is.
+    // Rounds only depend on the wallet's transaction graph, so entries stay
+    // valid until a transaction is added to or removed from the wallet, which
+    // drops the entries of that transaction and of everything spending it.
+    mutable std::map<COutPoint, int> mapDarksendRounds;
+
+    void InvalidateDarksendRounds(const uint256& hash);
+    int GetOutpointDarksendRounds(const COutPoint& outpoint) const;
+
+    // Coin index: the unspent outputs we own, ordered by amount, so coin
+    // selection only has to look at candidate outputs. Maintained together
+    // with the balance index by UpdateBalances().
+    typedef std::multimap<int64_t, COutPoint> CoinIndex;
+    mutable CoinIndex mapAvailableCoins;
+    mutable std::map<uint256, std::vector<CoinIndex::iterator> > mapTxCoins;
+
+    void UpdateTxCoins(const uint256& hash) const;
+    void AvailableCoinsInRange(std::vector<COutput>& vCoins, int64_t nMinValue, int64_t nMaxValue, bool fOnlyConfirmed, const CCoinControl *coinControl, AvailableCoinsType coin_type, bool useIX) const;
+
+    // Activity log index: the wallet transactions and accounting entries by
+    // nOrderPos, for the whole wallet and per account, and the wallet
+    // transactions by the height of their block (-1 if not in the main chain).
+    // Accounting entries are kept in memory once the wallet is loaded. Which
+    // accounts a transaction shows up under depends on the address book and
+    // on which outputs are ours, so the per account index is rebuilt by the
+    // next query after either changes.
+    std::list<CAccountingEntry> laccentries;
+    TxItems wtxOrdered;
+    std::map<std::string, TxItems> mapAccountOrdered;
+    bool fAccountOrderedDirty;
+    std::set<std::pair<int, uint256> > setTxByHeight;
+    std::map<uint256, int> mapTxHeight;
+
+    void GetTxAccounts(const CWalletTx& wtx, std::set<std::string>& setAccounts) const;
+    void AddToTxIndex(CWalletTx* pwtx);
+    void RemoveFromTxIndex(CWalletTx* pwtx);
+    void UpdateTxHeight(const CWalletTx& wtx);
+    void BuildTxIndex();
+    void RebuildAccountIndex();
+
+    // Address index: for every destination we own outputs of, the wallet
+    // transactions paying to it and spending from it, and the amount it
+    // received in the main chain per block height, which is moved along
+    // with the height index as blocks are connected and disconnected.
+    // Unconfirmed and generated receipts are left out of the height totals:
+    // whether they count depends on the mempool and on maturity, so queries
+    // look at those transactions themselves. Like the per account index it
+    // is rebuilt by the next query after our keys change.
+    struct CAddressTally
+    {
+        std::set<uint256> setTxids;
+        std::set<uint256> setSpends;
+        std::set<uint256> setUnconfirmed;
+        std::map<int, int64_t> mapReceivedByHeight;
+        std::map<int, std::set<uint256> > mapTxidsByHeight;
+    };
+    std::map<CTxDestination, CAddressTally> mapAddressTally;
+    bool fAddressIndexDirty;
+
+    void AddToAddressIndex(const CWalletTx& wtx);
+    void TallyTxHeight(const CWalletTx& wtx, int nHeight, bool fAdd);
+    void RebuildAddressIndex();
+
 public:
     bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
     bool SelectCoinsDark(int64_t nValueMin, int64_t nValueMax, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax) const;
@@ -138,6 +305,7 @@ public:
     bool SelectCoinsDarkDenominated(int64_t nTargetValue, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet) const;
     bool HasCollateralInputs() const;
     bool IsCollateralAmount(int64_t nInputAmount) const;
+    int  GetInputDarksendRounds(CTxIn in) const;
     int  CountInputsWithAmount(int64_t nInputAmount);
 
     bool SelectCoinsCollateral(std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet) const ;
@@ -180,11 +348,19 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
+        fKeyPoolFiller = false;
+        fKeyPoolRequested = false;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        pindexBalances = NULL;
+        nBalancesDarksendRounds = 0;
+        fBalancesRebuild = true;
+        fAccountOrderedDirty = true;
+        fAddressIndexDirty = true;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -256,21 +432,34 @@ public:
      */
     int64_t IncOrderPosNext(CWalletDB *pwalletdb = NULL);
 
-    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef std::multimap<int64_t, TxPair > TxItems;
-
     /** Get the wallet's activity log
+        @param[in] strAccount  only the items that can show up under this account, "*" for all
         @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+        @warning The index is only valid while cs_wallet is held
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    const TxItems& OrderedTxItems(const std::string& strAccount = "*");
+
+    /** Get the wallet transactions that are not in the main chain or are in a block above nHeight */
+    void GetTxsAboveHeight(int nHeight, std::vector<const CWalletTx*>& vpwtx) const;
+
+    /** Write an accounting entry and add it to the activity log */
+    bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb);
+    /** Sum of the accounting entries of strAccount, "*" for all */
+    int64_t GetAccountCreditDebit(const std::string& strAccount);
+    void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& acentries);
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
     void SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
+    /** Scan the active chain from pindexStart for wallet transactions.
+     *  Takes cs_main and cs_wallet itself, a block at a time; call it without
+     *  holding them to keep the rest of the node responsive. */
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    /** Add the transactions of vtx that spend one of setTxids, adding their ids
+     *  to setTxids as well. Returns the number of transactions added. */
+    int AddSpendsOf(std::set<uint256>& setTxids, const std::vector<CTransaction>& vtx, const CBlock* pblock, bool fUpdate);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64_t GetBalance() const;
@@ -280,6 +469,12 @@ public:
     double GetAverageAnonymizedRounds() const;
     int64_t GetNormalizedAnonymizedBalance() const;
     int64_t GetDenominatedBalance(bool onlyDenom=true, bool onlyUnconfirmed=false) const;
+    // All balance totals at once, under a single cs_main/cs_wallet acquisition
+    CWalletBalances GetBalances() const;
+    // The same without waiting for cs_main: brought up to date if cs_main is
+    // free, otherwise as of the last update. nHeightRet is the height of the
+    // tip they were computed at.
+    CWalletBalances GetBalancesNoWait(int& nHeightRet) const;
 
     bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend,
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX=false);
@@ -296,6 +491,11 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    // Wake up the background filler if the key pool is below its low-water
+    // mark. Returns false if there is no filler running.
+    bool RequestKeyPoolTopUp();
+    // Keeps the key pool filled in the background, generating keys on all cores
+    void ThreadKeyPoolFiller();
     int64_t AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
@@ -307,6 +507,11 @@ public:
     std::set< std::set<CTxDestination> > GetAddressGroupings();
     std::map<CTxDestination, int64_t> GetAddressBalances();
 
+    /** Amount received by address in transactions at least nMinDepth deep, leaving out generated coins */
+    int64_t GetReceivedByAddress(const CTxDestination& address, int nMinDepth);
+    /** The wallet transactions paying to address */
+    const std::set<uint256>& GetAddressTxids(const CTxDestination& address);
+
     std::set<CTxDestination> GetAccountAddresses(std::string strAccount) const;
 
     bool IsDenominated(const CTxIn &txin) const;
@@ -450,6 +655,42 @@ public:
     boost::signals2::signal<void (const std::string &title, int nProgress)> ShowProgress;
 };
 
+/** Groups the wallet file writes made while it is in scope into a single
+ * database transaction.
+ *
+ * The outermost batch owns the transaction and has to be committed with
+ * Commit(); if it ends without that, e.g. because an exception unwinds it,
+ * its writes are aborted. Batches opened inside another one join it and
+ * leave committing to the outermost one.
+ *
+ * A batch holds cs_wallet for its whole lifetime, so take cs_main before
+ * opening one. While a batch is open every access to the wallet file from
+ * this thread has to go through GetDB(): a second CWalletDB would wait for
+ * the pages locked by the open transaction. Wallets that aren't file backed
+ * have no database to hand out.
+ */
+class CWalletBatch
+{
+private:
+    const CWallet* pwallet;
+    CWalletDB* pwalletdb;
+    bool fOwner;
+    bool fTxn;
+
+    CWalletBatch(const CWalletBatch&);
+    void operator=(const CWalletBatch&);
+
+public:
+    CWalletBatch(const CWallet* pwalletIn);
+    ~CWalletBatch();
+
+    CWalletDB& GetDB() { assert(pwalletdb); return *pwalletdb; }
+
+    // Commit the writes so far. Later writes of the outermost batch are
+    // written one by one; a nested batch leaves this to the outermost one.
+    bool Commit();
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey
 {
@@ -763,6 +763,35 @@ DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet)
     return DB_LOAD_OK;
 }
 
+static CCriticalSection cs_walletdbstats;
+static CWalletDBStats walletdbStats = CWalletDBStats();
+
+void RecordWalletDBCommit(int64_t nMillis, bool fSuccess)
+{
+    LOCK(cs_walletdbstats);
+    walletdbStats.nBatches++;
+    if (!fSuccess)
+        walletdbStats.nBatchesFailed++;
+    walletdbStats.nCommitMillisLast = nMillis;
+    walletdbStats.nCommitMillisMax = max(walletdbStats.nCommitMillisMax, nMillis);
+    walletdbStats.nCommitMillisTotal += nMillis;
+}
+
+void RecordWalletDBFlush(int64_t nMillis)
+{
+    LOCK(cs_walletdbstats);
+    walletdbStats.nFlushes++;
+    walletdbStats.nFlushMillisLast = nMillis;
+    walletdbStats.nFlushMillisMax = max(walletdbStats.nFlushMillisMax, nMillis);
+    walletdbStats.nFlushMillisTotal += nMillis;
+}
+
+CWalletDBStats GetWalletDBStats()
+{
+    LOCK(cs_walletdbstats);
+    return walletdbStats;
+}
+
 void ThreadFlushWalletDB(const string& strFile)
 {
     // Make this thread recognisable as the wallet flushing thread
@@ -817,7 +846,9 @@ void ThreadFlushWalletDB(const string& strFile)
                         bitdb.CheckpointLSN(strFile);
 
                         bitdb.mapFileUseCount.erase(mi++);
-                        LogPrint("db", "Flushed wallet.dat %dms\n", GetTimeMillis() - nStart);
+                        int64_t nElapsed = GetTimeMillis() - nStart;
+                        RecordWalletDBFlush(nElapsed);
+                        LogPrint("db", "Flushed wallet.dat %dms\n", nElapsed);
                     }
                 }
             }
@@ -130,4 +130,22 @@ public:
 
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 
+/** Timings of wallet write batches and of the background flushes of wallet.dat */
+struct CWalletDBStats
+{
+    uint64_t nBatches;
+    uint64_t nBatchesFailed;
+    int64_t nCommitMillisLast;
+    int64_t nCommitMillisMax;
+    int64_t nCommitMillisTotal;
+    uint64_t nFlushes;
+    int64_t nFlushMillisLast;
+    int64_t nFlushMillisMax;
+    int64_t nFlushMillisTotal;
+};
+
+void RecordWalletDBCommit(int64_t nMillis, bool fSuccess);
+void RecordWalletDBFlush(int64_t nMillis);
+CWalletDBStats GetWalletDBStats();
+
 #endif // BITCOIN_WALLETDB_H